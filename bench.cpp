@@ -0,0 +1,1026 @@
+#include "src/tensor.cpp"
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+
+// Timing helpers
+
+template <typename F> double bestTime (F f, int repeats) {
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < repeats; i++) {
+        let start = std::chrono::steady_clock::now();
+        f();
+        let end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count()); }
+    return best; }
+
+// Like bestTime, but repeats `f` enough times per sample that each sample takes
+// at least a millisecond, so that ops on small tensors can be timed accurately.
+// Returns the best time for a single call.
+template <typename F> double batchTime (F f, int repeats) {
+    size_t calls = 1;
+    while (true) {
+        double seconds = bestTime([&] { for (size_t i = 0; i < calls; i++) f(); }, 1);
+        if (seconds >= 1e-3 || calls >= (1 << 20))
+            break;
+        calls *= seconds > 0 ? std::min(100.0, std::max(2.0, 2e-3 / seconds)) : 100; }
+    return bestTime([&] { for (size_t i = 0; i < calls; i++) f(); }, repeats) / calls; }
+
+template <typename T> String typeName ();
+template <> String typeName<int> () { return "int"; }
+template <> String typeName<float> () { return "float"; }
+template <> String typeName<double> () { return "double"; }
+template <> String typeName<int8_t> () { return "int8"; }
+template <> String typeName<bf16> () { return "bf16"; }
+template <> String typeName<f16> () { return "f16"; }
+
+
+// Results. Every measurement gets recorded along with the memory bandwidth that
+// was measured for the current thread count, which is the roofline for these
+// ops: almost all of them do at most a couple of flops per element, so they're
+// bound by memory traffic and the best they can do is run at full bandwidth.
+// With `--json=path`, the results get written to `path` at the end of the run.
+
+struct Result {
+    String suite, name, type, layout, variant;
+    Shape shape;
+    size_t threads;
+    double seconds, bytes, flops, bandwidth, error; };
+
+List<Result> results;
+String currentSuite;
+double currentBandwidth = 0;
+
+void record (String name, String type, String layout, String variant, Shape shape, double seconds, double bytes, double flops,
+             double error = 0) {
+    results.push_back({ currentSuite, name, type, layout, variant, shape, getNumThreads(),
+        seconds, bytes, flops, currentBandwidth, error }); }
+
+void report (String name, String type, String level, double seconds, double bytes, double baseline) {
+    record(name, type, "contiguous", level, Shape(), seconds, bytes, 0);
+    printf("%-10s %-7s %-8s %10.3f ms %8.2f GB/s %7.2fx\n",
+        name.c_str(), type.c_str(), level.c_str(), seconds * 1e3, bytes / seconds / 1e9, baseline / seconds); }
+
+String jsonString (const String& value) {
+    String result = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') result += '\\';
+        result += c; }
+    return result + "\""; }
+
+String jsonNumber (double value) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.6g", value);
+    return buffer; }
+
+void writeJson (const String& path) {
+    std::ofstream file(path);
+    if (!file)
+        throw "writeJson - Couldn't open the file";
+
+    file << "{\n  \"threads\": " << getNumThreads() << ",\n  \"simd\": " << jsonString(simdLevelName(detectSimdLevel()))
+         << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        String shape;
+        for (size_t d = 0; d < r.shape.length; d++)
+            shape += (d ? ", " : "") + std::to_string(r.shape[d]);
+        file << (i ? ",\n" : "\n") << "    {\"suite\": " << jsonString(r.suite) << ", \"name\": " << jsonString(r.name)
+             << ", \"type\": " << jsonString(r.type) << ", \"layout\": " << jsonString(r.layout)
+             << ", \"variant\": " << jsonString(r.variant) << ", \"shape\": [" << shape << "]"
+             << ", \"threads\": " << r.threads << ", \"seconds\": " << jsonNumber(r.seconds)
+             << ", \"bytes\": " << jsonNumber(r.bytes) << ", \"flops\": " << jsonNumber(r.flops)
+             << ", \"gbps\": " << jsonNumber(r.bytes / r.seconds / 1e9) << ", \"gflops\": " << jsonNumber(r.flops / r.seconds / 1e9)
+             << ", \"roofline_gbps\": " << jsonNumber(r.bandwidth) << ", \"error\": " << jsonNumber(r.error) << "}"; }
+    file << "\n  ]\n}\n"; }
+
+
+// Memory bandwidth, from a STREAM-style triad (a = b + 3c) over arrays that are
+// much bigger than the last-level cache, split across the thread pool
+
+double measureBandwidth (int repeats) {
+    size_t length = 1 << 23;
+    List<double> a(length), b(length, 1), c(length, 2);
+    double seconds = bestTime([&] {
+        parallelFor(0, length, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                a[i] = b[i] + 3 * c[i]; }); }, std::max(repeats, 3));
+    return 3.0 * length * sizeof(double) / seconds / 1e9; }
+
+
+// SIMD benchmarks. The baseline for each op is the loop that BTen used before
+// it had the strided iterator and SIMD kernels: one bounds-checked `at()` per
+// element. We then time the op itself at every instruction set this CPU has.
+
+template <typename T> void benchSimd (size_t length, int repeats) {
+    let a = Tensor<T>::random(1, 100, Shape((int) length));
+    let b = Tensor<T>::random(1, 100, Shape((int) length));
+    T* out = new T[length];
+    volatile T sink = 0;
+    volatile size_t indexSink = 0;
+    String type = typeName<T>();
+    SimdLevel best = detectSimdLevel();
+
+    #define benchOp(name, bytes, baselineLoop, expression)                      \
+    {                                                                           \
+        double baseline = bestTime([&] { baselineLoop; }, repeats);             \
+        report(name, type, "loop", baseline, bytes, baseline);                  \
+        for (int level = 0; level <= (int) best; level++) {                     \
+            setSimdLevel((SimdLevel) level);                                    \
+            double seconds = bestTime([&] { expression; }, repeats);            \
+            report(name, type, simdLevelName((SimdLevel) level), seconds, bytes, baseline); }}
+
+    double unary = 2.0 * length * sizeof(T), binary = 3.0 * length * sizeof(T), fold = 1.0 * length * sizeof(T);
+    benchOp("add", binary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) + b.at(i), Tensor<T>(a + b));
+    benchOp("sub", binary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) - b.at(i), Tensor<T>(a - b));
+    benchOp("mul", binary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) * b.at(i), Tensor<T>(a * b));
+    benchOp("div", binary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) / b.at(i), Tensor<T>(a / b));
+    benchOp("add scalar", unary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) + (T) 3, Tensor<T>(a + (T) 3));
+    benchOp("mul scalar", unary, for (size_t i = 0; i < length; i++) out[i] = a.at(i) * (T) 3, Tensor<T>(a * (T) 3));
+
+    benchOp("sum", fold, T r = 0; for (size_t i = 0; i < length; i++) r += a.at(i); sink = r, sink = a.sum());
+    benchOp("max", fold, T r = a.at(0); for (size_t i = 0; i < length; i++) if (a.at(i) > r) r = a.at(i); sink = r, sink = a.max());
+    benchOp("min", fold, T r = a.at(0); for (size_t i = 0; i < length; i++) if (a.at(i) < r) r = a.at(i); sink = r, sink = a.min());
+    benchOp("argmax", fold, size_t r = 0; for (size_t i = 0; i < length; i++) if (a.at(i) > a.at(r)) r = i; indexSink = r, indexSink = a.argmax(0)(0));
+
+    #undef benchOp
+    setSimdLevel(best);
+    delete[] out;
+    print(); }
+
+
+// GEMM benchmarks. We time square products and both kinds of skinny product,
+// with B both contiguous and transposed, and report GFLOP/s. The baseline is a
+// naive triple loop over `at()`, which we only run for the smallest size.
+
+void benchGemm (int repeats) {
+    List<List<int>> sizes = { { 512, 512, 512 }, { 1024, 1024, 1024 }, { 2048, 2048, 2048 },
+        { 4096, 4096, 4096 }, { 64, 4096, 4096 }, { 4096, 64, 4096 }, { 4096, 4096, 64 } };
+
+    for (const List<int>& size : sizes) {
+        int m = size[0], n = size[1], k = size[2];
+        double flops = 2.0 * m * n * k;
+        let a = Tensor<float>::random(-1, 1, Shape(m, k));
+        let b = Tensor<float>::random(-1, 1, Shape(k, n));
+        let bt = Tensor<float>::random(-1, 1, Shape(n, k)).transpose();
+        int runs = flops > 1e11 ? 1 : repeats;
+
+        double baseline = 0;
+        if (flops <= 2.0 * 512 * 512 * 512) {
+            float* out = new float[m * n];
+            baseline = bestTime([&] {
+                for (int i = 0; i < m; i++)
+                    for (int j = 0; j < n; j++) {
+                        float r = 0;
+                        for (int p = 0; p < k; p++)
+                            r += a.at(i * k + p) * b.at(p * n + j);
+                        out[i * n + j] = r; }}, 1);
+            delete[] out; }
+
+        String name = std::to_string(m) + "x" + std::to_string(n) + "x" + std::to_string(k);
+        double seconds = bestTime([&] { a.matmul(b); }, runs);
+        double transposed = bestTime([&] { a.matmul(bt); }, runs);
+        double bytes = 4.0 * (m * k + k * n + m * n);
+        record("matmul", "float", "contiguous", "", Shape(m, n, k), seconds, bytes, flops);
+        record("matmul", "float", "transposed", "", Shape(m, n, k), transposed, bytes, flops);
+        printf("%-16s %10.3f ms %8.2f GFLOP/s   B^T: %8.2f GFLOP/s", name.c_str(), seconds * 1e3,
+            flops / seconds / 1e9, flops / transposed / 1e9);
+        if (baseline) printf("   %7.2fx vs loop", baseline / seconds);
+        printf("\n");
+        fflush(stdout); }
+
+    print(); }
+
+
+// Fusion benchmarks. We evaluate chains of 2 to 8 elementwise ops over tensors
+// that are much bigger than the last-level cache, both as a single fused
+// expression and one op at a time (which is how BTen evaluated them before it
+// had expression templates). The fused chain reads every input once and writes
+// the output once, while the unfused chain writes out and reads back an
+// intermediate for every op, so the gap should grow with the chain length.
+
+template <typename E, typename T> BinaryExpression<AddOp, E, Tensor<T>>
+chainStep (const E& e, const Tensor<T>& next, std::true_type) { return e + next; }
+template <typename E, typename T> BinaryExpression<MulOp, E, Tensor<T>>
+chainStep (const E& e, const Tensor<T>& next, std::false_type) { return e * next; }
+
+// Builds a chain of K alternating multiplies and adds as one expression, ending
+// with an add (so x[0] * x[1] + x[2] for K = 2)
+template <size_t K> struct FusedChain {
+    template <typename E, typename T> static Tensor<T> run (const E& e, const List<Tensor<T>>& x, size_t i) {
+        let next = chainStep(e, x[i], std::integral_constant<bool, K % 2 == 1>());
+        return FusedChain<K - 1>::run(next, x, i + 1); }};
+template <> struct FusedChain<0> {
+    template <typename E, typename T> static Tensor<T> run (const E& e, const List<Tensor<T>>&, size_t) {
+        return e; }};
+
+template <typename T> Tensor<T> unfusedChain (size_t ops, const List<Tensor<T>>& x) {
+    Tensor<T> result = x[0];
+    for (size_t i = 1; i <= ops; i++)
+        result = (ops - i) % 2 == 0 ? Tensor<T>(result + x[i]) : Tensor<T>(result * x[i]);
+    return result; }
+
+template <size_t K> void benchFusionChain (const List<Tensor<float>>& x, size_t length, int repeats) {
+    double fused = bestTime([&] { FusedChain<K>::run(x[0], x, 1); }, repeats);
+    double unfused = bestTime([&] { unfusedChain(K, x); }, repeats);
+    double fusedBytes = (K + 2.0) * length * sizeof(float), unfusedBytes = 3.0 * K * length * sizeof(float);
+    String name = std::to_string(K) + " ops";
+    record(name, "float", "contiguous", "fused", Shape((int) length), fused, fusedBytes, K * length);
+    record(name, "float", "contiguous", "unfused", Shape((int) length), unfused, unfusedBytes, K * length);
+    printf("%zu ops   fused %9.3f ms %7.2f GB/s   unfused %9.3f ms %7.2f GB/s   %5.2fx\n", K,
+        fused * 1e3, fusedBytes / fused / 1e9, unfused * 1e3, unfusedBytes / unfused / 1e9, unfused / fused);
+    fflush(stdout); }
+
+void benchFusion (size_t length, int repeats) {
+    List<Tensor<float>> x;
+    for (size_t i = 0; i <= 8; i++)
+        x.push_back(Tensor<float>::random(0.5, 1.5, Shape((int) length)));
+
+    benchFusionChain<2>(x, length, repeats);
+    benchFusionChain<3>(x, length, repeats);
+    benchFusionChain<4>(x, length, repeats);
+    benchFusionChain<5>(x, length, repeats);
+    benchFusionChain<6>(x, length, repeats);
+    benchFusionChain<7>(x, length, repeats);
+    benchFusionChain<8>(x, length, repeats);
+    print(); }
+
+
+// RNG benchmarks. The baseline is the way BTen used to fill tensors, drawing one
+// value at a time from a std::mt19937 with a std:: distribution.
+
+template <typename T> void benchRandom (size_t length, int repeats) {
+    T* out = new T[length];
+    String type = typeName<T>();
+    SimdLevel best = detectSimdLevel();
+    std::mt19937 gen(0);
+
+    #define benchDistribution(name, distribution, expression)                   \
+    {                                                                           \
+        double baseline = bestTime([&] {                                        \
+            distribution<T> dist;                                               \
+            for (size_t i = 0; i < length; i++) out[i] = dist(gen); }, repeats); \
+        report(name, type, "mt19937", baseline, length * sizeof(T), baseline);  \
+        for (int level = 0; level <= (int) best; level++) {                     \
+            setSimdLevel((SimdLevel) level);                                    \
+            double seconds = bestTime([&] { expression; }, repeats);            \
+            report(name, type, simdLevelName((SimdLevel) level), seconds, length * sizeof(T), baseline); }}
+
+    benchDistribution("uniform", std::uniform_real_distribution, Tensor<T>::random(Shape((int) length)));
+    benchDistribution("normal", std::normal_distribution, Tensor<T>::normal(Shape((int) length)));
+
+    #undef benchDistribution
+    setSimdLevel(best);
+    delete[] out;
+    print(); }
+
+
+// Softmax benchmarks, over rows of 32768 elements, along the contiguous last
+// dimension and along the strided first dimension of the transposed shape. The
+// baseline is the naive version, with a pass for the max, a pass for the sum of
+// exps and a pass for the output, all using std::exp. Softmax moves every
+// element twice (in and out), and logsumexp only reads it.
+
+template <typename T> void benchSoftmax (size_t length, int repeats) {
+    const size_t columns = 32768, rows = std::max((size_t) 1, length / columns);
+    let x = Tensor<T>::normal(Shape((int) rows, (int) columns));
+    let xt = Tensor<T>::normal(Shape((int) columns, (int) rows));
+    T* out = new T[rows * columns];
+    String type = typeName<T>();
+    SimdLevel best = detectSimdLevel();
+    double bytes = rows * columns * sizeof(T);
+
+    double baseline = bestTime([&] {
+        for (size_t r = 0; r < rows; r++) {
+            const T* row = x.buffer->data + r * columns;
+            T* y = out + r * columns;
+            T max = *std::max_element(row, row + columns), sum = 0;
+            for (size_t i = 0; i < columns; i++)
+                sum += std::exp(row[i] - max);
+            for (size_t i = 0; i < columns; i++)
+                y[i] = std::exp(row[i] - max) / sum; }}, repeats);
+    report("softmax", type, "naive", baseline, 2 * bytes, baseline);
+
+    for (int level = 0; level <= (int) best; level++) {
+        setSimdLevel((SimdLevel) level);
+        String name = simdLevelName((SimdLevel) level);
+        report("softmax", type, name, bestTime([&] { x.softmax(-1); }, repeats), 2 * bytes, baseline);
+        report("softmax(0)", type, name, bestTime([&] { xt.softmax(0); }, repeats), 2 * bytes, baseline);
+        report("logsumexp", type, name, bestTime([&] { x.logsumexp(-1); }, repeats), bytes, baseline); }
+
+    setSimdLevel(best);
+    delete[] out;
+    print(); }
+
+
+// Elementwise math benchmarks. The baseline for each function is a loop over
+// its std:: version (with the usual formulas for sigmoid and GELU), and the fast
+// modes get rows of their own. Every function reads and writes each element once.
+
+template <typename T> void benchMath (size_t length, int repeats) {
+    let x = Tensor<T>::normal(Shape((int) length));
+    let positive = Tensor<T>::random(0, 4, Shape((int) length));
+    let y = Tensor<T>::zeros(Shape((int) length));
+    T* out = y.buffer->data;
+    String type = typeName<T>();
+    SimdLevel best = detectSimdLevel();
+    double bytes = 2.0 * length * sizeof(T);
+
+    #define benchFunction(name, input, scalar, method)                          \
+    {                                                                           \
+        const T* in = input.buffer->data;                                       \
+        double baseline = bestTime([&] {                                        \
+            for (size_t i = 0; i < length; i++) { T v = in[i]; out[i] = scalar; }}, repeats); \
+        report(name, type, "std", baseline, bytes, baseline);                   \
+        for (int level = 0; level <= (int) best; level++) {                     \
+            setSimdLevel((SimdLevel) level);                                    \
+            double seconds = bestTime([&] { y.assign(input.method); }, repeats); \
+            report(name, type, simdLevelName((SimdLevel) level), seconds, bytes, baseline); }}
+
+    benchFunction("exp", x, std::exp(v), exp());
+    benchFunction("log", positive, std::log(v), log());
+    benchFunction("sqrt", positive, std::sqrt(v), sqrt());
+    benchFunction("relu", x, std::max(v, (T) 0), relu());
+    benchFunction("tanh", x, std::tanh(v), tanh());
+    benchFunction("tanh fast", x, std::tanh(v), tanh(MathMode::Fast));
+    benchFunction("sigmoid", x, 1 / (1 + std::exp(-v)), sigmoid());
+    benchFunction("sigm. fast", x, 1 / (1 + std::exp(-v)), sigmoid(MathMode::Fast));
+    benchFunction("gelu", x, v * (T) 0.5 * std::erfc(-v * (T) 0.70710678118654752440), gelu());
+    benchFunction("gelu fast", x, v * (T) 0.5 * std::erfc(-v * (T) 0.70710678118654752440), gelu(MathMode::Fast));
+
+    #undef benchFunction
+    setSimdLevel(best);
+    print(); }
+
+
+// Summation benchmarks, over `length` floats that are uniform in [0, 1), so that
+// the rounding errors of a naive sum all point the same way instead of cancelling
+// out. Each row reports the relative error against a long double reference next
+// to its throughput, for the full sum and for sums along dim 0 of a matrix with
+// 1024 columns (where the error is the worst one over the columns). The baseline
+// is a plain loop that adds the elements one after another.
+
+void benchSummation (size_t length, int repeats) {
+    const size_t columns = 1024, rows = std::max((size_t) 1, length / columns);
+    length = rows * columns;
+    let x = Tensor<float>::random(0, 1, Shape((int) length));
+    let m = Tensor<float>(x.buffer, Shape((int) rows, (int) columns));
+    const float* data = x.buffer->data;
+    double bytes = length * sizeof(float);
+    volatile float sink = 0;
+
+    long double reference = 0;
+    List<long double> columnReference(columns, 0);
+    for (size_t i = 0; i < length; i++) {
+        reference += data[i];
+        columnReference[i % columns] += data[i]; }
+
+    let columnError = [&] (const Tensor<float>& sums) {
+        double error = 0;
+        for (size_t j = 0; j < columns; j++)
+            error = std::max(error, (double) std::abs((sums.buffer->data[j] - columnReference[j]) / columnReference[j]));
+        return error; };
+
+    #define benchSum(name, variant, seconds, error)                             \
+    {                                                                           \
+        double time = seconds;                                                  \
+        record(name, "float", "contiguous", variant, m.shape, time, bytes, length, error); \
+        printf("%-7s %-9s %10.3f ms %8.2f GB/s %7.2fx   relative error %.2e\n", \
+            name, variant, time * 1e3, bytes / time / 1e9, baseline / time, (double) (error)); }
+
+    float naive = 0;
+    double baseline = bestTime([&] {
+        float r = 0;
+        for (size_t i = 0; i < length; i++)
+            r += data[i];
+        sink = naive = r; }, repeats);
+    benchSum("sum", "loop", baseline, std::abs((naive - reference) / reference));
+
+    float pairwise = 0, kahan = 0;
+    double wide = 0;
+    benchSum("sum", "pairwise", bestTime([&] { sink = pairwise = x.sum(); }, repeats), std::abs((pairwise - reference) / reference));
+    benchSum("sum", "kahan", bestTime([&] { sink = kahan = x.sum(SumMode::Kahan); }, repeats), std::abs((kahan - reference) / reference));
+    benchSum("sum", "double", bestTime([&] { wide = x.sum<double>(); sink = wide; }, repeats), std::abs((wide - reference) / reference));
+
+    Tensor<float> sums = m.sum(0);
+    benchSum("sum(0)", "pairwise", bestTime([&] { m.sumOut(sums, 0); }, repeats), columnError(sums));
+    benchSum("sum(0)", "kahan", bestTime([&] { m.sumOut(sums, 0, SumMode::Kahan); }, repeats), columnError(sums));
+    benchSum("sum(0)", "double", bestTime([&] { m.sumOut<double>(sums, 0); }, repeats), columnError(sums));
+
+    #undef benchSum
+    print(); }
+
+
+// Low-precision benchmarks. Conversions between floats and halves, sums of
+// float, bf16 and f16 tensors (which should take about half as long for the
+// halves, since they read half as many bytes), and matrix products in float32,
+// bf16 (accumulated in float32) and int8 (accumulated in int32, both on its own
+// and with the scaling of a quantized product).
+
+template <typename T> void benchConversion (const Tensor<float>& x, int repeats) {
+    size_t length = x.shape.volume();
+    const float* data = x.buffer->data;
+    Buffer<T> halves(length);
+    Buffer<float> floats(length);
+    double bytes = length * (sizeof(float) + sizeof(T));
+
+    double narrow = bestTime([&] { parallelFor(0, length, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        convertFromFloat(end - begin, data + begin, halves.data + begin); }); }, repeats);
+    double wide = bestTime([&] { parallelFor(0, length, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        convertToFloat(end - begin, halves.data + begin, floats.data + begin); }); }, repeats);
+    double copy = bestTime([&] { parallelFor(0, length, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        std::copy(data + begin, data + end, floats.data + begin); }); }, repeats);
+
+    String type = typeName<T>();
+    record("from float", type, "contiguous", "", x.shape, narrow, bytes, length);
+    record("to float", type, "contiguous", "", x.shape, wide, bytes, length);
+    printf("float -> %-4s %10.3f ms %8.2f GB/s      %-4s -> float %10.3f ms %8.2f GB/s   (float copy %8.2f GB/s)\n",
+        type.c_str(), narrow * 1e3, bytes / narrow / 1e9, type.c_str(), wide * 1e3, bytes / wide / 1e9,
+        2 * length * sizeof(float) / copy / 1e9); }
+
+template <typename T> void benchHalfSum (const Tensor<float>& x, double baseline, int repeats) {
+    Tensor<T> h = Tensor<float>(x).template to<T>();
+    volatile float sink = 0;
+    double seconds = bestTime([&] { sink = h.sum(); }, repeats);
+    double bytes = x.shape.volume() * sizeof(T);
+    record("sum", typeName<T>(), "contiguous", "", x.shape, seconds, bytes, x.shape.volume());
+    printf("sum   %-6s %10.3f ms %8.2f GB/s %7.2fx\n", typeName<T>().c_str(), seconds * 1e3, bytes / seconds / 1e9, baseline / seconds); }
+
+void benchLowPrecision (size_t length, int repeats) {
+    let x = Tensor<float>::normal(0, 1, Shape((int) length));
+    benchConversion<bf16>(x, repeats);
+    benchConversion<f16>(x, repeats);
+    print();
+
+    volatile float sink = 0;
+    double baseline = bestTime([&] { sink = x.sum(); }, repeats);
+    double bytes = length * sizeof(float);
+    record("sum", "float", "contiguous", "", x.shape, baseline, bytes, length);
+    printf("sum   %-6s %10.3f ms %8.2f GB/s %7.2fx\n", "float", baseline * 1e3, bytes / baseline / 1e9, 1.0);
+    benchHalfSum<bf16>(x, baseline, repeats);
+    benchHalfSum<f16>(x, baseline, repeats);
+    print();
+
+    for (int size : { 512, 1024, 2048 }) {
+        double flops = 2.0 * size * size * size;
+        let a = Tensor<float>::random(-1, 1, Shape(size, size));
+        let b = Tensor<float>::random(-1, 1, Shape(size, size));
+        let ah = Tensor<bf16>::random(-1, 1, Shape(size, size));
+        let bh = Tensor<bf16>::random(-1, 1, Shape(size, size));
+        let aq = QuantizedTensor<>::quantize(a);
+        let bq = QuantizedTensor<>::quantize(b, 1);
+        Buffer<int32_t> product(size * size);
+
+        double single = bestTime([&] { a.matmul(b); }, repeats);
+        double half = bestTime([&] { ah.matmul(bh); }, repeats);
+        double integer = bestTime([&] {
+            integerGemm((size_t) size, (size_t) size, (size_t) size, aq.values.buffer->data, size, 1,
+                        bq.values.buffer->data, size, 1, product.data, size, 1); }, repeats);
+        double quantized = bestTime([&] { aq.matmul(bq); }, repeats);
+
+        Shape shape = Shape(size, size, size);
+        record("matmul", "float", "contiguous", "", shape, single, 4.0 * 3 * size * size, flops);
+        record("matmul", "bf16", "contiguous", "", shape, half, 2.0 * 3 * size * size, flops);
+        record("matmul", "int8", "contiguous", "int32", shape, integer, 6.0 * size * size, flops);
+        record("matmul", "int8", "contiguous", "quantized", shape, quantized, 6.0 * size * size, flops);
+        printf("matmul %4dx%-4d  float %8.2f GFLOP/s   bf16 %8.2f GFLOP/s   int8 %8.2f GOP/s   quantized %8.2f GOP/s\n",
+            size, size, flops / single / 1e9, flops / half / 1e9, flops / integer / 1e9, flops / quantized / 1e9);
+        fflush(stdout); }
+
+    print(); }
+
+
+// Casts between element types, against the scalar loop in Buffer::convert. The
+// strided case converts every other row of a matrix, which isn't dense, so it
+// goes through the iterator rather than straight through the buffer.
+
+template <typename T, typename U> void benchCast (size_t length, int repeats) {
+    let x = Tensor<float>::normal(0, 100, Shape((int) length)).template to<T>();
+    let rows = Tensor<T>(x.buffer, Shape((int) length / 2048, 1024), Shape(2048, 1));
+    double bytes = length * (sizeof(T) + sizeof(U));
+
+    double scalar = bestTime([&] { x.buffer->template convert<U>(); }, repeats);
+    double truncate = bestTime([&] { x.template to<U>(); }, repeats);
+    double saturate = bestTime([&] { x.template to<U>(CastMode::SaturateRound); }, repeats);
+    double strided = bestTime([&] { rows.template to<U>(); }, repeats);
+
+    String type = typeName<T>() + "->" + typeName<U>();
+    record("cast", type, "contiguous", "scalar", x.shape, scalar, bytes, length);
+    record("cast", type, "contiguous", "truncate", x.shape, truncate, bytes, length);
+    record("cast", type, "contiguous", "saturate", x.shape, saturate, bytes, length);
+    record("cast", type, "strided", "truncate", rows.shape, strided, bytes / 2, length / 2);
+    printf("%-14s scalar %8.2f GB/s   to %8.2f GB/s %6.2fx   saturate+round %8.2f GB/s   strided %8.2f GB/s\n",
+        type.c_str(), bytes / scalar / 1e9, bytes / truncate / 1e9, scalar / truncate,
+        bytes / saturate / 1e9, bytes / 2 / strided / 1e9);
+    fflush(stdout); }
+
+void benchCasts (size_t length, int repeats) {
+    benchCast<float, int>(length, repeats);
+    benchCast<int, float>(length, repeats);
+    benchCast<float, double>(length, repeats);
+    benchCast<double, float>(length, repeats);
+    benchCast<float, int8_t>(length, repeats);
+    benchCast<int8_t, float>(length, repeats);
+    benchCast<double, int>(length, repeats);
+    benchCast<bf16, int>(length, repeats);
+    print(); }
+
+
+// Convolution benchmarks, on layers from a ResNet and a MobileNet at batch size
+// 1, against a naive loop over the output and the window. Each algorithm that
+// can run a layer gets timed in NCHW and NHWC (the same data, permuted).
+
+struct ConvLayer {
+    const char* name;
+    int channels, size, filters, kernel, stride, padding, groups; };
+
+double naiveConv (const float* x, const float* w, float* y, const ConvLayer& l, int outputSize) {
+    int channels = l.channels / l.groups, filters = l.filters / l.groups;
+    return bestTime([&] {
+        for (int f = 0; f < l.filters; f++)
+            for (int oh = 0; oh < outputSize; oh++)
+                for (int ow = 0; ow < outputSize; ow++) {
+                    float sum = 0;
+                    for (int c = 0; c < channels; c++)
+                        for (int kh = 0; kh < l.kernel; kh++)
+                            for (int kw = 0; kw < l.kernel; kw++) {
+                                int ih = oh * l.stride - l.padding + kh, iw = ow * l.stride - l.padding + kw;
+                                if (ih >= 0 && ih < l.size && iw >= 0 && iw < l.size)
+                                    sum += x[((f / filters * channels + c) * l.size + ih) * l.size + iw] *
+                                           w[((f * channels + c) * l.kernel + kh) * l.kernel + kw]; }
+                    y[(f * outputSize + oh) * outputSize + ow] = sum; }}, 1); }
+
+void benchConv (int repeats) {
+    ConvLayer layers[] = {
+        { "stem 7x7/2", 3, 224, 64, 7, 2, 3, 1 },
+        { "3x3 64", 64, 56, 64, 3, 1, 1, 1 },
+        { "3x3 128", 128, 56, 128, 3, 1, 1, 1 },
+        { "3x3 256", 256, 14, 256, 3, 1, 1, 1 },
+        { "1x1 256->64", 256, 56, 64, 1, 1, 0, 1 },
+        { "dw 3x3 128", 128, 56, 128, 3, 1, 1, 128 },
+        { "dw 3x3/2 256", 256, 28, 256, 3, 2, 1, 256 } };
+    ConvAlgorithm algorithms[] = { ConvAlgorithm::Im2col, ConvAlgorithm::Direct, ConvAlgorithm::Winograd };
+    const char* names[] = { "im2col", "direct", "winograd" };
+
+    for (const ConvLayer& l : layers) {
+        let x = Tensor<float>::normal(Shape(1, l.channels, l.size, l.size));
+        let nhwc = Tensor<float>(x.permute(0, 2, 3, 1)).permute(0, 3, 1, 2);
+        let w = Tensor<float>::normal(Shape(l.filters, l.channels / l.groups, l.kernel, l.kernel));
+        int outputSize = (l.size + 2 * l.padding - l.kernel) / l.stride + 1;
+        double flops = 2.0 * l.filters * outputSize * outputSize * l.channels / l.groups * l.kernel * l.kernel;
+
+        List<float> y(l.filters * outputSize * outputSize);
+        double naive = naiveConv(x.buffer->data, w.buffer->data, y.data(), l, outputSize);
+        record("conv2d", "float", "contiguous", "naive", x.shape, naive, 0, flops);
+        printf("%-14s naive %8.2f GFLOP/s\n", l.name, flops / naive / 1e9);
+
+        for (int a = 0; a < 3; a++) {
+            double seconds[2];
+            try {
+                seconds[0] = bestTime([&] { x.conv2d(w, l.stride, l.padding, 1, l.groups, algorithms[a]); }, repeats);
+                seconds[1] = bestTime([&] { nhwc.conv2d(w, l.stride, l.padding, 1, l.groups, algorithms[a]); }, repeats); }
+            catch (const char* error) {
+                continue; }
+            record("conv2d", "float", "nchw", names[a], x.shape, seconds[0], 0, flops);
+            record("conv2d", "float", "nhwc", names[a], x.shape, seconds[1], 0, flops);
+            printf("%-14s %-8s NCHW %8.2f GFLOP/s %7.1fx   NHWC %8.2f GFLOP/s %7.1fx\n", "", names[a],
+                flops / seconds[0] / 1e9, naive / seconds[0], flops / seconds[1] / 1e9, naive / seconds[1]); }
+        fflush(stdout); }
+
+    // Pooling, which is bound by memory rather than arithmetic
+    let x = Tensor<float>::normal(Shape(1, 64, 112, 112));
+    let nhwc = Tensor<float>(x.permute(0, 2, 3, 1)).permute(0, 3, 1, 2);
+    double bytes = x.shape.volume() * sizeof(float) * 1.25;
+    double maxPool = bestTime([&] { x.maxPool2d(3, 2, 1); }, repeats);
+    double maxPoolNhwc = bestTime([&] { nhwc.maxPool2d(3, 2, 1); }, repeats);
+    double avgPool = bestTime([&] { x.avgPool2d(2); }, repeats);
+    double avgPoolNhwc = bestTime([&] { nhwc.avgPool2d(2); }, repeats);
+    record("maxPool2d", "float", "nchw", "3x3/2", x.shape, maxPool, bytes, 0);
+    record("maxPool2d", "float", "nhwc", "3x3/2", x.shape, maxPoolNhwc, bytes, 0);
+    record("avgPool2d", "float", "nchw", "2x2/2", x.shape, avgPool, bytes, 0);
+    record("avgPool2d", "float", "nhwc", "2x2/2", x.shape, avgPoolNhwc, bytes, 0);
+    printf("maxPool 3x3/2  NCHW %8.2f GB/s   NHWC %8.2f GB/s\n", bytes / maxPool / 1e9, bytes / maxPoolNhwc / 1e9);
+    printf("avgPool 2x2/2  NCHW %8.2f GB/s   NHWC %8.2f GB/s\n", bytes / avgPool / 1e9, bytes / avgPoolNhwc / 1e9);
+    print(); }
+
+
+// Graph benchmarks. A two-layer MLP with a log-softmax at the end, run eagerly
+// and replayed from a captured graph, at batch sizes from a single row (where
+// the per-op overhead of allocating and planning dominates) to a large batch
+// (where the GEMMs do). The memory columns compare the sum of the graph's
+// intermediate buffers to the arena that they get packed into.
+
+void benchGraph (int repeats) {
+    size_t batches[] = { 1, 16, 256 };
+    for (size_t batch : batches) {
+        let input = Tensor<float>::normal(Shape((int) batch, 512));
+        let w1 = Tensor<float>::normal(0, 0.05, Shape(512, 1024)), b1 = Tensor<float>::normal(Shape(1, 1024));
+        let w2 = Tensor<float>::normal(0, 0.05, Shape(1024, 256)), b2 = Tensor<float>::normal(Shape(1, 256));
+        let model = [&] { return ((input.matmul(w1) + b1).gelu().matmul(w2) + b2).logSoftmax(1); };
+
+        Graph graph;
+        graph.capture(model);
+        double eager = batchTime([&] { model(); }, repeats);
+        double replay = batchTime([&] { graph.replay(); }, repeats);
+
+        Shape shape = Shape((int) batch, 512);
+        double flops = 2.0 * batch * (512 * 1024 + 1024 * 256);
+        record("mlp", "float", "contiguous", "eager", shape, eager, 0, flops);
+        record("mlp", "float", "contiguous", "replay", shape, replay, 0, flops);
+        printf("batch %-5zu eager %10.1f us   replay %10.1f us %6.2fx   intermediates %8.1f KB   arena %8.1f KB\n",
+            batch, eager * 1e6, replay * 1e6, eager / replay, graph.intermediateBytes / 1e3, graph.arenaBytes / 1e3);
+        fflush(stdout); }
+    print(); }
+
+
+// Indexing benchmarks. An embedding lookup picks random rows of a table with
+// millions of rows, so each row is a cache miss, and the best it can do is copy
+// the rows at the speed of a plain copy of the same number of bytes, which is
+// what we compare it to, along with the measured memory bandwidth. Element gathers and scatters pick single elements, so
+// they get compared to a scalar loop, and the gathers are timed at every
+// instruction set, since they're the only ones that use the gather instructions.
+
+void benchIndexing (size_t length, int repeats) {
+    size_t rows = 1 << 21, lookups = 1 << 16;
+    int widths[] = { 16, 64, 256 };
+    for (int width : widths) {
+        let table = Tensor<float>::normal(Shape((int) (rows * 64 / width), width));
+        let ids = Tensor<int>::random(0, table.shape[0] - 1, Shape((int) lookups));
+        let rowsCopy = Tensor<float>::normal(Shape((int) lookups, width));
+        let output = Tensor<float>::zeros(Shape((int) lookups, width));
+        double lookup = bestTime([&] { table.indexSelect(0, ids); }, repeats);
+        double copy = bestTime([&] { output.assign(rowsCopy); }, repeats);
+        double bytes = 2.0 * lookups * width * sizeof(float);
+        record("embedding", "float", "contiguous", "indexSelect", table.shape, lookup, bytes, 0);
+        record("embedding", "float", "contiguous", "copy", rowsCopy.shape, copy, bytes, 0);
+        printf("embedding %8d x %-4d  lookup %8.2f GB/s   copy %8.2f GB/s %6.2fx   %5.1f%% of bandwidth\n",
+            table.shape[0], width, bytes / lookup / 1e9, bytes / copy / 1e9, copy / lookup, 100 * bytes / lookup / 1e9 / currentBandwidth);
+        fflush(stdout); }
+
+    let x = Tensor<float>::normal(Shape((int) length));
+    let index = Tensor<int>::random(0, (int) length - 1, Shape((int) length));
+    let source = Tensor<float>::normal(Shape((int) length));
+    double bytes = 3.0 * length * sizeof(float);
+    double scalar = bestTime([&] {
+        let y = Tensor<float>::zeros(x.shape);
+        for (size_t i = 0; i < length; i++)
+            y.at(i) = x.at(index.at(i)); }, repeats);
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::AVX2, SimdLevel::AVX512 }) {
+        if (level > detectSimdLevel())
+            continue;
+        setSimdLevel(level);
+        double gather = bestTime([&] { x.gather(0, index); }, repeats);
+        double scatter = bestTime([&] { x.scatterAdd(0, index, source); }, repeats);
+        record("gather", "float", "contiguous", simdLevelName(level), x.shape, gather, bytes, 0);
+        record("scatterAdd", "float", "contiguous", simdLevelName(level), x.shape, scatter, bytes + length * sizeof(float), length);
+        printf("%-8s gather %8.2f GB/s %6.2fx   scatterAdd %8.2f GB/s\n", simdLevelName(level).c_str(),
+            bytes / gather / 1e9, scalar / gather, (bytes + length * sizeof(float)) / scatter / 1e9);
+        fflush(stdout); }
+    setSimdLevel(detectSimdLevel());
+    print(); }
+
+
+// Sorting benchmarks. Top-k gets timed on rows of 50k to 1M elements, like a
+// beam search over a vocabulary or a retrieval over an index, against copying
+// each row out and calling std::partial_sort on it, which is what it replaces.
+// Full sorts get compared to std::sort on (value, index) pairs, since they
+// return both, and both get timed along a strided dimension too.
+
+void benchSort (int repeats) {
+    struct Case { int rows, columns; };
+    Case cases[] = { { 64, 50000 }, { 4, 1 << 20 } };
+    for (Case c : cases) {
+        let x = Tensor<float>::normal(Shape(c.rows, c.columns));
+        double bytes = (double) c.rows * c.columns * sizeof(float);
+        for (int k : { 10, 100 }) {
+            double topk = bestTime([&] { x.topk(k); }, repeats);
+            double baseline = bestTime([&] {
+                List<std::pair<float, size_t>> row(c.columns);
+                for (int r = 0; r < c.rows; r++) {
+                    for (int i = 0; i < c.columns; i++)
+                        row[i] = std::make_pair(-x.data()[(size_t) r * c.columns + i], (size_t) i);
+                    std::partial_sort(row.begin(), row.begin() + k, row.end()); }}, repeats);
+            record("topk", "float", "contiguous", "k=" + std::to_string(k), x.shape, topk, bytes, 0);
+            record("topk", "float", "contiguous", "std::partial_sort", x.shape, baseline, bytes, 0);
+            printf("topk %-3d %5d x %-8d %8.2f ms %7.2f GB/s   std::partial_sort %8.2f ms %6.2fx\n",
+                k, c.rows, c.columns, topk * 1e3, bytes / topk / 1e9, baseline * 1e3, baseline / topk);
+            fflush(stdout); }
+
+        double sort = bestTime([&] { x.sort(); }, repeats);
+        double baseline = bestTime([&] {
+            List<std::pair<float, size_t>> row(c.columns);
+            for (int r = 0; r < c.rows; r++) {
+                for (int i = 0; i < c.columns; i++)
+                    row[i] = std::make_pair(x.data()[(size_t) r * c.columns + i], (size_t) i);
+                std::sort(row.begin(), row.end()); }}, repeats);
+        let strided = x.transpose().contiguous().transpose();
+        double stridedSort = bestTime([&] { strided.sort(1); }, repeats);
+        record("sort", "float", "contiguous", "", x.shape, sort, bytes, 0);
+        record("sort", "float", "contiguous", "std::sort", x.shape, baseline, bytes, 0);
+        record("sort", "float", "strided", "", x.shape, stridedSort, bytes, 0);
+        printf("sort     %5d x %-8d %8.2f ms   strided %8.2f ms   std::sort %8.2f ms %6.2fx\n",
+            c.rows, c.columns, sort * 1e3, stridedSort * 1e3, baseline * 1e3, baseline / sort);
+        fflush(stdout); }
+    print(); }
+
+
+// Sparse benchmarks. A sparse matrix gets multiplied by a dense vector (SpMV)
+// and a dense matrix (SpMM) at a range of densities, against the same matrix
+// stored densely, going through the GEMM. The density where the sparse path
+// stops winning is the crossover, below which a sparse tensor is worth it.
+
+void benchSparse (int repeats) {
+    int rows = 4096, columns = 4096, n = 64;
+    let b = Tensor<float>::normal(Shape(columns, n));
+    let x = Tensor<float>::normal(Shape(columns, 1));
+    let v = x.view(columns);
+    double crossover[2] = { 0, 0 };
+    for (double density : { 0.001, 0.003, 0.01, 0.03, 0.1, 0.2, 0.3, 0.5 }) {
+        let mask = Tensor<float>::random(0, 1, Shape(rows, columns));
+        let a = Tensor<float>::normal(Shape(rows, columns));
+        for (size_t i = 0; i < a.shape.volume(); i++)
+            if (mask.at(i) >= density) a.at(i) = 0;
+        let s = SparseTensor<float>::fromDense(a);
+        String name = "density=" + jsonNumber(density);
+
+        double spmv = bestTime([&] { s.matmul(v); }, repeats);
+        double gemv = bestTime([&] { a.matmul(x); }, repeats);
+        double spmm = bestTime([&] { s.matmul(b); }, repeats);
+        double gemm = bestTime([&] { a.matmul(b); }, repeats);
+        double flops = 2.0 * s.nnz() * n, denseFlops = 2.0 * rows * columns * n;
+        record("spmv", "float", "sparse", name, a.shape, spmv, 0, 2.0 * s.nnz());
+        record("spmv", "float", "dense", name, a.shape, gemv, 0, 2.0 * rows * columns);
+        record("spmm", "float", "sparse", name, a.shape, spmm, 0, flops);
+        record("spmm", "float", "dense", name, a.shape, gemm, 0, denseFlops);
+        printf("density %6.3f   spmv %8.3f ms  dense %8.3f ms %7.2fx   spmm %8.3f ms  dense %8.3f ms %7.2fx\n",
+            density, spmv * 1e3, gemv * 1e3, gemv / spmv, spmm * 1e3, gemm * 1e3, gemm / spmm);
+        fflush(stdout);
+        if (!crossover[0] && spmv > gemv) crossover[0] = density;
+        if (!crossover[1] && spmm > gemm) crossover[1] = density; }
+
+    let describe = [] (double density) {
+        return density ? "below a density of " + jsonNumber(density) : String("at every density tried"); };
+    print("Sparse SpMV wins", describe(crossover[0]) + ", and SpMM wins", describe(crossover[1]));
+    print(); }
+
+
+// File benchmarks. We save a large checkpoint and time how long it takes to load
+// it back, which should only depend on the size of the header, since the data
+// gets mapped rather than read. The first pass over the loaded data pays for
+// the page faults that bring it in from the page cache (or the disk).
+
+void benchFile (size_t length, int repeats) {
+    String path = "bench.bten";
+    {
+        let x = Tensor<float>::random(0, 1, Shape((int) length));
+        TensorWriter().add("x", x).write(path);
+    }
+
+    double load = bestTime([&] { TensorFile(path).get<float>("x"); }, repeats);
+    TensorFile file(path);
+    let x = file.get<float>("x");
+    float total = 0;
+    double touch = bestTime([&] { total = x.sum(); }, 1);
+    double bytes = length * sizeof(float);
+    record("load", "float", "contiguous", "", Shape((int) length), load, 0, 0);
+    record("first sum", "float", "contiguous", "", Shape((int) length), touch, bytes, length);
+    printf("%.2f GB   load %9.3f ms   first sum %9.3f ms %7.2f GB/s   (sum = %g)\n",
+        bytes / 1e9, load * 1e3, touch * 1e3, bytes / touch / 1e9, total);
+    std::remove(path.c_str());
+    print(); }
+
+
+// Op sweeps. We time the core ops over a grid of sizes, ranks, element types and
+// layouts, on every thread count from 1 up to the size of the pool. Each size is
+// split as evenly as possible over the dimensions of the given rank, and each
+// op is run on three layouts of the same data:
+//   contiguous: the inputs are dense and row-major
+//   transposed: the inputs are permuted views of dense tensors with the
+//               dimensions in reverse order, so nothing is adjacent in memory
+//   broadcast:  the second input has the first dimension only, and gets
+//               broadcast over the rest (BTen aligns broadcasts on the left)
+// We report GB/s and GFLOP/s, and how close the op gets to the roofline, which
+// is the measured bandwidth divided by the bytes that the op needs to move.
+// Tensors that fit in cache can beat it, since the bandwidth is from memory.
+
+Shape sweepShape (size_t volume, int rank) {
+    Shape shape = Shape::filled(rank, 1);
+    size_t remaining = volume;
+    for (int i = 0; i < rank; i++) {
+        int d = (int) std::round(std::pow((double) remaining, 1.0 / (rank - i)));
+        shape[i] = std::max(1, d);
+        remaining = std::max((size_t) 1, remaining / shape[i]); }
+    return shape; }
+
+template <typename T> Tensor<T> sweepInput (const Shape& shape, const String& layout) {
+    if (layout != "transposed")
+        return Tensor<T>::random(1, 100, shape);
+
+    List<int> reversed;
+    for (int i = shape.length - 1; i >= 0; i--)
+        reversed.push_back(i);
+    return Tensor<T>::random(1, 100, permuteShape(shape, reversed)).permute(reversed); }
+
+template <typename T> void benchSweep (size_t maxLength, int repeats) {
+    String type = typeName<T>();
+    String layouts[] = { "contiguous", "transposed", "broadcast" };
+    List<int> reversed;
+
+    for (size_t length = 1 << 10; length <= maxLength; length <<= 4) {
+        for (int rank = 1; rank <= 4; rank++) {
+            Shape shape = sweepShape(length, rank);
+            size_t n = shape.volume();
+            double size = sizeof(T);
+            reversed.clear();
+            for (int i = rank - 1; i >= 0; i--)
+                reversed.push_back(i);
+
+            for (const String& layout : layouts) {
+                let a = sweepInput<T>(shape, layout);
+                let b = layout == "broadcast" ? Tensor<T>::random(1, 100, Shape(shape[0])) : sweepInput<T>(shape, layout);
+                double inputBytes = layout == "broadcast" ? n * size + shape[0] * size : 2 * n * size;
+
+                #define benchSweepOp(name, expression, bytes, flops)            \
+                {                                                               \
+                    double seconds = batchTime([&] { expression; }, repeats);   \
+                    record(name, type, layout, "", shape, seconds, bytes, flops); \
+                    double roofline = currentBandwidth * 1e9 / (bytes);         \
+                    printf("%-10s %-7s %-11s %-24s %10.4f ms %8.2f GB/s %7.2f GFLOP/s %5.1f%% of roofline\n", \
+                        name, type.c_str(), layout.c_str(), shape.toString().c_str(), seconds * 1e3, \
+                        (bytes) / seconds / 1e9, (flops) / seconds / 1e9, 100 / seconds / roofline); }
+
+                benchSweepOp("add", Tensor<T>(a + b), inputBytes + n * size, n);
+                benchSweepOp("mul-add", Tensor<T>(a * b + a), inputBytes + n * size, 2.0 * n);
+                benchSweepOp("sum", a.sum(), n * size, n);
+                benchSweepOp("sum(0)", a.sum(0), n * size + n / shape[0] * size, n);
+                benchSweepOp("sum(-1)", a.sum(-1), n * size + n / shape[-1] * size, n);
+                benchSweepOp("max(0)", a.max(0), n * size + n / shape[0] * size, n);
+                if (rank >= 3)
+                    benchSweepOp("sum(0,2)", a.sum({ 0, 2 }), n * size + n / shape[0] / shape[2] * size, n);
+                if (layout != "broadcast")
+                    benchSweepOp("permute", Tensor<T>(a.permute(reversed) + (T) 0), 2 * n * size, 0);
+                if (layout == "transposed")
+                    benchSweepOp("contiguous", a.contiguous(), 2 * n * size, 0);
+                #undef benchSweepOp
+            }}}
+
+    // Factories don't have a layout, so we only need to time them once per size
+    for (size_t length = 1 << 10; length <= maxLength; length <<= 4) {
+        Shape shape((int) length);
+        double seconds = batchTime([&] { Tensor<T>::random(0, 1, shape); }, repeats);
+        record("random", type, "contiguous", "", shape, seconds, length * sizeof(T), 0);
+        printf("%-10s %-7s %-11s %-24s %10.4f ms %8.2f GB/s\n", "random", type.c_str(), "contiguous",
+            shape.toString().c_str(), seconds * 1e3, length * sizeof(T) / seconds / 1e9); }
+
+    // Printing only makes sense for small tensors, so we time it on a 16x16 matrix
+    let small = Tensor<T>::random(0, 1, Shape(16, 16));
+    double seconds = batchTime([&] { small.toString(); }, repeats);
+    record("toString", type, "contiguous", "", small.shape, seconds, 0, 0);
+    printf("%-10s %-7s %-11s %-24s %10.4f ms\n", "toString", type.c_str(), "contiguous", small.shape.toString().c_str(), seconds * 1e3);
+    fflush(stdout);
+    print(); }
+
+void benchSweeps (size_t maxLength, int repeats) {
+    size_t threads = getNumThreads();
+    for (size_t t = 1; t <= threads; t = t * 2 > threads && t < threads ? threads : t * 2) {
+        setNumThreads(t);
+        currentBandwidth = measureBandwidth(repeats);
+        print("Op sweep up to", maxLength, "elements on", t, "threads, memory bandwidth", currentBandwidth, "GB/s");
+        print();
+        benchSweep<float>(maxLength, repeats);
+        benchSweep<double>(maxLength, repeats);
+        benchSweep<int>(maxLength, repeats); }
+    setNumThreads(threads);
+    currentBandwidth = measureBandwidth(repeats); }
+
+
+int main (int argc, char** argv) {
+    // Pull the `--json=path` flag out of the arguments, wherever it is
+    String json;
+    List<String> args;
+    for (int i = 1; i < argc; i++) {
+        String arg = argv[i];
+        if (arg.compare(0, 7, "--json=") == 0)
+             json = arg.substr(7);
+        else args.push_back(arg); }
+
+    String suite = args.size() > 0 ? args[0] : "all";
+    size_t length = args.size() > 1 ? std::stoul(args[1]) : 1 << 22;
+    int repeats = args.size() > 2 ? std::stoi(args[2]) : 10;
+    bool lengthGiven = args.size() > 1;
+
+    try {
+        currentBandwidth = measureBandwidth(repeats);
+
+        if (suite == "all" || suite == "ops") {
+            currentSuite = "ops";
+            benchSweeps(length, repeats); }
+
+        if (suite == "all" || suite == "simd") {
+            currentSuite = "simd";
+            print("Elementwise and reduction kernels over", length, "elements, best of", repeats, "runs");
+            print();
+            benchSimd<float>(length, repeats);
+            benchSimd<double>(length, repeats);
+            benchSimd<int>(length, repeats); }
+
+        if (suite == "all" || suite == "gemm") {
+            currentSuite = "gemm";
+            print("Float32 matrix multiplication (m x n x k) on", getNumThreads(), "threads");
+            print();
+            benchGemm(repeats); }
+
+        if (suite == "all" || suite == "fusion") {
+            currentSuite = "fusion";
+            size_t fusionLength = lengthGiven ? length : 1 << 25;
+            print("Fused vs unfused float32 elementwise chains over", fusionLength, "elements on", getNumThreads(), "threads");
+            print();
+            benchFusion(fusionLength, repeats); }
+
+        if (suite == "all" || suite == "random") {
+            currentSuite = "random";
+            print("Random tensors with", length, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchRandom<float>(length, repeats);
+            benchRandom<double>(length, repeats); }
+
+        if (suite == "all" || suite == "softmax") {
+            currentSuite = "softmax";
+            print("Softmax over rows of 32768 elements,", length, "elements in all, on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchSoftmax<float>(length, repeats);
+            benchSoftmax<double>(length, repeats); }
+
+        if (suite == "all" || suite == "math") {
+            currentSuite = "math";
+            print("Elementwise math over", length, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchMath<float>(length, repeats);
+            benchMath<double>(length, repeats); }
+
+        if (suite == "all" || suite == "summation") {
+            currentSuite = "summation";
+            size_t sumLength = lengthGiven ? length : 1 << 26;
+            print("Float32 summation over", sumLength, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchSummation(sumLength, repeats); }
+
+        if (suite == "all" || suite == "lowp") {
+            currentSuite = "lowp";
+            print("Half-precision and int8 tensors,", length, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchLowPrecision(length, repeats); }
+
+        if (suite == "all" || suite == "cast") {
+            currentSuite = "cast";
+            print("Casts between element types,", length, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchCasts(length, repeats); }
+
+        if (suite == "all" || suite == "conv") {
+            currentSuite = "conv";
+            print("Convolution and pooling on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchConv(repeats); }
+
+        if (suite == "all" || suite == "graph") {
+            currentSuite = "graph";
+            print("Eager execution against graph replay, on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchGraph(repeats); }
+
+        if (suite == "all" || suite == "indexing") {
+            currentSuite = "indexing";
+            print("Embedding lookups, gathers and scatters over", length, "elements on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchIndexing(length, repeats); }
+
+        if (suite == "all" || suite == "sort") {
+            currentSuite = "sort";
+            print("Top-k and sorting along rows on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchSort(repeats); }
+
+        if (suite == "all" || suite == "sparse") {
+            currentSuite = "sparse";
+            print("Sparse against dense matrix products on", getNumThreads(), "threads, best of", repeats, "runs");
+            print();
+            benchSparse(repeats); }
+
+        if (suite == "all" || suite == "file") {
+            currentSuite = "file";
+            size_t fileLength = lengthGiven ? length : 1 << 28;
+            print("Loading a memory-mapped float32 checkpoint with", fileLength, "elements, best of", repeats, "runs");
+            print();
+            benchFile(fileLength, repeats); }
+
+        if (!json.empty()) {
+            writeJson(json);
+            print("Wrote", results.size(), "results to", json); }
+    }
+    catch (const char* error) {
+        print(error);
+        return 1;
+    }
+}
@@ -0,0 +1,244 @@
+#ifndef __ALLOCATOR__
+#define __ALLOCATOR__
+
+#include "core.cpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+
+// Caching allocator for tensor data. A steady-state loop (like running the same
+// model over and over) allocates and frees the same sizes of buffers on every
+// iteration, so rather than handing memory back to the system when a buffer is
+// freed, we keep it around and give it to the next buffer of the same size.
+//
+// Requests are rounded up to one of a set of size classes, four per power of two
+// (so at most 25% of a block is wasted), and each size class has its own free
+// list. Small blocks are cached per thread first, so the common case doesn't
+// take a lock at all, and spill over into a shared cache once a thread's cache
+// is full. Large blocks always go through the shared cache, since they often get
+// freed on a different thread than the one that allocated them.
+//
+// Every block is aligned to 64 bytes, which is a cache line and a full AVX-512
+// register. Large blocks are mapped directly and aligned to 2MB, and we ask the
+// kernel to back them with huge pages, which cuts down on TLB misses and on the
+// number of page faults when the block is first touched.
+
+#define ALLOCATOR_ALIGNMENT 64
+#define ALLOCATOR_SIZE_CLASSES 256
+#define ALLOCATOR_HUGE_PAGE (2 << 20)
+
+// Blocks up to this size get cached per thread, and each thread caches at most
+// ALLOCATOR_THREAD_CACHE bytes
+#define ALLOCATOR_SMALL_BLOCK (256 << 10)
+#define ALLOCATOR_THREAD_CACHE (8 << 20)
+
+struct AllocatorStats {
+    size_t inUse;           // Bytes in blocks that are currently allocated
+    size_t cached;          // Bytes in freed blocks that are being kept for reuse
+    size_t peak;            // Highest value of `inUse` so far
+    size_t allocations;     // Number of allocations
+    size_t hits;            // Number of allocations that reused a cached block
+
+    double hitRate () const {
+        return this->allocations ? (double) this->hits / this->allocations : 0; }
+
+    String toString () const {
+        return "AllocatorStats(inUse=" + std::to_string(this->inUse) + ", cached=" + std::to_string(this->cached) +
+            ", peak=" + std::to_string(this->peak) + ", hitRate=" + std::to_string(this->hitRate()) + ")"; }};
+
+
+class CachingAllocator {
+public:
+    std::mutex mutex;
+    List<void*> freeLists[ALLOCATOR_SIZE_CLASSES];
+    size_t cacheLimit;
+    std::atomic<size_t> inUse, cached, peak, allocations, hits;
+
+    struct ThreadCache {
+        List<void*> freeLists[ALLOCATOR_SIZE_CLASSES];
+        size_t bytes = 0;
+
+        // Hand everything back to the shared cache when the thread exits
+        ~ThreadCache () {
+            threadExiting() = true;
+            CachingAllocator& allocator = cachingAllocator();
+            std::lock_guard<std::mutex> lock(allocator.mutex);
+            for (size_t c = 0; c < ALLOCATOR_SIZE_CLASSES; c++)
+                for (void* block : this->freeLists[c])
+                    allocator.freeLists[c].push_back(block); }};
+
+    // Constructor. The cache limit can be set with BTEN_CACHE_LIMIT (in bytes).
+    CachingAllocator () : cacheLimit(4ul << 30), inUse(0), cached(0), peak(0), allocations(0), hits(0) {
+        const char* value = std::getenv("BTEN_CACHE_LIMIT");
+        if (value)
+            this->cacheLimit = std::strtoull(value, NULL, 10); }
+
+
+    // Allocation methods
+
+    void* allocate (size_t bytes) {
+        if (bytes == 0)
+            return NULL;
+
+        size_t c = sizeClass(bytes);
+        size_t size = classSize(c);
+        void* block = NULL;
+        this->allocations++;
+
+        // Check this thread's cache, and then the shared cache
+        ThreadCache* local = threadCache();
+        if (local && size <= ALLOCATOR_SMALL_BLOCK && !local->freeLists[c].empty()) {
+            block = local->freeLists[c].back();
+            local->freeLists[c].pop_back();
+            local->bytes -= size; }
+        else {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->freeLists[c].empty()) {
+                block = this->freeLists[c].back();
+                this->freeLists[c].pop_back(); }}
+
+        if (block) {
+            this->hits++;
+            this->cached -= size; }
+        else block = mapBlock(size);
+
+        size_t current = this->inUse += size;
+        size_t previous = this->peak;
+        while (current > previous && !this->peak.compare_exchange_weak(previous, current));
+        return block; }
+
+    void free (void* block, size_t bytes) {
+        if (!block)
+            return;
+
+        size_t c = sizeClass(bytes);
+        size_t size = classSize(c);
+        this->inUse -= size;
+
+        ThreadCache* local = threadCache();
+        if (local && size <= ALLOCATOR_SMALL_BLOCK && local->bytes + size <= ALLOCATOR_THREAD_CACHE) {
+            local->freeLists[c].push_back(block);
+            local->bytes += size;
+            this->cached += size;
+            return; }
+
+        if (this->cached + size > this->cacheLimit)
+            return unmapBlock(block, size);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->freeLists[c].push_back(block);
+        this->cached += size; }
+
+    // Frees every cached block in the shared cache and the calling thread's cache
+    void release () {
+        ThreadCache* local = threadCache();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        for (size_t c = 0; c < ALLOCATOR_SIZE_CLASSES; c++) {
+            if (local) {
+                for (void* block : local->freeLists[c]) {
+                    unmapBlock(block, classSize(c));
+                    this->cached -= classSize(c); }
+                local->freeLists[c].clear(); }
+            for (void* block : this->freeLists[c]) {
+                unmapBlock(block, classSize(c));
+                this->cached -= classSize(c); }
+            this->freeLists[c].clear(); }
+        if (local)
+            local->bytes = 0; }
+
+
+    // Helper methods
+
+    // Size classes go up in steps of a quarter of a power of two, starting from
+    // four steps of 64 bytes
+    static size_t sizeClass (size_t bytes) {
+        size_t units = (bytes + ALLOCATOR_ALIGNMENT - 1) / ALLOCATOR_ALIGNMENT;
+        if (units <= 4)
+            return units - 1;
+
+        size_t shift = 63 - __builtin_clzl(units - 1) - 2;
+        return 4 * (shift + 1) + ((units - 1) >> shift) - 4; }
+
+    static size_t classSize (size_t c) {
+        if (c < 4)
+            return (c + 1) * ALLOCATOR_ALIGNMENT;
+        size_t shift = c / 4 - 1;
+        return ((c % 4 + 5) << shift) * ALLOCATOR_ALIGNMENT; }
+
+    // Returns the calling thread's cache, or NULL if the thread is exiting and
+    // its cache has already been destroyed
+    static ThreadCache* threadCache () {
+        if (threadExiting())
+            return NULL;
+        static thread_local ThreadCache cache;
+        return &cache; }
+
+    static bool& threadExiting () {
+        static thread_local bool value = false;
+        return value; }
+
+    static void* mapBlock (size_t size) {
+        #ifdef __linux__
+        if (size >= ALLOCATOR_HUGE_PAGE) {
+            // Map an extra huge page's worth, so we can trim the mapping down to
+            // a region that's aligned to a huge page boundary
+            size_t length = size + ALLOCATOR_HUGE_PAGE;
+            char* region = (char*) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region == MAP_FAILED)
+                throw std::bad_alloc();
+
+            char* block = (char*) (((uintptr_t) region + ALLOCATOR_HUGE_PAGE - 1) & ~(uintptr_t) (ALLOCATOR_HUGE_PAGE - 1));
+            if (block > region)
+                munmap(region, block - region);
+            if (region + length > block + size)
+                munmap(block + size, region + length - block - size);
+            madvise(block, size, MADV_HUGEPAGE);
+            return block; }
+        #endif
+
+        void* block = NULL;
+        if (posix_memalign(&block, ALLOCATOR_ALIGNMENT, size))
+            throw std::bad_alloc();
+        return block; }
+
+    static void unmapBlock (void* block, size_t size) {
+        #ifdef __linux__
+        if (size >= ALLOCATOR_HUGE_PAGE)
+            return (void) munmap(block, size);
+        #endif
+        std::free(block); }
+
+    static CachingAllocator& cachingAllocator () {
+        static CachingAllocator* allocator = new CachingAllocator();
+        return *allocator; }};
+
+
+// Global allocator
+
+void* poolAllocate (size_t bytes) {
+    return CachingAllocator::cachingAllocator().allocate(bytes); }
+
+void poolFree (void* block, size_t bytes) {
+    CachingAllocator::cachingAllocator().free(block, bytes); }
+
+AllocatorStats getAllocatorStats () {
+    CachingAllocator& allocator = CachingAllocator::cachingAllocator();
+    return { allocator.inUse, allocator.cached, allocator.peak, allocator.allocations, allocator.hits }; }
+
+// Returns the memory held by the cache to the system. Blocks cached by other
+// threads stay where they are until those threads exit.
+void releaseCachedMemory () {
+    CachingAllocator::cachingAllocator().release(); }
+
+void setAllocatorCacheLimit (size_t bytes) {
+    CachingAllocator::cachingAllocator().cacheLimit = bytes; }
+
+
+#endif
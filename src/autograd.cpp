@@ -0,0 +1,197 @@
+#ifndef __AUTOGRAD__
+#define __AUTOGRAD__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "expression.cpp"
+#include <functional>
+#include <unordered_set>
+
+
+// Reverse-mode automatic differentiation. A tensor that requires a gradient
+// holds a reference to a node in the computational graph: leaf tensors (the
+// ones created with `setRequiresGrad`) get a node of their own, and every
+// differentiable op that has one of them as an input records a new node for its
+// output, with references to its inputs' nodes and a function that maps the
+// gradient of its output to the gradients of its inputs. Ops only record a node
+// when at least one of their inputs requires a gradient, and never record one
+// inside a `NoGrad` scope, so inference code doesn't pay for the graph at all.
+//
+// Calling `backward` on a tensor sorts the nodes it depends on topologically
+// and then walks them from the output back to the leaves. Gradients are summed
+// into each node in place as they arrive, and as soon as a node has passed its
+// gradient on to its inputs, we drop its gradient, its backward function (and
+// with it any tensors that the function saved from the forward pass) and its
+// edges, so the memory held by the graph shrinks as the backward pass goes on.
+// Only the leaves keep their gradients, which accumulate across calls until
+// they're cleared with `zeroGrad`.
+//
+// Backward functions read the values of the tensors they saved from the forward
+// pass, so each node also keeps the versions of those tensors' buffers (see
+// buffer.cpp) from when it was recorded. If an in-place op has written to one of
+// them since, the gradient would come out wrong, so `backward` throws instead.
+
+
+// Grad mode
+
+// Whether ops on the current thread should record nodes in the graph
+bool& gradEnabled () {
+    static thread_local bool value = true;
+    return value; }
+
+// Disables graph recording until it goes out of scope:
+//
+//     {
+//         NoGrad guard;
+//         let y = model(x);  // Records nothing
+//     }
+struct NoGrad {
+    bool previous;
+    NoGrad () : previous(gradEnabled()) { gradEnabled() = false; }
+    ~NoGrad () { gradEnabled() = this->previous; }};
+
+
+// Graph nodes
+
+template <typename T> class Tensor;
+
+template <typename T> struct Node {
+    typedef std::function<List<Tensor<T>>(const Tensor<T>&)> Backward;
+    typedef std::pair<Reference<Buffer<T>>, size_t> Saved;
+
+    List<Reference<Node<T>>> inputs;
+    Backward backward;              // Maps the output's gradient to one gradient per input
+    List<Saved> saved;              // Buffers that `backward` reads, with their versions when it was recorded
+    Reference<Tensor<T>> grad;      // Gradient accumulated so far
+    bool leaf;
+
+    // Constructors
+    Node () : leaf(true) { }
+    Node (List<Reference<Node<T>>> inputs, Backward backward, List<Saved> saved = {}) :
+        inputs(inputs), backward(backward), saved(saved), leaf(false) { }
+
+    // Destructor. A long chain of nodes would overflow the stack if each one
+    // freed its inputs recursively, so we take apart any inputs that nothing else
+    // references here, one at a time. (The backward function also holds on to
+    // its inputs, through the tensors it saved, so that gets dropped as well.)
+    ~Node () {
+        List<Reference<Node<T>>> stack;
+        stack.swap(this->inputs);
+        this->backward = nullptr;
+        while (!stack.empty()) {
+            Reference<Node<T>> node = stack.back();
+            stack.pop_back();
+            if (node.use_count() == 1) {
+                stack.insert(stack.end(), node->inputs.begin(), node->inputs.end());
+                node->inputs.clear();
+                node->backward = nullptr; }}}
+
+    // Adds `incoming` to this node's gradient. The first gradient to arrive is
+    // adopted as-is if nothing else references its buffer, and copied otherwise,
+    // since we sum later gradients into it in place.
+    void accumulate (const Tensor<T>& incoming) {
+        if (!this->grad) {
+            bool owned = incoming.buffer.use_count() == 1 && incoming.stride == getStrideForShape(incoming.shape);
+            this->grad = Reference<Tensor<T>>(new Tensor<T>(owned ? incoming : evaluateDetached(incoming)));
+            return; }
+
+        if (this->grad->shape != incoming.shape)
+            throw "Node.accumulate - The gradient doesn't have the same shape as the tensor";
+        *this->grad += incoming; }};
+
+
+// Helper functions
+
+// Sums the gradient of a broadcasted op's output over the dimensions that the
+// input with shape `shape` was broadcast along, which gives the gradient of the
+// input itself
+template <typename T> Tensor<T> reduceGradient (Tensor<T> grad, const Shape& shape) {
+    if (grad.shape == shape)
+        return grad;
+
+    for (size_t d = 0; d < grad.shape.length; d++) {
+        if ((d >= shape.length || shape[d] == 1) && grad.shape[d] != 1)
+            grad = grad.sum(d); }
+
+    // All that's left is dropping the trailing dimensions the input doesn't have
+    return grad.reshape(shape); }
+
+// Broadcasts the gradient of a reduction's output (where the reduced dimension
+// has size 1) back over the input's shape `shape`, without copying it
+template <typename T> Tensor<T> expandGradient (const Tensor<T>& grad, const Shape& shape) {
+    return Tensor<T>(grad.buffer, shape, getBroadcastedStride(grad.shape, grad.stride, shape), grad.offset); }
+
+// Routes the gradient of a max or min over `dims` to the elements at `indices`,
+// which count in row-major order over those dimensions, leaving a zero gradient
+// everywhere else
+template <typename T, typename I> Tensor<T> scatterGradient (const Tensor<T>& grad, const Tensor<I>& indices, const Shape& shape, Shape dims) {
+    let result = Tensor<T>::zeros(shape);
+    T* data = result.data();
+    const T* values = grad.data();
+    const I* index = indices.data();
+    std::sort(dims.dimensions, dims.dimensions + dims.length);
+
+    for (let it = StridedIterator(indices.shape, { result.stride, indices.stride, grad.stride }); !it.done(); it.next()) {
+        for (size_t j = 0; j < it.size; j++) {
+            size_t position = index[it.offset[1] + j * it.stride[1]];
+            ptrdiff_t offset = it.offset[0] + j * it.stride[0];
+            for (int k = (int) dims.length - 1; k >= 0; k--) {
+                offset += position % shape[dims[k]] * result.stride[dims[k]];
+                position /= shape[dims[k]]; }
+            data[offset] = values[it.offset[2] + j * it.stride[2]]; }}
+    return result; }
+
+
+// Backward pass
+
+// Backpropagates `seed`, the gradient of some output with respect to itself,
+// through the graph that ends at `root`
+template <typename T> void runBackward (const Reference<Node<T>>& root, const Tensor<T>& seed) {
+    NoGrad guard;
+
+    // Sort the graph with an iterative depth-first search, so that deep graphs
+    // can't overflow the stack. Each node ends up after all of its inputs. The
+    // sorted list holds on to every node, since we cut the edges between them as
+    // we go.
+    List<Reference<Node<T>>> order;
+    std::unordered_set<Node<T>*> visited = { root.get() };
+    List<std::pair<Reference<Node<T>>, size_t>> stack = { { root, 0 } };
+    while (!stack.empty()) {
+        let& top = stack.back();
+        if (top.second < top.first->inputs.size()) {
+            let input = top.first->inputs[top.second++];
+            if (visited.insert(input.get()).second)
+                stack.push_back({ input, 0 }); }
+        else {
+            order.push_back(top.first);
+            stack.pop_back(); }}
+
+    // Walk the graph from the output back to the leaves, releasing each node as
+    // soon as we're done with it
+    root->accumulate(seed);
+    for (size_t i = order.size(); i-- > 0;) {
+        Reference<Node<T>> node = order[i];
+        order[i].reset();
+        if (node->leaf || !node->grad)
+            continue;
+        if (!node->backward)
+            throw "Tensor.backward - This graph has already been freed by an earlier backward pass";
+        for (size_t k = 0; k < node->saved.size(); k++) {
+            if (node->saved[k].first->version != node->saved[k].second)
+                throw "Tensor.backward - A tensor needed for the gradient has been modified by an in-place operation"; }
+
+        List<Tensor<T>> grads;
+        {
+            Tensor<T> grad = *node->grad;
+            node->grad.reset();
+            grads = node->backward(grad);
+        }
+        node->backward = nullptr;
+        node->saved.clear();
+        for (size_t k = 0; k < grads.size(); k++)
+            node->inputs[k]->accumulate(grads[k]);
+        node->inputs.clear(); }}
+
+
+#endif
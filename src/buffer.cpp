@@ -2,41 +2,135 @@
 #define __BUFFER__
 
 #include "core.cpp"
+#include "allocator.cpp"
+#include "profiler.cpp"
+
+
+// Buffers get their memory from the caching allocator (see allocator.cpp), so
+// it's 64-byte aligned and gets reused instead of going back to the system. The
+// array constructor also lets a buffer take ownership of an array that was
+// allocated with `new[]`, which it'll free with `delete[]`, and the external
+// constructor wraps memory that belongs to something else (like a memory-mapped
+// file), which the buffer keeps alive through `owner` but never frees itself.
+
+// Buffers that allocate their own memory also report it to the profiler (see
+// profiler.cpp), when it's built in.
+
+// Every in-place write to a buffer bumps its `version`, so that the autograd
+// graph can tell when a tensor that a backward function saved has been changed
+// since (see autograd.cpp).
+
+// Graph capture (see graph.cpp) needs to know about every buffer that gets
+// created while it's recording, so that it can move their memory into its arena
+// afterwards. Buffers report to the observer for their thread, if there is one,
+// with a handle that lets the observer look at and rebind them without knowing
+// their type.
+
+struct BufferHandle {
+    void* buffer;
+    void* (*data) (void* buffer);
+    size_t (*bytes) (void* buffer);
+    void (*rebind) (void* buffer, void* data, Reference<void> owner); };
+
+struct BufferObserver {
+    virtual void created (const BufferHandle& handle) = 0;
+    virtual void destroyed (void* buffer) = 0; };
+
+BufferObserver*& bufferObserver () {
+    static thread_local BufferObserver* value = NULL;
+    return value; }
 
 
 template <typename T> class Buffer {
 public:
     size_t length;
     T* data;
+    bool pooled;            // Whether `data` came from the caching allocator
+    Reference<void> owner;  // What `data` belongs to, if it's external
+    size_t version;         // Number of in-place writes to `data` so far
 
     // Constructors
 
+    // Uninitialized constructor
+    Buffer (size_t length) : length(length), data(allocate(length)), pooled(true), version(0) {
+        profileAllocation(length * sizeof(T));
+        this->observe(); }
+
     // Vector constructor
-    Buffer (List<T> data) : length(data.size()), data(new T[data.size()]) {
+    Buffer (List<T> data) : Buffer(data.size()) {
         std::copy(data.begin(), data.end(), this->data); }
 
     // Array constructor
-    Buffer (size_t length, T* data) : length(length), data(data) { }
+    Buffer (size_t length, T* data) : length(length), data(data), pooled(false), version(0) { }
+
+    // External constructor
+    Buffer (size_t length, T* data, Reference<void> owner) :
+        length(length), data(data), pooled(false), owner(owner), version(0) { }
 
     // Copy constructor
-    Buffer (const Buffer<T>& other) : length(other.length), data(new T[other.length]) {
+    Buffer (const Buffer<T>& other) : Buffer(other.length) {
         std::copy(other.data, &other.data[other.length], this->data); }
 
+    // Move constructor, which takes over the other buffer's memory and leaves it empty
+    Buffer (Buffer<T>&& other) :
+        length(other.length), data(other.data), pooled(other.pooled), owner(std::move(other.owner)), version(other.version) {
+        other.length = 0;
+        other.data = NULL;
+        this->observe(); }
+
 
     // Destructor
 
     ~Buffer () {
-        if (this->data)
-            delete[] this->data; }
+        if (bufferObserver())
+            bufferObserver()->destroyed(this);
+        this->deallocate(); }
+
+
+    // Memory methods
+
+    static T* allocate (size_t length) {
+        return (T*) poolAllocate(length * sizeof(T)); }
+
+    void deallocate () {
+        if (this->owner)
+            this->owner.reset();
+        else if (this->data && this->pooled)
+            poolFree(this->data, this->length * sizeof(T));
+        else if (this->data)
+            delete[] this->data;
+        this->data = NULL; }
 
 
-    // Unimplemented methods
+    // Observer methods
 
-    Buffer<int> toInt () {
-        throw "This method hasn't been implemented for this type"; }
+    void observe () {
+        if (bufferObserver())
+            bufferObserver()->created({ this, &Buffer<T>::dataOf, &Buffer<T>::bytesOf, &Buffer<T>::rebind }); }
 
-    Buffer<float> toFloat () {
-        throw "This method hasn't been implemented for this type"; }
+    static void* dataOf (void* buffer) { return ((Buffer<T>*) buffer)->data; }
+    static size_t bytesOf (void* buffer) { return ((Buffer<T>*) buffer)->length * sizeof(T); }
+
+    // Frees this buffer's memory, and points it at `data` instead, which
+    // belongs to `owner`
+    static void rebind (void* buffer, void* data, Reference<void> owner) {
+        Buffer<T>* self = (Buffer<T>*) buffer;
+        self->deallocate();
+        self->data = (T*) data;
+        self->pooled = false;
+        self->owner = owner; }
+
+
+    // Conversion methods
+
+    Buffer<int> toInt () { return this->template convert<int>(); }
+    Buffer<float> toFloat () { return this->template convert<float>(); }
+
+    template <typename U> Buffer<U> convert () {
+        Buffer<U> result(this->length);
+        for (size_t i = 0; i < this->length; i++)
+            result.data[i] = (U) this->data[i];
+        return result; }
 
 
     // Helper methods
@@ -50,10 +144,26 @@ public:
     Buffer<T>& operator= (const Buffer<T>& other) {
     	if (this == &other) return *this;
 
-	    if (this->data) delete[] this->data;
+        this->deallocate();
         this->length = other.length;
-        this->data = new T[other.length];
+        this->data = allocate(other.length);
+        this->pooled = true;
+        profileAllocation(other.length * sizeof(T));
         std::copy(other.data, &other.data[other.length], this->data);
+        this->version++;
+        return *this; }
+
+    Buffer<T>& operator= (Buffer<T>&& other) {
+        if (this == &other) return *this;
+
+        this->deallocate();
+        this->length = other.length;
+        this->data = other.data;
+        this->pooled = other.pooled;
+        this->owner = std::move(other.owner);
+        other.length = 0;
+        other.data = NULL;
+        this->version++;
         return *this; }
 
     T& operator[] (int i) const {
@@ -62,24 +172,4 @@ public:
         else return this->data[i]; }};
 
 
-// Overloads for Buffer<float> methods
-
-template<> Buffer<float> Buffer<float>::toFloat () { return *this; }
-template<> Buffer<int> Buffer<float>::toInt () {
-    int* data = new int[this->length];
-    for (int i = 0; i < this->length; i++) {
-        data[i] = (int)this->data[i]; }
-    return Buffer<int>(this->length, data); }
-
-
-// Overloads for Buffer<int> methods
-
-template<> Buffer<int> Buffer<int>::toInt () { return *this; }
-template<> Buffer<float> Buffer<int>::toFloat () {
-    float* data = new float[this->length];
-    for (int i = 0; i < this->length; i++) {
-        data[i] = (float)this->data[i]; }
-    return Buffer<float>(this->length, data); }
-
-
 #endif
@@ -0,0 +1,249 @@
+#ifndef __CAST__
+#define __CAST__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "half.cpp"
+#include "parallel.cpp"
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+// Converting between element types, which is what Tensor::to does. A cast
+// truncates floats towards zero when it turns them into integers, like a C++
+// cast, unless it's told to round them to the nearest integer (ties to even),
+// and it can also saturate, clamping values that are out of range for the new
+// type to its lowest or highest value, and turning NaNs into 0. Without
+// saturation, integers that don't fit wrap around, and floats that don't fit
+// are undefined, the same as in C++. Conversions to floating point types always
+// round to nearest, and overflow to infinity, so the modes only matter for
+// conversions to integers.
+//
+// Pairs of built-in types convert a vector register at a time, with every lane
+// going through __builtin_convertvector, and bf16 and f16 go through float,
+// a tile at a time, using the conversion kernels in half.cpp.
+
+enum class CastMode { Truncate, Round, Saturate, SaturateRound };
+
+#define CAST_TILE 256     // Most elements gathered or widened at a time
+
+
+// Bounds
+
+// The range of values in T that fit in U, given as values of T. Integers get
+// compared as long doubles, which hold every 64-bit integer exactly, and a bound
+// that gets rounded up past the end of the range when it's stored in a float
+// type is moved back to the next float towards zero.
+template <typename T, typename U> T castLow () {
+    long double bound = std::max((long double) std::numeric_limits<U>::lowest(), (long double) std::numeric_limits<T>::lowest());
+    T low = (T) bound;
+    if ((long double) low < bound)
+        low = (T) std::nextafter(low, T(0));
+    return low; }
+
+template <typename T, typename U> T castHigh () {
+    long double bound = std::min((long double) std::numeric_limits<U>::max(), (long double) std::numeric_limits<T>::max());
+    T high = (T) bound;
+    if ((long double) high > bound)
+        high = (T) std::nextafter(high, T(0));
+    return high; }
+
+// 2^(digits - 1), the smallest magnitude where every float is an integer
+template <typename T> T roundingMagic () {
+    return std::ldexp(T(1), std::numeric_limits<T>::digits - 1); }
+
+
+// Kernels. The rounding and saturation are applied to scalars and whole vector
+// registers alike, before they get converted. Rounding uses the usual trick of
+// adding and subtracting `magic`, which the float adder rounds to the nearest
+// integer, and skips values that are already integers.
+
+template <bool Round, bool Saturate> struct CastOp {
+    template <typename V> static SIMD_INLINE V apply (const V& input, const V& low, const V& high, const V& magic) {
+        V x = input;
+        if (Round) {
+            V size = x < V() ? -x : x, offset = x < V() ? -magic : magic;
+            V rounded = (x + offset) - offset;
+            x = size < magic ? rounded : x; }
+        if (Saturate) {
+            x = x > high ? high : x;
+            x = x < low ? low : x;
+            x = x == x ? x : V(); }
+        return x; }};
+
+// The highest bound can fall short of U's highest value when U has more digits
+// than T (the largest float below 2^31 is 2^31 - 128), so in that case we
+// replace everything above it with U's highest value after the conversion,
+// given a mask of all ones where it was
+template <typename W> SIMD_INLINE W saturateHigh (const W& y, const W& over, const W& highest, std::true_type) {
+    return (y & ~over) | (highest & over); }
+template <typename W> SIMD_INLINE W saturateHigh (const W& y, const W&, const W&, std::false_type) {
+    return y; }
+
+// Conversions between floats and integers narrower than 32 bits go through
+// int32, which x86 converts in one instruction and then packs or extends,
+// rather than being split into a conversion per lane
+template <typename T, typename U> struct CastVia {
+    typedef typename std::conditional<
+        (std::is_floating_point<T>::value && std::is_integral<U>::value && sizeof(U) < 4) ||
+        (std::is_integral<T>::value && sizeof(T) < 4 && std::is_floating_point<U>::value), int32_t, U>::type type; };
+
+// Converts a vector register of V's lanes into W's lanes, where W is given by a
+// null pointer (vector types lose their width as template arguments). GCC lowers
+// these conversions between int8 and int32 one lane at a time, so for the widths
+// we use, those go through the sign extension and truncation instructions.
+template <typename V, typename W> SIMD_INLINE W castLanes (const V& x, const W*) {
+    return __builtin_convertvector(x, W); }
+
+#define laneCasts(isa, lanes, widen, narrow)                                    \
+typedef int8_t Int8x##lanes __attribute__((vector_size(lanes)));               \
+typedef int32_t Int32x##lanes __attribute__((vector_size(lanes * 4)));         \
+inline __attribute__((target(isa))) Int32x##lanes castLanes (const Int8x##lanes& x, const Int32x##lanes*) { \
+    return widen; }                                                             \
+inline __attribute__((target(isa))) Int8x##lanes castLanes (const Int32x##lanes& x, const Int8x##lanes*) { \
+    return narrow; }
+
+#ifdef SIMD_X86
+laneCasts("sse4.1", 4,
+    (Int32x4) _mm_cvtepi8_epi32(_mm_cvtsi32_si128(bitCast<int>(x))),
+    bitCast<Int8x4>(_mm_cvtsi128_si32(_mm_shuffle_epi8((__m128i) x, _mm_setr_epi32(0x0C080400, -1, -1, -1)))));
+laneCasts("avx2", 8,
+    (Int32x8) _mm256_cvtepi8_epi32(_mm_cvtsi64_si128(bitCast<long long>(x))),
+    bitCast<Int8x8>(_mm_cvtsi128_si64(_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+        _mm256_shuffle_epi8((__m256i) x, _mm256_setr_epi32(0x0C080400, -1, -1, -1, 0x0C080400, -1, -1, -1)),
+        _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1))))));
+laneCasts("avx512f", 16,
+    (Int32x16) _mm512_cvtepi8_epi32(bitCast<__m128i>(x)),
+    bitCast<Int8x16>(_mm512_cvtepi32_epi8((__m512i) x)));
+#endif
+
+// out[i] = (U) in[i], for built-in types. Each step converts as many lanes as
+// fit in one register of the wider type, since GCC splits the selects on wider
+// vectors into one per lane.
+template <typename T, typename U, size_t Bytes, bool Round, bool Saturate> SIMD_INLINE
+void castKernel (size_t n, const T* in, U* out) {
+    const size_t w = Bytes > sizeof(T) && Bytes > sizeof(U) ? Bytes / (sizeof(T) > sizeof(U) ? sizeof(T) : sizeof(U)) : 1;
+    typedef typename CastVia<T, U>::type Via;
+    typedef T In __attribute__((vector_size(w * sizeof(T))));
+    typedef Via Mid __attribute__((vector_size(w * sizeof(Via))));
+    typedef U Out __attribute__((vector_size(w * sizeof(U))));
+    typedef CastOp<Round && std::is_floating_point<T>::value && std::is_integral<U>::value,
+                   Saturate && std::is_integral<U>::value> Op;
+    typedef std::integral_constant<bool, Saturate && std::is_floating_point<T>::value && std::is_integral<U>::value &&
+                                         (std::numeric_limits<U>::digits > std::numeric_limits<T>::digits)> Overflows;
+    const T low = castLow<T, U>(), high = castHigh<T, U>(), magic = std::is_floating_point<T>::value ? roundingMagic<T>() : T(0);
+    const U highest = std::numeric_limits<U>::max();
+    const In lows = In() + low, highs = In() + high, magics = In() + magic;
+    const Out highests = Out() + highest;
+    size_t i = 0;
+
+    for (; i + w <= n; i += w) {
+        In x;
+        std::memcpy(&x, in + i, sizeof(x));
+        Mid y = castLanes(Op::apply(x, lows, highs, magics), (Mid*) NULL);
+        Out z = saturateHigh(castLanes(y, (Out*) NULL), __builtin_convertvector(x > highs, Out), highests, Overflows());
+        std::memcpy(out + i, &z, sizeof(z)); }
+
+    for (; i < n; i++) {
+        U y = (U) Op::apply(in[i], low, high, magic);
+        out[i] = saturateHigh(y, (U) -(int) (in[i] > high), highest, Overflows()); }}
+
+#define castEntryPoint(suffix, isa, bytes)                                      \
+template <typename T, typename U, bool Round, bool Saturate> __attribute__((target(isa))) \
+void cast##suffix (size_t n, const T* in, U* out) {                             \
+    castKernel<T, U, bytes, Round, Saturate>(n, in, out); }
+
+#ifdef SIMD_X86
+castEntryPoint(SSE, "sse4.1", 16);
+castEntryPoint(AVX2, "avx2", 32);
+castEntryPoint(AVX512, "avx512f", 64);
+#endif
+
+template <typename T, typename U, bool Round, bool Saturate> void simdCast (size_t n, const T* in, U* out) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return castAVX512<T, U, Round, Saturate>(n, in, out);
+            case SimdLevel::AVX2: return castAVX2<T, U, Round, Saturate>(n, in, out);
+            case SimdLevel::SSE: return castSSE<T, U, Round, Saturate>(n, in, out);
+            default: break; }}
+    #endif
+    castKernel<T, U, sizeof(float), Round, Saturate>(n, in, out); }
+
+
+// Dispatchers
+
+// out[i] = (U) in[i] for contiguous runs of elements, for every pair of types
+template <typename T, typename U> void castRun (size_t n, const T* in, U* out, CastMode mode) {
+    castRun(n, in, out, mode, std::is_arithmetic<T>(), std::is_arithmetic<U>()); }
+
+template <typename T, typename U> void castRun (size_t n, const T* in, U* out, CastMode mode, std::true_type, std::true_type) {
+    switch (mode) {
+        case CastMode::Truncate: return simdCast<T, U, false, false>(n, in, out);
+        case CastMode::Round: return simdCast<T, U, true, false>(n, in, out);
+        case CastMode::Saturate: return simdCast<T, U, false, true>(n, in, out);
+        case CastMode::SaturateRound: return simdCast<T, U, true, true>(n, in, out); }}
+
+// Halves get widened to floats first
+template <typename T, typename U, typename B> void castRun (size_t n, const T* in, U* out, CastMode mode, std::false_type, B) {
+    if (std::is_same<U, float>::value)
+        return convertToFloat(n, in, reinterpret_cast<float*>(out));
+    float x[CAST_TILE];
+    for (size_t i = 0; i < n; i += CAST_TILE) {
+        size_t m = std::min((size_t) CAST_TILE, n - i);
+        convertToFloat(m, in + i, x);
+        castRun(m, x, out + i, mode); }}
+
+// And everything else gets cast to floats, and then narrowed
+template <typename T, typename U> void castRun (size_t n, const T* in, U* out, CastMode mode, std::true_type, std::false_type) {
+    if (std::is_same<T, float>::value)
+        return convertFromFloat(n, reinterpret_cast<const float*>(in), out);
+    float x[CAST_TILE];
+    for (size_t i = 0; i < n; i += CAST_TILE) {
+        size_t m = std::min((size_t) CAST_TILE, n - i);
+        castRun(m, in + i, x, mode);
+        convertFromFloat(m, x, out + i); }}
+
+// Casts the tensor with the given shape and stride from `input` into `output`,
+// which has the same shape and its own stride. Runs that aren't contiguous on
+// either side get gathered into (or scattered from) a tile, so that the kernels
+// above still see contiguous runs.
+template <typename T, typename U> void castStrided (const T* input, const Shape& shape, const Shape& stride,
+                                                   U* output, const Shape& outputStride, CastMode mode) {
+    size_t volume = shape.volume();
+    let plan = StridedIterator(shape, { outputStride, stride });
+    parallelFor(0, volume, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        T x[CAST_TILE];
+        U y[CAST_TILE];
+        let it = plan;
+        it.limit(begin, end);
+        for (; !it.done(); it.next()) {
+            U* out = output + it.offset[0];
+            const T* in = input + it.offset[1];
+            if (it.stride[0] == 1 && it.stride[1] == 1) {
+                castRun(it.size, in, out, mode);
+                continue; }
+
+            for (size_t j = 0; j < it.size; j += CAST_TILE) {
+                size_t m = std::min((size_t) CAST_TILE, it.size - j);
+                const T* source = in + j * it.stride[1];
+                if (it.stride[1] != 1) {
+                    for (size_t k = 0; k < m; k++)
+                        x[k] = source[k * it.stride[1]];
+                    source = x; }
+                if (it.stride[0] == 1)
+                    castRun(m, source, out + j, mode);
+                else {
+                    castRun(m, source, y, mode);
+                    for (size_t k = 0; k < m; k++)
+                        out[(j + k) * it.stride[0]] = y[k]; }}}}); }
+
+
+#endif
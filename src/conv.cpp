@@ -0,0 +1,564 @@
+#ifndef __CONV__
+#define __CONV__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "allocator.cpp"
+#include "gemm.cpp"
+
+
+// 2-D convolution and pooling over tensors of shape [N, C, H, W]. None of the
+// kernels care how the elements are laid out, since they all take the strides
+// of the four dimensions: an NHWC tensor is just an NCHW-shaped view with the
+// channels innermost (`x.permute(0, 3, 1, 2)` of a [N, H, W, C] tensor), and
+// the output gets the same layout as the input, so neither one gets transposed.
+// Convolutions have three algorithms:
+//
+// - im2col: the receptive field of each output pixel gets copied into a row of
+//   a matrix (or a column, for NCHW), a block of output rows at a time, and one
+//   GEMM per group multiplies it with the weights. The matrix is oriented so that
+//   the GEMM writes straight into the output, with the channels running along
+//   whichever of its dimensions is contiguous.
+// - Direct: 1x1 convolutions without padding are already a matrix product of
+//   the weights and the input's pixels, so they go to the GEMM without a copy.
+//   Depthwise convolutions (one filter per channel) do far too little work per
+//   element for a GEMM, so each filter tap gets multiplied into a whole row of
+//   outputs (NCHW) or into all of a pixel's channels (NHWC) a vector register at
+//   a time.
+// - Winograd's F(2x2, 3x3) computes 3x3 convolutions in 2x2 output tiles. Each
+//   4x4 input tile and each filter get transformed so that the convolution turns
+//   into 16 elementwise products, which summed over the input channels are 16
+//   independent GEMMs with 16 multiplies per tile instead of 36. The transforms
+//   add and subtract neighbouring inputs, so the results lose a few more bits
+//   than the direct sums do.
+//
+// `ConvAlgorithm::Auto` picks the direct path for depthwise and 1x1 convolutions,
+// Winograd for 3x3 convolutions with enough channels to pay for the transforms
+// and enough tiles to keep its GEMMs large (with fewer, packing the transformed
+// filters for each GEMM costs more than Winograd saves), and im2col for the rest.
+
+#define CONV_BLOCK_ELEMENTS (1 << 18)   // Target size of an im2col or Winograd block
+#define CONV_WINOGRAD_CHANNELS 32       // Fewest input and output channels for Winograd
+#define CONV_WINOGRAD_TILES 256         // Fewest 2x2 output tiles for Winograd
+#define CONV_WINOGRAD_BLOCK 256         // Fewest tiles per Winograd block
+#define CONV_WINOGRAD_PADDING 16        // Elements between the 16 matrices of a block (see below)
+
+enum class ConvAlgorithm { Auto, Im2col, Direct, Winograd };
+enum class PoolMode { Max, Average };
+
+// The sizes of a convolution or pooling window, along with the strides of the
+// input, the weight and the output in N, C, H, W order. The output is always
+// dense, either channels-last (output[1] == 1) or row-major (output[3] == 1).
+struct ConvShape {
+    size_t batch, channels, height, width;
+    size_t filters, kernelHeight, kernelWidth;
+    size_t outputHeight, outputWidth;
+    size_t stride, padding, dilation, groups;
+    ptrdiff_t input[4], weight[4], output[4];
+};
+
+// The range of outputs [begin, end) whose input `o * stride + offset` falls
+// inside [0, size)
+inline void convRange (size_t outputs, ptrdiff_t offset, size_t stride, size_t size, size_t& begin, size_t& end) {
+    ptrdiff_t s = stride, lo = offset < 0 ? (-offset + s - 1) / s : 0;
+    ptrdiff_t hi = (ptrdiff_t) size - offset > 0 ? ((ptrdiff_t) size - 1 - offset) / s + 1 : 0;
+    begin = std::min((size_t) lo, outputs);
+    end = std::max(begin, std::min((size_t) hi, outputs)); }
+
+
+// Kernels
+
+// out[i] += w * in[i]
+template <typename T, size_t Bytes> SIMD_INLINE void convScaleAddKernel (size_t n, T w, const T* in, T* out) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t lanes = V::width;
+    typename V::type scale = V::broadcast(w);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes)
+        V::store(out + i, V::load(out + i) + scale * V::load(in + i));
+    for (; i < n; i++)
+        out[i] += w * in[i]; }
+
+// out[i] += w[i] * in[i]
+template <typename T, size_t Bytes> SIMD_INLINE void convMultiplyAddKernel (size_t n, const T* w, const T* in, T* out) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t lanes = V::width;
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes)
+        V::store(out + i, V::load(out + i) + V::load(w + i) * V::load(in + i));
+    for (; i < n; i++)
+        out[i] += w[i] * in[i]; }
+
+// out[i] = op(out[i], in[i])
+template <typename T, size_t Bytes, typename Op> SIMD_INLINE void convAccumulateKernel (size_t n, const T* in, T* out) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        V::store(out + i, Op::apply(V::load(out + i), V::load(in + i)));
+    for (; i < n; i++)
+        out[i] = Op::apply(out[i], in[i]); }
+
+
+// Per-instruction-set entry points
+
+#define convEntryPoints(suffix, attributes, bytes)                              \
+template <typename T> attributes                                               \
+void convScaleAdd##suffix (size_t n, T w, const T* in, T* out) {               \
+    convScaleAddKernel<T, bytes>(n, w, in, out); }                              \
+                                                                                \
+template <typename T> attributes                                               \
+void convMultiplyAdd##suffix (size_t n, const T* w, const T* in, T* out) {     \
+    convMultiplyAddKernel<T, bytes>(n, w, in, out); }                           \
+                                                                                \
+template <typename T, typename Op> attributes                                  \
+void convAccumulate##suffix (size_t n, const T* in, T* out) {                  \
+    convAccumulateKernel<T, bytes, Op>(n, in, out); }
+
+#ifdef SIMD_X86
+convEntryPoints(SSE, GEMM_CONTRACT __attribute__((target("sse4.1"))), 16);
+convEntryPoints(AVX2, GEMM_CONTRACT __attribute__((target("avx2,fma"))), 32);
+convEntryPoints(AVX512, GEMM_CONTRACT __attribute__((target("avx512f,fma"))), 64);
+#endif
+convEntryPoints(Scalar, , sizeof(T));
+
+// Calls the entry point `name` for the current instruction set
+#ifdef SIMD_X86
+#define convDispatch(name, ...)                                                 \
+    switch (simdLevel()) {                                                      \
+        case SimdLevel::AVX512: return name##AVX512(__VA_ARGS__);               \
+        case SimdLevel::AVX2: return name##AVX2(__VA_ARGS__);                   \
+        case SimdLevel::SSE: return name##SSE(__VA_ARGS__);                     \
+        default: return name##Scalar(__VA_ARGS__); }
+#else
+#define convDispatch(name, ...) return name##Scalar(__VA_ARGS__);
+#endif
+
+template <typename T> void convScaleAdd (size_t n, T w, const T* in, T* out) {
+    convDispatch(convScaleAdd, n, w, in, out); }
+template <typename T> void convMultiplyAdd (size_t n, const T* w, const T* in, T* out) {
+    convDispatch(convMultiplyAdd, n, w, in, out); }
+template <typename T, typename Op> void convAccumulate (size_t n, const T* in, T* out) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return convAccumulateAVX512<T, Op>(n, in, out);
+        case SimdLevel::AVX2: return convAccumulateAVX2<T, Op>(n, in, out);
+        case SimdLevel::SSE: return convAccumulateSSE<T, Op>(n, in, out);
+        default: break; }
+    #endif
+    convAccumulateScalar<T, Op>(n, in, out); }
+
+
+// Bias
+
+// Adds bias[f] to every output of filter f
+template <typename T> void convAddBias (const ConvShape& p, const T* bias, ptrdiff_t biasStride, T* output) {
+    if (!bias)
+        return;
+    size_t pixels = p.outputHeight * p.outputWidth;
+    T* shift = (T*) poolAllocate(p.filters * sizeof(T));
+    for (size_t f = 0; f < p.filters; f++)
+        shift[f] = bias[f * biasStride];
+
+    if (p.output[1] == 1) {
+        parallelFor(0, p.batch * pixels, std::max((size_t) 1, PARALLEL_GRAIN / p.filters), [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                convAccumulate<T, AddOp>(p.filters, shift, output + i * p.output[3]); }); }
+    else parallelFor(0, p.batch * p.filters, std::max((size_t) 1, PARALLEL_GRAIN / pixels), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            T* out = output + i * p.output[1];
+            for (size_t q = 0; q < pixels; q++)
+                out[q] += shift[i % p.filters]; }});
+    poolFree(shift, p.filters * sizeof(T)); }
+
+
+// im2col
+
+template <typename T> void conv2dIm2col (const ConvShape& p, const T* input, const T* weight, T* output) {
+    size_t groups = p.groups, channels = p.channels / groups, filters = p.filters / groups;
+    size_t taps = p.kernelHeight * p.kernelWidth, k = channels * taps, ow = p.outputWidth;
+    bool channelsLast = p.output[1] == 1;
+
+    // Pack the weights into a [filters, k] matrix, with k running over (c, kh, kw),
+    // or (kh, kw, c) when the channels are innermost, to match the columns
+    T* packed = (T*) poolAllocate(p.filters * k * sizeof(T));
+    for (size_t f = 0; f < p.filters; f++)
+        for (size_t c = 0; c < channels; c++)
+            for (size_t kh = 0; kh < p.kernelHeight; kh++)
+                for (size_t kw = 0; kw < p.kernelWidth; kw++)
+                    packed[f * k + (channelsLast ? (kh * p.kernelWidth + kw) * channels + c : c * taps + kh * p.kernelWidth + kw)] =
+                        weight[f * p.weight[0] + c * p.weight[1] + kh * p.weight[2] + kw * p.weight[3]];
+
+    size_t rows = std::max((size_t) 1, std::min(p.outputHeight, CONV_BLOCK_ELEMENTS / (k * ow)));
+    T* columns = (T*) poolAllocate(k * rows * ow * sizeof(T));
+
+    for (size_t n = 0; n < p.batch; n++) {
+        for (size_t g = 0; g < groups; g++) {
+            const T* in = input + n * p.input[0] + g * channels * p.input[1];
+            const T* filter = packed + g * filters * k;
+            for (size_t oh = 0; oh < p.outputHeight; oh += rows) {
+                size_t count = std::min(rows, p.outputHeight - oh), pixels = count * ow;
+                T* out = output + n * p.output[0] + g * filters * p.output[1] + oh * p.output[2];
+
+                // Channels-last: one row of `k` elements per output pixel, made
+                // of runs of channels
+                if (channelsLast) {
+                    parallelFor(0, pixels, std::max((size_t) 1, PARALLEL_GRAIN / k), [&] (size_t begin, size_t end) {
+                        for (size_t q = begin; q < end; q++) {
+                            ptrdiff_t y = (oh + q / ow) * p.stride - p.padding, x = (q % ow) * p.stride - p.padding;
+                            for (size_t kh = 0; kh < p.kernelHeight; kh++) {
+                                for (size_t kw = 0; kw < p.kernelWidth; kw++) {
+                                    T* column = columns + q * k + (kh * p.kernelWidth + kw) * channels;
+                                    ptrdiff_t ih = y + kh * p.dilation, iw = x + kw * p.dilation;
+                                    if (ih < 0 || ih >= (ptrdiff_t) p.height || iw < 0 || iw >= (ptrdiff_t) p.width) {
+                                        std::fill(column, column + channels, T(0));
+                                        continue; }
+                                    const T* source = in + ih * p.input[2] + iw * p.input[3];
+                                    for (size_t c = 0; c < channels; c++)
+                                        column[c] = source[c * p.input[1]]; }}}});
+                    gemm(pixels, filters, k, (const T*) columns, (ptrdiff_t) k, 1, filter, 1, (ptrdiff_t) k,
+                         out, p.output[3], 1); }
+
+                // Row-major: one row of `pixels` elements per (c, kh, kw), made of
+                // runs of an input row
+                else {
+                    parallelFor(0, k, std::max((size_t) 1, PARALLEL_GRAIN / pixels), [&] (size_t begin, size_t end) {
+                        for (size_t i = begin; i < end; i++) {
+                            size_t c = i / taps, kh = i % taps / p.kernelWidth, kw = i % p.kernelWidth;
+                            ptrdiff_t offset = kw * p.dilation - p.padding;
+                            size_t first, last;
+                            convRange(ow, offset, p.stride, p.width, first, last);
+                            for (size_t r = 0; r < count; r++) {
+                                T* column = columns + i * pixels + r * ow;
+                                ptrdiff_t ih = (oh + r) * p.stride - p.padding + kh * p.dilation;
+                                if (ih < 0 || ih >= (ptrdiff_t) p.height) {
+                                    std::fill(column, column + ow, T(0));
+                                    continue; }
+                                const T* source = in + c * p.input[1] + ih * p.input[2] + offset * p.input[3];
+                                ptrdiff_t step = p.stride * p.input[3];
+                                std::fill(column, column + first, T(0));
+                                for (size_t j = first; j < last; j++)
+                                    column[j] = source[j * step];
+                                std::fill(column + last, column + ow, T(0)); }}});
+                    gemm(filters, pixels, k, filter, (ptrdiff_t) k, 1, (const T*) columns, (ptrdiff_t) pixels, 1,
+                         out, p.output[1], 1); }}}}
+
+    poolFree(columns, k * rows * ow * sizeof(T));
+    poolFree(packed, p.filters * k * sizeof(T)); }
+
+
+// Direct convolutions
+
+// 1x1 convolutions, as a product of the [filters, channels] weights with the
+// input's [channels, pixels]. When the input's rows follow on from each other,
+// that's one GEMM per image, and otherwise it's one per output row.
+template <typename T> void conv2dPointwise (const ConvShape& p, const T* input, const T* weight, T* output) {
+    size_t channels = p.channels, filters = p.filters;
+    T* packed = (T*) poolAllocate(filters * channels * sizeof(T));
+    for (size_t f = 0; f < filters; f++)
+        for (size_t c = 0; c < channels; c++)
+            packed[f * channels + c] = weight[f * p.weight[0] + c * p.weight[1]];
+
+    bool collapse = p.stride == 1 && p.input[2] == (ptrdiff_t) p.width * p.input[3];
+    size_t rows = collapse ? 1 : p.outputHeight, pixels = collapse ? p.outputHeight * p.outputWidth : p.outputWidth;
+    ptrdiff_t step = p.stride * p.input[3];
+    let multiply = [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const T* in = input + i / rows * p.input[0] + i % rows * p.stride * p.input[2];
+            T* out = output + i / rows * p.output[0] + i % rows * p.output[2];
+            if (p.output[1] == 1)
+                gemm(pixels, filters, channels, in, step, p.input[1], (const T*) packed, 1, (ptrdiff_t) channels,
+                     out, p.output[3], 1);
+            else gemm(filters, pixels, channels, (const T*) packed, (ptrdiff_t) channels, 1, in, p.input[1], step,
+                      out, p.output[1], 1); }};
+
+    // As with bmm, give each thread whole products when there are enough of them
+    size_t products = p.batch * rows;
+    if (products >= getNumThreads())
+        parallelFor(0, products, std::max((size_t) 1, GEMM_PARALLEL_THRESHOLD / (pixels * filters * channels + 1)), multiply);
+    else multiply(0, products);
+    poolFree(packed, filters * channels * sizeof(T)); }
+
+// Depthwise convolutions, one filter per channel
+template <typename T> void conv2dDepthwise (const ConvShape& p, const T* input, const T* weight, T* output) {
+    size_t channels = p.channels, ow = p.outputWidth, taps = p.kernelHeight * p.kernelWidth;
+
+    // Channels-last: each tap multiplies a pixel's channels by the taps of every
+    // filter, so we transpose the weights to [taps, channels] first
+    if (p.output[1] == 1) {
+        T* packed = (T*) poolAllocate(taps * channels * sizeof(T));
+        for (size_t c = 0; c < channels; c++)
+            for (size_t t = 0; t < taps; t++)
+                packed[t * channels + c] = weight[c * p.weight[0] + t / p.kernelWidth * p.weight[2] + t % p.kernelWidth * p.weight[3]];
+
+        parallelFor(0, p.batch * p.outputHeight, std::max((size_t) 1, PARALLEL_GRAIN / (ow * channels * taps)), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                size_t n = r / p.outputHeight, oh = r % p.outputHeight;
+                for (size_t x = 0; x < ow; x++) {
+                    T* out = output + n * p.output[0] + oh * p.output[2] + x * p.output[3];
+                    std::fill(out, out + channels, T(0));
+                    for (size_t t = 0; t < taps; t++) {
+                        ptrdiff_t ih = oh * p.stride - p.padding + t / p.kernelWidth * p.dilation;
+                        ptrdiff_t iw = x * p.stride - p.padding + t % p.kernelWidth * p.dilation;
+                        if (ih < 0 || ih >= (ptrdiff_t) p.height || iw < 0 || iw >= (ptrdiff_t) p.width)
+                            continue;
+                        const T* in = input + n * p.input[0] + ih * p.input[2] + iw * p.input[3];
+                        const T* w = packed + t * channels;
+                        if (p.input[1] == 1)
+                            convMultiplyAdd(channels, w, in, out);
+                        else for (size_t c = 0; c < channels; c++)
+                            out[c] += w[c] * in[c * p.input[1]]; }}}});
+        poolFree(packed, taps * channels * sizeof(T));
+        return; }
+
+    // Row-major: each tap gets multiplied into a whole output row, which is a
+    // vector operation when the input row is contiguous and the stride is 1
+    parallelFor(0, p.batch * channels * p.outputHeight, std::max((size_t) 1, PARALLEL_GRAIN / (ow * taps)), [&] (size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            size_t n = r / (channels * p.outputHeight), c = r / p.outputHeight % channels, oh = r % p.outputHeight;
+            T* out = output + n * p.output[0] + c * p.output[1] + oh * p.output[2];
+            std::fill(out, out + ow, T(0));
+            for (size_t kh = 0; kh < p.kernelHeight; kh++) {
+                ptrdiff_t ih = oh * p.stride - p.padding + kh * p.dilation;
+                if (ih < 0 || ih >= (ptrdiff_t) p.height)
+                    continue;
+                const T* row = input + n * p.input[0] + c * p.input[1] + ih * p.input[2];
+                for (size_t kw = 0; kw < p.kernelWidth; kw++) {
+                    ptrdiff_t offset = kw * p.dilation - p.padding, step = p.stride * p.input[3];
+                    size_t first, last;
+                    convRange(ow, offset, p.stride, p.width, first, last);
+                    T w = weight[c * p.weight[0] + kh * p.weight[2] + kw * p.weight[3]];
+                    const T* in = row + (first * p.stride + offset) * p.input[3];
+                    if (step == 1)
+                        convScaleAdd(last - first, w, in, out + first);
+                    else for (size_t j = first; j < last; j++)
+                        out[j] += w * in[(j - first) * step]; }}}}); }
+
+
+// Winograd F(2x2, 3x3). With g a 3x3 filter and d a 4x4 input tile, the 2x2
+// output tile is A^T [(G g G^T) * (B^T d B)] A, where * is elementwise and
+//
+//     B^T = [1  0 -1  0]     G = [  1    0    0]     A^T = [1  1  1  0]
+//           [0  1  1  0]         [1/2  1/2  1/2]           [0  1 -1 -1]
+//           [0 -1  1  0]         [1/2 -1/2  1/2]
+//           [0  1  0 -1]         [  0    0    1]
+//
+// The filter transforms only get computed once per call. The tiles are taken a
+// block at a time, and for each of the 16 elements of a transformed tile, the
+// products summed over the channels are a [filters, channels] x [channels, tiles]
+// GEMM. Each transformed tile gets written to (and each product read from) all
+// 16 matrices, so we leave CONV_WINOGRAD_PADDING elements between them, since
+// with power-of-two sizes those 16 elements would otherwise all fall into the
+// same cache set.
+
+struct WinogradTile {
+    size_t n, y, x; };  // The image, and the top left output of the tile
+
+template <typename T> void conv2dWinograd (const ConvShape& p, const T* input, const T* weight, T* output) {
+    size_t channels = p.channels, filters = p.filters;
+    size_t tilesHigh = (p.outputHeight + 1) / 2, tilesWide = (p.outputWidth + 1) / 2, tiles = p.batch * tilesHigh * tilesWide;
+    size_t block = std::min(tiles, std::max((size_t) CONV_WINOGRAD_BLOCK, CONV_BLOCK_ELEMENTS / (16 * std::max(channels, filters))));
+
+    // U = G g G^T, stored as 16 [filters, channels] matrices
+    T* u = (T*) poolAllocate(16 * filters * channels * sizeof(T));
+    parallelFor(0, filters, std::max((size_t) 1, PARALLEL_GRAIN / (16 * channels)), [&] (size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++) {
+            for (size_t c = 0; c < channels; c++) {
+                T g[3][3], gg[4][3];
+                for (size_t i = 0; i < 3; i++)
+                    for (size_t j = 0; j < 3; j++)
+                        g[i][j] = weight[f * p.weight[0] + c * p.weight[1] + i * p.weight[2] + j * p.weight[3]];
+                for (size_t j = 0; j < 3; j++) {
+                    gg[0][j] = g[0][j];
+                    gg[1][j] = (g[0][j] + g[1][j] + g[2][j]) / 2;
+                    gg[2][j] = (g[0][j] - g[1][j] + g[2][j]) / 2;
+                    gg[3][j] = g[2][j]; }
+                for (size_t i = 0; i < 4; i++) {
+                    T* row = u + i * 4 * filters * channels + f * channels + c;
+                    row[0] = gg[i][0];
+                    row[filters * channels] = (gg[i][0] + gg[i][1] + gg[i][2]) / 2;
+                    row[2 * filters * channels] = (gg[i][0] - gg[i][1] + gg[i][2]) / 2;
+                    row[3 * filters * channels] = gg[i][2]; }}}});
+
+    T* v = (T*) poolAllocate(16 * (channels * block + CONV_WINOGRAD_PADDING) * sizeof(T));
+    T* m = (T*) poolAllocate(16 * (filters * block + CONV_WINOGRAD_PADDING) * sizeof(T));
+    WinogradTile* positions = (WinogradTile*) poolAllocate(block * sizeof(WinogradTile));
+    for (size_t first = 0; first < tiles; first += block) {
+        size_t count = std::min(block, tiles - first);
+        size_t vStride = channels * count + CONV_WINOGRAD_PADDING, mStride = filters * count + CONV_WINOGRAD_PADDING;
+
+        // Work out where each tile is up front, rather than dividing for every
+        // channel and filter
+        size_t n = first / (tilesHigh * tilesWide), y = first / tilesWide % tilesHigh * 2, x = first % tilesWide * 2;
+        for (size_t t = 0; t < count; t++) {
+            positions[t] = { n, y, x };
+            if ((x += 2) >= 2 * tilesWide) {
+                x = 0;
+                if ((y += 2) >= 2 * tilesHigh) {
+                    y = 0;
+                    n++; }}}
+
+        // V = B^T d B, stored as 16 [channels, count] matrices. Tiles that are
+        // inside the input get loaded without checking their bounds.
+        parallelFor(0, channels, std::max((size_t) 1, PARALLEL_GRAIN / (16 * count)), [&] (size_t begin, size_t end) {
+            for (size_t c = begin; c < end; c++) {
+                for (size_t t = 0; t < count; t++) {
+                    const WinogradTile& tile = positions[t];
+                    ptrdiff_t top = tile.y - p.padding, left = tile.x - p.padding;
+                    const T* in = input + tile.n * p.input[0] + c * p.input[1] + top * p.input[2] + left * p.input[3];
+                    T d[4][4], bd[4][4];
+                    if (top >= 0 && top + 4 <= (ptrdiff_t) p.height && left >= 0 && left + 4 <= (ptrdiff_t) p.width) {
+                        for (size_t i = 0; i < 4; i++)
+                            for (size_t j = 0; j < 4; j++)
+                                d[i][j] = in[i * p.input[2] + j * p.input[3]]; }
+                    else for (ptrdiff_t i = 0; i < 4; i++)
+                        for (ptrdiff_t j = 0; j < 4; j++)
+                            d[i][j] = top + i >= 0 && top + i < (ptrdiff_t) p.height && left + j >= 0 && left + j < (ptrdiff_t) p.width
+                                ? in[i * p.input[2] + j * p.input[3]] : T(0);
+                    for (size_t j = 0; j < 4; j++) {
+                        bd[0][j] = d[0][j] - d[2][j];
+                        bd[1][j] = d[1][j] + d[2][j];
+                        bd[2][j] = d[2][j] - d[1][j];
+                        bd[3][j] = d[1][j] - d[3][j]; }
+                    T* out = v + c * count + t;
+                    for (size_t i = 0; i < 4; i++) {
+                        out[(i * 4) * vStride] = bd[i][0] - bd[i][2];
+                        out[(i * 4 + 1) * vStride] = bd[i][1] + bd[i][2];
+                        out[(i * 4 + 2) * vStride] = bd[i][2] - bd[i][1];
+                        out[(i * 4 + 3) * vStride] = bd[i][1] - bd[i][3]; }}}});
+
+        for (size_t e = 0; e < 16; e++)
+            gemm(filters, count, channels, (const T*) u + e * filters * channels, (ptrdiff_t) channels, 1,
+                 (const T*) v + e * vStride, (ptrdiff_t) count, 1, m + e * mStride, (ptrdiff_t) count, 1);
+
+        // Y = A^T M A, clipped at the bottom and right edges
+        parallelFor(0, filters, std::max((size_t) 1, PARALLEL_GRAIN / (16 * count)), [&] (size_t begin, size_t end) {
+            for (size_t f = begin; f < end; f++) {
+                for (size_t t = 0; t < count; t++) {
+                    const WinogradTile& tile = positions[t];
+                    T a[2][4];
+                    const T* in = m + f * count + t;
+                    for (size_t j = 0; j < 4; j++) {
+                        T m0 = in[j * mStride], m1 = in[(4 + j) * mStride], m2 = in[(8 + j) * mStride], m3 = in[(12 + j) * mStride];
+                        a[0][j] = m0 + m1 + m2;
+                        a[1][j] = m1 - m2 - m3; }
+                    T* out = output + tile.n * p.output[0] + f * p.output[1] + tile.y * p.output[2] + tile.x * p.output[3];
+                    for (size_t i = 0; i < 2 && tile.y + i < p.outputHeight; i++) {
+                        out[i * p.output[2]] = a[i][0] + a[i][1] + a[i][2];
+                        if (tile.x + 1 < p.outputWidth)
+                            out[i * p.output[2] + p.output[3]] = a[i][1] - a[i][2] - a[i][3]; }}}}); }
+
+    poolFree(positions, block * sizeof(WinogradTile));
+    poolFree(m, 16 * (filters * block + CONV_WINOGRAD_PADDING) * sizeof(T));
+    poolFree(v, 16 * (channels * block + CONV_WINOGRAD_PADDING) * sizeof(T));
+    poolFree(u, 16 * filters * channels * sizeof(T)); }
+
+
+// Entry points
+
+// Which algorithm `algorithm` means for this convolution, checking that it can
+// run it
+inline ConvAlgorithm convAlgorithm (const ConvShape& p, ConvAlgorithm algorithm) {
+    bool depthwise = p.groups > 1 && p.groups == p.channels && p.filters == p.channels;
+    bool pointwise = p.kernelHeight == 1 && p.kernelWidth == 1 && p.padding == 0 && p.groups == 1;
+    bool winograd = p.kernelHeight == 3 && p.kernelWidth == 3 && p.stride == 1 && p.dilation == 1 && p.groups == 1;
+
+    if (algorithm == ConvAlgorithm::Auto) {
+        if (depthwise || pointwise)
+            return ConvAlgorithm::Direct;
+        size_t tiles = p.batch * ((p.outputHeight + 1) / 2) * ((p.outputWidth + 1) / 2);
+        if (winograd && p.channels >= CONV_WINOGRAD_CHANNELS && p.filters >= CONV_WINOGRAD_CHANNELS && tiles >= CONV_WINOGRAD_TILES)
+            return ConvAlgorithm::Winograd;
+        return ConvAlgorithm::Im2col; }
+    if (algorithm == ConvAlgorithm::Direct && !depthwise && !pointwise)
+        throw "Tensor.conv2d - Only depthwise and unpadded 1x1 convolutions have a direct algorithm";
+    if (algorithm == ConvAlgorithm::Winograd && !winograd)
+        throw "Tensor.conv2d - Winograd only handles 3x3 convolutions with a stride and dilation of 1 and one group";
+    return algorithm; }
+
+// output = conv2d(input, weight) + bias, where `bias` can be NULL and `algorithm`
+// has already been resolved by convAlgorithm
+template <typename T> void conv2dForward (const ConvShape& p, const T* input, const T* weight, const T* bias, ptrdiff_t biasStride,
+                                          T* output, ConvAlgorithm algorithm) {
+    if (algorithm == ConvAlgorithm::Winograd)
+        conv2dWinograd(p, input, weight, output);
+    else if (algorithm == ConvAlgorithm::Direct && p.groups > 1)
+        conv2dDepthwise(p, input, weight, output);
+    else if (algorithm == ConvAlgorithm::Direct)
+        conv2dPointwise(p, input, weight, output);
+    else conv2dIm2col(p, input, weight, output);
+    convAddBias(p, bias, biasStride, output); }
+
+
+// Pooling. Each output is the max or the average of its window, leaving out the
+// padding, which as with the depthwise convolution gets computed a whole output
+// row at a time (NCHW) or for all of a pixel's channels at once (NHWC).
+
+template <typename T, typename Op> void poolWindows (const ConvShape& p, const T* input, T* output, T initial, bool average) {
+    size_t channels = p.channels, ow = p.outputWidth, taps = p.kernelHeight * p.kernelWidth;
+
+    if (p.output[1] == 1) {
+        parallelFor(0, p.batch * p.outputHeight, std::max((size_t) 1, PARALLEL_GRAIN / (ow * channels * taps)), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                size_t n = r / p.outputHeight, oh = r % p.outputHeight;
+                for (size_t x = 0; x < ow; x++) {
+                    T* out = output + n * p.output[0] + oh * p.output[2] + x * p.output[3];
+                    std::fill(out, out + channels, initial);
+                    size_t count = 0;
+                    for (size_t t = 0; t < taps; t++) {
+                        ptrdiff_t ih = oh * p.stride - p.padding + t / p.kernelWidth * p.dilation;
+                        ptrdiff_t iw = x * p.stride - p.padding + t % p.kernelWidth * p.dilation;
+                        if (ih < 0 || ih >= (ptrdiff_t) p.height || iw < 0 || iw >= (ptrdiff_t) p.width)
+                            continue;
+                        const T* in = input + n * p.input[0] + ih * p.input[2] + iw * p.input[3];
+                        if (p.input[1] == 1)
+                            convAccumulate<T, Op>(channels, in, out);
+                        else for (size_t c = 0; c < channels; c++)
+                            out[c] = Op::apply(out[c], in[c * p.input[1]]);
+                        count++; }
+                    if (average)
+                        for (size_t c = 0; c < channels; c++)
+                            out[c] /= count; }}});
+        return; }
+
+    parallelFor(0, p.batch * channels * p.outputHeight, std::max((size_t) 1, PARALLEL_GRAIN / (ow * taps)), [&] (size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            size_t n = r / (channels * p.outputHeight), c = r / p.outputHeight % channels, oh = r % p.outputHeight;
+            T* out = output + n * p.output[0] + c * p.output[1] + oh * p.output[2];
+            std::fill(out, out + ow, initial);
+            size_t rows = 0;
+            for (size_t kh = 0; kh < p.kernelHeight; kh++) {
+                ptrdiff_t ih = oh * p.stride - p.padding + kh * p.dilation;
+                if (ih < 0 || ih >= (ptrdiff_t) p.height)
+                    continue;
+                const T* row = input + n * p.input[0] + c * p.input[1] + ih * p.input[2];
+                for (size_t kw = 0; kw < p.kernelWidth; kw++) {
+                    ptrdiff_t offset = kw * p.dilation - p.padding, step = p.stride * p.input[3];
+                    size_t first, last;
+                    convRange(ow, offset, p.stride, p.width, first, last);
+                    const T* in = row + (first * p.stride + offset) * p.input[3];
+                    if (step == 1)
+                        convAccumulate<T, Op>(last - first, in, out + first);
+                    else for (size_t j = first; j < last; j++)
+                        out[j] = Op::apply(out[j], in[(j - first) * step]); }
+                rows++; }
+
+            // Every output in the row has the same number of rows in its window,
+            // but the ones near the edges have fewer columns
+            if (average) {
+                for (size_t x = 0; x < ow; x++) {
+                    size_t columns = 0;
+                    for (size_t kw = 0; kw < p.kernelWidth; kw++) {
+                        ptrdiff_t iw = x * p.stride - p.padding + kw * p.dilation;
+                        columns += iw >= 0 && iw < (ptrdiff_t) p.width; }
+                    out[x] /= rows * columns; }}}}); }
+
+template <typename T> void pool2dForward (const ConvShape& p, const T* input, T* output, PoolMode mode) {
+    if (mode == PoolMode::Max)
+        poolWindows<T, MaxOp>(p, input, output, std::numeric_limits<T>::lowest(), false);
+    else poolWindows<T, AddOp>(p, input, output, T(0), true); }
+
+
+#endif
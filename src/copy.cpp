@@ -0,0 +1,81 @@
+#ifndef __COPY__
+#define __COPY__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "iterator.cpp"
+#include "parallel.cpp"
+
+
+// Copying strided tensors into new contiguous buffers, which is what
+// Tensor::contiguous does. When the dimension that's contiguous in the input
+// isn't the innermost one (like in a transposed matrix), copying in the output's
+// order reads every element from a different cache line, and copying in the
+// input's order writes them that way, so either way most of each line that gets
+// loaded is wasted. Instead we copy a COPY_TILE x COPY_TILE tile at a time,
+// between the input's contiguous dimension and the output's, which keeps all of
+// the lines that a tile touches in the cache until every element on them has
+// been used. Everything else gets copied a run of the iterator at a time.
+
+#define COPY_TILE 32
+
+// Copies the tensor with the given shape and stride from `input` into `output`,
+// in row-major order
+template <typename T> void copyContiguous (const T* input, const Shape& shape, const Shape& stride, T* output) {
+    Shape outputStride = getStrideForShape(shape);
+    size_t volume = shape.volume();
+
+    // Find the innermost dimension of the output, and the dimension with the
+    // smallest stride in the input
+    int inner = -1, fast = -1;
+    for (size_t d = 0; d < shape.length; d++) {
+        if (shape[d] == 1)
+            continue;
+        inner = d;
+        if (fast < 0 || std::abs(stride[d]) < std::abs(stride[fast]))
+            fast = d; }
+
+    if (volume == 0)
+        return;
+    if (inner < 0 || fast == inner || shape[fast] < COPY_TILE || shape[inner] < COPY_TILE) {
+        let plan = StridedIterator(shape, { outputStride, stride });
+        parallelFor(0, volume, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+            let it = plan;
+            it.limit(begin, end);
+            for (; !it.done(); it.next()) {
+                T* out = output + it.offset[0];
+                const T* in = input + it.offset[1];
+                if (it.stride[0] == 1 && it.stride[1] == 1)
+                    std::copy(in, in + it.size, out);
+                else for (size_t j = 0; j < it.size; j++)
+                    out[j * it.stride[0]] = in[j * it.stride[1]]; }});
+        return; }
+
+    // Each tile is one work item, with the tiles along the output's innermost
+    // dimension next to each other, so each thread writes long runs of the output
+    size_t rows = (shape[fast] + COPY_TILE - 1) / COPY_TILE, columns = (shape[inner] + COPY_TILE - 1) / COPY_TILE;
+    size_t tiles = volume / shape[fast] / shape[inner] * rows * columns;
+    ptrdiff_t inputRow = stride[fast], inputColumn = stride[inner], outputRow = outputStride[fast];
+
+    parallelFor(0, tiles, std::max((size_t) 1, (size_t) PARALLEL_GRAIN / (COPY_TILE * COPY_TILE)), [&] (size_t begin, size_t end) {
+        for (size_t tile = begin; tile < end; tile++) {
+            size_t column = tile % columns, row = tile / columns % rows, outer = tile / columns / rows;
+            ptrdiff_t in = 0, out = 0;
+            for (int d = shape.length - 1; d >= 0; d--) {
+                if (d == fast || d == inner)
+                    continue;
+                size_t position = outer % shape[d];
+                outer /= shape[d];
+                in += position * stride[d];
+                out += position * outputStride[d]; }
+
+            size_t i0 = row * COPY_TILE, i1 = std::min(i0 + COPY_TILE, (size_t) shape[fast]);
+            size_t j0 = column * COPY_TILE, j1 = std::min(j0 + COPY_TILE, (size_t) shape[inner]);
+            for (size_t i = i0; i < i1; i++) {
+                const T* x = input + in + i * inputRow;
+                T* y = output + out + i * outputRow;
+                for (size_t j = j0; j < j1; j++)
+                    y[j] = x[j * inputColumn]; }}}); }
+
+
+#endif
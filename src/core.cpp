@@ -2,6 +2,8 @@
 #define __CORE__
 
 #include <limits>
+#include <memory>
+#include <algorithm>
 #include <random>
 #include <string>
 #include <vector>
@@ -16,7 +18,12 @@ template <typename T> using Reference = std::shared_ptr<T>;
 
 // Macros
 #define let auto
-#define stringFromType(T) ((String(*)(T)) std::to_string)
+#define stringFromType(T) (valueToString<T>)
+
+
+// Converts a value to a string with std::to_string, which also takes types that
+// only convert to one of its overloads, like int8_t or bf16
+template <typename T> String valueToString (T x) { return std::to_string(x); }
 
 
 // Print function
@@ -87,9 +94,9 @@ template <> String join(List<String> input) {
     return join(input, ","); }
 
 template <typename T> String join(int length, T* input, String delimiter) {
-    return join(map(length, input, (String (*)(T)) std::to_string), delimiter); }
+    return join(map(length, input, stringFromType(T)), delimiter); }
 template <typename T> String join(int length, T* input) {
-    return join(map(length, input, (String (*)(T)) std::to_string)); }
+    return join(map(length, input, stringFromType(T))); }
 
 
 #endif
@@ -0,0 +1,47 @@
+#ifndef __DTYPE__
+#define __DTYPE__
+
+#include "core.cpp"
+#include "half.cpp"
+#include <cstdint>
+
+
+// Runtime tags for the element types that BTen's templates get instantiated
+// with. Tensor operations are statically typed, so these are only needed where
+// the type has to be written down somewhere, like in a file header.
+
+enum class DType : uint32_t { Int32 = 0, UInt64 = 1, Float32 = 2, Float64 = 3, Int8 = 4, BFloat16 = 5, Float16 = 6 };
+
+template <typename T> struct DTypeOf;
+template <> struct DTypeOf<int> { static const DType value = DType::Int32; };
+template <> struct DTypeOf<size_t> { static const DType value = DType::UInt64; };
+template <> struct DTypeOf<float> { static const DType value = DType::Float32; };
+template <> struct DTypeOf<double> { static const DType value = DType::Float64; };
+template <> struct DTypeOf<int8_t> { static const DType value = DType::Int8; };
+template <> struct DTypeOf<bf16> { static const DType value = DType::BFloat16; };
+template <> struct DTypeOf<f16> { static const DType value = DType::Float16; };
+
+size_t dtypeSize (DType dtype) {
+    switch (dtype) {
+        case DType::Int32: return 4;
+        case DType::UInt64: return 8;
+        case DType::Float32: return 4;
+        case DType::Float64: return 8;
+        case DType::Int8: return 1;
+        case DType::BFloat16: return 2;
+        case DType::Float16: return 2;
+        default: throw "dtypeSize - Unknown dtype"; }}
+
+String dtypeName (DType dtype) {
+    switch (dtype) {
+        case DType::Int32: return "int32";
+        case DType::UInt64: return "uint64";
+        case DType::Float32: return "float32";
+        case DType::Float64: return "float64";
+        case DType::Int8: return "int8";
+        case DType::BFloat16: return "bfloat16";
+        case DType::Float16: return "float16";
+        default: return "unknown"; }}
+
+
+#endif
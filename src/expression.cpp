@@ -0,0 +1,585 @@
+#ifndef __EXPRESSION__
+#define __EXPRESSION__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "profiler.cpp"
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "math.cpp"
+#include <type_traits>
+
+
+// Lazy elementwise expressions. Rather than computing each intermediate result
+// of something like `a * b + c - d` into a new tensor, the arithmetic operators
+// build up a tree of expression types at compile time, e.g.
+//
+//     BinaryExpression<SubOp, BinaryExpression<AddOp, BinaryExpression<MulOp,
+//         Tensor<T>, Tensor<T>>, Tensor<T>>, Tensor<T>>
+//
+// and the whole tree gets evaluated in a single pass when it's assigned to a
+// Tensor (or reduced, or printed). Elementwise math like `x.exp()` or
+// `x.gelu()` builds a UnaryExpression node in the same way. Every node computes its broadcasted shape when
+// it's constructed, so shape errors are still thrown at the operator itself.
+//
+// To evaluate a tree, we give every tensor in it (the leaves) its own operand in
+// one StridedIterator, along with the output. Then for each run that the iterator
+// hands us, we evaluate the tree one tile at a time: the leaves return pointers
+// straight into their buffers (or gather into a scratch tile if they're strided),
+// and each operator node runs the SIMD kernel for its op into its own scratch
+// tile. The tiles are small enough that the intermediates never leave L1, so the
+// only memory traffic is reading the leaves and writing the output.
+//
+// Each node in the tree implements the same interface as a Tensor leaf:
+//
+//     typedef T Type;
+//     Shape shape;
+//     void collect (const Shape& outputShape, ExpressionOperands& operands) const;
+//     const T* evaluate (const StridedIterator& it, size_t j, size_t n,
+//                        size_t& operand, T* scratch, ptrdiff_t& step) const;
+//     bool requiresGrad () const;
+//     void collectNodes (List<Reference<Node<T>>>& nodes) const;
+//     void collectSaved (List<typename Node<T>::Saved>& saved) const;
+//     void differentiate (const Tensor<T>& grad, List<Tensor<T>>& grads) const;
+//
+// `collect` appends the data and broadcasted strides of each leaf in the tree,
+// from left to right, and `evaluate` returns the `n` values starting at position `j` of the
+// iterator's current run, with a step of either 0 (one broadcast value) or 1.
+// The last four methods are used for autograd, and are described below.
+
+// Number of elements evaluated at a time by each node
+#define EXPRESSION_TILE 256
+
+template <typename T> class Tensor;
+template <typename T> struct ScalarExpression;
+template <typename Op, typename L, typename R> struct BinaryExpression;
+template <typename Op, typename E> struct UnaryExpression;
+void checkNotCapturing (const char* error);  // See graph.cpp
+
+template <typename E> struct IsOperatorExpression { static const bool value = false; };
+template <typename Op, typename L, typename R> struct IsOperatorExpression<BinaryExpression<Op, L, R>> {
+    static const bool value = true; };
+template <typename Op, typename E> struct IsOperatorExpression<UnaryExpression<Op, E>> {
+    static const bool value = true; };
+
+template <typename E> struct IsExpression { static const bool value = false; };
+template <typename T> struct IsExpression<Tensor<T>> { static const bool value = true; };
+template <typename T> struct IsExpression<ScalarExpression<T>> { static const bool value = true; };
+template <typename Op, typename L, typename R> struct IsExpression<BinaryExpression<Op, L, R>> {
+    static const bool value = true; };
+template <typename Op, typename E> struct IsExpression<UnaryExpression<Op, E>> {
+    static const bool value = true; };
+
+// Whether the root of an expression reads all of its leaves before it writes
+// anything into its scratch tile, which is true of leaves, and of operator nodes
+// whose left side is a leaf (since the right side gets its own scratch tile).
+// Unary operators work in place on their input's values, so they read their
+// leaves first whenever their input does.
+template <typename E> struct ReadsLeavesFirst { static const bool value = true; };
+template <typename Op, typename L, typename R> struct ReadsLeavesFirst<BinaryExpression<Op, L, R>> {
+    static const bool value = !IsOperatorExpression<L>::value; };
+template <typename Op, typename E> struct ReadsLeavesFirst<UnaryExpression<Op, E>> {
+    static const bool value = ReadsLeavesFirst<E>::value; };
+
+
+// Evaluation
+
+// The operands of an expression's iterator, which are the output followed by
+// each leaf of the tree. These live on the stack rather than in a List, so that
+// evaluating an expression into an existing tensor doesn't allocate at all.
+struct ExpressionOperands {
+    const void* data[MAX_OPERANDS];
+    Shape strides[MAX_OPERANDS];
+    size_t length;
+
+    ExpressionOperands () : length(0) { }
+
+    void push (const void* data, const Shape& stride) {
+        if (this->length == MAX_OPERANDS)
+            throw "Expression - Too many tensors in a single expression, try evaluating part of it first";
+        this->data[this->length] = data;
+        this->strides[this->length++] = stride; }};
+
+// Evaluates `expression` into `data`, which holds a tensor with the given shape
+// and stride. The expression gets broadcast to that shape, so its own shape has
+// to be compatible with it.
+//
+// The output is allowed to share memory with the leaves of the expression, which
+// is how in-place ops like `a += b` work. When a leaf reads exactly the same
+// elements as the output (like `a` in `a + b`), every element gets read before
+// it's written, as long as we don't use the output as scratch space for the
+// tree, since the nodes along the left edge of the tree write their results into
+// it before the leaves to their right have been read. So in that case we give
+// the root a scratch tile of its own, unless the root is something like `a + b`,
+// which reads every leaf before writing, and whose left leaf is the output (so
+// it can't be strided, which would make it gather its values into the output).
+// Any other overlap, like `a += a.transpose()`, would read elements that were
+// already written, so we evaluate those into a temporary tensor first.
+//
+// Working that out is split from the evaluation itself, so that graph capture
+// (see graph.cpp) can do it once and then reuse the plan on every replay.
+
+struct ExpressionPlan {
+    StridedIterator iterator;
+    bool direct;        // Whether the root can use the output as its scratch tile
+    bool temporary;     // Whether the expression has to go through a temporary tensor
+
+    ExpressionPlan (const StridedIterator& iterator, bool direct, bool temporary) :
+        iterator(iterator), direct(direct), temporary(temporary) { }};
+
+// Whether two tensors with the given shape, whose elements start at `a` and `b`,
+// could share any memory, going by the range of addresses that each one spans.
+// Views of the same buffer (like two slices of it) start at different places.
+template <typename T> bool spansOverlap (const void* a, const Shape& strideA, const void* b, const Shape& strideB,
+                                         const Shape& shape) {
+    if (shape.volume() == 0)
+        return false;
+    ptrdiff_t lowA = 0, highA = 0, lowB = 0, highB = 0;
+    for (size_t d = 0; d < shape.length; d++) {
+        ptrdiff_t extentA = (ptrdiff_t) (shape[d] - 1) * strideA[d], extentB = (ptrdiff_t) (shape[d] - 1) * strideB[d];
+        (extentA < 0 ? lowA : highA) += extentA;
+        (extentB < 0 ? lowB : highB) += extentB; }
+    const T *x = (const T*) a, *y = (const T*) b;
+    return x + lowA <= y + highB && y + lowB <= x + highA; }
+
+template <typename E> ExpressionPlan planExpression (const E& expression, const typename E::Type* data,
+                                                     const Shape& shape, const Shape& stride) {
+    typedef typename E::Type T;
+    ExpressionOperands operands;
+    operands.push(data, stride);
+    expression.collect(shape, operands);
+
+    bool aliased = false;
+    for (size_t k = 1; k < operands.length; k++) {
+        if (operands.data[k] != data) {
+            if (spansOverlap<T>(data, stride, operands.data[k], operands.strides[k], shape))
+                return ExpressionPlan(StridedIterator(shape, { stride }), false, true);
+            continue; }
+        if (operands.strides[k] != operands.strides[0])
+            return ExpressionPlan(StridedIterator(shape, { stride }), false, true);
+        aliased = true; }
+
+    bool direct = !aliased || (ReadsLeavesFirst<E>::value && operands.data[1] == data);
+    return ExpressionPlan(StridedIterator(shape, operands.strides, operands.length), direct, false); }
+
+template <typename E> void evaluatePlan (const E& expression, typename E::Type* data, const Shape& shape,
+                                         const Shape& stride, const ExpressionPlan& plan) {
+    typedef typename E::Type T;
+    if (plan.temporary) {
+        Tensor<T> temporary(Reference<Buffer<T>>(new Buffer<T>(shape.volume())), shape);
+        evaluateExpression(expression, temporary.buffer->data, shape, temporary.stride);
+        return evaluateExpression(temporary, data, shape, stride); }
+
+    parallelFor(0, shape.volume(), PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        T tile[EXPRESSION_TILE];
+        let it = plan.iterator;
+        it.limit(begin, end);
+        for (; !it.done(); it.next()) {
+            ptrdiff_t outputStep = it.stride[0];
+            bool direct = outputStep == 1 && plan.direct;
+            for (size_t j = 0; j < it.size; j += EXPRESSION_TILE) {
+                T* out = data + it.offset[0] + j * outputStep;
+                size_t n = std::min((size_t) EXPRESSION_TILE, it.size - j);
+                size_t operand = 1;
+                ptrdiff_t step;
+                const T* values = expression.evaluate(it, j, n, operand, direct ? out : tile, step);
+                if (values == out && step == outputStep)
+                    continue;
+                if (step == 0)
+                    { T value = values[0]; for (size_t i = 0; i < n; i++) out[i * outputStep] = value; }
+                else if (outputStep == 1)
+                    std::copy(values, values + n, out);
+                else for (size_t i = 0; i < n; i++)
+                    out[i * outputStep] = values[i]; }}}); }
+
+template <typename E> void evaluateExpression (const E& expression, typename E::Type* data,
+                                               const Shape& shape, const Shape& stride) {
+    evaluatePlan(expression, data, shape, stride, planExpression(expression, data, shape, stride)); }
+
+// Evaluates `expression` into the new contiguous buffer `data`
+template <typename E> void evaluateExpression (const E& expression, typename E::Type* data) {
+    evaluateExpression(expression, data, expression.shape, getStrideForShape(expression.shape)); }
+
+// Costs of evaluating an expression, for the profiler: the number of operator
+// nodes in the tree, which each do one FLOP per element, and the bytes that
+// get read and written, counting the elements of each leaf once, however far
+// they get broadcast.
+
+template <typename E> struct ExpressionOps { static const size_t value = 0; };
+template <typename Op, typename L, typename R> struct ExpressionOps<BinaryExpression<Op, L, R>> {
+    static const size_t value = ExpressionOps<L>::value + ExpressionOps<R>::value + 1; };
+template <typename Op, typename E> struct ExpressionOps<UnaryExpression<Op, E>> {
+    static const size_t value = ExpressionOps<E>::value + 1; };
+
+template <typename E> double expressionBytes (const E& expression, const Shape& shape, bool output) {
+    ExpressionOperands operands;
+    expression.collect(shape, operands);
+    double elements = output ? shape.volume() : 0;
+    for (size_t i = 0; i < operands.length; i++) {
+        double n = 1;
+        for (size_t d = 0; d < shape.length; d++)
+            if (operands.strides[i][d]) n *= shape[d];
+        elements += n; }
+    return elements * sizeof(typename E::Type); }
+
+// Evaluates `expression` into a new tensor without recording it in the autograd
+// graph. The backward pass uses this for the expressions it builds, since they
+// can never need a gradient themselves.
+template <typename E> Tensor<typename E::Type> evaluateDetached (const E& expression) {
+    typedef typename E::Type T;
+    profileOp("elementwise", profileSignature(expression.shape, getStrideForShape(expression.shape)),
+              expressionBytes(expression, expression.shape, true), (double) ExpressionOps<E>::value * expression.shape.volume());
+    let buffer = Reference<Buffer<T>>(new Buffer<T>(expression.shape.volume()));
+    evaluateExpression(expression, buffer->data);
+    return Tensor<T>(buffer, expression.shape); }
+
+// Folds every element of `expression` with `Op`, starting from `initial`. Like
+// the full reductions on Tensor, the result doesn't depend on the thread count.
+template <typename Op, typename E> typename E::Type reduceExpression (const E& expression, typename E::Type initial) {
+    typedef typename E::Type T;
+    checkNotCapturing("Expression.reduce - Reductions to a single value can't be captured in a graph");
+    profileOp("reduce", profileSignature(expression.shape, getStrideForShape(expression.shape)),
+              expressionBytes(expression, expression.shape, false), (double) (ExpressionOps<E>::value + 1) * expression.shape.volume());
+    ExpressionOperands operands;
+    operands.push(NULL, getStrideForShape(expression.shape));
+    expression.collect(expression.shape, operands);
+    let plan = StridedIterator(expression.shape, operands.strides, operands.length);
+
+    let reduceBlock = [&] (size_t begin, size_t end) {
+        T result = initial;
+        let it = plan;
+        it.limit(begin, end);
+        for (; !it.done(); it.next()) {
+            for (size_t j = 0; j < it.size; j += EXPRESSION_TILE) {
+                size_t n = std::min((size_t) EXPRESSION_TILE, it.size - j);
+                size_t operand = 1;
+                ptrdiff_t step;
+                T scratch[EXPRESSION_TILE];
+                const T* values = expression.evaluate(it, j, n, operand, scratch, step);
+                if (step) result = Op::apply(result, simdFold<T, Op>(n, values, initial));
+                else for (size_t i = 0; i < n; i++) result = Op::apply(result, values[0]); }}
+        return result; };
+
+    let combine = [] (T a, T b) { return Op::apply(a, b); };
+    return parallelReduce<T>(expression.shape.volume(), PARALLEL_GRAIN, reduceBlock, combine); }
+
+
+// Gradients. Given the gradient of an op's output and its two operands, these
+// return (lazy) expressions for the gradient with respect to each operand.
+
+template <typename Op> struct OpGradient;
+
+template <> struct OpGradient<AddOp> {
+    template <typename G, typename L, typename R> static G left (const G& grad, const L&, const R&) { return grad; }
+    template <typename G, typename L, typename R> static G right (const G& grad, const L&, const R&) { return grad; }};
+
+template <> struct OpGradient<SubOp> {
+    template <typename G, typename L, typename R> static G left (const G& grad, const L&, const R&) { return grad; }
+    template <typename G, typename L, typename R> static auto right (const G& grad, const L&, const R&) ->
+        decltype((typename G::Type) 0 - grad) { return (typename G::Type) 0 - grad; }};
+
+template <> struct OpGradient<MulOp> {
+    template <typename G, typename L, typename R> static auto left (const G& grad, const L&, const R& r) ->
+        decltype(grad * r) { return grad * r; }
+    template <typename G, typename L, typename R> static auto right (const G& grad, const L& l, const R&) ->
+        decltype(grad * l) { return grad * l; }};
+
+template <> struct OpGradient<DivOp> {
+    template <typename G, typename L, typename R> static auto left (const G& grad, const L&, const R& r) ->
+        decltype(grad / r) { return grad / r; }
+    template <typename G, typename L, typename R> static auto right (const G& grad, const L& l, const R& r) ->
+        decltype((typename G::Type) 0 - grad * l / (r * r)) { return (typename G::Type) 0 - grad * l / (r * r); }};
+
+// Unary ops only have one operand, whose gradient comes from `input`. The mode
+// is the one the op was applied with, and the derivatives of the fast versions
+// use the fast functions too.
+
+template <> struct OpGradient<ExpOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad * x.exp()) { return grad * x.exp(); }};
+
+template <> struct OpGradient<LogOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad / x) { return grad / x; }};
+
+template <> struct OpGradient<SqrtOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype((typename G::Type) 0.5 * grad / x.sqrt()) { return (typename G::Type) 0.5 * grad / x.sqrt(); }};
+
+template <> struct OpGradient<TanhOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad * ((typename G::Type) 1 - x.tanh(mode) * x.tanh(mode))) {
+        return grad * ((typename G::Type) 1 - x.tanh(mode) * x.tanh(mode)); }};
+
+template <> struct OpGradient<SigmoidOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad * x.sigmoid(mode) * ((typename G::Type) 1 - x.sigmoid(mode))) {
+        return grad * x.sigmoid(mode) * ((typename G::Type) 1 - x.sigmoid(mode)); }};
+
+template <> struct OpGradient<ReluOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad * UnaryExpression<StepOp, E>(x)) { return grad * UnaryExpression<StepOp, E>(x); }};
+
+template <> struct OpGradient<GeluOp> {
+    template <typename G, typename E> static auto input (const G& grad, const E& x, MathMode mode) ->
+        decltype(grad * UnaryExpression<GeluGradientOp, E>(x, mode)) { return grad * UnaryExpression<GeluGradientOp, E>(x, mode); }};
+
+
+// Expression nodes
+
+// Elementwise math methods, which every expression (and Tensor) has. Each one
+// returns a UnaryExpression, so the math gets fused into the surrounding
+// expression. Tanh, sigmoid and GELU also take a mode, where MathMode::Fast
+// uses cheaper approximations (see math.cpp for their error bounds).
+#define unaryMethods(Self)                                                      \
+    UnaryExpression<ExpOp, Self> exp () const { return UnaryExpression<ExpOp, Self>(*this); } \
+    UnaryExpression<LogOp, Self> log () const { return UnaryExpression<LogOp, Self>(*this); } \
+    UnaryExpression<SqrtOp, Self> sqrt () const { return UnaryExpression<SqrtOp, Self>(*this); } \
+    UnaryExpression<ReluOp, Self> relu () const { return UnaryExpression<ReluOp, Self>(*this); } \
+    UnaryExpression<TanhOp, Self> tanh (MathMode mode = MathMode::Accurate) const { \
+        return UnaryExpression<TanhOp, Self>(*this, mode); }                     \
+    UnaryExpression<SigmoidOp, Self> sigmoid (MathMode mode = MathMode::Accurate) const { \
+        return UnaryExpression<SigmoidOp, Self>(*this, mode); }                  \
+    UnaryExpression<GeluOp, Self> gelu (MathMode mode = MathMode::Accurate) const { \
+        return UnaryExpression<GeluOp, Self>(*this, mode); }
+
+// Evaluation methods, which every operator node has. Full reductions get fused
+// into the evaluation, so they never materialize the expression either, and
+// everything else gets forwarded to the evaluated tensor.
+#define forwardToTensor(methodName)                                             \
+    template <typename... Args> auto methodName (Args... args) const ->         \
+        decltype(std::declval<Tensor<T>&>().methodName(args...)) {              \
+        return this->eval().methodName(args...); }
+
+// Reductions over several dimensions take a braced list of them, which can't be
+// deduced as one of the arguments above, so they get their own overload
+#define forwardDimensionsToTensor(methodName)                                   \
+    template <typename... Args> auto methodName (Shape dims, Args... args) const -> \
+        decltype(std::declval<Tensor<T>&>().methodName(dims, args...)) {        \
+        return this->eval().methodName(dims, args...); }
+
+#define evaluationMethods                                                       \
+    Tensor<T> eval () const { return Tensor<T>(*this); }                        \
+                                                                                \
+    template <typename A = typename SumAccumulator<T>::type>                    \
+    A sum (SumMode mode = SumMode::Pairwise) const {                            \
+        return std::is_same<A, T>::value && mode == SumMode::Pairwise ?         \
+            (A) reduceExpression<AddOp>(*this, 0) : this->eval().template sum<A>(mode); } \
+    template <typename A = typename MeanType<T>::accumulator> A mean (SumMode mode = SumMode::Pairwise) const { \
+        return this->template sum<A>(mode) / (A) this->shape.volume(); }       \
+    T max () const { return reduceExpression<MaxOp>(*this, std::numeric_limits<T>::lowest()); } \
+    T min () const { return reduceExpression<MinOp>(*this, std::numeric_limits<T>::max()); } \
+                                                                                \
+    forwardDimensionsToTensor(sum)                                              \
+    forwardDimensionsToTensor(mean)                                             \
+    forwardDimensionsToTensor(max)                                              \
+    forwardDimensionsToTensor(min)                                              \
+    forwardToTensor(sum)                                                        \
+    forwardToTensor(mean)                                                       \
+    forwardToTensor(max)                                                        \
+    forwardToTensor(min)                                                        \
+    forwardToTensor(argmax)                                                     \
+    forwardToTensor(argmin)                                                     \
+    forwardToTensor(softmax)                                                    \
+    forwardToTensor(logSoftmax)                                                 \
+    forwardToTensor(logsumexp)                                                  \
+    forwardToTensor(permute)                                                    \
+    forwardToTensor(transpose)                                                  \
+    forwardToTensor(contiguous)                                                 \
+    forwardToTensor(view)                                                       \
+    forwardToTensor(reshape)                                                    \
+    forwardToTensor(matmul)                                                     \
+    forwardToTensor(bmm)                                                        \
+    forwardToTensor(toString)
+
+// A single value, broadcast over the whole expression
+template <typename T> struct ScalarExpression {
+    typedef T Type;
+    T value;
+    Shape shape;
+
+    ScalarExpression (T value) : value(value), shape(Shape()) { }
+
+    void collect (const Shape&, ExpressionOperands&) const { }
+
+    const T* evaluate (const StridedIterator&, size_t, size_t, size_t&, T*, ptrdiff_t& step) const {
+        step = 0;
+        return &this->value; }
+
+    bool requiresGrad () const { return false; }
+    template <typename N> void collectNodes (List<N>&) const { }
+    template <typename S> void collectSaved (List<S>&) const { }
+    void differentiate (const Tensor<T>&, List<Tensor<T>>&) const { }};
+
+// An elementwise binary operator, applied with one of the operator structs from
+// simd.cpp
+template <typename Op, typename L, typename R> struct BinaryExpression {
+    typedef typename L::Type Type;
+    typedef Type T;
+    L left;
+    R right;
+    Shape shape;
+
+    BinaryExpression (const L& left, const R& right) :
+        left(left), right(right), shape(getBroadcastedShape(left.shape, right.shape)) { }
+
+    void collect (const Shape& outputShape, ExpressionOperands& operands) const {
+        this->left.collect(outputShape, operands);
+        this->right.collect(outputShape, operands); }
+
+    // The left side gets evaluated into our own scratch tile, and we then apply
+    // the op in place, so each level of the tree only needs one extra tile
+    const T* evaluate (const StridedIterator& it, size_t j, size_t n,
+                       size_t& operand, T* scratch, ptrdiff_t& step) const {
+        T rightScratch[EXPRESSION_TILE];
+        ptrdiff_t sa, sb;
+        const T* a = this->left.evaluate(it, j, n, operand, scratch, sa);
+        const T* b = this->right.evaluate(it, j, n, operand, rightScratch, sb);
+
+        // Hold on to a broadcast value, since we're about to overwrite it
+        T x = a[0];
+        if (!sa) a = &x;
+
+        if (!sa && !sb) {
+            step = 0;
+            scratch[0] = Op::apply(a[0], b[0]);
+            return scratch; }
+
+        step = 1;
+        simdBinary<T, Op>(n, scratch, a, sa, b, sb);
+        return scratch; }
+
+
+    // Autograd methods. When an expression gets evaluated into a tensor, the
+    // whole tree is recorded as a single node in the graph, with the leaves that
+    // require a gradient as its inputs (see autograd.cpp). The backward pass then
+    // walks down the tree, building the gradient of each child as another lazy
+    // expression. Any intermediate values it needs, like `a * b` in the gradient
+    // of `(a * b) * c` with respect to `c`, get recomputed on the fly as part of
+    // that expression rather than being kept around from the forward pass.
+    // Since those values get read from the leaves, the node saves the versions
+    // of all their buffers, so `backward` can tell if one has been modified.
+
+    bool requiresGrad () const {
+        return this->left.requiresGrad() || this->right.requiresGrad(); }
+
+    template <typename N> void collectNodes (List<N>& nodes) const {
+        this->left.collectNodes(nodes);
+        this->right.collectNodes(nodes); }
+
+    template <typename S> void collectSaved (List<S>& saved) const {
+        this->left.collectSaved(saved);
+        this->right.collectSaved(saved); }
+
+    void differentiate (const Tensor<T>& grad, List<Tensor<T>>& grads) const {
+        if (this->left.requiresGrad())
+            this->left.differentiate(evaluateDetached(OpGradient<Op>::left(grad, this->left, this->right)), grads);
+        if (this->right.requiresGrad())
+            this->right.differentiate(evaluateDetached(OpGradient<Op>::right(grad, this->left, this->right)), grads); }
+
+
+    // Evaluation and math methods
+    evaluationMethods
+    unaryMethods(BinaryExpression)
+};
+
+// An elementwise unary function, applied with one of the op structs from
+// math.cpp. Most of these are only defined for floating point types.
+template <typename Op, typename E> struct UnaryExpression {
+    typedef typename E::Type Type;
+    typedef Type T;
+    static_assert(!std::is_integral<T>::value || std::is_same<Op, ReluOp>::value || std::is_same<Op, StepOp>::value,
+        "Tensor math - Only floating point types are supported, besides relu");
+    E input;
+    Shape shape;
+    MathMode mode;
+
+    UnaryExpression (const E& input, MathMode mode = MathMode::Accurate) :
+        input(input), shape(input.shape), mode(mode) { }
+
+    void collect (const Shape& outputShape, ExpressionOperands& operands) const {
+        this->input.collect(outputShape, operands); }
+
+    // The input gets evaluated into our scratch tile, and we then apply the op in
+    // place (or straight from the input's buffer, if it's a contiguous leaf)
+    const T* evaluate (const StridedIterator& it, size_t j, size_t n,
+                       size_t& operand, T* scratch, ptrdiff_t& step) const {
+        const T* a = this->input.evaluate(it, j, n, operand, scratch, step);
+        size_t length = step ? n : 1;
+        if (this->mode == MathMode::Fast)
+            simdUnary<T, typename Op::Fast>(length, scratch, a);
+        else simdUnary<T, Op>(length, scratch, a);
+        return scratch; }
+
+
+    // Autograd methods (see BinaryExpression)
+
+    bool requiresGrad () const {
+        return this->input.requiresGrad(); }
+
+    template <typename N> void collectNodes (List<N>& nodes) const {
+        this->input.collectNodes(nodes); }
+
+    template <typename S> void collectSaved (List<S>& saved) const {
+        this->input.collectSaved(saved); }
+
+    void differentiate (const Tensor<T>& grad, List<Tensor<T>>& grads) const {
+        if (this->input.requiresGrad())
+            this->input.differentiate(evaluateDetached(OpGradient<Op>::input(grad, this->input, this->mode)), grads); }
+
+
+    // Evaluation and math methods
+    evaluationMethods
+    unaryMethods(UnaryExpression)
+};
+
+#undef evaluationMethods
+#undef forwardToTensor
+
+
+// Operators. Each operator gets three overloads: expression op expression,
+// expression op scalar, and scalar op expression.
+
+#define expressionOp(op, simdOp)                                                \
+template <typename L, typename R> typename std::enable_if<                      \
+    IsExpression<L>::value && IsExpression<R>::value,                           \
+    BinaryExpression<simdOp, L, R>>::type                                       \
+operator op (const L& left, const R& right) {                                   \
+    static_assert(std::is_same<typename L::Type, typename R::Type>::value,      \
+        "Both sides of a tensor operator must have the same type");             \
+    return BinaryExpression<simdOp, L, R>(left, right); }                       \
+                                                                                \
+template <typename L> typename std::enable_if<IsExpression<L>::value,           \
+    BinaryExpression<simdOp, L, ScalarExpression<typename L::Type>>>::type      \
+operator op (const L& left, typename L::Type right) {                           \
+    typedef ScalarExpression<typename L::Type> S;                               \
+    return BinaryExpression<simdOp, L, S>(left, S(right)); }                    \
+                                                                                \
+template <typename R> typename std::enable_if<IsExpression<R>::value,           \
+    BinaryExpression<simdOp, ScalarExpression<typename R::Type>, R>>::type      \
+operator op (typename R::Type left, const R& right) {                           \
+    typedef ScalarExpression<typename R::Type> S;                               \
+    return BinaryExpression<simdOp, S, R>(S(left), right); }
+
+expressionOp(+, AddOp);
+expressionOp(-, SubOp);
+expressionOp(*, MulOp);
+expressionOp(/, DivOp);
+
+
+// Print operator
+
+template <typename Op, typename L, typename R>
+std::ostream& operator<< (std::ostream& os, const BinaryExpression<Op, L, R>& expression) {
+    os << expression.eval();
+    return os; }
+
+template <typename Op, typename E>
+std::ostream& operator<< (std::ostream& os, const UnaryExpression<Op, E>& expression) {
+    os << expression.eval();
+    return os; }
+
+
+#endif
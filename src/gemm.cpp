@@ -0,0 +1,351 @@
+#ifndef __GEMM__
+#define __GEMM__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "allocator.cpp"
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+// General matrix multiplication, C = A * B, where every matrix is given as a
+// pointer plus a row stride and a column stride, so transposed and permuted
+// tensors can be multiplied without copying them first. The implementation
+// follows the usual Goto/BLIS structure:
+//
+// - B is split into KC x NC blocks and A into MC x KC blocks, sized so that a
+//   packed block of B stays in L3 and a packed block of A stays in L2.
+// - Each block is packed into a contiguous buffer of thin panels (MR rows of A
+//   or NR columns of B at a time), laid out in the order the micro-kernel reads
+//   them. Packing is also where arbitrary strides get resolved, and where the
+//   edges get zero-padded so the micro-kernel never has to handle them.
+// - The micro-kernel computes one MR x NR tile of C entirely in registers, as a
+//   series of rank-1 updates: for each k, it broadcasts MR values from the A
+//   panel and multiplies them against two vector registers from the B panel.
+//
+// As with the elementwise kernels, the micro-kernel is written once with vector
+// extensions and instantiated for each instruction set. The rows (or columns)
+// of C are then divided up between the thread pool's threads, each of which
+// runs the blocked algorithm on its own strip.
+
+#define GEMM_MR 6
+#define GEMM_KC 256
+#define GEMM_MC 120
+#define GEMM_NC 3072
+
+// Products smaller than this (in multiply-adds) aren't worth splitting up
+#define GEMM_PARALLEL_THRESHOLD (1 << 18)
+
+// GCC doesn't contract `a * b + c` into a fused multiply-add under -std=c++11
+// unless we ask it to, and the micro-kernel depends on FMAs to reach peak.
+#if defined(__GNUC__) && !defined(__clang__)
+#define GEMM_CONTRACT __attribute__((optimize("fp-contract=fast")))
+#else
+#define GEMM_CONTRACT
+#endif
+
+
+// Packing helpers
+
+// Packs an mc x kc block of A into panels of MR rows, each stored k-major, and
+// converts its elements from S to T
+template <typename S, typename T> SIMD_INLINE
+void gemmPackA (size_t mc, size_t kc, const S* a, ptrdiff_t rs, ptrdiff_t cs, T* packed) {
+    for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+        size_t rows = std::min((size_t) GEMM_MR, mc - ir);
+        for (size_t p = 0; p < kc; p++) {
+            const S* column = a + ir * rs + p * cs;
+            for (size_t i = 0; i < rows; i++)
+                packed[i] = column[i * rs];
+            for (size_t i = rows; i < GEMM_MR; i++)
+                packed[i] = 0;
+            packed += GEMM_MR; }}}
+
+// Packs a kc x nc block of B into panels of NR columns, each stored k-major, and
+// converts its elements from S to T
+template <size_t NR, typename S, typename T> SIMD_INLINE
+void gemmPackB (size_t kc, size_t nc, const S* b, ptrdiff_t rs, ptrdiff_t cs, T* packed) {
+    for (size_t jr = 0; jr < nc; jr += NR) {
+        size_t columns = std::min(NR, nc - jr);
+        for (size_t p = 0; p < kc; p++) {
+            const S* row = b + p * rs + jr * cs;
+            if (cs == 1)
+                std::copy(row, row + columns, packed);
+            else for (size_t j = 0; j < columns; j++)
+                packed[j] = row[j * cs];
+            for (size_t j = columns; j < NR; j++)
+                packed[j] = 0;
+            packed += NR; }}}
+
+
+// Micro-kernel
+
+// Computes the MR x NR product of an A panel and a B panel over `kc` steps, and
+// stores it (row-major) into `tile`. Unlike the other kernels, this one is
+// defined directly inside each per-instruction-set function rather than being
+// inlined into it, so that GCC lowers the broadcasts with the right instruction
+// set (when it's inlined from a generic function, it splits them into 128-bit
+// pieces). It's called once per tile, so the call itself costs nothing.
+#define gemmMicroKernel(suffix, attributes, bytes)                              \
+template <typename T> __attribute__((noinline)) attributes GEMM_CONTRACT       \
+void gemmMicroKernel##suffix (size_t kc, const T* a, const T* b, T* tile) {     \
+    typedef SimdVector<T, bytes> V;                                             \
+    typedef typename V::type Vector;                                            \
+    const size_t w = V::width;                                                  \
+    const Vector zero = -Vector();                                              \
+                                                                                \
+    Vector c00 = Vector(), c01 = Vector(), c10 = Vector(), c11 = Vector(),      \
+           c20 = Vector(), c21 = Vector(), c30 = Vector(), c31 = Vector(),      \
+           c40 = Vector(), c41 = Vector(), c50 = Vector(), c51 = Vector();      \
+                                                                                \
+    for (size_t p = 0; p < kc; p++) {                                           \
+        Vector b0, b1, ai;                                                      \
+        std::memcpy(&b0, b, sizeof(b0));                                        \
+        std::memcpy(&b1, b + w, sizeof(b1));                                    \
+        ai = a[0] + zero; c00 += ai * b0; c01 += ai * b1;                       \
+        ai = a[1] + zero; c10 += ai * b0; c11 += ai * b1;                       \
+        ai = a[2] + zero; c20 += ai * b0; c21 += ai * b1;                       \
+        ai = a[3] + zero; c30 += ai * b0; c31 += ai * b1;                       \
+        ai = a[4] + zero; c40 += ai * b0; c41 += ai * b1;                       \
+        ai = a[5] + zero; c50 += ai * b0; c51 += ai * b1;                       \
+        a += GEMM_MR;                                                           \
+        b += 2 * w; }                                                           \
+                                                                                \
+    Vector rows[2 * GEMM_MR] = { c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51 }; \
+    std::memcpy(tile, rows, sizeof(rows)); }
+
+// Blocked driver. Computes C = A * B for an m x k matrix A and a k x n matrix B,
+// whose elements get converted to C's type as they're packed.
+
+template <typename S, typename T, size_t Bytes, void (*microKernel)(size_t, const T*, const T*, T*)>
+void gemmKernel (size_t m, size_t n, size_t k,
+                 const S* a, ptrdiff_t rsA, ptrdiff_t csA,
+                 const S* b, ptrdiff_t rsB, ptrdiff_t csB,
+                 T* c, ptrdiff_t rsC, ptrdiff_t csC) {
+    const size_t NR = 2 * SimdVector<T, Bytes>::width;
+    T* packedA = (T*) poolAllocate(GEMM_MC * GEMM_KC * sizeof(T));
+    T* packedB = (T*) poolAllocate(GEMM_KC * GEMM_NC * sizeof(T));
+    T tile[GEMM_MR * NR];
+
+    for (size_t i = 0; i < m; i++)
+        for (size_t j = 0; j < n; j++)
+            c[i * rsC + j * csC] = 0;
+
+    for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+        size_t nc = std::min((size_t) GEMM_NC, n - jc);
+
+        for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+            size_t kc = std::min((size_t) GEMM_KC, k - pc);
+            gemmPackB<NR>(kc, nc, b + pc * rsB + jc * csB, rsB, csB, packedB);
+
+            for (size_t ic = 0; ic < m; ic += GEMM_MC) {
+                size_t mc = std::min((size_t) GEMM_MC, m - ic);
+                gemmPackA(mc, kc, a + ic * rsA + pc * csA, rsA, csA, packedA);
+
+                for (size_t jr = 0; jr < nc; jr += NR) {
+                    for (size_t ir = 0; ir < mc; ir += GEMM_MR) {
+                        microKernel(kc, packedA + ir * kc, packedB + jr * kc, tile);
+
+                        // Accumulate the tile into C, skipping the zero-padded edges
+                        size_t rows = std::min((size_t) GEMM_MR, mc - ir);
+                        size_t columns = std::min(NR, nc - jr);
+                        T* out = c + (ic + ir) * rsC + (jc + jr) * csC;
+                        if (csC == 1 && columns == NR) {
+                            for (size_t i = 0; i < rows; i++)
+                                for (size_t j = 0; j < NR; j++)
+                                    out[i * rsC + j] += tile[i * NR + j]; }
+                        else for (size_t i = 0; i < rows; i++)
+                            for (size_t j = 0; j < columns; j++)
+                                out[i * rsC + j * csC] += tile[i * NR + j]; }}}}}
+
+    poolFree(packedA, GEMM_MC * GEMM_KC * sizeof(T));
+    poolFree(packedB, GEMM_KC * GEMM_NC * sizeof(T)); }
+
+#ifdef SIMD_X86
+gemmMicroKernel(SSE, __attribute__((target("sse4.1"))), 16);
+gemmMicroKernel(AVX2, __attribute__((target("avx2,fma"))), 32);
+gemmMicroKernel(AVX512, __attribute__((target("avx512f,fma"))), 64);
+#endif
+gemmMicroKernel(Generic, , 16);
+
+template <typename S, typename T>
+void gemmSerial (size_t m, size_t n, size_t k,
+                 const S* a, ptrdiff_t rsA, ptrdiff_t csA,
+                 const S* b, ptrdiff_t rsB, ptrdiff_t csB,
+                 T* c, ptrdiff_t rsC, ptrdiff_t csC) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512:
+            return gemmKernel<S, T, 64, gemmMicroKernelAVX512<T>>(m, n, k, a, rsA, csA, b, rsB, csB, c, rsC, csC);
+        case SimdLevel::AVX2:
+            return gemmKernel<S, T, 32, gemmMicroKernelAVX2<T>>(m, n, k, a, rsA, csA, b, rsB, csB, c, rsC, csC);
+        case SimdLevel::SSE:
+            return gemmKernel<S, T, 16, gemmMicroKernelSSE<T>>(m, n, k, a, rsA, csA, b, rsB, csB, c, rsC, csC);
+        default: break; }
+    #endif
+
+    gemmKernel<S, T, 16, gemmMicroKernelGeneric<T>>(m, n, k, a, rsA, csA, b, rsB, csB, c, rsC, csC); }
+
+
+// Parallel entry points. We split C into strips along whichever of its
+// dimensions is larger, so that skinny products still get divided up evenly, and
+// hand the strips to the thread pool. `multiply(i, rows, j, columns)` computes
+// the block of C starting at row i and column j.
+
+template <typename F> void gemmStrips (size_t m, size_t n, size_t k, const F& multiply) {
+    bool splitRows = m >= n;
+    size_t length = splitRows ? m : n;
+    size_t unit = splitRows ? GEMM_MR : 32;
+    size_t units = (length + unit - 1) / unit;
+    size_t work = unit * (splitRows ? n : m) * k;
+    size_t grain = std::max((size_t) 1, GEMM_PARALLEL_THRESHOLD / std::max((size_t) 1, work));
+
+    parallelFor(0, units, grain, [&] (size_t begin, size_t end) {
+        size_t start = begin * unit;
+        size_t size = std::min(length, end * unit) - start;
+        if (splitRows) multiply(start, size, 0, n);
+        else multiply(0, m, start, size); }); }
+
+// C = A * B, computed in C's type T. A and B can have another type S that
+// converts to T, like int8 matrices multiplied into int32.
+template <typename S, typename T>
+void gemm (size_t m, size_t n, size_t k,
+           const S* a, ptrdiff_t rsA, ptrdiff_t csA,
+           const S* b, ptrdiff_t rsB, ptrdiff_t csB,
+           T* c, ptrdiff_t rsC, ptrdiff_t csC) {
+    gemmStrips(m, n, k, [&] (size_t i, size_t rows, size_t j, size_t columns) {
+        gemmSerial(rows, columns, k, a + i * rsA, rsA, csA, b + j * csB, rsB, csB, c + i * rsC + j * csC, rsC, csC); }); }
+
+// Products of half-precision matrices (see half.cpp) accumulate in floats, and
+// only get rounded once, when the result is stored
+template <typename T> typename std::enable_if<!std::is_arithmetic<T>::value>::type
+gemm (size_t m, size_t n, size_t k,
+      const T* a, ptrdiff_t rsA, ptrdiff_t csA,
+      const T* b, ptrdiff_t rsB, ptrdiff_t csB,
+      T* c, ptrdiff_t rsC, ptrdiff_t csC) {
+    float* product = (float*) poolAllocate(m * n * sizeof(float));
+    gemm(m, n, k, a, rsA, csA, b, rsB, csB, product, (ptrdiff_t) n, 1);
+    parallelFor(0, m, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (csC == 1) convertFromFloat(n, product + i * n, c + i * rsC);
+            else for (size_t j = 0; j < n; j++) c[i * rsC + j * csC] = product[i * n + j]; }});
+    poolFree(product, m * n * sizeof(float)); }
+
+
+// 8-bit integer GEMM. Multiplying bytes in 32-bit lanes would waste three
+// quarters of every register, and x86's byte multiply-adds either saturate
+// (pmaddubsw) or need VNNI, and both want one side unsigned. What every x86 CPU
+// does have is pmaddwd, which multiplies int16s in pairs and adds each pair into
+// an int32 exactly, so we widen A and B to int16 and pack each pair of
+// neighbouring k values into one 32-bit word (pairs along a row of A, and the
+// matching pairs along a column of B). That turns the product into an ordinary
+// int32 GEMM over k / 2, which runs on the blocked driver above with a
+// micro-kernel whose multiply-add is a pmaddwd. The products of two bytes and
+// the sums of two products fit comfortably in 32 bits, so the result is exact
+// as long as the whole sum does too (k up to 2^17 for int8).
+
+// Multiplies the int16 pairs of `a` and `b` and adds up each pair
+#define gemmMadd(name, attributes, bytes, expression)                           \
+typedef int32_t name##Words __attribute__((vector_size(bytes)));               \
+attributes SIMD_INLINE name##Words name (const name##Words& a, const name##Words& b) { \
+    return expression; }
+
+#define gemmMaddKernel(suffix, attributes, bytes, madd)                         \
+template <typename T> __attribute__((noinline)) attributes                     \
+void gemmMaddKernel##suffix (size_t kc, const T* a, const T* b, T* tile) {      \
+    typedef SimdVector<int32_t, bytes> V;                                       \
+    typedef typename V::type Vector;                                            \
+    const size_t w = V::width;                                                  \
+                                                                                \
+    Vector c00 = Vector(), c01 = Vector(), c10 = Vector(), c11 = Vector(),      \
+           c20 = Vector(), c21 = Vector(), c30 = Vector(), c31 = Vector(),      \
+           c40 = Vector(), c41 = Vector(), c50 = Vector(), c51 = Vector();      \
+                                                                                \
+    for (size_t p = 0; p < kc; p++) {                                           \
+        Vector b0, b1, ai;                                                      \
+        std::memcpy(&b0, b, sizeof(b0));                                        \
+        std::memcpy(&b1, b + w, sizeof(b1));                                    \
+        ai = a[0] + Vector(); c00 += madd(ai, b0); c01 += madd(ai, b1);         \
+        ai = a[1] + Vector(); c10 += madd(ai, b0); c11 += madd(ai, b1);         \
+        ai = a[2] + Vector(); c20 += madd(ai, b0); c21 += madd(ai, b1);         \
+        ai = a[3] + Vector(); c30 += madd(ai, b0); c31 += madd(ai, b1);         \
+        ai = a[4] + Vector(); c40 += madd(ai, b0); c41 += madd(ai, b1);         \
+        ai = a[5] + Vector(); c50 += madd(ai, b0); c51 += madd(ai, b1);         \
+        a += GEMM_MR;                                                           \
+        b += 2 * w; }                                                           \
+                                                                                \
+    Vector rows[2 * GEMM_MR] = { c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51 }; \
+    std::memcpy(tile, rows, sizeof(rows)); }
+
+// (512-bit pmaddwd needs AVX-512BW on top of the AVX-512F that SimdLevel::AVX512
+// stands for, so that level checks for it separately.)
+#ifdef SIMD_X86
+gemmMadd(maddSSE, __attribute__((target("sse4.1"))), 16, (maddSSEWords) _mm_madd_epi16((__m128i) a, (__m128i) b));
+gemmMadd(maddAVX2, __attribute__((target("avx2"))), 32, (maddAVX2Words) _mm256_madd_epi16((__m256i) a, (__m256i) b));
+gemmMadd(maddAVX512, __attribute__((target("avx512f,avx512bw"))), 64, (maddAVX512Words) _mm512_madd_epi16((__m512i) a, (__m512i) b));
+gemmMaddKernel(SSE, __attribute__((target("sse4.1"))), 16, maddSSE);
+gemmMaddKernel(AVX2, __attribute__((target("avx2"))), 32, maddAVX2);
+gemmMaddKernel(AVX512, __attribute__((target("avx512f,avx512bw"))), 64, maddAVX512);
+
+bool hasAVX512BW () {
+    static bool supported = __builtin_cpu_supports("avx512bw");
+    return supported; }
+#endif
+
+// Without pmaddwd, we split the words into their low and high halves (with
+// sign extension) and multiply those
+gemmMadd(maddGeneric, , 16, ((a << 16) >> 16) * ((b << 16) >> 16) + (a >> 16) * (b >> 16));
+gemmMaddKernel(Generic, , 16, maddGeneric);
+
+// Packs x[2p * step] and x[(2p + 1) * step] into a word of int16 pairs, where
+// the second one is zero past the end of k
+template <typename Q> SIMD_INLINE int32_t gemmPair (const Q* x, ptrdiff_t step, size_t p, size_t k) {
+    uint32_t low = (uint16_t) (int16_t) x[2 * p * step];
+    uint32_t high = 2 * p + 1 < k ? (uint16_t) (int16_t) x[(2 * p + 1) * step] : 0;
+    return (int32_t) (low | high << 16); }
+
+// C = A * B for int8 (or uint8) matrices, accumulated exactly in int32
+template <typename Q>
+void integerGemm (size_t m, size_t n, size_t k,
+                  const Q* a, ptrdiff_t rsA, ptrdiff_t csA,
+                  const Q* b, ptrdiff_t rsB, ptrdiff_t csB,
+                  int32_t* c, ptrdiff_t rsC, ptrdiff_t csC) {
+    static_assert(sizeof(Q) == 1 && std::is_integral<Q>::value, "integerGemm - Only 8-bit integers are supported");
+    size_t pairs = (k + 1) / 2;
+    int32_t* pairsA = (int32_t*) poolAllocate(std::max((size_t) 1, m * pairs) * sizeof(int32_t));
+    int32_t* pairsB = (int32_t*) poolAllocate(std::max((size_t) 1, pairs * n) * sizeof(int32_t));
+    parallelFor(0, m, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, k)), [&] (size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            for (size_t p = 0; p < pairs; p++)
+                pairsA[i * pairs + p] = gemmPair(a + i * rsA, csA, p, k); });
+    parallelFor(0, pairs, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++)
+            for (size_t j = 0; j < n; j++)
+                pairsB[p * n + j] = gemmPair(b + j * csB, rsB, p, k); });
+
+    gemmStrips(m, n, k, [&] (size_t i, size_t rows, size_t j, size_t columns) {
+        const int32_t* pa = pairsA + i * pairs;
+        const int32_t* pb = pairsB + j;
+        int32_t* out = c + i * rsC + j * csC;
+        #ifdef SIMD_X86
+        switch (simdLevel()) {
+            case SimdLevel::AVX512:
+                if (hasAVX512BW())
+                    return gemmKernel<int32_t, int32_t, 64, gemmMaddKernelAVX512<int32_t>>(rows, columns, pairs, pa, pairs, 1, pb, n, 1, out, rsC, csC);
+                return gemmKernel<int32_t, int32_t, 32, gemmMaddKernelAVX2<int32_t>>(rows, columns, pairs, pa, pairs, 1, pb, n, 1, out, rsC, csC);
+            case SimdLevel::AVX2:
+                return gemmKernel<int32_t, int32_t, 32, gemmMaddKernelAVX2<int32_t>>(rows, columns, pairs, pa, pairs, 1, pb, n, 1, out, rsC, csC);
+            case SimdLevel::SSE:
+                return gemmKernel<int32_t, int32_t, 16, gemmMaddKernelSSE<int32_t>>(rows, columns, pairs, pa, pairs, 1, pb, n, 1, out, rsC, csC);
+            default: break; }
+        #endif
+        gemmKernel<int32_t, int32_t, 16, gemmMaddKernelGeneric<int32_t>>(rows, columns, pairs, pa, pairs, 1, pb, n, 1, out, rsC, csC); });
+
+    poolFree(pairsA, std::max((size_t) 1, m * pairs) * sizeof(int32_t));
+    poolFree(pairsB, std::max((size_t) 1, pairs * n) * sizeof(int32_t)); }
+
+
+#endif
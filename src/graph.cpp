@@ -0,0 +1,262 @@
+#ifndef __GRAPH__
+#define __GRAPH__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "allocator.cpp"
+#include "expression.cpp"
+#include "autograd.cpp"
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+
+// Graph capture, for running the same sequence of ops with the same shapes over
+// and over (like a model serving requests). Capturing runs a function once,
+// with every op on its thread recording a step: a function that repeats the op,
+// with its shapes, strides and iteration plan already worked out, and with the
+// buffers that it reads and writes. Replaying the graph runs the steps again,
+// reading whatever the tensors from outside the graph (its inputs and weights)
+// hold at the time, and writing into the same output tensors as before:
+//
+//     Graph graph;
+//     let output = graph.capture([&] { return (input.matmul(w1) + b1).relu().matmul(w2); });
+//     for (...) {
+//         input.assign(nextBatch);
+//         graph.replay();  // Updates `output`
+//     }
+//
+// Once the function returns, every buffer that a step created gets a place in
+// one arena, and buffers whose lifetimes don't overlap (from the step that
+// creates one to the last step that uses it) share the same memory, so the
+// graph's peak memory is the most that's ever live at once, rather than the sum
+// of every intermediate. The tensors that the function returns stay live until
+// the end. Replaying doesn't allocate any tensors, and the only memory it takes
+// is the scratch space that kernels like GEMM get from the caching allocator.
+//
+// Ops that create tensors or write into them are recorded, but ones that return
+// plain values (like the full `sum()`) can't be, so they throw while capturing.
+// Anything else that gets computed during the capture, outside of a Tensor op
+// (like a Tensor built from a list of values), is treated as a constant, and
+// keeps the value it had then. Autograd is disabled while capturing.
+
+class Graph;
+
+// The graph that ops on this thread are being recorded into, if any
+Graph*& capturingGraph () {
+    static thread_local Graph* value = NULL;
+    return value; }
+
+struct GraphStep {
+    std::function<void()> run;
+    List<const void*> reads;    // Data of the buffers that the step reads
+    const void* write;          // Data of the buffer that it writes
+};
+
+class Graph : public BufferObserver {
+public:
+    List<GraphStep> steps;
+    List<BufferHandle> buffers;             // Buffers created while capturing
+    List<const void*> outputs;              // Data of the buffers that the capture returned
+    Reference<void> arena;
+    size_t arenaBytes;                      // Size of the arena
+    size_t intermediateBytes;               // Total size of the buffers placed in it
+    bool captured;
+
+    Graph () : arenaBytes(0), intermediateBytes(0), captured(false) { }
+
+    // Graphs can't be copied, since buffers report to them by address
+    Graph (const Graph& other) = delete;
+    Graph& operator= (const Graph& other) = delete;
+
+
+    // Capturing
+
+    // Runs `f` once, recording its ops, and then plans the graph's memory and
+    // replays it, so that the tensors that `f` returns (a Tensor, or a List of
+    // them) hold their values in the arena
+    template <typename F> auto capture (const F& f) -> decltype(f()) {
+        if (this->captured)
+            throw "Graph.capture - This graph has already been captured";
+        if (capturingGraph())
+            throw "Graph.capture - Another graph is already being captured on this thread";
+
+        auto result = this->record(f);
+        this->markOutputs(result);
+        this->plan();
+        this->captured = true;
+        this->replay();
+        return result; }
+
+    template <typename F> auto record (const F& f) -> decltype(f()) {
+        NoGrad guard;
+        capturingGraph() = this;
+        bufferObserver() = this;
+        try {
+            auto result = f();
+            capturingGraph() = NULL;
+            bufferObserver() = NULL;
+            return result; }
+        catch (...) {
+            capturingGraph() = NULL;
+            bufferObserver() = NULL;
+            throw; }}
+
+    // Records a step, given the data of the buffers it reads and writes
+    void recordStep (std::function<void()> run, std::initializer_list<const void*> reads, const void* write) {
+        this->steps.push_back({ run, List<const void*>(reads), write }); }
+    void recordStep (std::function<void()> run, const ExpressionOperands& reads, const void* write) {
+        this->steps.push_back({ run, List<const void*>(reads.data, reads.data + reads.length), write }); }
+
+    template <typename T> void markOutputs (const T& output) {
+        this->outputs.push_back(output.data()); }
+    template <typename T> void markOutputs (const List<T>& outputs) {
+        for (const T& output : outputs)
+            this->outputs.push_back(output.data()); }
+
+
+    // Buffer observer methods
+
+    void created (const BufferHandle& handle) override {
+        this->buffers.push_back(handle); }
+
+    void destroyed (void* buffer) override {
+        for (size_t i = 0; i < this->buffers.size(); i++) {
+            if (this->buffers[i].buffer == buffer) {
+                this->buffers[i] = this->buffers.back();
+                this->buffers.pop_back();
+                return; }}}
+
+
+    // Memory planning. Each buffer that's first written by a step lives from
+    // that step to the last one that reads or writes it (or to the end, if it's
+    // an output), and buffers that are first read by a step were made outside of
+    // a step, so they're left where they are. We place the buffers largest first,
+    // each one at the lowest offset that doesn't overlap a buffer that's already
+    // been placed and is live at the same time as it.
+
+    struct Lifetime {
+        size_t buffer, bytes, first, last, offset; };
+
+    void plan () {
+        // Find the buffer that each step's pointers fall into
+        List<const char*> begins(this->buffers.size());
+        List<size_t> sizes(this->buffers.size());
+        for (size_t i = 0; i < this->buffers.size(); i++) {
+            begins[i] = (const char*) this->buffers[i].data(this->buffers[i].buffer);
+            sizes[i] = this->buffers[i].bytes(this->buffers[i].buffer); }
+        let find = [&] (const void* pointer) -> ptrdiff_t {
+            for (size_t i = 0; i < begins.size(); i++)
+                if (begins[i] && (const char*) pointer >= begins[i] && (const char*) pointer < begins[i] + std::max(sizes[i], (size_t) 1))
+                    return i;
+            return -1; };
+
+        size_t never = (size_t) -1, end = this->steps.size();
+        List<size_t> first(this->buffers.size(), never), last(this->buffers.size(), 0);
+        List<bool> constant(this->buffers.size(), false);
+        for (size_t s = 0; s < this->steps.size(); s++) {
+            for (const void* pointer : this->steps[s].reads) {
+                ptrdiff_t i = find(pointer);
+                if (i < 0) continue;
+                if (first[i] == never) constant[i] = true;
+                last[i] = s; }
+            ptrdiff_t i = find(this->steps[s].write);
+            if (i < 0) continue;
+            if (first[i] == never) first[i] = s;
+            last[i] = s; }
+        for (const void* pointer : this->outputs) {
+            ptrdiff_t i = find(pointer);
+            if (i >= 0) last[i] = end; }
+
+        List<Lifetime> lifetimes;
+        for (size_t i = 0; i < this->buffers.size(); i++)
+            if (first[i] != never && !constant[i] && sizes[i])
+                lifetimes.push_back({ i, (sizes[i] + ALLOCATOR_ALIGNMENT - 1) / ALLOCATOR_ALIGNMENT * ALLOCATOR_ALIGNMENT,
+                                      first[i], last[i], 0 });
+        std::stable_sort(lifetimes.begin(), lifetimes.end(), [] (const Lifetime& a, const Lifetime& b) {
+            return a.bytes > b.bytes; });
+
+        List<Lifetime*> placed;
+        for (Lifetime& lifetime : lifetimes) {
+            // Try the lowest offset, and then the end of each placed buffer that
+            // overlaps it, until one doesn't overlap any of them
+            List<Lifetime*> live;
+            for (Lifetime* other : placed)
+                if (other->first <= lifetime.last && lifetime.first <= other->last)
+                    live.push_back(other);
+            std::sort(live.begin(), live.end(), [] (Lifetime* a, Lifetime* b) { return a->offset < b->offset; });
+
+            size_t offset = 0;
+            for (Lifetime* other : live)
+                if (offset + lifetime.bytes > other->offset && offset < other->offset + other->bytes)
+                    offset = std::max(offset, other->offset + other->bytes);
+            lifetime.offset = offset;
+            placed.push_back(&lifetime);
+            this->arenaBytes = std::max(this->arenaBytes, offset + lifetime.bytes);
+            this->intermediateBytes += lifetime.bytes; }
+
+        // Move the buffers into the arena. Their old memory goes back to the
+        // allocator, and the steps see the new memory through the buffers.
+        size_t bytes = std::max(this->arenaBytes, (size_t) 1);
+        this->arena = Reference<void>(poolAllocate(bytes), [bytes] (void* block) { poolFree(block, bytes); });
+        for (const Lifetime& lifetime : lifetimes) {
+            const BufferHandle& handle = this->buffers[lifetime.buffer];
+            handle.rebind(handle.buffer, (char*) this->arena.get() + lifetime.offset, this->arena); }
+        this->buffers.clear(); }
+
+
+    // Replaying
+
+    void replay () {
+        if (!this->captured)
+            throw "Graph.replay - This graph hasn't been captured yet";
+        profileOp("replay", std::to_string(this->steps.size()) + " steps", 0, 0);
+        for (const GraphStep& step : this->steps)
+            step.run(); }
+
+
+    // Helper methods
+
+    String toString () const {
+        return "Graph(steps=" + std::to_string(this->steps.size()) + ", arenaBytes=" + std::to_string(this->arenaBytes) +
+            ", intermediateBytes=" + std::to_string(this->intermediateBytes) + ")"; }};
+
+
+// Recording. Every op that creates or writes a tensor runs through one of these,
+// which run it, and record it as well if its thread is capturing a graph. The
+// step functions take their buffers by reference, not their data, since the
+// data gets moved into the arena afterwards.
+
+template <typename F, typename R> void captureStep (const F& run, const R& reads, const void* write) {
+    run();
+    if (capturingGraph())
+        capturingGraph()->recordStep(run, reads, write); }
+template <typename F> void captureStep (const F& run, std::initializer_list<const void*> reads, const void* write) {
+    run();
+    if (capturingGraph())
+        capturingGraph()->recordStep(run, reads, write); }
+
+// Evaluates `expression` into `buffer`, starting `offset` elements in, and
+// records it with its plan
+template <typename E, typename T> void captureExpression (const E& expression, const Reference<Buffer<T>>& buffer,
+                                                          size_t offset, const Shape& shape, const Shape& stride) {
+    profileOp("elementwise", profileSignature(shape, stride), expressionBytes(expression, shape, true),
+              (double) ExpressionOps<E>::value * shape.volume());
+    if (!capturingGraph())
+        return evaluateExpression(expression, buffer->data + offset, shape, stride);
+
+    ExpressionOperands operands;
+    expression.collect(shape, operands);
+    let plan = planExpression(expression, buffer->data + offset, shape, stride);
+    let run = [expression, buffer, offset, shape, stride, plan] () {
+        evaluatePlan(expression, buffer->data + offset, shape, stride, plan); };
+    captureStep(run, operands, buffer->data + offset); }
+
+// Ops that return plain values can't be replayed, so they throw while capturing
+void checkNotCapturing (const char* error) {
+    if (capturingGraph())
+        throw error; }
+
+
+#endif
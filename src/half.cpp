@@ -0,0 +1,207 @@
+#ifndef __HALF__
+#define __HALF__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+
+// Half-precision storage types. bf16 is the top half of a float32, with the same
+// 8-bit exponent and a 7-bit mantissa, and f16 is IEEE binary16, with a 5-bit
+// exponent and a 10-bit mantissa. Neither one has any arithmetic of its own:
+// they convert to float implicitly, so `a + b` on two of them is a float sum,
+// which gets rounded back (to nearest even) when it's stored. The kernels treat
+// them the same way, converting runs of elements to floats a vector register at
+// a time (see the dispatchers in simd.cpp), and sums, means and matrix products
+// accumulate in float32, so a tensor of either type costs half the memory and
+// bandwidth of a float tensor without losing more than its own precision.
+//
+// The conversions are bit tricks on the 32-bit pattern of the float, written so
+// that they work on a single uint32_t as well as a whole vector register of
+// them, which means the scalar constructors and the vectorized kernels share
+// one implementation. (On x86, only F16C and AVX-512 BF16 have instructions for
+// these conversions, and a handful of integer ops per vector keeps up with
+// memory just as well.)
+
+template <typename To, typename From> SIMD_INLINE To bitCast (const From& x) {
+    static_assert(sizeof(To) == sizeof(From), "bitCast - The types must have the same size");
+    To y;
+    std::memcpy(&y, &x, sizeof(To));
+    return y; }
+
+
+// Bit conversions. Each one takes 16-bit patterns in the low half of 32-bit
+// lanes (or 32-bit float patterns), where U holds the lanes and F is the float
+// type with the same number of lanes.
+
+// bf16 -> float is exact, since bf16 is a truncated float
+template <typename U, typename F> SIMD_INLINE U bfloatToFloatBits (const U& h) {
+    return h << 16; }
+
+// float -> bf16 rounds to nearest even by adding just under half of the dropped
+// bits (plus one if the kept part is odd), and keeps NaNs quiet, since rounding
+// could turn a NaN with only low mantissa bits into an infinity
+template <typename U, typename F> SIMD_INLINE U floatToBfloatBits (const U& f) {
+    U rounded = (f + 0x7FFFu + ((f >> 16) & 1u)) >> 16;
+    return (f & 0x7FFFFFFFu) > 0x7F800000u ? (f >> 16) | 0x40u : rounded; }
+
+// f16 -> float moves the exponent and mantissa into place and rebiases the
+// exponent from 15 to 127. Infinities and NaNs get the rest of the bias, and
+// subnormals (m * 2^-24) come from building 2^-14 * (1 + m / 2^10) and then
+// subtracting 2^-14 with a float subtraction, which normalizes the result.
+template <typename U, typename F> SIMD_INLINE U halfToFloatBits (const U& h) {
+    U bits = (h & 0x7FFFu) << 13, exponent = bits & 0x0F800000u;
+    bits += 0x38000000u;
+    U special = bits + 0x38000000u;
+    U subnormal = bitCast<U>(bitCast<F>(bits + 0x00800000u) - bitCast<F>(U() + 0x38800000u));
+    bits = exponent == 0x0F800000u ? special : exponent == 0u ? subnormal : bits;
+    return bits | (h & 0x8000u) << 16; }
+
+// float -> f16 has three cases, which we compute side by side and then select
+// between: values too large for a half become infinity (or stay NaN), values
+// below the smallest normal half get added to 0.5, which makes the float adder
+// round their mantissa to the half's subnormal spacing for us, and everything
+// else gets its exponent rebiased and its 13 dropped bits rounded to nearest even
+template <typename U, typename F> SIMD_INLINE U floatToHalfBits (const U& x) {
+    U sign = x & 0x80000000u, f = x ^ sign;
+    U large = f > 0x7F800000u ? U() + 0x7E00u : U() + 0x7C00u;
+    U small = bitCast<U>(bitCast<F>(f) + bitCast<F>(U() + 0x3F000000u)) - 0x3F000000u;
+    U normal = (f + 0xC8000FFFu + ((f >> 13) & 1u)) >> 13;
+    U bits = f >= 0x47800000u ? large : f < 0x38800000u ? small : normal;
+    return bits | sign >> 16; }
+
+
+// Types
+
+#define halfType(name, toFloat, fromFloat)                                      \
+struct name {                                                                   \
+    uint16_t bits;                                                              \
+                                                                                \
+    name () = default;                                                          \
+    name (float x) : bits((uint16_t) fromFloat<uint32_t, float>(bitCast<uint32_t>(x))) { } \
+    operator float () const { return bitCast<float>(toFloat<uint32_t, float>(this->bits)); } \
+                                                                                \
+    static name fromBits (uint16_t bits) { name x; x.bits = bits; return x; }   \
+                                                                                \
+    name& operator+= (float x) { return *this = *this + x; }                   \
+    name& operator-= (float x) { return *this = *this - x; }                   \
+    name& operator*= (float x) { return *this = *this * x; }                   \
+    name& operator/= (float x) { return *this = *this / x; }};
+
+halfType(bf16, bfloatToFloatBits, floatToBfloatBits);
+halfType(f16, halfToFloatBits, floatToHalfBits);
+
+// How each type converts, for the kernels below
+template <typename T> struct HalfBits;
+template <> struct HalfBits<bf16> {
+    template <typename U, typename F> static SIMD_INLINE U toFloat (const U& h) { return bfloatToFloatBits<U, F>(h); }
+    template <typename U, typename F> static SIMD_INLINE U fromFloat (const U& f) { return floatToBfloatBits<U, F>(f); }};
+template <> struct HalfBits<f16> {
+    template <typename U, typename F> static SIMD_INLINE U toFloat (const U& h) { return halfToFloatBits<U, F>(h); }
+    template <typename U, typename F> static SIMD_INLINE U fromFloat (const U& f) { return floatToHalfBits<U, F>(f); }};
+
+// Limits, in the same terms as float's
+#define halfLimits(name, digitCount, minimum, maximum, lowestValue, epsilonValue, infinityValue, nanValue) \
+namespace std {                                                                 \
+template <> struct numeric_limits<name> {                                       \
+    static const bool is_specialized = true, is_signed = true, is_integer = false, is_exact = false, \
+                      has_infinity = true, has_quiet_NaN = true, is_bounded = true; \
+    static const int digits = digitCount;                                       \
+    static name min () { return name::fromBits(minimum); }                      \
+    static name max () { return name::fromBits(maximum); }                      \
+    static name lowest () { return name::fromBits(lowestValue); }               \
+    static name epsilon () { return name::fromBits(epsilonValue); }             \
+    static name infinity () { return name::fromBits(infinityValue); }           \
+    static name quiet_NaN () { return name::fromBits(nanValue); }}; }
+
+halfLimits(bf16, 8, 0x0080, 0x7F7F, 0xFF7F, 0x3C00, 0x7F80, 0x7FC0);
+halfLimits(f16, 11, 0x0400, 0x7BFF, 0xFBFF, 0x1400, 0x7C00, 0x7E00);
+
+
+// Kernels
+
+// Loads a vector register's worth of halves as floats
+template <typename T, size_t Bytes> SIMD_INLINE typename SimdVector<float, Bytes>::type loadHalf (const T* p) {
+    typedef typename SimdVector<uint32_t, Bytes>::type U;
+    typedef typename SimdVector<float, Bytes>::type F;
+    typedef uint16_t Narrow __attribute__((vector_size(Bytes / 2)));
+    Narrow h;
+    std::memcpy(&h, p, sizeof(h));
+    return bitCast<F>(HalfBits<T>::template toFloat<U, F>(__builtin_convertvector(h, U))); }
+
+// Rounds a vector register's worth of floats to halves, and stores them
+template <typename T, size_t Bytes> SIMD_INLINE void storeHalf (T* p, const typename SimdVector<float, Bytes>::type& x) {
+    typedef typename SimdVector<uint32_t, Bytes>::type U;
+    typedef typename SimdVector<float, Bytes>::type F;
+    typedef uint16_t Narrow __attribute__((vector_size(Bytes / 2)));
+    Narrow h = __builtin_convertvector(HalfBits<T>::template fromFloat<U, F>(bitCast<U>(x)), Narrow);
+    std::memcpy(p, &h, sizeof(h)); }
+
+template <typename T, size_t Bytes> SIMD_INLINE void toFloatKernel (size_t n, const T* in, float* out) {
+    const size_t w = SimdVector<float, Bytes>::width;
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        SimdVector<float, Bytes>::store(out + i, loadHalf<T, Bytes>(in + i));
+    for (; i < n; i++)
+        out[i] = in[i]; }
+
+template <typename T, size_t Bytes> SIMD_INLINE void fromFloatKernel (size_t n, const float* in, T* out) {
+    const size_t w = SimdVector<float, Bytes>::width;
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        storeHalf<T, Bytes>(out + i, SimdVector<float, Bytes>::load(in + i));
+    for (; i < n; i++)
+        out[i] = in[i]; }
+
+
+// Per-instruction-set entry points
+
+#define halfEntryPoints(suffix, isa, bytes)                                     \
+template <typename T> __attribute__((target(isa)))                             \
+void toFloat##suffix (size_t n, const T* in, float* out) {                      \
+    toFloatKernel<T, bytes>(n, in, out); }                                      \
+                                                                                \
+template <typename T> __attribute__((target(isa)))                             \
+void fromFloat##suffix (size_t n, const float* in, T* out) {                    \
+    fromFloatKernel<T, bytes>(n, in, out); }
+
+#ifdef SIMD_X86
+halfEntryPoints(SSE, "sse4.1", 16);
+halfEntryPoints(AVX2, "avx2", 32);
+halfEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+
+// Dispatchers (declared in simd.cpp)
+
+// out[i] = in[i] for contiguous runs of halves and floats
+template <typename T> void convertToFloat (size_t n, const T* in, float* out) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return toFloatAVX512(n, in, out);
+            case SimdLevel::AVX2: return toFloatAVX2(n, in, out);
+            case SimdLevel::SSE: return toFloatSSE(n, in, out);
+            default: break; }}
+    #endif
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[i]; }
+
+template <typename T> void convertFromFloat (size_t n, const float* in, T* out) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return fromFloatAVX512(n, in, out);
+            case SimdLevel::AVX2: return fromFloatAVX2(n, in, out);
+            case SimdLevel::SSE: return fromFloatSSE(n, in, out);
+            default: break; }}
+    #endif
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[i]; }
+
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef __INDEXING__
+#define __INDEXING__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#ifdef SIMD_X86
+#include <immintrin.h>
+#endif
+
+
+// Kernels for `indexSelect`, `gather` and `scatterAdd` in tensor.cpp. All three
+// look at contiguous tensors as [outer, size, inner], where `size` is the
+// dimension being indexed, and `outer` and `inner` are the products of the
+// dimensions before and after it.
+//
+// Each kernel works on runs of elements that read (or write) one element of
+// the indexed tensor each, at `index[i] * step + i * unit`. When there are inner
+// dimensions, a run goes along them, with `step` = `inner` and `unit` = 1, and
+// otherwise it goes along the indices themselves, with `step` = 1 and `unit` = 0.
+// Runs of 4- or 8-byte elements get loaded with the AVX2 or AVX-512 gather
+// instructions when the elements they can reach fit in INDEX_GATHER_BYTES. Those
+// are about 15% faster than scalar loads while they hit the cache, but once
+// most of them miss it, they're about 15% slower, since the scalar loads keep
+// more misses in flight at once. The limit also keeps every offset within the
+// 32 bits that the gather instructions take.
+//
+// `indexSelect` with inner dimensions (like an embedding lookup, which picks
+// whole rows of a table) doesn't need any of that, since each index picks a
+// contiguous row of `inner` elements, which just get copied. Scatters can't be
+// split between threads along the indices, since two of them can point at the
+// same element, so `scatterAdd` gets split along `outer` and `inner` instead,
+// where no two threads ever touch the same element.
+//
+// Indices have to be in [0, size). The kernels skip any run with an index
+// outside of that, and return how many there were, so the caller can throw.
+
+#define INDEX_GATHER_BYTES (1 << 23)     // Most memory that a run can reach to use the gather instructions
+#define INDEX_SCATTER_COLUMNS 64        // Fewest inner elements for each thread's share of a scatter
+
+
+// Number of indices in `index[0, n)` that aren't in [0, size). Negative ones
+// wrap around to huge values when they're converted to size_t.
+template <typename I> size_t invalidIndices (size_t n, const I* index, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+        count += (size_t) index[i] >= size;
+    return count; }
+
+
+// Gather runs: out[i] = in[index[i] * step + i * unit]
+
+template <typename T, typename I> void gatherScalar (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit, T* out) {
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[(ptrdiff_t) index[i] * step + (ptrdiff_t) i * unit]; }
+
+#ifdef SIMD_X86
+
+// Loads 8 (AVX2) or 16 (AVX-512) indices as 32-bit offsets. 64-bit indices get
+// truncated, which is fine, since they've already been checked against `size`.
+template <typename I> __attribute__((target("avx2"))) SIMD_INLINE __m256i loadOffsetsAVX2 (const I* index) {
+    if (sizeof(I) == 4)
+        return _mm256_loadu_si256((const __m256i*) index);
+    const __m256i low = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) index), low);
+    __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) (index + 4)), low);
+    return _mm256_blend_epi32(a, b, 0xF0); }
+
+template <typename I> __attribute__((target("avx512f"))) SIMD_INLINE __m512i loadOffsetsAVX512 (const I* index) {
+    if (sizeof(I) == 4)
+        return _mm512_loadu_si512(index);
+    return _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(_mm512_loadu_si512(index))),
+                              _mm512_cvtepi64_epi32(_mm512_loadu_si512(index + 8)), 1); }
+
+template <typename T, typename I> __attribute__((target("avx2")))
+void gatherAVX2 (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit, T* out) {
+    const __m256i steps = _mm256_set1_epi32((int) step), advance = _mm256_set1_epi32((int) (8 * unit));
+    __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int) unit));
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i offsets = _mm256_add_epi32(_mm256_mullo_epi32(loadOffsetsAVX2(index + i), steps), lanes);
+        lanes = _mm256_add_epi32(lanes, advance);
+        if (sizeof(T) == 4)
+            _mm256_storeu_si256((__m256i*) (out + i), _mm256_i32gather_epi32((const int*) in, offsets, 4));
+        else {
+            _mm256_storeu_si256((__m256i*) (out + i), _mm256_i32gather_epi64((const long long*) in, _mm256_castsi256_si128(offsets), 8));
+            _mm256_storeu_si256((__m256i*) (out + i + 4), _mm256_i32gather_epi64((const long long*) in, _mm256_extracti128_si256(offsets, 1), 8)); }}
+    gatherScalar(n - i, in + i * unit, index + i, step, unit, out + i); }
+
+template <typename T, typename I> __attribute__((target("avx512f")))
+void gatherAVX512 (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit, T* out) {
+    const __m512i steps = _mm512_set1_epi32((int) step), advance = _mm512_set1_epi32((int) (16 * unit));
+    __m512i lanes = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32((int) unit));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i offsets = _mm512_add_epi32(_mm512_mullo_epi32(loadOffsetsAVX512(index + i), steps), lanes);
+        lanes = _mm512_add_epi32(lanes, advance);
+        if (sizeof(T) == 4)
+            _mm512_storeu_si512(out + i, _mm512_i32gather_epi32(offsets, in, 4));
+        else {
+            _mm512_storeu_si512(out + i, _mm512_i32gather_epi64(_mm512_castsi512_si256(offsets), in, 8));
+            _mm512_storeu_si512(out + i + 8, _mm512_i32gather_epi64(_mm512_extracti64x4_epi64(offsets, 1), in, 8)); }}
+    gatherScalar(n - i, in + i * unit, index + i, step, unit, out + i); }
+
+#endif
+
+// Gathers a run, given the number of elements that its offsets can reach
+template <typename T, typename I> void gatherRun (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit,
+                                                  T* out, size_t span) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH && (sizeof(T) == 4 || sizeof(T) == 8) && (sizeof(I) == 4 || sizeof(I) == 8) &&
+        span * sizeof(T) <= INDEX_GATHER_BYTES) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return gatherAVX512(n, in, index, step, unit, out);
+            case SimdLevel::AVX2: return gatherAVX2(n, in, index, step, unit, out);
+            default: break; }}
+    #endif
+    gatherScalar(n, in, index, step, unit, out); }
+
+
+// Scatter runs: out[index[i] * step + i * unit] += in[i]. Within a run that
+// goes along the inner dimensions (`unit` = 1), every element lands on a
+// different column, so on AVX-512 a whole register of them can be gathered,
+// added to and scattered back at once. Along the indices, two of them can be
+// the same, so those runs stay scalar.
+
+template <typename T, typename I> void scatterAddScalar (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit, T* out) {
+    for (size_t i = 0; i < n; i++)
+        out[(ptrdiff_t) index[i] * step + (ptrdiff_t) i * unit] += in[i]; }
+
+#ifdef SIMD_X86
+template <typename T, typename I> __attribute__((target("avx512f")))
+void scatterAddAVX512 (size_t n, const T* in, const I* index, ptrdiff_t step, T* out) {
+    const __m512i steps = _mm512_set1_epi32((int) step), advance = _mm512_set1_epi32(16);
+    __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i offsets = _mm512_add_epi32(_mm512_mullo_epi32(loadOffsetsAVX512(index + i), steps), lanes);
+        lanes = _mm512_add_epi32(lanes, advance);
+        if (std::is_same<T, float>::value) {
+            __m512 sum = _mm512_add_ps(_mm512_i32gather_ps(offsets, out, 4), _mm512_loadu_ps(in + i));
+            _mm512_i32scatter_ps(out, offsets, sum, 4); }
+        else {
+            __m256i low = _mm512_castsi512_si256(offsets), high = _mm512_extracti64x4_epi64(offsets, 1);
+            __m512d a = _mm512_add_pd(_mm512_i32gather_pd(low, out, 8), _mm512_loadu_pd(in + i));
+            __m512d b = _mm512_add_pd(_mm512_i32gather_pd(high, out, 8), _mm512_loadu_pd(in + i + 8));
+            _mm512_i32scatter_pd(out, low, a, 8);
+            _mm512_i32scatter_pd(out, high, b, 8); }}
+    scatterAddScalar(n - i, in + i, index + i, step, 1, out + i); }
+#endif
+
+template <typename T, typename I> void scatterAddRun (size_t n, const T* in, const I* index, ptrdiff_t step, ptrdiff_t unit,
+                                                      T* out, size_t span) {
+    #ifdef SIMD_X86
+    if (unit == 1 && n >= SIMD_MIN_LENGTH && (std::is_same<T, float>::value || std::is_same<T, double>::value) &&
+        (sizeof(I) == 4 || sizeof(I) == 8) && span <= (size_t) std::numeric_limits<int32_t>::max() &&
+        simdLevel() == SimdLevel::AVX512)
+        return scatterAddAVX512(n, in, index, step, out);
+    #endif
+    scatterAddScalar(n, in, index, step, unit, out); }
+
+
+// Whole ops. Each one returns the number of indices that were out of range.
+
+// out[o, i, k] = in[o, index[i], k], for an [outer, size, inner] `in`, a list
+// of `n` indices, and an [outer, n, inner] `out`
+template <typename T, typename I> size_t indexSelectForward (const T* in, const I* index, T* out,
+                                                             size_t outer, size_t size, size_t n, size_t inner) {
+    let sum = [] (size_t a, size_t b) { return a + b; };
+    if (inner > 1)
+        return parallelReduce<size_t>(outer * n, std::max((size_t) 1, PARALLEL_GRAIN / inner), [&] (size_t begin, size_t end) {
+            size_t invalid = 0;
+            for (size_t r = begin, o = begin / n, i = begin % n; r < end; r++) {
+                size_t row = (size_t) index[i];
+                if (row >= size)
+                    invalid++;
+                else std::copy(in + (o * size + row) * inner, in + (o * size + row + 1) * inner, out + r * inner);
+                if (++i == n)
+                    i = 0, o++; }
+            return invalid; }, sum);
+
+    return parallelReduce<size_t>(outer * n, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        size_t invalid = 0;
+        for (size_t e = begin; e < end;) {
+            size_t o = e / n, i = e % n, length = std::min(n - i, end - e);
+            size_t count = invalidIndices(length, index + i, size);
+            if (count)
+                invalid += count;
+            else gatherRun(length, in + o * size, index + i, 1, 0, out + e, size);
+            e += length; }
+        return invalid; }, sum); }
+
+// out[o, i, k] = in[o, index[o, i, k], k], for an [outer, size, inner] `in`, and
+// an `index` and `out` that are both [outer, n, inner]
+template <typename T, typename I> size_t gatherForward (const T* in, const I* index, T* out,
+                                                        size_t outer, size_t size, size_t n, size_t inner) {
+    size_t run = inner > 1 ? inner : n;
+    ptrdiff_t step = inner > 1 ? inner : 1, unit = inner > 1 ? 1 : 0;
+    return parallelReduce<size_t>(outer * n * inner, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+        size_t invalid = 0;
+        for (size_t e = begin; e < end;) {
+            size_t j = e % run, length = std::min(run - j, end - e);
+            size_t o = inner > 1 ? e / inner / n : e / n;
+            size_t count = invalidIndices(length, index + e, size);
+            if (count)
+                invalid += count;
+            else gatherRun(length, in + o * size * inner + j * unit, index + e, step, unit, out + e, size * inner);
+            e += length; }
+        return invalid; }, [] (size_t a, size_t b) { return a + b; }); }
+
+// out[o, index[o, i, k], k] += in[o, i, k], for an [outer, size, inner] `out`,
+// and an `index` and `in` that are both [outer, n, inner]. Each thread takes
+// some columns of some of the outer slices, and adds up their elements in the
+// order of the indices, so the result doesn't depend on the number of threads.
+template <typename T, typename I> size_t scatterAddForward (const T* in, const I* index, T* out,
+                                                            size_t outer, size_t size, size_t n, size_t inner) {
+    size_t threads = getNumThreads();
+    size_t columns = std::min(inner, std::max((size_t) INDEX_SCATTER_COLUMNS, (inner + threads - 1) / threads));
+    size_t blocks = (inner + columns - 1) / columns;
+    size_t grain = std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n * columns));
+    return parallelReduce<size_t>(outer * blocks, grain, [&] (size_t begin, size_t end) {
+        size_t invalid = 0;
+        for (size_t item = begin; item < end; item++) {
+            size_t o = item / blocks, k0 = item % blocks * columns, k1 = std::min(inner, k0 + columns);
+            T* slice = out + o * size * inner;
+            if (inner == 1) {
+                size_t count = invalidIndices(n, index + o * n, size);
+                if (count)
+                    invalid += count;
+                else scatterAddRun(n, in + o * n, index + o * n, 1, 0, slice, size);
+                continue; }
+
+            for (size_t i = 0; i < n; i++) {
+                size_t e = (o * n + i) * inner + k0;
+                size_t count = invalidIndices(k1 - k0, index + e, size);
+                if (count)
+                    invalid += count;
+                else scatterAddRun(k1 - k0, in + e, index + e, inner, 1, slice + k0, size * inner); }}
+        return invalid; }, [] (size_t a, size_t b) { return a + b; }); }
+
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef __ITERATOR__
+#define __ITERATOR__
+
+#include "core.cpp"
+#include "shape.cpp"
+
+
+// Iterator for walking one or more strided buffers over a common shape. Rather
+// than recovering every operand's offset from a flat index with a div/mod per
+// dimension, we track the current position and the offset into each operand and
+// carry any overflows from one dimension into the next, the same way that
+// Tensor::toString does. Before iterating, dimensions of size 1 are dropped and
+// neighbouring dimensions that are contiguous in every operand (including
+// dimensions that are broadcast in every operand) are merged, so we only loop
+// over as many dimensions as the layouts actually require. The innermost
+// dimension is left to the caller as a tight linear loop:
+//
+//     for (let it = StridedIterator(shape, { strideA, strideB }); !it.done(); it.next()) {
+//         T* a = dataA + it.offset[0];
+//         T* b = dataB + it.offset[1];
+//         for (size_t j = 0; j < it.size; j++)
+//             a[j * it.stride[0]] = b[j * it.stride[1]]; }
+//
+// An iterator can also be limited to a range of elements (in row-major order),
+// which is how we split an iteration between threads. In that case the first
+// and last rows may be partial, so `size` can be shorter than the row length.
+
+#define MAX_OPERANDS 16
+
+struct StridedIterator {
+    size_t operands;
+    size_t rank;                        // Number of outer dimensions, after collapsing
+    size_t size;                        // Length of the current run in the innermost dimension
+    size_t length;                      // Length of the innermost dimension
+    size_t column;                      // Position of the current run in the innermost dimension
+    size_t remaining;                   // Number of elements left, including the current run
+    ptrdiff_t stride[MAX_OPERANDS];     // Innermost stride for each operand
+    ptrdiff_t offset[MAX_OPERANDS];     // Current offset into each operand
+    size_t shape[MAX_DIMENSIONS];       // Outer dimensions, after collapsing
+    size_t position[MAX_DIMENSIONS];    // Current position in the outer dimensions
+    ptrdiff_t strides[MAX_DIMENSIONS * MAX_OPERANDS];   // Outer strides, `operands` entries per dimension
+    bool finished;
+
+    // Constructors
+
+    StridedIterator (const Shape& shape, std::initializer_list<Shape> strides) :
+        StridedIterator(shape, strides.begin(), strides.size()) { }
+    StridedIterator (const Shape& shape, const List<Shape>& strides) :
+        StridedIterator(shape, strides.data(), strides.size()) { }
+
+    StridedIterator (const Shape& shape, const Shape* strides, size_t operands) :
+        operands(operands), rank(0), size(1), length(1), column(0), remaining(0), finished(false)
+    {
+        if (this->operands == 0 || this->operands > MAX_OPERANDS)
+            throw "StridedIterator - Invalid number of operands";
+        for (size_t k = 0; k < this->operands; k++) {
+            if (strides[k].length != shape.length)
+                throw "StridedIterator - Stride doesn't have the same number of dimensions as the shape"; }
+
+        // Collapse the dimensions, from the outermost to the innermost. There are
+        // at most as many collapsed dimensions as there are in the shape.
+        size_t dims = 0;
+        for (size_t d = 0; d < shape.length; d++) {
+            if (shape[d] == 0) {
+                this->finished = true;
+                continue; }
+            if (shape[d] == 1)
+                continue;
+
+            ptrdiff_t* previous = dims > 0 ? &this->strides[(dims - 1) * this->operands] : NULL;
+            bool mergeable = dims > 0;
+            for (size_t k = 0; k < this->operands && mergeable; k++)
+                mergeable = previous[k] == (ptrdiff_t) strides[k][d] * shape[d];
+
+            if (mergeable) {
+                this->shape[dims - 1] *= shape[d];
+                for (size_t k = 0; k < this->operands; k++)
+                    previous[k] = strides[k][d]; }
+            else {
+                this->shape[dims] = shape[d];
+                for (size_t k = 0; k < this->operands; k++)
+                    this->strides[dims * this->operands + k] = strides[k][d];
+                dims++; }}
+
+        // Split off the innermost dimension
+        for (size_t k = 0; k < this->operands; k++) {
+            this->offset[k] = 0;
+            this->stride[k] = 0; }
+        if (dims > 0) {
+            dims--;
+            this->size = this->shape[dims];
+            for (size_t k = 0; k < this->operands; k++)
+                this->stride[k] = this->strides[dims * this->operands + k]; }
+
+        this->rank = dims;
+        std::fill(this->position, &this->position[this->rank], 0);
+        this->length = this->size;
+        this->remaining = this->finished ? 0 : this->size;
+        for (size_t d = 0; d < this->rank; d++)
+            this->remaining *= this->shape[d];
+    }
+
+
+    // Iteration methods
+
+    bool done () const { return this->finished; }
+
+    // Limit the iteration to the elements [begin, end), and move to the first one
+    void limit (size_t begin, size_t end) {
+        size_t total = this->finished ? 0 : this->remaining;
+        end = std::min(end, total);
+        if (begin >= end) {
+            this->remaining = 0;
+            this->finished = true;
+            return; }
+
+        size_t row = begin / this->length;
+        this->column = begin % this->length;
+        for (size_t k = 0; k < this->operands; k++)
+            this->offset[k] = this->column * this->stride[k];
+        for (int d = (int) this->rank - 1; d >= 0; d--) {
+            this->position[d] = row % this->shape[d];
+            row /= this->shape[d];
+            for (size_t k = 0; k < this->operands; k++)
+                this->offset[k] += this->position[d] * this->strides[d * this->operands + k]; }
+
+        this->remaining = end - begin;
+        this->size = std::min(this->length - this->column, this->remaining);
+        this->finished = false; }
+
+    // Advance to the start of the next run
+    void next () {
+        this->remaining -= this->size;
+        if (this->remaining == 0) {
+            this->finished = true;
+            return; }
+
+        for (size_t k = 0; k < this->operands; k++)
+            this->offset[k] -= this->column * this->stride[k];
+        this->column = 0;
+        this->size = std::min(this->length, this->remaining);
+
+        for (int d = (int) this->rank - 1; d >= 0; d--) {
+            const ptrdiff_t* strides = &this->strides[d * this->operands];
+            this->position[d] += 1;
+            for (size_t k = 0; k < this->operands; k++)
+                this->offset[k] += strides[k];
+            if (this->position[d] < this->shape[d])
+                return;
+
+            for (size_t k = 0; k < this->operands; k++)
+                this->offset[k] -= strides[k] * this->shape[d];
+            this->position[d] = 0; }
+
+        this->finished = true; }};
+
+
+
+// Helper functions
+
+// Returns the strides for walking a tensor with the given shape and stride over
+// `outputShape`, which it gets broadcast to. Broadcasting aligns dimensions from
+// the left, so any trailing dimensions the tensor doesn't have, and any dimensions
+// where it has size 1, get a stride of 0.
+Shape getBroadcastedStride (const Shape& shape, const Shape& stride, const Shape& outputShape) {
+    Shape strides;
+    strides.resize(outputShape.length);
+    for (size_t d = 0; d < outputShape.length; d++)
+        strides.dimensions[d] = d < shape.length && shape.dimensions[d] > 1 ? stride.dimensions[d] : 0;
+    return strides; }
+
+
+#endif
@@ -0,0 +1,477 @@
+#ifndef __MATH__
+#define __MATH__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+
+// Branch-free approximations of the math functions, written on the bits of the
+// floats rather than with the usual branches and lookup tables, so that the
+// compiler can vectorize the loops that call them (libm's versions are opaque
+// function calls, and have to check whether they should set errno). Each one is
+// accurate to within a few ulps over the inputs that it's meant for.
+
+// Floating point layouts, and the number of series terms needed for each type's
+// precision
+template <typename T> struct FloatTraits;
+template <> struct FloatTraits<float> {
+    typedef uint32_t Bits;
+    typedef int32_t SignedBits;
+    static const int mantissa = 23, bias = 127, logTerms = 5, trigTerms = 5, expTerms = 7, newtonSteps = 3;
+    static const Bits rsqrtMagic = 0x5F3759DFu; };
+template <> struct FloatTraits<double> {
+    typedef uint64_t Bits;
+    typedef int64_t SignedBits;
+    static const int mantissa = 52, bias = 1023, logTerms = 11, trigTerms = 9, expTerms = 13, newtonSteps = 4;
+    static const Bits rsqrtMagic = 0x5FE6EB50C7B537A9ull; };
+
+// Builds a float from raw bits, and back
+template <typename T> SIMD_INLINE T fromBits (typename FloatTraits<T>::Bits bits) {
+    T x;
+    std::memcpy(&x, &bits, sizeof(T));
+    return x; }
+template <typename T> SIMD_INLINE typename FloatTraits<T>::Bits toBits (T x) {
+    typename FloatTraits<T>::Bits bits;
+    std::memcpy(&bits, &x, sizeof(T));
+    return bits; }
+
+// Returns `a` if `condition` holds and `b` otherwise. GCC turns a plain select
+// between floats back into a branch when the result feeds into more floating
+// point math (since the math might trap), which stops the loop from being
+// vectorized, so we select between the bits instead.
+template <typename T> SIMD_INLINE T bitSelect (bool condition, T a, T b) {
+    typedef typename FloatTraits<T>::Bits Bits;
+    Bits mask = (Bits) 0 - (Bits) condition;
+    return fromBits<T>((toBits(a) & mask) | (toBits(b) & ~mask)); }
+
+// Returns the integer `n`, which has to be less than 2^mantissa, as a float. We
+// do this by putting it in the mantissa of 2^mantissa and then subtracting that,
+// since converting a 64-bit integer to a double can't be vectorized before
+// AVX-512DQ.
+template <typename T> SIMD_INLINE T floatFromBits (typename FloatTraits<T>::Bits n) {
+    typedef FloatTraits<T> F;
+    typename F::Bits exponent = (typename F::Bits) (F::bias + F::mantissa) << F::mantissa;
+    return fromBits<T>(exponent | n) - fromBits<T>(exponent); }
+
+// Natural log of a positive, normal `x`. We split x into 2^e * m with m in
+// [sqrt(1/2), sqrt(2)), and then log(m) = 2 atanh((m - 1) / (m + 1)), whose series
+// converges quickly since the argument is at most 0.172.
+template <typename T> SIMD_INLINE T fastLog (T x) {
+    typedef FloatTraits<T> F;
+    typedef typename F::Bits Bits;
+    Bits bits = toBits(x), one = (Bits) F::bias << F::mantissa, mask = ((Bits) 1 << F::mantissa) - 1;
+
+    // Mantissas above sqrt(2) get halved, and the exponent bumped to make up for
+    // it. (This is done on the bits, since GCC won't vectorize a branch that does
+    // floating point math, and turns selects between floats back into branches.)
+    Bits big = (bits & mask) > (toBits((T) 1.41421356237309504880) & mask);
+    T e = floatFromBits<T>((bits >> F::mantissa) + big) - F::bias;
+    T m = fromBits<T>((bits & mask) | (one - (big << F::mantissa)));
+
+    T s = (m - 1) / (m + 1), s2 = s * s;
+    T p = (T) 1 / (2 * F::logTerms - 1);
+    for (int k = F::logTerms - 1; k > 0; k--)
+        p = p * s2 + (T) 1 / (2 * k - 1);
+    return e * (T) 0.693147180559945309417 + 2 * s * p; }
+
+// Square root of a non-negative `x`, from Newton's method on the reciprocal square
+// root. (std::sqrt has to check whether it should set errno, which stops the
+// loops that call it from being vectorized.)
+template <typename T> SIMD_INLINE T fastSqrt (T x) {
+    typedef FloatTraits<T> F;
+    T r = fromBits<T>(F::rsqrtMagic - (toBits(x) >> 1));
+    for (int k = 0; k < F::newtonSteps; k++)
+        r = r * ((T) 1.5 - (T) 0.5 * x * r * r);
+    return x * r; }
+
+// Sine and cosine of 2 pi u for `u` in [0, 1). We reduce to an angle in
+// [-pi/4, pi/4] plus a number of quarter turns, where the Taylor series are
+// accurate. Adding 1.5 * 2^mantissa rounds u * 4 to an integer, which leaves the
+// number of quarter turns in the low bits of the sum.
+template <typename T> SIMD_INLINE void fastSinCos (T u, T& sine, T& cosine) {
+    typedef FloatTraits<T> F;
+    const T shift = (T) 1.5 * ((typename F::Bits) 1 << F::mantissa);
+    T rounded = u * 4 + shift;
+    typename F::Bits q = toBits(rounded);
+    T x = (u - (rounded - shift) * (T) 0.25) * (T) 6.28318530717958647693, x2 = x * x;
+
+    T s = 1, c = 1;
+    for (int k = F::trigTerms - 1; k > 0; k--) {
+        s = 1 - s * x2 / (T) ((2 * k) * (2 * k + 1));
+        c = 1 - c * x2 / (T) ((2 * k - 1) * (2 * k)); }
+    s *= x;
+
+    // Rotate by the quarter turns: odd ones swap sine and cosine, and the signs
+    // follow the quadrant, so we flip them by moving bit 1 of q (or of q + 1)
+    // into the sign bit
+    const int top = 8 * sizeof(T) - 2;
+    bool odd = q & 1;
+    sine = fromBits<T>(toBits(odd ? c : s) ^ ((q & 2) << top));
+    cosine = fromBits<T>(toBits(odd ? s : c) ^ (((q + 1) & 2) << top)); }
+
+
+// Vector math. These work on whole vector registers, for kernels that are
+// written with the vector types from simd.cpp, and the same functions with a
+// single lane are the scalar versions. Special values (zeros, infinities, NaNs
+// and subnormals) are handled with selects at the end, which the vectors turn
+// into blends. The error bounds below are the largest errors we measured over
+// the whole range of each function, against long double references.
+
+// Vectors of floats, and of their bits. With `Bytes` equal to sizeof(T), these
+// are vectors with a single lane.
+template <typename T, size_t Bytes> struct MathVector {
+    typedef typename SimdVector<T, Bytes>::type Float;
+    typedef typename FloatTraits<T>::Bits Bits __attribute__((vector_size(Bytes)));
+    typedef typename FloatTraits<T>::SignedBits SignedBits __attribute__((vector_size(Bytes)));
+
+    static SIMD_INLINE Float broadcast (T x) { return SimdVector<T, Bytes>::broadcast(x); }
+    static SIMD_INLINE Float abs (const Float& x) { return (Float) ((Bits) x & ~signBit()); }
+    static SIMD_INLINE typename FloatTraits<T>::Bits signBit () { return (typename FloatTraits<T>::Bits) 1 << (8 * sizeof(T) - 1); }};
+
+// Whether unary ops pick their fast, less accurate versions (see the ops below)
+enum class MathMode { Accurate, Fast };
+
+constexpr double inverseFactorial (int k) {
+    return k == 0 ? 1 : inverseFactorial(k - 1) / k; }
+
+struct ExpCoefficients { static constexpr double at (int k) { return inverseFactorial(k); } };
+struct LogCoefficients { static constexpr double at (int k) { return 1.0 / (2 * k + 3); } };
+
+// The polynomial with coefficients C::at(i) through C::at(n), in Horner form. The
+// recursion happens at compile time, so the coefficients are constants.
+template <typename T, typename C, int i, int n> struct Polynomial {
+    template <typename V> static SIMD_INLINE V evaluate (const V& x) {
+        return (T) C::at(i) + x * Polynomial<T, C, i + 1, n>::evaluate(x); }};
+
+template <typename T, typename C, int n> struct Polynomial<T, C, n, n> {
+    template <typename V> static SIMD_INLINE V evaluate (const V&) {
+        return V() + (T) C::at(n); }};
+
+// Splits x - correction into k log(2) + r, with k = round(x / log(2)) and
+// |r| <= log(2) / 2. Like in fastSinCos, adding 1.5 * 2^mantissa rounds x / log(2)
+// to an integer and leaves k in the low bits. log(2) is split into a high part
+// with enough trailing zeros that k * high is exact, and a low part.
+template <typename T, size_t Bytes> SIMD_INLINE
+void expReduction (const typename MathVector<T, Bytes>::Float& x, const typename MathVector<T, Bytes>::Float& correction,
+                   typename MathVector<T, Bytes>::SignedBits& k, typename MathVector<T, Bytes>::Float& r) {
+    typedef MathVector<T, Bytes> M;
+    const T ln2High = sizeof(T) > 4 ? 6.93147180369123816490e-01 : 0.693145751953125;
+    const T ln2Low = sizeof(T) > 4 ? 1.90821492927058770002e-10 : 1.428606765330187e-06;
+    const typename M::Float shift = M::broadcast((T) 1.5 * ((typename FloatTraits<T>::Bits) 1 << FloatTraits<T>::mantissa));
+    typename M::Float rounded = x * (T) 1.44269504088896340736 + shift;
+    typename M::Float kf = rounded - shift;
+    k = (typename M::SignedBits) rounded - (typename M::SignedBits) shift;
+    r = x - kf * ln2High - kf * ln2Low - correction; }
+
+// e^(x - correction), where `correction` is much smaller than x (it lets callers
+// pass in the rounding error of x), from e^x = 2^k e^r and the Taylor series
+// for e^r, which converges quickly for |r| <= log(2) / 2. We build 2^k in two
+// halves, so that both halves are normal numbers even when 2^k overflows or is
+// subnormal, and the final multiply rounds the result to infinity, a subnormal
+// or zero just like the exact value would. Clamping x to a bit past those
+// limits keeps k in range without any other special cases. Accurate to 1.2 ulps.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float expVector (const typename MathVector<T, Bytes>::Float& value,
+                                                const typename MathVector<T, Bytes>::Float& correction) {
+    typedef FloatTraits<T> F;
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    typedef typename M::Bits Bits;
+    const T low = sizeof(T) > 4 ? -746 : -104, high = sizeof(T) > 4 ? 710 : 89;
+    Float x = value < low ? M::broadcast(low) : value;
+    x = x > high ? M::broadcast(high) : x;
+
+    typename M::SignedBits k, half;
+    Float r;
+    expReduction<T, Bytes>(x, correction, k, r);
+    Float p = Polynomial<T, ExpCoefficients, 0, F::expTerms>::evaluate(r);
+    half = k >> 1;
+    Float a = (Float) ((Bits) (half + F::bias) << F::mantissa);
+    Float b = (Float) ((Bits) (k - half + F::bias) << F::mantissa);
+    return p * a * b; }
+
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float expVector (const typename MathVector<T, Bytes>::Float& x) {
+    return expVector<T, Bytes>(x, typename MathVector<T, Bytes>::Float()); }
+
+template <typename T> SIMD_INLINE T fastExp (T x) {
+    typename MathVector<T, sizeof(T)>::Float v = { x };
+    return expVector<T, sizeof(T)>(v)[0]; }
+
+// Natural log, like fastLog, but with the exponent times log(2) split like in
+// expReduction, and with subnormals scaled up to normal numbers first.
+// Accurate to 2 ulps.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float logVector (const typename MathVector<T, Bytes>::Float& x) {
+    typedef FloatTraits<T> F;
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    typedef typename M::Bits Bits;
+    typedef typename F::Bits Bit;
+    const T ln2High = sizeof(T) > 4 ? 6.93147180369123816490e-01 : 0.693145751953125;
+    const T ln2Low = sizeof(T) > 4 ? 1.90821492927058770002e-10 : 1.428606765330187e-06;
+    const Bit one = (Bit) F::bias << F::mantissa, mask = ((Bit) 1 << F::mantissa) - 1;
+    const Bit exponent = (Bit) (F::bias + F::mantissa) << F::mantissa;
+    const T minimum = std::numeric_limits<T>::min(), scale = (T) ((Bit) 1 << (F::mantissa + 1));
+
+    Float subnormal = x < minimum ? M::broadcast(F::mantissa + 1) : M::broadcast(0);
+    Bits bits = (Bits) (x < minimum ? x * scale : x);
+    Bits big = (Bits) ((bits & mask) > (toBits((T) 1.41421356237309504880) & mask)) & 1;
+    Float e = ((Float) (((bits >> F::mantissa) + big) | exponent) - fromBits<T>(exponent)) - (T) F::bias - subnormal;
+    Float m = (Float) ((bits & mask) | (one - (big << F::mantissa)));
+
+    Float s = (m - 1) / (m + 1), s2 = s * s;
+    Float q = Polynomial<T, LogCoefficients, 0, F::logTerms - 2>::evaluate(s2);
+    Float result = e * ln2High + (2 * s + (e * ln2Low + 2 * s * s2 * q));
+
+    result = x == std::numeric_limits<T>::infinity() ? x : result;
+    result = x == 0 ? M::broadcast(-std::numeric_limits<T>::infinity()) : result;
+    return x >= 0 ? result : M::broadcast(std::numeric_limits<T>::quiet_NaN()); }
+
+// Square root, like fastSqrt, plus one last Newton step on the square root
+// itself, with subnormals scaled up to normal numbers first. Accurate to 0.75 ulps.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float sqrtVector (const typename MathVector<T, Bytes>::Float& x) {
+    typedef FloatTraits<T> F;
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    typedef typename M::Bits Bits;
+    const int half = (F::mantissa + 1) / 2;
+    const T minimum = std::numeric_limits<T>::min();
+    const T scale = (T) ((typename F::Bits) 1 << (2 * half)), unscale = 1 / (T) ((typename F::Bits) 1 << half);
+
+    Float y = x < minimum ? x * scale : x;
+    Float r = (Float) (F::rsqrtMagic - ((Bits) y >> 1));
+    for (int k = 0; k < F::newtonSteps; k++)
+        r = r * ((T) 1.5 - (T) 0.5 * y * r * r);
+    Float s = y * r;
+    s = s + (T) 0.5 * r * (y - s * s);
+
+    s = x < minimum ? s * unscale : s;
+    s = x == std::numeric_limits<T>::infinity() ? x : s;
+    return x >= 0 ? s : M::broadcast(std::numeric_limits<T>::quiet_NaN()); }
+
+// Hyperbolic tangent, from tanh |x| = (e^2|x| - 1) / (e^2|x| + 1), where we compute
+// e^2|x| - 1 = 2^k (e^r - 1) + 2^k - 1 without cancelling anything, by leaving the
+// 1 out of the series for e^r. Beyond 9.1 (or 19.1 for doubles), tanh rounds to 1.
+// Accurate to 3.2 ulps.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float tanhVector (const typename MathVector<T, Bytes>::Float& x) {
+    typedef FloatTraits<T> F;
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    typedef typename M::Bits Bits;
+    const T limit = sizeof(T) > 4 ? 19.1 : 9.1;
+    Float a = M::abs(x);
+    a = a > limit ? M::broadcast(limit) : a;
+
+    typename M::SignedBits k;
+    Float r;
+    expReduction<T, Bytes>(2 * a, Float(), k, r);
+    Float q = r * Polynomial<T, ExpCoefficients, 1, F::expTerms>::evaluate(r);
+    Float scale = (Float) ((Bits) (k + F::bias) << F::mantissa);
+    Float e = q * scale + (scale - 1);
+    return (Float) ((Bits) (e / (e + 2)) | ((Bits) x & M::signBit())); }
+
+// The fast tanh, which is the [7/6] Padé approximant of tanh, clamped where it
+// reaches 1. Within 7.2e-5 (relative).
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float fastTanhVector (const typename MathVector<T, Bytes>::Float& x) {
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    Float y = x > (T) 4.8 ? M::broadcast(4.8) : x;
+    y = y < (T) -4.8 ? M::broadcast(-4.8) : y;
+    Float y2 = y * y;
+    Float p = y * (135135 + y2 * (17325 + y2 * (378 + y2)));
+    Float q = 135135 + y2 * (62370 + y2 * (3150 + y2 * 28));
+    return p / q; }
+
+// Logistic sigmoid, as 1 / (1 + e^-x) for x >= 0, and e^x / (1 + e^x) otherwise,
+// which is accurate for large negative x too. Accurate to 2.7 ulps.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float sigmoidVector (const typename MathVector<T, Bytes>::Float& x) {
+    typedef typename MathVector<T, Bytes>::Float Float;
+    Float e = expVector<T, Bytes>(-MathVector<T, Bytes>::abs(x));
+    Float s = 1 / (1 + e);
+    return x >= 0 ? s : e * s; }
+
+// The fast sigmoid, from the fast tanh. Within 3.7e-5 (absolute).
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float fastSigmoidVector (const typename MathVector<T, Bytes>::Float& x) {
+    return (T) 0.5 + (T) 0.5 * fastTanhVector<T, Bytes>((T) 0.5 * x); }
+
+// Coefficients of Weideman's series for erfcx(y) = e^(y^2) erfc(y), from "Computation
+// of the Complex Error Function" (SIAM J. Numer. Anal., 1994), for y >= 0:
+//
+//     erfcx(y) = 2 p(z) / (L + y)^2 + 1 / (sqrt(pi) (L + y)),  z = (L - y) / (L + y)
+//
+// where p is a polynomial with these coefficients (highest degree first). With
+// 18 terms it's accurate to 3e-10 (relative), and with 40 terms to 6e-17.
+const float ERFCX_FLOAT[] = {
+    -3.18693212e-07f, 3.20361990e-07f, 1.98248095e-06f, -1.44503744e-06f, -1.37554282e-05f, -1.01066441e-07f,
+    9.87240264e-05f, 1.30102036e-04f, -5.70917264e-04f, -2.32408703e-03f, -9.91868382e-04f, 1.97733410e-02f,
+    9.47977192e-02f, 2.71656224e-01f, 5.85492842e-01f, 1.02234234e+00f, 1.49675866e+00f, 1.87040386e+00f };
+const double ERFCX_DOUBLE[] = {
+    -1.8963879940181163e-15, 1.1307862740790597e-15, 1.1358766032788792e-14, -5.4097243178119481e-15,
+    -7.0742703687197428e-14, 1.3725286640738077e-14, 4.5329571801873414e-13, 1.2031232943503917e-13,
+    -2.9076872637076590e-12, -2.7276035759454115e-12, 1.7714491164092308e-11, 3.4727270028806628e-11,
+    -9.0551243321071104e-11, -3.5632339998514437e-10, 2.1086006006033366e-10, 3.0177805405637304e-09,
+    3.2497465162015932e-09, -1.8315616783079122e-08, -6.3517734850840682e-08, 1.4198642400990898e-08,
+    5.9121369519084255e-07, 1.4835661132201004e-06, -1.0660138984937718e-06, -1.8007447144750865e-05,
+    -5.5913092642483194e-05, -3.9393631454895872e-05, 4.3980701598696580e-04, 2.7054056330737914e-03,
+    1.0048186242783425e-02, 2.9202916471241867e-02, 7.1823617790743370e-02, 1.5504263802479494e-01,
+    2.9989437996150063e-01, 5.2665289882770864e-01, 8.4721745765938182e-01, 1.2563815675765132e+00,
+    1.7253830848179778e+00, 2.2015137948783119e+00, 2.6160541527618604e+00, 2.8996245093897052e+00 };
+
+template <typename T> struct Erfcx;
+template <> struct Erfcx<float> {
+    static const int terms = 18;
+    static const float* coefficients () { return ERFCX_FLOAT; }};
+template <> struct Erfcx<double> {
+    static const int terms = 40;
+    static const double* coefficients () { return ERFCX_DOUBLE; }};
+
+// The standard normal distribution's CDF and density at x, with the CDF from
+// erfc(|x| / sqrt(2)) = e^(-x^2 / 2) erfcx(|x| / sqrt(2)). To get e^(-x^2 / 2)
+// without the rounding error of x^2 (which e^ would blow up for large x), we
+// split |x| into a high half whose square is exact and a low half, and hand the
+// rest of the square to expVector as its correction. Beyond |x| = 40, the
+// exponential underflows.
+template <typename T, size_t Bytes> SIMD_INLINE
+void normalVector (const typename MathVector<T, Bytes>::Float& x,
+                   typename MathVector<T, Bytes>::Float& cdf, typename MathVector<T, Bytes>::Float& density) {
+    typedef FloatTraits<T> F;
+    typedef MathVector<T, Bytes> M;
+    typedef typename M::Float Float;
+    typedef typename M::Bits Bits;
+    const T L = sizeof(T) > 4 ? 5.3182958969449886 : 3.5676213450081632;
+    const T* coefficients = Erfcx<T>::coefficients();
+    const typename F::Bits split = ~(((typename F::Bits) 1 << ((F::mantissa + 2) / 2)) - 1);
+
+    Float a = M::abs(x);
+    a = a > (T) 40 ? M::broadcast(40) : a;
+    Float high = (Float) ((Bits) a & split), low = a - high;
+    Float e = expVector<T, Bytes>((T) -0.5 * high * high, (T) 0.5 * low * (2 * high + low));
+
+    Float y = a * (T) 0.70710678118654752440;
+    Float z = (L - y) / (L + y), p = M::broadcast(coefficients[0]);
+    #pragma GCC unroll 40  // Otherwise the loop keeps reloading the coefficients
+    for (int i = 1; i < Erfcx<T>::terms; i++)
+        p = p * z + coefficients[i];
+    Float tail = e * ((p / (L + y) + (T) 0.28209479177387814347) / (L + y));
+
+    cdf = x < 0 ? tail : 1 - tail;
+    density = e * (T) 0.39894228040143267794; }
+
+// GELU, x times the normal CDF at x. Accurate to 10 ulps where the result is a
+// normal number (most of the error is in erfcx's polynomial), and its derivative
+// to 3 ulps of 1 (absolute).
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float geluVector (const typename MathVector<T, Bytes>::Float& x) {
+    typename MathVector<T, Bytes>::Float cdf, density;
+    normalVector<T, Bytes>(x, cdf, density);
+    return x * cdf; }
+
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float geluGradientVector (const typename MathVector<T, Bytes>::Float& x) {
+    typename MathVector<T, Bytes>::Float cdf, density;
+    normalVector<T, Bytes>(x, cdf, density);
+    return cdf + x * density; }
+
+// The fast GELU, which is the usual tanh approximation (with the fast tanh),
+// x / 2 (1 + tanh(sqrt(2 / pi) (x + 0.044715 x^3))). Within 5e-4 of GELU, and
+// its derivative within 0.013 (absolute), which is mostly the approximation.
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float fastGeluVector (const typename MathVector<T, Bytes>::Float& x) {
+    return (T) 0.5 * x * (1 + fastTanhVector<T, Bytes>((T) 0.79788456080286535588 * (x + (T) 0.044715 * x * x * x))); }
+
+template <typename T, size_t Bytes> SIMD_INLINE
+typename MathVector<T, Bytes>::Float fastGeluGradientVector (const typename MathVector<T, Bytes>::Float& x) {
+    typename MathVector<T, Bytes>::Float t = fastTanhVector<T, Bytes>((T) 0.79788456080286535588 * (x + (T) 0.044715 * x * x * x));
+    return (T) 0.5 * (1 + t) + (T) 0.5 * x * (1 - t * t) * (T) 0.79788456080286535588 * (1 + (T) 0.134145 * x * x); }
+
+
+// Unary ops. Each one applies its function to a vector register of any width
+// (one lane included), and names the op to use in the fast mode, which is the
+// op itself unless it has a faster version. ReLU and its step function work on
+// integers too.
+
+#define mathOp(name, fast, function)                                            \
+struct name {                                                                   \
+    typedef fast Fast;                                                          \
+    template <typename T, size_t Bytes> static SIMD_INLINE                      \
+    typename SimdVector<T, Bytes>::type apply (const typename SimdVector<T, Bytes>::type& x) { \
+        return function<T, Bytes>(x); }};
+
+template <typename T, size_t Bytes> SIMD_INLINE typename SimdVector<T, Bytes>::type reluVector (const typename SimdVector<T, Bytes>::type& x) {
+    return x < 0 ? SimdVector<T, Bytes>::broadcast(0) : x; }
+template <typename T, size_t Bytes> SIMD_INLINE typename SimdVector<T, Bytes>::type stepVector (const typename SimdVector<T, Bytes>::type& x) {
+    return x > 0 ? SimdVector<T, Bytes>::broadcast(1) : SimdVector<T, Bytes>::broadcast(0); }
+
+mathOp(ExpOp, ExpOp, expVector);
+mathOp(LogOp, LogOp, logVector);
+mathOp(SqrtOp, SqrtOp, sqrtVector);
+mathOp(FastTanhOp, FastTanhOp, fastTanhVector);
+mathOp(TanhOp, FastTanhOp, tanhVector);
+mathOp(FastSigmoidOp, FastSigmoidOp, fastSigmoidVector);
+mathOp(SigmoidOp, FastSigmoidOp, sigmoidVector);
+mathOp(FastGeluOp, FastGeluOp, fastGeluVector);
+mathOp(GeluOp, FastGeluOp, geluVector);
+mathOp(FastGeluGradientOp, FastGeluGradientOp, fastGeluGradientVector);
+mathOp(GeluGradientOp, FastGeluGradientOp, geluGradientVector);
+mathOp(ReluOp, ReluOp, reluVector);
+mathOp(StepOp, StepOp, stepVector);
+#undef mathOp
+
+// out[i] = op(a[i]), with the leftover elements done one lane at a time
+template <typename T, size_t Bytes, typename Op> SIMD_INLINE void unaryKernel (size_t n, T* out, const T* a) {
+    typedef SimdVector<T, Bytes> V;
+    typedef SimdVector<T, sizeof(T)> S;
+    size_t i = 0;
+    for (; i + V::width <= n; i += V::width)
+        V::store(out + i, Op::template apply<T, Bytes>(V::load(a + i)));
+    for (; i < n; i++)
+        out[i] = Op::template apply<T, sizeof(T)>(S::load(a + i))[0]; }
+
+#define mathEntryPoints(suffix, isa, bytes)                                     \
+template <typename T, typename Op> __attribute__((target(isa)))                \
+void unary##suffix (size_t n, T* out, const T* a) {                             \
+    unaryKernel<T, bytes, Op>(n, out, a); }
+
+#ifdef SIMD_X86
+mathEntryPoints(SSE, "sse4.1", 16);
+mathEntryPoints(AVX2, "avx2", 32);
+mathEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+// Computes out[i] = op(a[i]) for contiguous `out` and `a`, which can be the same.
+// Unlike simdBinary, short arrays don't skip the dispatch, since the functions
+// are expensive enough to make up for it, and this way each element's result
+// doesn't depend on how long the array it's in is.
+template <typename T, typename Op> void simdUnary (size_t n, T* out, const T* a, std::true_type) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return unaryAVX512<T, Op>(n, out, a);
+        case SimdLevel::AVX2: return unaryAVX2<T, Op>(n, out, a);
+        case SimdLevel::SSE: return unarySSE<T, Op>(n, out, a);
+        default: break; }
+    #endif
+    unaryKernel<T, sizeof(T), Op>(n, out, a); }
+
+// Storage types get converted to floats a tile at a time, like in simdBinary
+template <typename T, typename Op> void simdUnary (size_t n, T* out, const T* a, std::false_type) {
+    float x[WIDEN_TILE];
+    for (size_t i = 0; i < n; i += WIDEN_TILE) {
+        size_t m = std::min((size_t) WIDEN_TILE, n - i);
+        convertToFloat(m, a + i, x);
+        simdUnary<float, Op>(m, x, x, std::true_type());
+        convertFromFloat(m, x, out + i); }}
+
+template <typename T, typename Op> void simdUnary (size_t n, T* out, const T* a) {
+    simdUnary<T, Op>(n, out, a, std::is_arithmetic<T>()); }
+
+
+#endif
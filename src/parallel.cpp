@@ -0,0 +1,252 @@
+#ifndef __PARALLEL__
+#define __PARALLEL__
+
+#include "core.cpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+
+// Process-wide thread pool, used to split the outer loops of tensor operations
+// across cores. Each worker owns a queue of tasks: it pushes and pops its own
+// tasks at the back, and when it runs out it steals from the front of the other
+// workers' queues, so a worker that finishes early picks up the slack from the
+// slower ones. The thread that calls `parallelFor` queues up the chunks of its
+// loop and then works through them alongside the workers until they're done.
+//
+// Nothing about a computation's result is allowed to depend on how many threads
+// there are, or on which thread runs which chunk. Elementwise ops get this for
+// free, and reductions get it by splitting their input into fixed-size blocks
+// and combining the partial results in a fixed order (see `parallelReduce`).
+
+// Loops with fewer iterations than this (in elements) run on the calling thread
+#define PARALLEL_GRAIN 32768
+
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    // Double-ended queue of tasks, kept in a ring buffer that only ever grows,
+    // so that once it's big enough, queueing tasks doesn't allocate anything
+    struct Queue {
+        std::mutex mutex;
+        List<Task> tasks;
+        size_t head, count;
+
+        Queue () : tasks(16), head(0), count(0) { }
+
+        bool empty () const { return this->count == 0; }
+
+        void pushBack (Task task) {
+            if (this->count == this->tasks.size()) {
+                List<Task> grown(2 * this->tasks.size());
+                for (size_t i = 0; i < this->count; i++)
+                    grown[i] = std::move(this->tasks[(this->head + i) % this->tasks.size()]);
+                this->tasks.swap(grown);
+                this->head = 0; }
+            this->tasks[(this->head + this->count++) % this->tasks.size()] = std::move(task); }
+
+        Task popBack () {
+            return std::move(this->tasks[(this->head + --this->count) % this->tasks.size()]); }
+
+        Task popFront () {
+            Task task = std::move(this->tasks[this->head]);
+            this->head = (this->head + 1) % this->tasks.size();
+            this->count--;
+            return task; }};
+
+    size_t threads;
+    List<Queue*> queues;
+    List<std::thread> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued;
+    bool stopping;
+
+    // Constructor. The calling thread counts as one of the threads, so we only
+    // start `threads - 1` workers.
+    ThreadPool (size_t threads) : threads(std::max((size_t) 1, threads)), queued(0), stopping(false) {
+        for (size_t i = 0; i < this->threads; i++)
+            this->queues.push_back(new Queue());
+        for (size_t i = 1; i < this->threads; i++)
+            this->workers.push_back(std::thread(&ThreadPool::work, this, i)); }
+
+    // Destructor
+    ~ThreadPool () {
+        {
+            std::lock_guard<std::mutex> lock(this->sleepMutex);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (std::thread& worker : this->workers)
+            worker.join();
+        for (Queue* queue : this->queues)
+            delete queue; }
+
+
+    // Task methods
+
+    // Pushes a task onto the back of queue `i`
+    void push (size_t i, Task task) {
+        {
+            std::lock_guard<std::mutex> lock(this->queues[i]->mutex);
+            this->queues[i]->pushBack(std::move(task));
+        }
+        this->queued++;
+
+        // Take the sleep lock so that we can't slip in between a worker checking
+        // for tasks and going to sleep
+        { std::lock_guard<std::mutex> lock(this->sleepMutex); }
+        this->wake.notify_one(); }
+
+    // Pops a task from the back of queue `i`, or steals one from the front of
+    // another queue if that's empty. Returns false if there's nothing to run.
+    bool pop (size_t i, Task& task) {
+        for (size_t k = 0; k < this->threads; k++) {
+            Queue* queue = this->queues[(i + k) % this->threads];
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            if (queue->empty())
+                continue;
+
+            task = k == 0 ? queue->popBack() : queue->popFront();
+            this->queued--;
+            return true; }
+
+        return false; }
+
+    // Main loop for worker `i`
+    void work (size_t i) {
+        inParallelRegion() = true;
+        Task task;
+        while (true) {
+            if (this->pop(i, task)) {
+                task();
+                continue; }
+
+            std::unique_lock<std::mutex> lock(this->sleepMutex);
+            this->wake.wait(lock, [this] { return this->stopping || this->queued > 0; });
+            if (this->stopping)
+                return; }}
+
+
+    // Helper methods
+
+    // Whether the current thread is already running a chunk of a parallel loop.
+    // Nested loops just run serially, since the outer loop is already using
+    // every thread.
+    static bool& inParallelRegion () {
+        static thread_local bool value = false;
+        return value; }};
+
+
+// Global pool
+
+size_t defaultNumThreads () {
+    const char* value = std::getenv("BTEN_NUM_THREADS");
+    if (value && std::atoi(value) > 0)
+        return std::atoi(value);
+    return std::max(1u, std::thread::hardware_concurrency()); }
+
+Reference<ThreadPool>& threadPool () {
+    static Reference<ThreadPool> pool(new ThreadPool(defaultNumThreads()));
+    return pool; }
+
+size_t getNumThreads () {
+    return threadPool()->threads; }
+
+// Replaces the global pool with one that has `threads` threads. This shouldn't
+// be called while a parallel loop is running.
+void setNumThreads (size_t threads) {
+    if (threads == 0)
+        threads = defaultNumThreads();
+    if (threads != getNumThreads())
+        threadPool().reset(new ThreadPool(threads)); }
+
+
+// Parallel loops
+
+// Calls `f(start, end)` on chunks covering [begin, end), spread across the pool.
+// Each chunk has at least `grain` iterations, and ranges with fewer than
+// `2 * grain` iterations, or calls from inside another parallel loop, just run
+// as a single chunk on the calling thread.
+template <typename F> void parallelFor (size_t begin, size_t end, size_t grain, const F& f) {
+    if (end <= begin)
+        return;
+
+    ThreadPool* pool = threadPool().get();
+    size_t length = end - begin;
+    grain = std::max((size_t) 1, grain);
+    if (pool->threads == 1 || length < 2 * grain || ThreadPool::inParallelRegion())
+        return f(begin, end);
+
+    // Use a few chunks per thread, so that stealing can even out the load
+    size_t chunks = std::min(length / grain, 4 * pool->threads);
+    size_t chunkSize = (length + chunks - 1) / chunks;
+    chunks = (length + chunkSize - 1) / chunkSize;
+
+    // The chunks share the loop's state through a pointer, so that each task
+    // only captures that and its index, which is small enough for std::function
+    // to store without allocating
+    struct Loop {
+        const F* f;
+        size_t begin, end, chunkSize;
+        std::atomic<size_t> remaining;
+        std::exception_ptr error;
+        std::mutex errorMutex; };
+
+    Loop loop;
+    loop.f = &f;
+    loop.begin = begin;
+    loop.end = end;
+    loop.chunkSize = chunkSize;
+    loop.remaining = chunks;
+
+    for (size_t i = 0; i < chunks; i++) {
+        pool->push(i % pool->threads, [&loop, i] {
+            size_t start = loop.begin + i * loop.chunkSize;
+            size_t stop = std::min(loop.end, start + loop.chunkSize);
+            try { (*loop.f)(start, stop); }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(loop.errorMutex);
+                if (!loop.error) loop.error = std::current_exception(); }
+            loop.remaining--; }); }
+
+    // Work through the queues on this thread too, until every chunk is done
+    ThreadPool::inParallelRegion() = true;
+    ThreadPool::Task task;
+    while (loop.remaining > 0) {
+        if (pool->pop(0, task)) task();
+        else std::this_thread::yield(); }
+    ThreadPool::inParallelRegion() = false;
+
+    if (loop.error)
+        std::rethrow_exception(loop.error); }
+
+// Deterministic parallel reduction over [0, length). The range is split into
+// fixed blocks of `block` iterations, regardless of the number of threads, and
+// `f(start, end)` reduces a single block. The partial results are then combined
+// pairwise in a fixed tree order with `combine(a, b)`, so the result is exactly
+// the same whether it runs on one thread or sixty-four.
+template <typename R, typename F, typename C>
+R parallelReduce (size_t length, size_t block, const F& f, const C& combine) {
+    block = std::max((size_t) 1, block);
+    size_t blocks = std::max((size_t) 1, (length + block - 1) / block);
+    if (blocks == 1)
+        return f(0, length);
+
+    List<R> partials(blocks);
+    parallelFor(0, blocks, 1, [&] (size_t start, size_t end) {
+        for (size_t i = start; i < end; i++)
+            partials[i] = f(i * block, std::min(length, (i + 1) * block)); });
+
+    for (size_t step = 1; step < blocks; step *= 2)
+        for (size_t i = 0; i + step < blocks; i += 2 * step)
+            partials[i] = combine(partials[i], partials[i + step]);
+    return partials[0]; }
+
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef __PROFILER__
+#define __PROFILER__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+
+// Op profiler. Building with BTEN_PROFILE defined turns on the hooks in the
+// tensor ops, reductions, views, factories and buffer constructors. Without it,
+// `profileOp` and `profileAllocation` expand to nothing, so the hooks can stay
+// in every build, and they cost nothing in the ones that don't profile. Even
+// with the hooks built in, nothing gets recorded until the profiler starts:
+//
+//     profiler().start();
+//     let output = model.forward(batch);
+//     profiler().stop();
+//     print(profiler().summary());
+//     profiler().writeTrace("trace.json");  // For chrome://tracing or Perfetto
+//
+// Each op that runs while the profiler is on records its wall time, the bytes
+// it reads and writes and the FLOPs it does (worked out from its shapes, so a
+// broadcast operand counts its own elements, not the output's), the buffers that
+// get allocated while it runs, and a signature with the shape and stride of its
+// inputs. The calls get added up by op and signature for the summary, and each
+// one is also kept as an event for the trace, up to PROFILE_EVENT_LIMIT of them.
+//
+// Ops that call other ops (like `reshape` calling `contiguous`) show up nested
+// in the trace, and each allocation goes to the innermost op that's running on
+// its thread. An op that runs inside another call of the same op (like `sum`
+// calling `sumOut`) doesn't get recorded separately. The times include the
+// nested ops, so the times in the summary add up to more than the total.
+
+#define PROFILE_EVENT_LIMIT (1 << 20)  // Most events that the profiler keeps for the trace
+
+#ifdef BTEN_PROFILE
+#define profileOp(name, signature, bytes, flops)                                \
+    ProfileScope profileScope(name);                                            \
+    if (profileScope.active()) profileScope.describe(signature, bytes, flops)
+#define profileAllocation(bytes) recordProfileAllocation(bytes)
+#else
+#define profileOp(name, signature, bytes, flops)
+#define profileAllocation(bytes)
+#endif
+
+
+// The totals for one op and signature
+struct ProfileRecord {
+    String name;
+    String signature;
+    size_t calls;
+    double seconds;
+    double minSeconds;
+    double maxSeconds;
+    double bytes;
+    double flops;
+    size_t allocations;
+    size_t allocatedBytes; };
+
+// One call of an op, for the trace
+struct ProfileEvent {
+    size_t record;
+    size_t thread;
+    double start;               // Seconds since the profiler was cleared
+    double seconds;
+    size_t allocations;
+    size_t allocatedBytes; };
+
+class Profiler {
+public:
+    std::atomic<bool> enabled;
+    std::mutex lock;
+    std::chrono::steady_clock::time_point origin;
+    std::unordered_map<String, size_t> keys;   // Index of each op and signature's record
+    List<ProfileRecord> records;
+    List<ProfileEvent> events;
+    size_t droppedEvents;                       // Events past PROFILE_EVENT_LIMIT
+    size_t allocations;                         // Every allocation, in an op or not
+    size_t allocatedBytes;
+
+    Profiler () : enabled(false), origin(std::chrono::steady_clock::now()), droppedEvents(0), allocations(0), allocatedBytes(0) { }
+
+
+    // Recording
+
+    void start () { this->enabled = true; }
+    void stop () { this->enabled = false; }
+
+    void clear () {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->keys.clear();
+        this->records.clear();
+        this->events.clear();
+        this->droppedEvents = this->allocations = this->allocatedBytes = 0;
+        this->origin = std::chrono::steady_clock::now(); }
+
+    double now () const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - this->origin).count(); }
+
+    void record (const char* name, const String& signature, size_t thread, double start, double seconds,
+                 double bytes, double flops, size_t allocations, size_t allocatedBytes) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        String key = String(name) + " " + signature;
+        let it = this->keys.find(key);
+        if (it == this->keys.end()) {
+            it = this->keys.insert({ key, this->records.size() }).first;
+            this->records.push_back({ name, signature, 0, 0, seconds, seconds, 0, 0, 0, 0 }); }
+
+        ProfileRecord& record = this->records[it->second];
+        record.calls++;
+        record.seconds += seconds;
+        record.minSeconds = std::min(record.minSeconds, seconds);
+        record.maxSeconds = std::max(record.maxSeconds, seconds);
+        record.bytes += bytes;
+        record.flops += flops;
+        record.allocations += allocations;
+        record.allocatedBytes += allocatedBytes;
+        if (this->events.size() < PROFILE_EVENT_LIMIT)
+            this->events.push_back({ it->second, thread, start, seconds, allocations, allocatedBytes });
+        else this->droppedEvents++; }
+
+    void recordAllocation (size_t bytes) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->allocations++;
+        this->allocatedBytes += bytes; }
+
+
+    // Exporting
+
+    // A table of the ops, with the ones that took the most time first, and at
+    // most `rows` of them
+    String summary (size_t rows = 40) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        List<const ProfileRecord*> sorted;
+        size_t calls = 0;
+        for (const ProfileRecord& record : this->records) {
+            sorted.push_back(&record);
+            calls += record.calls; }
+        std::sort(sorted.begin(), sorted.end(), [] (const ProfileRecord* a, const ProfileRecord* b) {
+            return a->seconds > b->seconds; });
+
+        char line[512];
+        snprintf(line, sizeof(line), "%-14s %-40s %8s %11s %11s %11s %11s %9s %9s %8s %11s\n",
+            "op", "signature", "calls", "total ms", "mean us", "min us", "max us", "GB/s", "GFLOP/s", "allocs", "alloc MB");
+        String result = line;
+        for (size_t i = 0; i < std::min(rows, sorted.size()); i++) {
+            const ProfileRecord& r = *sorted[i];
+            String signature = r.signature.size() > 40 ? r.signature.substr(0, 37) + "..." : r.signature;
+            snprintf(line, sizeof(line), "%-14s %-40s %8zu %11.3f %11.2f %11.2f %11.2f %9.2f %9.2f %8zu %11.3f\n",
+                r.name.c_str(), signature.c_str(), r.calls, r.seconds * 1e3, r.seconds / r.calls * 1e6,
+                r.minSeconds * 1e6, r.maxSeconds * 1e6,
+                r.seconds > 0 ? r.bytes / r.seconds / 1e9 : 0, r.seconds > 0 ? r.flops / r.seconds / 1e9 : 0,
+                r.allocations, r.allocatedBytes / 1e6);
+            result += line; }
+        snprintf(line, sizeof(line), "%zu calls of %zu ops and signatures, %zu allocations (%.3f MB)",
+            calls, this->records.size(), this->allocations, this->allocatedBytes / 1e6);
+        result += line;
+        if (this->droppedEvents)
+            result += ", " + std::to_string(this->droppedEvents) + " calls left out of the trace";
+        return result; }
+
+    // Writes the events in Chrome's trace event format, as complete ("X")
+    // events with their bytes, FLOPs and allocations as arguments
+    void writeTrace (const String& path) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        std::ofstream file(path);
+        if (!file)
+            throw "Profiler.writeTrace - Couldn't open the file";
+
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        char line[1024];
+        for (size_t i = 0; i < this->events.size(); i++) {
+            const ProfileEvent& event = this->events[i];
+            const ProfileRecord& record = this->records[event.record];
+            snprintf(line, sizeof(line), "%s\n{\"name\": \"%s\", \"cat\": \"op\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"pid\": 0, \"tid\": %zu, \"args\": {\"signature\": \"%s\", \"bytes\": %.0f, \"flops\": %.0f, "
+                "\"allocations\": %zu, \"allocatedBytes\": %zu}}",
+                i ? "," : "", record.name.c_str(), event.start * 1e6, event.seconds * 1e6, event.thread, record.signature.c_str(),
+                record.bytes / record.calls, record.flops / record.calls, event.allocations, event.allocatedBytes);
+            file << line; }
+        file << "\n]}\n";
+        if (!file)
+            throw "Profiler.writeTrace - Couldn't write the file"; }};
+
+inline Profiler& profiler () {
+    static Profiler value;
+    return value; }
+
+
+// Scopes. `profileOp` puts one on the stack for the rest of the op, which times
+// it and records it when it ends. The scopes on a thread form a stack, so that
+// allocations can find the op that they belong to.
+
+struct ProfileScope;
+
+inline ProfileScope*& currentProfileScope () {
+    static thread_local ProfileScope* value = NULL;
+    return value; }
+
+// A small number for the current thread, for the trace
+inline size_t profileThread () {
+    static std::atomic<size_t> count(0);
+    static thread_local size_t value = count++;
+    return value; }
+
+struct ProfileScope {
+    const char* name;           // NULL if this scope isn't recording
+    ProfileScope* parent;
+    String signature;
+    double start, bytes, flops;
+    size_t allocations, allocatedBytes;
+
+    ProfileScope (const char* name) : name(NULL), parent(NULL), start(0), bytes(0), flops(0), allocations(0), allocatedBytes(0) {
+        if (!profiler().enabled)
+            return;
+        for (ProfileScope* scope = currentProfileScope(); scope; scope = scope->parent)
+            if (!strcmp(scope->name, name))
+                return;
+        this->name = name;
+        this->parent = currentProfileScope();
+        currentProfileScope() = this;
+        this->start = profiler().now(); }
+
+    ProfileScope (const ProfileScope& other) = delete;
+    ProfileScope& operator= (const ProfileScope& other) = delete;
+
+    ~ProfileScope () {
+        if (!this->name)
+            return;
+        double seconds = profiler().now() - this->start;
+        currentProfileScope() = this->parent;
+        profiler().record(this->name, this->signature, profileThread(), this->start, seconds,
+                          this->bytes, this->flops, this->allocations, this->allocatedBytes); }
+
+    bool active () const {
+        return this->name; }
+
+    void describe (const String& signature, double bytes, double flops) {
+        this->signature = signature;
+        this->bytes = bytes;
+        this->flops = flops; }};
+
+inline void recordProfileAllocation (size_t bytes) {
+    if (!profiler().enabled)
+        return;
+    profiler().recordAllocation(bytes);
+    if (ProfileScope* scope = currentProfileScope()) {
+        scope->allocations++;
+        scope->allocatedBytes += bytes; }}
+
+// The signature of one operand, like "[64,128]/[128,1]" for its shape and stride
+inline String profileSignature (const Shape& shape, const Shape& stride) {
+    String result = "[";
+    for (size_t i = 0; i < shape.length; i++)
+        result += (i ? "," : "") + std::to_string(shape[i]);
+    result += "]/[";
+    for (size_t i = 0; i < stride.length; i++)
+        result += (i ? "," : "") + std::to_string(stride[i]);
+    return result + "]"; }
+
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef __QUANTIZE__
+#define __QUANTIZE__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "gemm.cpp"
+#include "autograd.cpp"
+
+
+// Quantized tensors. A tensor of 8-bit integers q stands for the real values
+// scale * (q - zeroPoint), with either one scale and zero point for the whole
+// tensor, or one for each slice along an `axis` (per-channel quantization, which
+// weight matrices usually want, since their columns can have very different
+// ranges). `quantize` picks them so that the range of the values (stretched to
+// include 0, so that zero stays exact) maps onto the whole range of Q.
+//
+// Matrix products of quantized tensors run on the int8 GEMM in gemm.cpp, which
+// accumulates the raw integers in int32. The zero points get subtracted
+// afterwards: for C = sa * sb * (A - za)(B - zb),
+//
+//     (A - za)(B - zb) = AB - za * colsum(B) - zb * rowsum(A) + k * za * zb
+//
+// so the correction only needs the row sums of A and the column sums of B, and
+// the scales get applied once per output element. A can be quantized per tensor
+// or per row (axis 0), and B per tensor or per column (axis 1).
+
+#define QUANTIZE_TILE 256     // Most elements converted per call to the kernels
+
+
+// Kernels. The scales and zero points are either broadcast (a step of 0) or
+// given for every element (a step of 1), and rounding goes through the usual
+// trick of adding and subtracting 1.5 * 2^23, which rounds any float below 2^22
+// to the nearest integer (ties to even) without a libm call.
+
+#define QUANTIZE_ROUND 12582912.0f
+
+// out[i] = clamp(round(in[i] / scale) + zeroPoint), given the inverse scales
+template <typename Q, size_t Bytes> SIMD_INLINE
+void quantizeKernel (size_t n, const float* in, Q* out, const float* inverse, const float* zero, ptrdiff_t step) {
+    typedef SimdVector<float, Bytes> V;
+    typedef typename SimdVector<int32_t, Bytes>::type Integers;
+    typedef Q Narrow __attribute__((vector_size(V::width)));
+    const float low = std::numeric_limits<Q>::min(), high = std::numeric_limits<Q>::max();
+    const size_t w = V::width;
+    size_t i = 0;
+
+    for (; i + w <= n; i += w) {
+        typename V::type s = step ? V::load(inverse + i) : V::broadcast(inverse[0]);
+        typename V::type z = step ? V::load(zero + i) : V::broadcast(zero[0]);
+        typename V::type x = V::load(in + i) * s + z;
+        x = x < V::broadcast(low) ? V::broadcast(low) : x > V::broadcast(high) ? V::broadcast(high) : x;
+        x = (x + QUANTIZE_ROUND) - QUANTIZE_ROUND;
+        Narrow q = __builtin_convertvector(__builtin_convertvector(x, Integers), Narrow);
+        std::memcpy(out + i, &q, sizeof(q)); }
+
+    for (; i < n; i++) {
+        float x = std::min(high, std::max(low, in[i] * inverse[i * step] + zero[i * step]));
+        out[i] = (Q) (int32_t) ((x + QUANTIZE_ROUND) - QUANTIZE_ROUND); }}
+
+// out[i] = (in[i] - zeroPoint) * scale
+template <typename Q, size_t Bytes> SIMD_INLINE
+void dequantizeKernel (size_t n, const Q* in, float* out, const float* scale, const float* zero, ptrdiff_t step) {
+    typedef SimdVector<float, Bytes> V;
+    typedef Q Narrow __attribute__((vector_size(V::width)));
+    const size_t w = V::width;
+    size_t i = 0;
+
+    for (; i + w <= n; i += w) {
+        typename V::type s = step ? V::load(scale + i) : V::broadcast(scale[0]);
+        typename V::type z = step ? V::load(zero + i) : V::broadcast(zero[0]);
+        Narrow q;
+        std::memcpy(&q, in + i, sizeof(q));
+        V::store(out + i, (__builtin_convertvector(q, typename V::type) - z) * s); }
+
+    for (; i < n; i++)
+        out[i] = ((float) in[i] - zero[i * step]) * scale[i * step]; }
+
+#define quantizeEntryPoints(suffix, isa, bytes)                                 \
+template <typename Q> __attribute__((target(isa)))                             \
+void quantize##suffix (size_t n, const float* in, Q* out, const float* inverse, const float* zero, ptrdiff_t step) { \
+    quantizeKernel<Q, bytes>(n, in, out, inverse, zero, step); }                \
+                                                                                \
+template <typename Q> __attribute__((target(isa)))                             \
+void dequantize##suffix (size_t n, const Q* in, float* out, const float* scale, const float* zero, ptrdiff_t step) { \
+    dequantizeKernel<Q, bytes>(n, in, out, scale, zero, step); }
+
+#ifdef SIMD_X86
+quantizeEntryPoints(SSE, "sse4.1", 16);
+quantizeEntryPoints(AVX2, "avx2", 32);
+quantizeEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+template <typename Q> void simdQuantize (size_t n, const float* in, Q* out, const float* inverse, const float* zero, ptrdiff_t step) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return quantizeAVX512(n, in, out, inverse, zero, step);
+        case SimdLevel::AVX2: return quantizeAVX2(n, in, out, inverse, zero, step);
+        case SimdLevel::SSE: return quantizeSSE(n, in, out, inverse, zero, step);
+        default: break; }
+    #endif
+    quantizeKernel<Q, sizeof(float)>(n, in, out, inverse, zero, step); }
+
+template <typename Q> void simdDequantize (size_t n, const Q* in, float* out, const float* scale, const float* zero, ptrdiff_t step) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return dequantizeAVX512(n, in, out, scale, zero, step);
+        case SimdLevel::AVX2: return dequantizeAVX2(n, in, out, scale, zero, step);
+        case SimdLevel::SSE: return dequantizeSSE(n, in, out, scale, zero, step);
+        default: break; }
+    #endif
+    dequantizeKernel<Q, sizeof(float)>(n, in, out, scale, zero, step); }
+
+
+// Quantized tensors
+
+template <typename Q = int8_t> struct QuantizedTensor {
+    static_assert(sizeof(Q) == 1 && std::is_integral<Q>::value, "QuantizedTensor - Only 8-bit integers are supported");
+
+    Tensor<Q> values;
+    Tensor<float> scales;       // One per tensor, or one per slice along `axis`
+    Tensor<int> zeroPoints;
+    int axis;                   // -1 for per-tensor quantization
+
+    QuantizedTensor (const Tensor<Q>& values, const Tensor<float>& scales, const Tensor<int>& zeroPoints, int axis) :
+        values(values), scales(scales), zeroPoints(zeroPoints), axis(axis) {
+        size_t channels = axis < 0 ? 1 : values.shape[axis];
+        if (scales.shape.volume() != channels || zeroPoints.shape.volume() != channels)
+            throw "QuantizedTensor - There must be one scale and zero point per channel"; }
+
+
+    // Conversions
+
+    // Quantizes `x`, per tensor if `axis` is -1 and per slice along `axis` otherwise
+    static QuantizedTensor<Q> quantize (const Tensor<float>& x, int axis = -1) {
+        if (axis < -1 || axis >= (int) x.shape.length)
+            throw "QuantizedTensor.quantize - Axis out of range";
+        profileOp("quantize", profileSignature(x.shape, x.stride), (double) x.shape.volume() * (2 * sizeof(float) + sizeof(Q)), 0);
+
+        // The range of each channel comes from reducing every other dimension
+        NoGrad guard;
+        Tensor<float> input = Tensor<float>(x).contiguous();
+        Shape dims;
+        for (int i = 0; i < (int) x.shape.length; i++) {
+            if (i != axis) {
+                dims.resize(dims.length + 1);
+                dims[-1] = i; }}
+        Tensor<float> low = axis < 0 ? Tensor<float>(input.min()) : dims.length ? input.min(dims, false) : input;
+        Tensor<float> high = axis < 0 ? Tensor<float>(input.max()) : dims.length ? input.max(dims, false) : input;
+
+        size_t channels = low.shape.volume();
+        let scales = Tensor<float>(Reference<Buffer<float>>(new Buffer<float>(channels)), Shape((int) channels));
+        let zeroPoints = Tensor<int>(Reference<Buffer<int>>(new Buffer<int>(channels)), Shape((int) channels));
+        const float qmin = std::numeric_limits<Q>::min(), qmax = std::numeric_limits<Q>::max();
+        for (size_t c = 0; c < channels; c++) {
+            float lo = std::min(low.at(c), 0.0f), hi = std::max(high.at(c), 0.0f);
+            float scale = hi > lo ? (hi - lo) / (qmax - qmin) : 1;
+            scales.at(c) = scale;
+            zeroPoints.at(c) = (int) std::min(qmax, std::max(qmin, std::nearbyint(qmin - lo / scale))); }
+
+        let values = Tensor<Q>(Reference<Buffer<Q>>(new Buffer<Q>(x.shape.volume())), x.shape);
+        quantizeValues(input.data(), values.data(), x.shape, axis, scales.data(), zeroPoints.data());
+        return QuantizedTensor<Q>(values, scales, zeroPoints, axis); }
+
+    // Returns the real values that this tensor stands for
+    Tensor<float> dequantize () const {
+        profileOp("dequantize", profileSignature(this->values.shape, this->values.stride),
+                  (double) this->values.shape.volume() * (sizeof(Q) + sizeof(float)), 0);
+        Tensor<Q> input = Tensor<Q>(this->values).contiguous();
+        let output = Tensor<float>(Reference<Buffer<float>>(new Buffer<float>(input.shape.volume())), input.shape);
+        dequantizeValues(input.data(), output.data(), input.shape, this->axis,
+                         this->scales.data(), this->zeroPoints.data());
+        return output; }
+
+
+    // Matrix multiplication
+
+    // Product of two quantized 2-D tensors, as floats
+    Tensor<float> matmul (const QuantizedTensor<Q>& other) const {
+        const Tensor<Q>& a = this->values;
+        const Tensor<Q>& b = other.values;
+        if (a.shape.length != 2 || b.shape.length != 2)
+            throw "QuantizedTensor.matmul - Both tensors must be 2-dimensional";
+        if (a.shape[1] != b.shape[0])
+            throw "QuantizedTensor.matmul - The inner dimensions of the tensors don't match";
+        if (this->axis == 1 || other.axis == 0)
+            throw "QuantizedTensor.matmul - Only per-row scales for the left side and per-column scales for the right side are supported";
+
+        size_t m = a.shape[0], k = a.shape[1], n = b.shape[1];
+        profileOp("quantizedMatmul", profileSignature(a.shape, a.stride) + " " + profileSignature(b.shape, b.stride),
+                  (double) (m * k + k * n) * sizeof(Q) + (double) m * n * sizeof(float), 2.0 * m * n * k);
+        Buffer<int32_t> product(m * n), rowSums(m), columnSums(n), zeroB(n);
+        Buffer<float> scaleB(n);
+        integerGemm(m, n, k, a.data(), a.stride[0], a.stride[1], b.data(), b.stride[0], b.stride[1],
+                    product.data, (ptrdiff_t) n, 1);
+
+        // The row sums of A, the column sums of B, and B's scales and zero points for every column
+        parallelFor(0, m, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, k)), [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                int32_t sum = 0;
+                for (size_t p = 0; p < k; p++)
+                    sum += a.data()[i * a.stride[0] + p * a.stride[1]];
+                rowSums.data[i] = sum; }});
+        parallelFor(0, n, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, k)), [&] (size_t begin, size_t end) {
+            std::fill(columnSums.data + begin, columnSums.data + end, 0);
+            for (size_t p = 0; p < k; p++)
+                for (size_t j = begin; j < end; j++)
+                    columnSums.data[j] += b.data()[p * b.stride[0] + j * b.stride[1]];
+            for (size_t j = begin; j < end; j++) {
+                scaleB.data[j] = other.scales.at(other.axis < 0 ? 0 : j);
+                zeroB.data[j] = other.zeroPoints.at(other.axis < 0 ? 0 : j); }});
+
+        let output = Tensor<float>(Reference<Buffer<float>>(new Buffer<float>(m * n)), Shape((int) m, (int) n));
+        float* out = output.data();
+        parallelFor(0, m, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                float scaleA = this->scales.at(this->axis < 0 ? 0 : i);
+                int64_t zeroA = this->zeroPoints.at(this->axis < 0 ? 0 : i);
+                int64_t rowTerm = rowSums.data[i] - (int64_t) k * zeroA;
+                for (size_t j = 0; j < n; j++) {
+                    int64_t value = product.data[i * n + j] - zeroB.data[j] * rowTerm - zeroA * columnSums.data[j];
+                    out[i * n + j] = scaleA * scaleB.data[j] * (float) value; }}});
+        return output; }
+
+
+    // Helper methods
+
+    String toString () const {
+        return "QuantizedTensor { scales: " + this->scales.toString() + ", zero points: " + this->zeroPoints.toString() +
+               ", values: " + this->values.toString() + " }"; }
+
+
+    // Kernels. A contiguous tensor quantized along `axis` is a series of runs
+    // that share a channel, unless `axis` is the last dimension, in which case
+    // each run goes through all the channels with a step of 1 (and a tensor
+    // quantized as a whole is one long run). `f(begin, n, channel, step)`
+    // handles the n elements from `begin`, starting at `channel`.
+
+    template <typename F> static void forEachRun (const Shape& shape, int axis, const F& f) {
+        size_t volume = shape.volume(), channels = 1, inner = volume;
+        if (axis >= 0) {
+            channels = shape[axis];
+            inner = 1;
+            for (size_t i = axis + 1; i < shape.length; i++)
+                inner *= shape[i]; }
+
+        parallelFor(0, volume, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+            for (size_t i = begin; i < end;) {
+                size_t n;
+                if (inner == 1) {
+                    size_t channel = i % channels;
+                    n = std::min(end - i, channels - channel);
+                    f(i, n, channel, 1); }
+                else {
+                    n = std::min(end - i, inner - i % inner);
+                    f(i, n, i / inner % channels, 0); }
+                i += n; }}); }
+
+    static void quantizeValues (const float* input, Q* output, const Shape& shape, int axis,
+                                const float* scales, const int* zeroPoints) {
+        forEachRun(shape, axis, [&] (size_t begin, size_t n, size_t channel, ptrdiff_t step) {
+            float inverse[QUANTIZE_TILE], zero[QUANTIZE_TILE];
+            for (size_t j = 0; j < n; j += QUANTIZE_TILE) {
+                size_t length = std::min((size_t) QUANTIZE_TILE, n - j);
+                for (size_t c = 0; c < (step ? length : 1); c++) {
+                    inverse[c] = 1 / scales[channel + j * step + c];
+                    zero[c] = (float) zeroPoints[channel + j * step + c]; }
+                simdQuantize(length, input + begin + j, output + begin + j, inverse, zero, step); }}); }
+
+    static void dequantizeValues (const Q* input, float* output, const Shape& shape, int axis,
+                                  const float* scales, const int* zeroPoints) {
+        forEachRun(shape, axis, [&] (size_t begin, size_t n, size_t channel, ptrdiff_t step) {
+            float zero[QUANTIZE_TILE];
+            for (size_t j = 0; j < n; j += QUANTIZE_TILE) {
+                size_t length = std::min((size_t) QUANTIZE_TILE, n - j);
+                for (size_t c = 0; c < (step ? length : 1); c++)
+                    zero[c] = (float) zeroPoints[channel + j * step + c];
+                simdDequantize(length, input + begin + j, output + begin + j, scales + channel + j * step, zero, step); }}); }};
+
+
+#endif
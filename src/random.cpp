@@ -0,0 +1,241 @@
+#ifndef __RANDOM__
+#define __RANDOM__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "math.cpp"
+#include "half.cpp"
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+
+// Random number generation. Rather than drawing values one after another from a
+// stateful generator, we use Philox4x32-10 (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3"), a counter-based generator that turns a 64-bit
+// key and a 128-bit counter into four random 32-bit words. The key is the seed,
+// the upper half of the counter is a stream number that every call to
+// Tensor::random or Tensor::normal takes from the generator (its offset), and the
+// lower half is the index of the block of words within the output. So the value
+// of every element only depends on the seed, the offset and the element's index,
+// which means we can fill any part of a tensor on any thread in any order and
+// still get exactly the same bits.
+//
+// The words are generated a tile of counters at a time, with each step of the
+// rounds applied to the whole tile in a loop that the compiler vectorizes, and
+// like the kernels in simd.cpp, the tile kernels get compiled once per
+// instruction set and picked at runtime. Normal samples come from the Box-Muller
+// transform, using the branch-free approximations of log, sqrt, sin and cos from
+// math.cpp, which vectorize the same way (the libm versions don't).
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// Number of counters (blocks of four words) generated at once
+#define RANDOM_TILE 64
+#define RANDOM_TILE_WORDS (4 * RANDOM_TILE)
+
+
+// Generators
+
+class Generator {
+public:
+    uint64_t seed;
+    std::atomic<uint64_t> offset;
+
+    // Constructor
+    Generator (uint64_t seed) : seed(seed), offset(0) { }
+
+    // Sets the seed, and starts counting offsets from zero again
+    void manualSeed (uint64_t seed) {
+        this->seed = seed;
+        this->offset = 0; }
+
+    // Reserves a stream of random words for a single call
+    uint64_t next () {
+        return this->offset++; }};
+
+// The generator that Tensor::random and Tensor::normal use by default. It gets a
+// nondeterministic seed, unless `manualSeed` is called.
+Generator& defaultGenerator () {
+    static Generator* generator = new Generator(((uint64_t) std::random_device()() << 32) | std::random_device()());
+    return *generator; }
+
+void manualSeed (uint64_t seed) {
+    defaultGenerator().manualSeed(seed); }
+
+
+// Philox
+
+// Writes the words for counters [block, block + RANDOM_TILE) of `stream`. Each
+// step of the rounds runs over the whole tile, which the compiler vectorizes.
+SIMD_INLINE void philoxKernel (uint32_t* out, uint64_t block, uint64_t stream, uint64_t seed) {
+    uint32_t c0[RANDOM_TILE], c1[RANDOM_TILE], c2[RANDOM_TILE], c3[RANDOM_TILE];
+    for (size_t j = 0; j < RANDOM_TILE; j++) {
+        c0[j] = (uint32_t) (block + j);
+        c1[j] = (uint32_t) ((block + j) >> 32);
+        c2[j] = (uint32_t) stream;
+        c3[j] = (uint32_t) (stream >> 32); }
+
+    uint32_t k0 = (uint32_t) seed, k1 = (uint32_t) (seed >> 32);
+    for (size_t round = 0; round < 10; round++) {
+        for (size_t j = 0; j < RANDOM_TILE; j++) {
+            uint64_t p0 = (uint64_t) PHILOX_M0 * c0[j];
+            uint64_t p1 = (uint64_t) PHILOX_M1 * c2[j];
+            uint32_t x0 = (uint32_t) (p1 >> 32) ^ c1[j] ^ k0;
+            uint32_t x2 = (uint32_t) (p0 >> 32) ^ c3[j] ^ k1;
+            c0[j] = x0;
+            c1[j] = (uint32_t) p1;
+            c2[j] = x2;
+            c3[j] = (uint32_t) p0; }
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1; }
+
+    for (size_t j = 0; j < RANDOM_TILE; j++) {
+        out[4 * j] = c0[j];
+        out[4 * j + 1] = c1[j];
+        out[4 * j + 2] = c2[j];
+        out[4 * j + 3] = c3[j]; }}
+
+
+// Distributions. Each one turns a tile of words into values, using `words` words
+// per value.
+
+template <typename T, bool = std::is_integral<T>::value> struct Uniform;
+
+// Integers in [low, high], from 32 bits each for 32-bit types and 64 bits each for
+// 64-bit types. (Scaling the bits down to the range leaves a bias of at most
+// range / 2^32 or range / 2^64, which is far too small to notice.)
+template <typename T> struct Uniform<T, true> {
+    static const size_t words = sizeof(T) > 4 ? 2 : 1;
+    T low;
+    uint64_t range;
+
+    Uniform (T low, T high) : low(low), range((uint64_t) high - (uint64_t) low + 1) { }
+
+    SIMD_INLINE void operator() (T* out, const uint32_t* w, size_t n) const {
+        if (words == 1) {
+            for (size_t i = 0; i < n; i++)
+                out[i] = (T) ((uint64_t) this->low + (((uint64_t) w[i] * this->range) >> 32));
+            return; }
+
+        for (size_t i = 0; i < n; i++) {
+            uint64_t bits = ((uint64_t) w[2 * i] << 32) | w[2 * i + 1];
+            uint64_t scaled = this->range ? (uint64_t) (((unsigned __int128) bits * this->range) >> 64) : bits;
+            out[i] = (T) ((uint64_t) this->low + scaled); }}};
+
+// Floats in [low, high), from as many random bits as the mantissa holds
+template <typename T> struct Uniform<T, false> {
+    static const size_t words = sizeof(T) / 4;
+    T low, scale;
+
+    Uniform (T low, T high) : low(low), scale(high - low) { }
+
+    SIMD_INLINE void operator() (T* out, const uint32_t* w, size_t n) const {
+        for (size_t i = 0; i < n; i++)
+            out[i] = this->low + this->scale * unit(&w[i * words]); }
+
+    // Returns a value in [0, 1), by filling the mantissa of a number in [1, 2)
+    // with random bits
+    static SIMD_INLINE T unit (const uint32_t* w) {
+        typedef FloatTraits<T> F;
+        typename F::Bits bits = w[0];
+        if (sizeof(T) > 4)
+            bits = (bits << 32) | w[1];
+        bits = (bits >> (8 * sizeof(T) - F::mantissa)) | ((typename F::Bits) F::bias << F::mantissa);
+        return fromBits<T>(bits) - 1; }};
+
+// Normally distributed floats, which the Box-Muller transform produces in pairs
+template <typename T> struct Normal {
+    static const size_t words = sizeof(T) / 4;
+    T mean, std;
+
+    Normal (T mean, T std) : mean(mean), std(std) { }
+
+    SIMD_INLINE void operator() (T* out, const uint32_t* w, size_t n) const {
+        const T epsilon = (T) 1 / ((typename FloatTraits<T>::Bits) 1 << FloatTraits<T>::mantissa);
+        for (size_t i = 0; i < n / 2; i++) {
+            T u1 = Uniform<T>::unit(&w[2 * i * words]) + epsilon;  // In (0, 1]
+            T u2 = Uniform<T>::unit(&w[(2 * i + 1) * words]);
+            T radius = fastSqrt(-2 * fastLog(u1)), sine, cosine;
+            fastSinCos(u2, sine, cosine);
+            out[2 * i] = this->mean + this->std * radius * cosine;
+            out[2 * i + 1] = this->mean + this->std * radius * sine; }}};
+
+// Half-precision floats get sampled as floats and then rounded
+template <typename T, typename D> struct HalfDistribution {
+    static const size_t words = D::words;
+    D dist;
+
+    HalfDistribution (const D& dist) : dist(dist) { }
+
+    SIMD_INLINE void operator() (T* out, const uint32_t* w, size_t n) const {
+        float values[RANDOM_TILE_WORDS];
+        this->dist(values, w, n);
+        convertFromFloat(n, values, out); }};
+
+#define halfDistributions(T)                                                    \
+template <> struct Uniform<T, false> : HalfDistribution<T, Uniform<float>> {    \
+    Uniform (float low, float high) : HalfDistribution<T, Uniform<float>>(Uniform<float>(low, high)) { }}; \
+template <> struct Normal<T> : HalfDistribution<T, Normal<float>> {             \
+    Normal (float mean, float std) : HalfDistribution<T, Normal<float>>(Normal<float>(mean, std)) { }};
+
+halfDistributions(bf16);
+halfDistributions(f16);
+
+
+// Filling tensors
+
+// Fills values [begin, end) of the output with `dist`, where `begin` lies on a
+// tile boundary. Every tile fills RANDOM_TILE_WORDS / words values, and a partial
+// tile at the end goes through a scratch array.
+template <typename T, typename D> SIMD_INLINE
+void fillKernel (T* data, size_t begin, size_t end, const D& dist, uint64_t stream, uint64_t seed) {
+    const size_t values = RANDOM_TILE_WORDS / D::words;
+    uint32_t words[RANDOM_TILE_WORDS];
+    T scratch[values];
+
+    for (size_t i = begin; i < end; i += values) {
+        philoxKernel(words, i / values * RANDOM_TILE, stream, seed);
+        if (end - i >= values)
+            dist(data + i, words, values);
+        else {
+            dist(scratch, words, values);
+            std::copy(scratch, scratch + (end - i), data + i); }}}
+
+#define randomEntryPoints(suffix, isa)                                          \
+template <typename T, typename D> __attribute__((target(isa)))                 \
+void fill##suffix (T* data, size_t begin, size_t end, const D& dist, uint64_t stream, uint64_t seed) { \
+    fillKernel(data, begin, end, dist, stream, seed); }
+
+#ifdef SIMD_X86
+randomEntryPoints(SSE, "sse4.1");
+randomEntryPoints(AVX2, "avx2");
+randomEntryPoints(AVX512, "avx512f");
+#endif
+
+template <typename T, typename D> void fillScalar (T* data, size_t begin, size_t end, const D& dist, uint64_t stream, uint64_t seed) {
+    fillKernel(data, begin, end, dist, stream, seed); }
+
+// Fills `n` values with samples from `dist`, using a new stream from `generator`.
+// The output is split between threads along tile boundaries.
+template <typename T, typename D> void fillRandom (T* data, size_t n, const D& dist, Generator& generator) {
+    uint64_t stream = generator.next(), seed = generator.seed;
+    const size_t values = RANDOM_TILE_WORDS / D::words;
+    size_t tiles = (n + values - 1) / values;
+
+    parallelFor(0, tiles, (PARALLEL_GRAIN + values - 1) / values, [&] (size_t first, size_t last) {
+        size_t begin = first * values, end = std::min(n, last * values);
+        switch (simdLevel()) {
+            #ifdef SIMD_X86
+            case SimdLevel::AVX512: return fillAVX512(data, begin, end, dist, stream, seed);
+            case SimdLevel::AVX2: return fillAVX2(data, begin, end, dist, stream, seed);
+            case SimdLevel::SSE: return fillSSE(data, begin, end, dist, stream, seed);
+            #endif
+            default: return fillScalar(data, begin, end, dist, stream, seed); }}); }
+
+
+#endif
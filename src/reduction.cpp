@@ -0,0 +1,364 @@
+#ifndef __REDUCTION__
+#define __REDUCTION__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "summation.cpp"
+
+
+// Reductions over one or more dimensions of a strided tensor, which is what
+// Tensor::sum(dims), Tensor::max(dims) and friends do. The loop order comes from
+// the input's strides. If the dimension with the smallest stride gets reduced,
+// each output element is the fold of a run of (usually contiguous) values, so we
+// just fold those runs one output at a time. Otherwise the smallest-stride
+// dimension is kept, and folding one output at a time would read every value
+// from a different cache line. Instead we keep a tile of up to REDUCE_TILE
+// neighbouring outputs (the "columns") in an accumulator and fold whole rows of
+// the input into it, one reduced position at a time, which is an elementwise op
+// between two contiguous arrays that simdBinary vectorizes. When the rows are
+// too short to fill a vector register (like summing a [N, 4] matrix along dim 0)
+// and consecutive reduced positions are adjacent in memory, the accumulator
+// holds several rows side by side instead, which get folded together at the end.
+//
+// Threads split up the outputs when there are enough of them, and otherwise each
+// output's reduction gets split into fixed blocks with parallelReduce. Sums split
+// long column reductions into blocks either way, since adding up the blocks as a
+// tree is what keeps their rounding error down. The split only depends on the
+// shape, so the results don't depend on the thread count.
+//
+// What a reduction does to the values is up to its reducer, which supplies an
+// accumulator type and its initial value, and the methods
+//
+//     foldRun(acc, run, n, step, index)       Folds run[0], run[step], ... run[(n - 1) * step] into acc
+//     foldColumns(acc, row, n, step, index)   Folds row[j * step] into acc[j] for each j < n
+//     combine(a, b)                           Folds b into a, where b covers later elements than a
+//     result(acc, count)                      Converts the accumulator of `count` elements into an output
+//
+// `index` is the position of the (first) folded element in row-major order over
+// the reduced dimensions, which argmax and argmin return. Reducers also say
+// whether the engine can fold several rows into one tile (`wide`), and whether
+// it should always split long column reductions into blocks (`pairwise`).
+
+#define REDUCE_TILE 1024     // Most outputs in a tile of the outer-dimension path
+#define REDUCE_SPLIT 64      // Fewer work items than this split their reductions between threads
+
+
+// Reducers
+
+// Folds the values with `Op`, in an accumulator of type A, and divides the result
+// by the number of elements if `Mean` is set
+template <typename T, typename A, typename Op, bool Mean = false> struct ValueReducer {
+    typedef T Input;
+    typedef A Accumulator;
+    typedef A Output;
+    static const bool wide = true, pairwise = false;
+    A initial;
+
+    ValueReducer (A initial) : initial(initial) { }
+
+    void foldRun (A& acc, const T* run, size_t n, ptrdiff_t step, size_t) const {
+        if (step == 1)
+            acc = Op::apply(acc, (A) simdFold<T, Op>(n - 1, run + 1, run[0]));
+        else for (size_t i = 0; i < n; i++)
+            acc = Op::apply(acc, (A) run[i * step]); }
+
+    void foldColumns (A* acc, const T* row, size_t n, ptrdiff_t step, size_t) const {
+        if (step == 1 && std::is_same<T, A>::value)
+            simdBinary<A, Op>(n, acc, acc, 1, (const A*) row, 1);
+        else for (size_t j = 0; j < n; j++)
+            acc[j] = Op::apply(acc[j], (A) row[j * step]); }
+
+    void combine (A& a, const A& b) const { a = Op::apply(a, b); }
+    A result (const A& acc, size_t count) const { return Mean ? acc / (A) count : acc; }};
+
+// Sums the values pairwise (see summation.cpp) in an accumulator of type A, and
+// divides the result by the number of elements if `Mean` is set
+template <typename T, typename A, typename O, bool Mean> struct SumReducer {
+    typedef T Input;
+    typedef A Accumulator;
+    typedef O Output;
+    static const bool wide = true, pairwise = true;
+    A initial;
+
+    SumReducer () : initial(0) { }
+
+    void foldRun (A& acc, const T* run, size_t n, ptrdiff_t step, size_t) const {
+        acc += step == 1 ? simdPairwiseSum<A>(n, run) : pairwiseSum<A>(n, run, step); }
+
+    void foldColumns (A* acc, const T* row, size_t n, ptrdiff_t step, size_t) const {
+        if (step == 1)
+            simdAccumulate(n, acc, row);
+        else for (size_t j = 0; j < n; j++)
+            acc[j] += (A) row[j * step]; }
+
+    void combine (A& a, const A& b) const { a += b; }
+    O result (const A& acc, size_t count) const { return (O) (Mean ? acc / (A) count : acc); }};
+
+// Like SumReducer, but with a compensated sum instead of a pairwise one. Along
+// an outer dimension, the accumulators hold a sum and a compensation each, so the
+// columns get added up one at a time rather than a vector register at a time.
+template <typename T, typename A, typename O, bool Mean> struct KahanSumReducer {
+    typedef T Input;
+    struct Accumulator { A sum, compensation; };
+    typedef O Output;
+    static const bool wide = true, pairwise = false;
+    Accumulator initial;
+
+    KahanSumReducer () { this->initial.sum = 0; this->initial.compensation = 0; }
+
+    void foldRun (Accumulator& acc, const T* run, size_t n, ptrdiff_t step, size_t) const {
+        if (step == 1)
+            simdKahanSum(n, run, acc.sum, acc.compensation);
+        else for (size_t i = 0; i < n; i++)
+            neumaierAdd(acc.sum, acc.compensation, (A) run[i * step]); }
+
+    void foldColumns (Accumulator* acc, const T* row, size_t n, ptrdiff_t step, size_t) const {
+        for (size_t j = 0; j < n; j++)
+            neumaierAdd(acc[j].sum, acc[j].compensation, (A) row[j * step]); }
+
+    void combine (Accumulator& a, const Accumulator& b) const {
+        neumaierAdd(a.sum, a.compensation, b.sum);
+        a.compensation += b.compensation; }
+    O result (const Accumulator& acc, size_t count) const {
+        A total = acc.sum + acc.compensation;
+        return (O) (Mean ? total / (A) count : total); }};
+
+// Finds the index of the first largest (or smallest) value. The accumulator holds
+// the best value so far along with its index, so each step only does one compare.
+template <typename T, bool Largest> struct IndexReducer {
+    typedef T Input;
+    struct Accumulator { T value; size_t index; };
+    typedef size_t Output;
+    static const bool wide = false, pairwise = false;
+    static const size_t empty = (size_t) -1;
+    Accumulator initial;
+
+    IndexReducer () { this->initial.value = 0; this->initial.index = empty; }
+
+    static bool better (T x, const Accumulator& acc) {
+        return acc.index == empty || (Largest ? x > acc.value : x < acc.value); }
+
+    void foldRun (Accumulator& acc, const T* run, size_t n, ptrdiff_t step, size_t index) const {
+        if (step == 1) {
+            size_t i = Largest ? simdArgmax(n, run) : simdArgmin(n, run);
+            if (better(run[i], acc)) {
+                acc.value = run[i];
+                acc.index = index + i; }}
+        else for (size_t i = 0; i < n; i++) {
+            if (better(run[i * step], acc)) {
+                acc.value = run[i * step];
+                acc.index = index + i; }}}
+
+    void foldColumns (Accumulator* acc, const T* row, size_t n, ptrdiff_t step, size_t index) const {
+        for (size_t j = 0; j < n; j++) {
+            if (better(row[j * step], acc[j])) {
+                acc[j].value = row[j * step];
+                acc[j].index = index; }}}
+
+    void combine (Accumulator& a, const Accumulator& b) const {
+        if (b.index != empty && better(b.value, a))
+            a = b; }
+    size_t result (const Accumulator& acc, size_t) const { return acc.index == empty ? 0 : acc.index; }};
+
+// The identity of max and min, so that they can start from it like sums do
+template <typename T> T lowestValue () {
+    return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest(); }
+template <typename T> T highestValue () {
+    return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max(); }
+
+
+// Helper functions
+
+// The dimensions to reduce are kept in a Shape too, so that passing them around
+// doesn't allocate anything
+bool reducesDimension (const Shape& dims, int dim) {
+    return std::find(dims.dimensions, dims.dimensions + dims.length, dim) != dims.dimensions + dims.length; }
+
+// Checks the dimensions to reduce, wrapping negative ones around, and returns the
+// shape of the result, which is the input's shape with those dimensions set to 1
+Shape getReducedShape (const Shape& shape, Shape& dims) {
+    Shape outputShape = shape;
+    for (size_t i = 0; i < dims.length; i++) {
+        int& dim = dims.dimensions[i];
+        if (dim < 0)
+            dim = shape.length + dim;
+        if (dim < 0 || (size_t) dim >= shape.length)
+            throw "getReducedShape - Dimension index out of range";
+        if (std::find(dims.dimensions, &dims.dimensions[i], dim) != &dims.dimensions[i])
+            throw "getReducedShape - Dimension reduced more than once";
+        outputShape.dimensions[dim] = 1; }
+    return outputShape; }
+
+// Drops the reduced dimensions from the result's shape, for keepdim = false
+Shape squeezeReducedShape (const Shape& shape, const Shape& dims) {
+    Shape squeezed;
+    for (size_t d = 0; d < shape.length; d++) {
+        if (!reducesDimension(dims, d)) {
+            squeezed.resize(squeezed.length + 1);
+            squeezed.dimensions[squeezed.length - 1] = shape.dimensions[d]; }}
+    return squeezed; }
+
+// Gives a result with the reduced dimensions dropped the strides it would have
+// if they were still there (with size 1, their strides don't matter)
+Shape unsqueezeReducedStride (const Shape& stride, const Shape& outputShape, const Shape& dims) {
+    if (stride.length == outputShape.length)
+        return stride;
+    Shape result = outputShape;
+    for (size_t d = 0, i = 0; d < outputShape.length; d++)
+        result.dimensions[d] = reducesDimension(dims, d) ? 0 : stride.dimensions[i++];
+    return result; }
+
+
+// Driver
+
+// Reduces the tensor with the given data, shape and stride over every dimension
+// where `outputShape` has size 1 and the input doesn't, writing the result into
+// `output`, which has shape `outputShape` and stride `outputStride`
+template <typename R> void reduceInto (const R& reducer, const typename R::Input* input, const Shape& shape, const Shape& stride,
+                                       typename R::Output* output, const Shape& outputShape, const Shape& outputStride) {
+    typedef typename R::Accumulator A;
+
+    // Split the input's dimensions into kept and reduced ones, and find the one
+    // with the smallest stride
+    Shape reducedShape = shape;
+    int fast = -1;
+    for (size_t d = 0; d < shape.length; d++) {
+        if (outputShape[d] > 1)
+            reducedShape[d] = 1;
+        if (shape[d] > 1 && (fast < 0 || std::abs(stride[d]) < std::abs(stride[fast])))
+            fast = d; }
+
+    size_t outputs = outputShape.volume(), count = reducedShape.volume();
+    if (outputs == 0)
+        return;
+    if (count == 0) {
+        for (let it = StridedIterator(outputShape, { outputStride }); !it.done(); it.next())
+            for (size_t j = 0; j < it.size; j++)
+                output[it.offset[0] + j * it.stride[0]] = reducer.result(reducer.initial, 0);
+        return; }
+
+    let reducedPlan = StridedIterator(reducedShape, { stride });
+    let combine = [&] (A a, const A& b) { reducer.combine(a, b); return a; };
+
+    // Folds elements [begin, end) of the reduced dimensions, starting from the
+    // input offset `base`, into `acc`, a run at a time
+    let foldRange = [&] (A& acc, ptrdiff_t base, size_t begin, size_t end) {
+        if (reducedPlan.rank == 0) {
+            reducer.foldRun(acc, input + base + begin * reducedPlan.stride[0], end - begin, reducedPlan.stride[0], begin);
+            return; }
+        let it = reducedPlan;
+        it.limit(begin, end);
+        for (size_t index = begin; !it.done(); index += it.size, it.next())
+            reducer.foldRun(acc, input + base + it.offset[0], it.size, it.stride[0], index); };
+
+    // Inner path: every output folds its own runs
+    if (fast < 0 || outputShape[fast] == 1 || count == 1) {
+        let outputPlan = StridedIterator(outputShape, { outputStride, stride });
+        if (outputs < REDUCE_SPLIT && count >= 2 * PARALLEL_GRAIN) {
+            for (let it = outputPlan; !it.done(); it.next()) {
+                for (size_t j = 0; j < it.size; j++) {
+                    ptrdiff_t base = it.offset[1] + j * it.stride[1];
+                    A acc = parallelReduce<A>(count, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+                        A partial = reducer.initial;
+                        foldRange(partial, base, begin, end);
+                        return partial; }, combine);
+                    output[it.offset[0] + j * it.stride[0]] = reducer.result(acc, count); }}
+            return; }
+
+        parallelFor(0, outputs, std::max((size_t) 1, PARALLEL_GRAIN / count), [&] (size_t begin, size_t end) {
+            let it = outputPlan;
+            it.limit(begin, end);
+            ptrdiff_t step = reducedPlan.stride[0];
+            for (; !it.done(); it.next()) {
+                for (size_t j = 0; j < it.size; j++) {
+                    A acc = reducer.initial;
+                    if (reducedPlan.rank == 0)
+                        reducer.foldRun(acc, input + it.offset[1] + j * it.stride[1], count, step, 0);
+                    else foldRange(acc, it.offset[1] + j * it.stride[1], 0, count);
+                    output[it.offset[0] + j * it.stride[0]] = reducer.result(acc, count); }}});
+        return; }
+
+    // Outer path: the columns are the kept dimension with the smallest stride,
+    // and each work item is a tile of them at one position of the other kept
+    // dimensions. If the columns are contiguous and fit in a tile several times
+    // over, and the innermost reduced dimension steps over exactly one row of
+    // them, the tile holds `rows` rows side by side.
+    size_t columns = shape[fast];
+    ptrdiff_t columnStride = stride[fast], outputColumnStride = outputStride[fast];
+    Shape otherShape = outputShape;
+    otherShape[fast] = 1;
+    size_t others = otherShape.volume();
+    let otherPlan = StridedIterator(otherShape, { outputStride, stride });
+
+    size_t rows = 1;
+    if (R::wide && columnStride == 1 && reducedPlan.stride[0] == (ptrdiff_t) columns && columns * 2 <= REDUCE_TILE)
+        rows = std::min(REDUCE_TILE / columns, reducedPlan.length);
+    size_t tileColumns = std::min(columns, (size_t) REDUCE_TILE);
+    size_t tilesPerRow = (columns + tileColumns - 1) / tileColumns, items = others * tilesPerRow;
+
+    // Folds elements [begin, end) of the reduced dimensions into the tile `acc`
+    // of n columns, starting from the input offset `base`
+    let foldTile = [&] (A* acc, size_t n, ptrdiff_t base, size_t begin, size_t end) {
+        let it = reducedPlan;
+        it.limit(begin, end);
+        for (size_t index = begin; !it.done(); index += it.size, it.next()) {
+            const typename R::Input* row = input + base + it.offset[0];
+            if (rows > 1) {
+                for (size_t j = 0; j < it.size; j += rows)
+                    reducer.foldColumns(acc, row + j * columns, std::min(rows, it.size - j) * columns, 1, index + j); }
+            else for (size_t j = 0; j < it.size; j++)
+                reducer.foldColumns(acc, row + j * it.stride[0], n, columnStride, index + j); }};
+
+    // Writes out the results of tile `item`, given its accumulators
+    let finishTile = [&] (size_t item, A* acc, size_t n) {
+        for (size_t r = 1; r < rows; r++)
+            for (size_t j = 0; j < n; j++)
+                reducer.combine(acc[j], acc[r * columns + j]);
+
+        let it = otherPlan;
+        it.limit(item / tilesPerRow, item / tilesPerRow + 1);
+        size_t first = item % tilesPerRow * tileColumns;
+        for (size_t j = 0; j < n; j++)
+            output[it.offset[0] + (first + j) * outputColumnStride] = reducer.result(acc[j], count); };
+
+    // Finds the size and input offset of tile `item`
+    let locateTile = [&] (size_t item, size_t& n, ptrdiff_t& base) {
+        let it = otherPlan;
+        it.limit(item / tilesPerRow, item / tilesPerRow + 1);
+        size_t first = item % tilesPerRow * tileColumns;
+        n = std::min(tileColumns, columns - first);
+        base = it.offset[1] + first * columnStride; };
+
+    size_t width = rows > 1 ? rows * columns : tileColumns;
+    size_t block = std::max((size_t) 1, PARALLEL_GRAIN / tileColumns);
+    if ((items < REDUCE_SPLIT || R::pairwise) && count >= 2 * block) {
+        for (size_t item = 0; item < items; item++) {
+            size_t n;
+            ptrdiff_t base;
+            locateTile(item, n, base);
+            List<A> acc = parallelReduce<List<A>>(count, block, [&] (size_t begin, size_t end) {
+                List<A> partial(width, reducer.initial);
+                foldTile(partial.data(), n, base, begin, end);
+                return partial; },
+                [&] (List<A> a, const List<A>& b) {
+                    for (size_t j = 0; j < width; j++)
+                        reducer.combine(a[j], b[j]);
+                    return a; });
+            finishTile(item, acc.data(), n); }
+        return; }
+
+    parallelFor(0, items, std::max((size_t) 1, PARALLEL_GRAIN / (count * tileColumns)), [&] (size_t begin, size_t end) {
+        A acc[REDUCE_TILE];
+        for (size_t item = begin; item < end; item++) {
+            size_t n;
+            ptrdiff_t base;
+            locateTile(item, n, base);
+            std::fill(acc, acc + width, reducer.initial);
+            foldTile(acc, n, base, 0, count);
+            finishTile(item, acc, n); }}); }
+
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef __SERIALIZATION__
+#define __SERIALIZATION__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "dtype.cpp"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Binary file format for saving and loading named tensors. Loading a file maps
+// it into memory and points each tensor's buffer straight at its data in the
+// mapping, so nothing gets read or copied up front: the OS pages the data in as
+// it's touched, and loading even a multi-GB checkpoint only costs the time to
+// parse the header. The mapping is private, so writing to a loaded tensor gives
+// the process its own copy of that page rather than changing the file.
+//
+// The layout is a header followed by the data for each tensor, stored in native
+// byte order (so files aren't portable between little- and big-endian machines):
+//
+//     char[4]  magic ("BTEN")
+//     uint32   version
+//     uint64   number of tensors
+//     for each tensor:
+//         uint32   name length, followed by the name itself
+//         uint32   dtype
+//         uint32   rank
+//         int64    shape[rank]
+//         int64    stride[rank]
+//         uint64   offset of the data from the start of the file, in bytes
+//         uint64   length of the data, in elements
+//
+// Each tensor's whole buffer gets written along with its strides, so views like
+// `transpose()` are saved and loaded without being copied. The data for each
+// tensor starts at a multiple of 64 bytes, which keeps the mapped buffers as
+// aligned as the ones from the caching allocator.
+
+#define TENSOR_FILE_MAGIC "BTEN"
+#define TENSOR_FILE_VERSION 1
+#define TENSOR_FILE_ALIGNMENT 64
+
+template <typename T> class Tensor;
+
+
+// Memory-mapped files
+
+struct MappedFile {
+    char* data;
+    size_t length;
+
+    MappedFile (const String& path) : data(NULL), length(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw "MappedFile - Couldn't open the file";
+
+        struct stat info;
+        if (fstat(fd, &info) < 0) {
+            close(fd);
+            throw "MappedFile - Couldn't get the size of the file"; }
+
+        this->length = info.st_size;
+        if (this->length > 0) {
+            void* region = mmap(NULL, this->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (region == MAP_FAILED) {
+                close(fd);
+                throw "MappedFile - Couldn't map the file into memory"; }
+            this->data = (char*) region; }
+        close(fd); }
+
+    ~MappedFile () {
+        if (this->data)
+            munmap(this->data, this->length); }};
+
+
+// Loading
+
+class TensorFile {
+public:
+    struct Entry {
+        DType dtype;
+        Shape shape;
+        Shape stride;
+        size_t offset;
+        size_t length; };
+
+    Reference<MappedFile> file;
+    List<String> names;
+    std::map<String, Entry> entries;
+
+    // Constructor. Maps the file at `path` and parses its header.
+    TensorFile (const String& path) : file(new MappedFile(path)) {
+        size_t position = 0;
+        char magic[4];
+        this->read(position, magic, 4);
+        if (std::memcmp(magic, TENSOR_FILE_MAGIC, 4))
+            throw "TensorFile - This isn't a tensor file";
+        if (this->read<uint32_t>(position) != TENSOR_FILE_VERSION)
+            throw "TensorFile - Unsupported file version";
+
+        uint64_t count = this->read<uint64_t>(position);
+        for (uint64_t i = 0; i < count; i++) {
+            String name(this->read<uint32_t>(position), '\0');
+            this->read(position, &name[0], name.size());
+
+            Entry entry;
+            entry.dtype = (DType) this->read<uint32_t>(position);
+            size_t rank = this->read<uint32_t>(position);
+            List<int> shape, stride;
+            for (size_t d = 0; d < rank; d++)
+                shape.push_back(this->read<int64_t>(position));
+            for (size_t d = 0; d < rank; d++)
+                stride.push_back(this->read<int64_t>(position));
+            entry.shape = Shape(shape);
+            entry.stride = Shape(stride);
+            entry.offset = this->read<uint64_t>(position);
+            entry.length = this->read<uint64_t>(position);
+            this->validate(entry);
+
+            if (this->entries.count(name))
+                throw "TensorFile - The file has two tensors with the same name";
+            this->names.push_back(name);
+            this->entries.insert({ name, entry }); }}
+
+
+    // Accessors
+
+    bool contains (const String& name) const {
+        return this->entries.count(name) > 0; }
+
+    // Returns the tensor called `name`, backed directly by the mapped file
+    template <typename T> Tensor<T> get (const String& name) const {
+        let it = this->entries.find(name);
+        if (it == this->entries.end())
+            throw "TensorFile.get - There's no tensor with this name in the file";
+        const Entry& entry = it->second;
+        if (entry.dtype != DTypeOf<T>::value)
+            throw "TensorFile.get - The tensor in the file has a different dtype";
+
+        T* data = (T*) (this->file->data + entry.offset);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(entry.length, data, this->file));
+        return Tensor<T>(buffer, entry.shape, entry.stride); }
+
+
+    // Helper methods
+
+    void read (size_t& position, void* output, size_t bytes) const {
+        if (bytes > this->file->length || position > this->file->length - bytes)
+            throw "TensorFile - The file is truncated";
+        std::memcpy(output, this->file->data + position, bytes);
+        position += bytes; }
+
+    template <typename I> I read (size_t& position) const {
+        I value;
+        this->read(position, &value, sizeof(I));
+        return value; }
+
+    // Makes sure that every element of the tensor lies inside the file
+    void validate (const Entry& entry) const {
+        size_t size;
+        try { size = dtypeSize(entry.dtype); }
+        catch (const char* error) { throw "TensorFile - The file has a tensor with an unknown dtype"; }
+
+        if (entry.offset % size || entry.offset > this->file->length ||
+            entry.length > (this->file->length - entry.offset) / size)
+            throw "TensorFile - The file has a tensor whose data runs past the end of the file";
+
+        size_t last = 0;
+        for (size_t d = 0; d < entry.shape.length; d++) {
+            if (entry.shape[d] < 0 || entry.stride[d] < 0)
+                throw "TensorFile - The file has a tensor with a negative shape or stride";
+            if (entry.shape[d] == 0)
+                return;
+            last += (size_t) (entry.shape[d] - 1) * entry.stride[d]; }
+        if (last >= entry.length)
+            throw "TensorFile - The file has a tensor whose strides run past the end of its data"; }};
+
+
+// Saving
+
+class TensorWriter {
+public:
+    struct Entry {
+        String name;
+        DType dtype;
+        Shape shape;
+        Shape stride;
+        const char* data;
+        size_t length;
+        Reference<void> buffer; };  // Keeps the data alive until it's written
+
+    List<Entry> entries;
+
+    // Adds `tensor` to the file under `name`
+    template <typename T> TensorWriter& add (const String& name, const Tensor<T>& tensor) {
+        for (const Entry& entry : this->entries) {
+            if (entry.name == name)
+                throw "TensorWriter.add - There's already a tensor with this name"; }
+
+        this->entries.push_back({ name, DTypeOf<T>::value, tensor.shape, tensor.stride,
+            (const char*) tensor.data(), extent(tensor.shape, tensor.stride), tensor.buffer });
+        return *this; }
+
+    // Number of elements from a tensor's first element to the last one its
+    // strides can reach, so a view like a slice only saves its own part of the
+    // buffer it shares
+    static size_t extent (const Shape& shape, const Shape& stride) {
+        size_t last = 0;
+        for (size_t d = 0; d < shape.length; d++) {
+            if (shape[d] == 0)
+                return 0;
+            last += (size_t) (shape[d] - 1) * stride[d]; }
+        return last + 1; }
+
+    // Writes the header and then the data for every tensor to `path`
+    void write (const String& path) const {
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            throw "TensorWriter.write - Couldn't open the file";
+
+        // Work out where each tensor's data goes, after the header
+        size_t headerSize = 4 + sizeof(uint32_t) + sizeof(uint64_t);
+        for (const Entry& entry : this->entries)
+            headerSize += 3 * sizeof(uint32_t) + entry.name.size() + 2 * entry.shape.length * sizeof(int64_t) + 2 * sizeof(uint64_t);
+
+        List<uint64_t> offsets;
+        size_t offset = headerSize;
+        for (const Entry& entry : this->entries) {
+            offset = (offset + TENSOR_FILE_ALIGNMENT - 1) / TENSOR_FILE_ALIGNMENT * TENSOR_FILE_ALIGNMENT;
+            offsets.push_back(offset);
+            offset += entry.length * dtypeSize(entry.dtype); }
+
+        // Write the header
+        String header = TENSOR_FILE_MAGIC;
+        append<uint32_t>(header, TENSOR_FILE_VERSION);
+        append<uint64_t>(header, this->entries.size());
+        for (size_t i = 0; i < this->entries.size(); i++) {
+            const Entry& entry = this->entries[i];
+            append<uint32_t>(header, entry.name.size());
+            header += entry.name;
+            append<uint32_t>(header, (uint32_t) entry.dtype);
+            append<uint32_t>(header, entry.shape.length);
+            for (size_t d = 0; d < entry.shape.length; d++)
+                append<int64_t>(header, entry.shape[d]);
+            for (size_t d = 0; d < entry.shape.length; d++)
+                append<int64_t>(header, entry.stride[d]);
+            append<uint64_t>(header, offsets[i]);
+            append<uint64_t>(header, entry.length); }
+
+        // Write the data, padding each tensor out to its offset
+        bool ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+        size_t position = header.size();
+        for (size_t i = 0; i < this->entries.size() && ok; i++) {
+            const Entry& entry = this->entries[i];
+            String padding(offsets[i] - position, '\0');
+            size_t bytes = entry.length * dtypeSize(entry.dtype);
+            ok = std::fwrite(padding.data(), 1, padding.size(), file) == padding.size() &&
+                 std::fwrite(entry.data, 1, bytes, file) == bytes;
+            position = offsets[i] + bytes; }
+
+        if (std::fclose(file) != 0 || !ok)
+            throw "TensorWriter.write - Couldn't write the file"; }
+
+
+    // Helper methods
+
+    template <typename I> static void append (String& output, I value) {
+        output.append((const char*) &value, sizeof(I)); }};
+
+
+#endif
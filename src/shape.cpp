@@ -4,76 +4,116 @@
 #include "core.cpp"
 
 
+// Shapes (and strides, which are stored as shapes too) keep their dimensions in
+// a fixed-size array inside the struct, rather than on the heap. Tensors never
+// have very many dimensions, and this way creating, copying and destroying one
+// doesn't involve the allocator at all, which matters for ops on small tensors,
+// where building the output's shape and stride can take longer than the math.
+// Since a shape is just a few ints, it's trivially copyable, and moving one is
+// the same as copying it.
+
+#define MAX_DIMENSIONS 8
+
 struct Shape {
     size_t length;
-    int* dimensions;
+    int dimensions[MAX_DIMENSIONS];
 
     // Constructors
 
     // Basic constructors
-    Shape () : length(0), dimensions(NULL) { }
-    Shape (int n) : length(1), dimensions(new int[1]) {
-        this->dimensions[0] = n; }
+    constexpr Shape () : length(0), dimensions() { }
+    constexpr Shape (int n) : length(1), dimensions{ n } { }
 
-    // Vector constructors
-    template <typename... Args> Shape (int n, Args... rest) :
-        Shape(List<int>({ n }), rest...) { }
-    template <typename... Args> Shape (List<int> dimensions, int n, Args... rest) :
-        Shape(push(dimensions, n), rest...) { }
+    // Variadic constructor
+    template <typename... Args> constexpr Shape (int n, int m, Args... rest) :
+        length(2 + sizeof...(Args)), dimensions{ n, m, static_cast<int>(rest)... } {
+        static_assert(2 + sizeof...(Args) <= MAX_DIMENSIONS, "Shape - Too many dimensions"); }
 
-    Shape (List<int> dimensions) : length(dimensions.size()), dimensions(new int[dimensions.size()]) {
-        std::copy(dimensions.begin(), dimensions.end(), this->dimensions); }
+    // Vector constructor
+    Shape (const List<int>& dimensions) : Shape(dimensions.size(), dimensions.data()) { }
 
     // Array constructor
-    Shape (size_t length, int* dimensions) : length(length), dimensions(dimensions) { }
-
-    // Copy constructor
-    Shape (const Shape& other) : length(other.length), dimensions(new int[other.length]) {
-        std::copy(other.dimensions, &other.dimensions[other.length], this->dimensions); }
-
-
-    // Destructor
-
-    ~Shape () {
-        if (this->dimensions)
-            delete[] this->dimensions; }
+    Shape (size_t length, const int* dimensions) : length(length), dimensions() {
+        if (length > MAX_DIMENSIONS)
+            throw "Shape - Too many dimensions";
+        std::copy(dimensions, &dimensions[length], this->dimensions); }
+
+    // Returns a shape with `length` dimensions, all equal to `value`
+    static Shape filled (size_t length, int value) {
+        Shape result;
+        result.resize(length);
+        std::fill(result.dimensions, &result.dimensions[length], value);
+        return result; }
 
 
     // Helper methods
 
     String toString () const {
-        return "Shape(" + join(map(this->length, this->dimensions, stringFromType(int))) + ")"; }
+        return "Shape(" + join(map(List<int>(this->dimensions, &this->dimensions[this->length]), stringFromType(int))) + ")"; }
 
     size_t volume () const {
-        int result = 1;
+        size_t result = 1;
         for (int i = 0; i < this->length; i++)
             result *= this->dimensions[i];
         return result; }
 
-    Shape flattenDimension (int dim) {
+    // Product of dimensions [begin, end)
+    size_t volume (int begin, int end) const {
+        size_t result = 1;
+        for (int i = begin; i < end; i++)
+            result *= this->dimensions[i];
+        return result; }
+
+    // Sets the number of dimensions, leaving the values of any new ones undefined
+    void resize (size_t length) {
+        if (length > MAX_DIMENSIONS)
+            throw "Shape - Too many dimensions";
+        this->length = length; }
+
+    Shape flattenDimension (int dim) const {
         if (dim < 0)
             dim = this->length + dim;
         if (dim < 0 || dim >= this->length)
             throw "Shape.flattenDimension - Index out of range";
 
-        let newShape = Shape(*this);
-        newShape[dim] = 1;
+        Shape newShape = *this;
+        newShape.dimensions[dim] = 1;
         return newShape;
     }
 
+    // Returns a shape with `value` inserted before dimension `dim` (or at the end)
+    Shape insertDimension (int dim, int value) const {
+        if (dim < 0 || (size_t) dim > this->length)
+            throw "Shape.insertDimension - Index out of range";
 
-    // Operator overloads for Shape
+        Shape newShape;
+        newShape.resize(this->length + 1);
+        std::copy(this->dimensions, this->dimensions + dim, newShape.dimensions);
+        newShape.dimensions[dim] = value;
+        std::copy(this->dimensions + dim, this->dimensions + this->length, newShape.dimensions + dim + 1);
+        return newShape; }
 
-    Shape& operator= (const Shape& other) {
-    	if (this == &other) return *this;
+    // Returns a shape without dimension `dim`
+    Shape removeDimension (int dim) const {
+        if (dim < 0 || (size_t) dim >= this->length)
+            throw "Shape.removeDimension - Index out of range";
+
+        Shape newShape;
+        newShape.resize(this->length - 1);
+        std::copy(this->dimensions, this->dimensions + dim, newShape.dimensions);
+        std::copy(this->dimensions + dim + 1, this->dimensions + this->length, newShape.dimensions + dim);
+        return newShape; }
+
+
+    // Operator overloads for Shape
 
-	    if (this->dimensions) delete[] this->dimensions;
-        this->length = other.length;
-        this->dimensions = new int[other.length];
-        std::copy(other.dimensions, &other.dimensions[other.length], this->dimensions);
-        return *this; }
+    int& operator[] (int i) {
+        if (i < 0) i = this->length + i;
+        if (i < 0 || (size_t) i >= this->length)
+             throw "Shape[] - Index out of range";
+        else return this->dimensions[i]; }
 
-    int& operator[] (int i) const {
+    int operator[] (int i) const {
         if (i < 0) i = this->length + i;
         if (i < 0 || i >= this->length)
              throw "Shape[] - Index out of range";
@@ -106,40 +146,127 @@ bool shapesAreCompatible (const Shape& a, const Shape& b) {
     return true; }
 
 Shape getBroadcastedShape (const Shape& a, const Shape& b) {
-    size_t num_dimensions = std::max(a.length, b.length);
-    int* dimensions = new int[num_dimensions];
+    Shape result;
+    result.resize(std::max(a.length, b.length));
 
-    for (int i = 0; i < num_dimensions; i++) {
+    for (size_t i = 0; i < result.length; i++) {
         if (i >= a.length)
-            dimensions[i] = b[i];
+            result.dimensions[i] = b.dimensions[i];
         else if (i >= b.length)
-            dimensions[i] = a[i];
-        else if (a[i] == 1 || b[i] == 1 || a[i] == b[i])
-            dimensions[i] = std::max(a[i], b[i]);
+            result.dimensions[i] = a.dimensions[i];
+        else if (a.dimensions[i] == 1 || b.dimensions[i] == 1 || a.dimensions[i] == b.dimensions[i])
+            result.dimensions[i] = std::max(a.dimensions[i], b.dimensions[i]);
         else
             throw "These tensor shapes aren't compatible with each other!"; }
 
-    return Shape(num_dimensions, dimensions); }
+    return result; }
 
 Shape getStrideForShape (const Shape& shape) {
-    size_t volume = shape.volume();
-    int* strides = new int[shape.length];
+    Shape strides;
+    strides.resize(shape.length);
 
     for (int i = shape.length - 1; i >= 0; i--) {
         if (i == shape.length - 1)
-             strides[i] = 1;
-        else strides[i] = strides[i + 1] * shape[i + 1]; }
+             strides.dimensions[i] = 1;
+        else strides.dimensions[i] = strides.dimensions[i + 1] * shape.dimensions[i + 1]; }
+
+    return strides; }
+
+// Whether a tensor with the given shape and stride has its elements laid out
+// contiguously in row-major order, like a new tensor would. Dimensions of size 1
+// can have any stride, since they're never stepped along.
+bool isContiguousStride (const Shape& shape, const Shape& stride) {
+    int expected = 1;
+    for (int i = shape.length - 1; i >= 0; i--) {
+        if (shape.dimensions[i] == 1)
+            continue;
+        if (stride.dimensions[i] != expected)
+            return false;
+        expected *= shape.dimensions[i]; }
+    return true; }
+
+// Whether a tensor with the given shape and stride covers a contiguous block of
+// memory with no gaps, in any order, like a permuted contiguous tensor does
+bool isDenseStride (const Shape& shape, const Shape& stride) {
+    int order[MAX_DIMENSIONS], n = 0;
+    for (size_t i = 0; i < shape.length; i++)
+        if (shape.dimensions[i] != 1) order[n++] = i;
+
+    // Sort the dimensions by stride, with an insertion sort since there are at
+    // most MAX_DIMENSIONS of them
+    for (int k = 1; k < n; k++) {
+        int d = order[k], j = k;
+        for (; j > 0 && stride.dimensions[order[j - 1]] > stride.dimensions[d]; j--)
+            order[j] = order[j - 1];
+        order[j] = d; }
+
+    int expected = 1;
+    for (int k = 0; k < n; k++) {
+        if (stride.dimensions[order[k]] != expected)
+            return false;
+        expected *= shape.dimensions[order[k]]; }
+    return true; }
+
+// Fills in a dimension of -1 in `newShape` so that it has `volume` elements
+Shape inferShape (const Shape& newShape, size_t volume) {
+    Shape result = newShape;
+    int inferred = -1;
+    size_t known = 1;
+    for (size_t i = 0; i < result.length; i++) {
+        if (result.dimensions[i] != -1)
+            known *= result.dimensions[i];
+        else if (inferred >= 0)
+            throw "inferShape - Only one dimension can be inferred";
+        else inferred = i; }
+
+    if (inferred >= 0 && known > 0 && volume % known == 0)
+        result.dimensions[inferred] = volume / known;
+    if (result.volume() != volume)
+        throw "inferShape - The new shape doesn't have the same number of elements";
+    return result; }
+
+// Finds the strides that view the elements of a tensor with the given shape and
+// stride as `newShape`, in the same row-major order, without moving them. We
+// split the old dimensions into chunks that are each contiguous within
+// themselves, and every chunk has to be made up of whole new dimensions. So the
+// rows of a transposed matrix can be split in two, but the whole transposed
+// matrix can't be flattened. Returns false if there's no such view.
+bool getViewStride (const Shape& shape, const Shape& stride, const Shape& newShape, Shape& newStride) {
+    newStride = Shape::filled(newShape.length, 1);
+    if (shape.length == 0 || shape.volume() == 0) {
+        if (shape.length) newStride = getStrideForShape(newShape);
+        return true; }
+
+    int view = newShape.length - 1;
+    ptrdiff_t chunkStride = stride.dimensions[shape.length - 1];
+    size_t chunkSize = 1, viewSize = 1;
+    for (int d = shape.length - 1; d >= 0; d--) {
+        chunkSize *= shape.dimensions[d];
+        if (d > 0 && (shape.dimensions[d - 1] == 1 || stride.dimensions[d - 1] == (ptrdiff_t) chunkSize * chunkStride))
+            continue;
+
+        // The chunk ends here, so hand it out to the new dimensions
+        while (view >= 0 && (viewSize < chunkSize || newShape.dimensions[view] == 1)) {
+            newStride.dimensions[view] = viewSize * chunkStride;
+            viewSize *= newShape.dimensions[view];
+            view--; }
+        if (viewSize != chunkSize)
+            return false;
+        if (d > 0) {
+            chunkStride = stride.dimensions[d - 1];
+            chunkSize = viewSize = 1; }}
 
-    return Shape(shape.length, strides); }
+    return view == -1; }
 
 Shape permuteShape (const Shape& shape, const List<int>& ordering) {
     if (ordering.size() != shape.length)
         throw "permuteShape - The given ordering doesn't have the same number of elements as the shape being permuted";
 
-    let shapeData = List<int>();
-    for (int dim : ordering)
-        shapeData.push_back(shape[dim]);
-    return Shape(shapeData); }
+    Shape result;
+    result.resize(shape.length);
+    for (size_t i = 0; i < shape.length; i++)
+        result.dimensions[i] = shape[ordering[i]];
+    return result; }
 
 
 
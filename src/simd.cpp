@@ -0,0 +1,250 @@
+#ifndef __SIMD__
+#define __SIMD__
+
+#include "core.cpp"
+#include <cstring>
+#include <type_traits>
+
+
+// Vectorized kernels for the elementwise ops and reductions in tensor.cpp. Each
+// kernel is written once against GCC/Clang vector extensions, which give us
+// fixed-width SIMD registers with the usual arithmetic operators, and is then
+// instantiated for each instruction set we support (SSE4.1, AVX2 and AVX-512)
+// with a `target` attribute. The instruction set is picked at runtime with
+// CPUID, so the same binary runs on any x86 machine, and falls back to plain
+// scalar loops everywhere else. All of these kernels work on contiguous runs of
+// elements, and the StridedIterator is responsible for handing them the longest
+// runs that it can.
+
+enum class SimdLevel { Scalar, SSE, AVX2, AVX512 };
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#endif
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+
+// The vector types never cross a real function boundary (every kernel is inlined
+// into its entry point), so GCC's warnings about the vector ABI don't apply to us
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+// Runs shorter than this don't make up for the cost of dispatching
+#define SIMD_MIN_LENGTH 16
+
+
+// Instruction set detection
+
+SimdLevel detectSimdLevel () {
+    #ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SimdLevel::SSE;
+    #endif
+    return SimdLevel::Scalar; }
+
+// The instruction set that the kernels currently dispatch to. This defaults to
+// the best one the CPU supports, but can be lowered (e.g. for benchmarking).
+SimdLevel& simdLevel () {
+    static SimdLevel level = detectSimdLevel();
+    return level; }
+
+void setSimdLevel (SimdLevel level) {
+    if (level > detectSimdLevel())
+        throw "setSimdLevel - This CPU doesn't support the requested instruction set";
+    simdLevel() = level; }
+
+String simdLevelName (SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE: return "sse4.1";
+        default: return "scalar"; }}
+
+
+// Operators. These are applied to both scalars and whole vector registers.
+
+struct AddOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a + b; }};
+struct SubOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a - b; }};
+struct MulOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a * b; }};
+struct DivOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a / b; }};
+struct MaxOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a > b ? a : b; }};
+struct MinOp { template <typename V> static SIMD_INLINE V apply (const V& a, const V& b) { return a < b ? a : b; }};
+
+
+// Generic kernels. `Bytes` is the register width, and all of these get inlined
+// into the per-instruction-set entry points below, which is where the vector
+// types actually get lowered to SSE/AVX2/AVX-512 instructions.
+
+template <typename T, size_t Bytes> struct SimdVector {
+    typedef T type __attribute__((vector_size(Bytes)));
+    static const size_t width = Bytes / sizeof(T);
+
+    static SIMD_INLINE type load (const T* p) { type v; std::memcpy(&v, p, sizeof(v)); return v; }
+    static SIMD_INLINE void store (T* p, const type& v) { std::memcpy(p, &v, sizeof(v)); }
+    static SIMD_INLINE type broadcast (T x) { return type() + x; }};
+
+// out[i] = a[i * sa] op b[i * sb], where each of `sa` and `sb` is either 0 or 1
+template <typename T, size_t Bytes, typename Op> SIMD_INLINE
+void binaryKernel (size_t n, T* out, const T* a, ptrdiff_t sa, const T* b, ptrdiff_t sb) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+
+    if (sa && sb) {
+        for (; i + w <= n; i += w)
+            V::store(out + i, Op::apply(V::load(a + i), V::load(b + i))); }
+    else if (sa) {
+        typename V::type y = V::broadcast(b[0]);
+        for (; i + w <= n; i += w)
+            V::store(out + i, Op::apply(V::load(a + i), y)); }
+    else if (sb) {
+        typename V::type x = V::broadcast(a[0]);
+        for (; i + w <= n; i += w)
+            V::store(out + i, Op::apply(x, V::load(b + i))); }
+
+    for (; i < n; i++)
+        out[i] = Op::apply(a[i * sa], b[i * sb]); }
+
+// Folds `row` with `Op`, starting from `initial`. We keep four independent
+// accumulators so that the loop isn't bound by the latency of a single chain.
+template <typename T, size_t Bytes, typename Op> SIMD_INLINE
+T foldKernel (size_t n, const T* row, T initial) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+    T result = initial;
+
+    if (n >= 4 * w) {
+        typename V::type acc0 = V::load(row), acc1 = V::load(row + w),
+                         acc2 = V::load(row + 2 * w), acc3 = V::load(row + 3 * w);
+        for (i = 4 * w; i + 4 * w <= n; i += 4 * w) {
+            acc0 = Op::apply(acc0, V::load(row + i));
+            acc1 = Op::apply(acc1, V::load(row + i + w));
+            acc2 = Op::apply(acc2, V::load(row + i + 2 * w));
+            acc3 = Op::apply(acc3, V::load(row + i + 3 * w)); }
+        for (; i + w <= n; i += w)
+            acc0 = Op::apply(acc0, V::load(row + i));
+
+        acc0 = Op::apply(Op::apply(acc0, acc1), Op::apply(acc2, acc3));
+        T lanes[w];
+        V::store(lanes, acc0);
+        for (size_t k = 0; k < w; k++)
+            result = Op::apply(result, lanes[k]); }
+
+    for (; i < n; i++)
+        result = Op::apply(result, row[i]);
+    return result; }
+
+
+// Per-instruction-set entry points
+
+#define simdEntryPoints(suffix, isa, bytes)                                     \
+template <typename T, typename Op> __attribute__((target(isa)))                \
+void binary##suffix (size_t n, T* out, const T* a, ptrdiff_t sa, const T* b, ptrdiff_t sb) { \
+    binaryKernel<T, bytes, Op>(n, out, a, sa, b, sb); }                         \
+                                                                                \
+template <typename T, typename Op> __attribute__((target(isa)))                \
+T fold##suffix (size_t n, const T* row, T initial) {                            \
+    return foldKernel<T, bytes, Op>(n, row, initial); }
+
+#ifdef SIMD_X86
+simdEntryPoints(SSE, "sse4.1", 16);
+simdEntryPoints(AVX2, "avx2", 32);
+simdEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+
+// Dispatchers. These are what the rest of BTen calls.
+
+// Computes out[i] = a[i * sa] op b[i * sb] for a contiguous `out`. The inputs
+// can be contiguous (stride 1), broadcast (stride 0) or arbitrarily strided,
+// although only the first two cases are vectorized.
+template <typename T, typename Op>
+void simdBinary (size_t n, T* out, const T* a, ptrdiff_t sa, const T* b, ptrdiff_t sb, std::true_type) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH && (sa == 0 || sa == 1) && (sb == 0 || sb == 1) && (sa || sb)) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return binaryAVX512<T, Op>(n, out, a, sa, b, sb);
+            case SimdLevel::AVX2: return binaryAVX2<T, Op>(n, out, a, sa, b, sb);
+            case SimdLevel::SSE: return binarySSE<T, Op>(n, out, a, sa, b, sb);
+            default: break; }}
+    #endif
+
+    for (size_t i = 0; i < n; i++)
+        out[i] = Op::apply(a[i * sa], b[i * sb]); }
+
+// Folds a contiguous row with `Op`, starting from `initial`
+template <typename T, typename Op> T simdFold (size_t n, const T* row, T initial, std::true_type) {
+    #ifdef SIMD_X86
+    if (n >= SIMD_MIN_LENGTH) {
+        switch (simdLevel()) {
+            case SimdLevel::AVX512: return foldAVX512<T, Op>(n, row, initial);
+            case SimdLevel::AVX2: return foldAVX2<T, Op>(n, row, initial);
+            case SimdLevel::SSE: return foldSSE<T, Op>(n, row, initial);
+            default: break; }}
+    #endif
+
+    T result = initial;
+    for (size_t i = 0; i < n; i++)
+        result = Op::apply(result, row[i]);
+    return result; }
+
+// Storage types like bf16 and f16 (see half.cpp) don't have any arithmetic of
+// their own, so these convert them to floats a tile of WIDEN_TILE elements at a
+// time, run the float kernel on the tile, and round the results back
+#define WIDEN_TILE 256
+
+template <typename T> void convertToFloat (size_t n, const T* in, float* out);
+template <typename T> void convertFromFloat (size_t n, const float* in, T* out);
+
+// Converts `n` values of `a` with stride `step` (where a step of 0 only needs
+// the first value), and returns the stride of the floats
+template <typename T> ptrdiff_t widen (size_t n, const T* a, ptrdiff_t step, float* out) {
+    if (step == 1) convertToFloat(n, a, out);
+    else if (step == 0) out[0] = a[0];
+    else for (size_t i = 0; i < n; i++) out[i] = a[i * step];
+    return step ? 1 : 0; }
+
+template <typename T, typename Op>
+void simdBinary (size_t n, T* out, const T* a, ptrdiff_t sa, const T* b, ptrdiff_t sb, std::false_type) {
+    float x[WIDEN_TILE], y[WIDEN_TILE], z[WIDEN_TILE];
+    for (size_t i = 0; i < n; i += WIDEN_TILE) {
+        size_t m = std::min((size_t) WIDEN_TILE, n - i);
+        ptrdiff_t sx = widen(m, a + i * sa, sa, x), sy = widen(m, b + i * sb, sb, y);
+        simdBinary<float, Op>(m, z, x, sx, y, sy, std::true_type());
+        convertFromFloat(m, z, out + i); }}
+
+template <typename T, typename Op> T simdFold (size_t n, const T* row, T initial, std::false_type) {
+    float x[WIDEN_TILE], result = initial;
+    for (size_t i = 0; i < n; i += WIDEN_TILE) {
+        size_t m = std::min((size_t) WIDEN_TILE, n - i);
+        convertToFloat(m, row + i, x);
+        result = simdFold<float, Op>(m, x, result, std::true_type()); }
+    return result; }
+
+template <typename T, typename Op>
+void simdBinary (size_t n, T* out, const T* a, ptrdiff_t sa, const T* b, ptrdiff_t sb) {
+    simdBinary<T, Op>(n, out, a, sa, b, sb, std::is_arithmetic<T>()); }
+
+template <typename T, typename Op> T simdFold (size_t n, const T* row, T initial) {
+    return simdFold<T, Op>(n, row, initial, std::is_arithmetic<T>()); }
+
+template <typename T> T simdSum (size_t n, const T* row) { return simdFold<T, AddOp>(n, row, 0); }
+template <typename T> T simdMax (size_t n, const T* row) { return simdFold<T, MaxOp>(n, row, row[0]); }
+template <typename T> T simdMin (size_t n, const T* row) { return simdFold<T, MinOp>(n, row, row[0]); }
+
+// Argmax/argmin take two passes: a vectorized pass to find the extreme value, and
+// then a search for its first occurrence, which usually stops well before the end.
+// (If the extreme value is a NaN the search won't find it, and we fall back to 0.)
+template <typename T> size_t simdArgmax (size_t n, const T* row) {
+    size_t i = std::find(row, row + n, simdMax(n, row)) - row;
+    return i < n ? i : 0; }
+template <typename T> size_t simdArgmin (size_t n, const T* row) {
+    size_t i = std::find(row, row + n, simdMin(n, row)) - row;
+    return i < n ? i : 0; }
+
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef __SOFTMAX__
+#define __SOFTMAX__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "math.cpp"
+
+
+// Fused softmax, log-softmax and logsumexp along a dimension. All three need
+// the max of the values along the dimension (subtracting it keeps the exps from
+// overflowing) and the sum of exp(x - max). Softmax then writes exp(x - max) / sum
+// and log-softmax writes x - max - log(sum).
+//
+// The exps are what limit the speed of these ops, so we try to only take one per
+// element. When the dimension is contiguous, we find the max of each row with
+// simdMax first, and then take a second pass to sum the exps, which for softmax
+// also writes them to the output, so all that's left is to scale the output by
+// 1 / sum (rows are short enough that the second and third passes read them from
+// the cache). Otherwise, the dimension is strided, and we process up to
+// SOFTMAX_COLUMNS neighbouring rows at once instead, which are usually adjacent
+// in memory (like the columns of a matrix when taking the softmax along dim 0),
+// a vector register at a time. Here we find the max and the sum in a single pass
+// with an online update: each column keeps a running max m and sum, and once
+// every SOFTMAX_BLOCK elements, the max goes up to m' and the sum gets multiplied
+// by exp(m - m'), which costs a fraction of an exp per element. Either way the
+// exps come from expVector, and every row is only ever handled by one thread,
+// so the results don't depend on the thread count.
+//
+// Rows with infinities would take exp(inf - inf) if we subtracted an infinite
+// max, so the max gets clamped to the finite range first. A row with +inf then
+// sums to +inf, which is its logsumexp, and a fully masked row (all -inf) sums
+// to 0, whose logsumexp is -inf. Its softmax comes out as all zeros and its
+// log-softmax as all -inf, on the contiguous and strided paths alike.
+
+#define SOFTMAX_BLOCK 8
+#define SOFTMAX_COLUMNS 64
+
+enum class SoftmaxMode { Softmax, LogSoftmax, LogSumExp };
+
+
+// Kernels
+
+// Returns the sum of exp(x - max) over the contiguous `row`, and writes the exps
+// to `output` too, unless it's NULL
+template <typename T, size_t Bytes> SIMD_INLINE T softmaxExpSumKernel (size_t n, const T* row, T* output, T max) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width;
+    typename V::type sum = V::broadcast(0), shift = V::broadcast(max);
+    size_t i = 0;
+    for (; i + w <= n; i += w) {
+        typename V::type y = expVector<T, Bytes>(V::load(row + i) - shift);
+        if (output) V::store(output + i, y);
+        sum += y; }
+
+    T lanes[w], result = 0;
+    V::store(lanes, sum);
+    for (size_t k = 0; k < w; k++)
+        result += lanes[k];
+    for (; i < n; i++) {
+        T y = fastExp(row[i] - max);
+        if (output) output[i] = y;
+        result += y; }
+    return result; }
+
+// Finds the max and sum of exps of `columns` neighbouring rows at once, where
+// element d of row c is at input[d * step + c]. `columns` has to be a multiple
+// of the vector width.
+template <typename T, size_t Bytes> SIMD_INLINE
+void softmaxColumnKernel (size_t length, size_t columns, const T* input, ptrdiff_t step, T* max, T* sum) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width, groups = columns / w;
+    typename V::type m[SOFTMAX_COLUMNS / V::width], s[SOFTMAX_COLUMNS / V::width], blockMax[SOFTMAX_COLUMNS / V::width];
+    for (size_t g = 0; g < groups; g++) {
+        m[g] = V::broadcast(std::numeric_limits<T>::lowest());
+        s[g] = V::broadcast(0); }
+
+    for (size_t d = 0; d < length; d += SOFTMAX_BLOCK) {
+        size_t end = std::min(length, d + SOFTMAX_BLOCK);
+        for (size_t g = 0; g < groups; g++)
+            blockMax[g] = m[g];
+        for (size_t k = d; k < end; k++)
+            for (size_t g = 0; g < groups; g++)
+                blockMax[g] = MaxOp::apply(blockMax[g], V::load(input + k * step + g * w));
+        for (size_t g = 0; g < groups; g++) {
+            blockMax[g] = MinOp::apply(blockMax[g], V::broadcast(std::numeric_limits<T>::max()));
+            s[g] *= expVector<T, Bytes>(m[g] - blockMax[g]);
+            m[g] = blockMax[g]; }
+        for (size_t k = d; k < end; k++)
+            for (size_t g = 0; g < groups; g++)
+                s[g] += expVector<T, Bytes>(V::load(input + k * step + g * w) - m[g]); }
+
+    for (size_t g = 0; g < groups; g++) {
+        V::store(max + g * w, m[g]);
+        V::store(sum + g * w, s[g]); }}
+
+// Writes the output for `columns` neighbouring rows, given the `shift` and
+// `scale` for each one. Softmax is exp(x - shift) * scale, with shift = max and
+// scale = 1 / sum, and log-softmax is x - shift, with shift = max + log(sum).
+// `columns` has to be a multiple of the vector width.
+template <typename T, size_t Bytes> SIMD_INLINE
+void softmaxApplyKernel (size_t length, size_t columns, const T* input, ptrdiff_t step,
+                         T* output, ptrdiff_t outputStep, const T* shift, const T* scale, bool log) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width, groups = columns / w;
+    typename V::type a[SOFTMAX_COLUMNS / V::width], b[SOFTMAX_COLUMNS / V::width];
+    for (size_t g = 0; g < groups; g++) {
+        a[g] = V::load(shift + g * w);
+        b[g] = V::load(scale + g * w); }
+
+    for (size_t d = 0; d < length; d++) {
+        const T* x = input + d * step;
+        T* y = output + d * outputStep;
+        if (log) for (size_t g = 0; g < groups; g++)
+            V::store(y + g * w, V::load(x + g * w) - a[g]);
+        else for (size_t g = 0; g < groups; g++)
+            V::store(y + g * w, expVector<T, Bytes>(V::load(x + g * w) - a[g]) * b[g]); }}
+
+
+// Per-instruction-set entry points. The column kernels take as many columns as
+// they can a whole vector register at a time, and the rest one at a time.
+
+#define softmaxEntryPoints(suffix, attributes, bytes)                           \
+template <typename T> attributes                                               \
+T softmaxExpSum##suffix (size_t n, const T* row, T* output, T max) {           \
+    return softmaxExpSumKernel<T, bytes>(n, row, output, max); }                \
+                                                                                \
+template <typename T> attributes                                               \
+void softmaxColumns##suffix (size_t length, size_t columns, const T* input, ptrdiff_t step, T* max, T* sum) { \
+    size_t c = columns / (bytes / sizeof(T)) * (bytes / sizeof(T));             \
+    softmaxColumnKernel<T, bytes>(length, c, input, step, max, sum);            \
+    softmaxColumnKernel<T, sizeof(T)>(length, columns - c, input + c, step, max + c, sum + c); } \
+                                                                                \
+template <typename T> attributes                                               \
+void softmaxApply##suffix (size_t length, size_t columns, const T* input, ptrdiff_t step, \
+                           T* output, ptrdiff_t outputStep, const T* shift, const T* scale, bool log) { \
+    size_t c = columns / (bytes / sizeof(T)) * (bytes / sizeof(T));             \
+    softmaxApplyKernel<T, bytes>(length, c, input, step, output, outputStep, shift, scale, log); \
+    softmaxApplyKernel<T, sizeof(T)>(length, columns - c, input + c, step, output + c, outputStep, shift + c, scale + c, log); }
+
+#ifdef SIMD_X86
+softmaxEntryPoints(SSE, __attribute__((target("sse4.1"))), 16);
+softmaxEntryPoints(AVX2, __attribute__((target("avx2"))), 32);
+softmaxEntryPoints(AVX512, __attribute__((target("avx512f"))), 64);
+#endif
+softmaxEntryPoints(Scalar, , sizeof(T));
+
+// Calls the entry point `name` for the current instruction set
+#ifdef SIMD_X86
+#define softmaxDispatch(name, ...)                                              \
+    switch (simdLevel()) {                                                      \
+        case SimdLevel::AVX512: return name##AVX512(__VA_ARGS__);               \
+        case SimdLevel::AVX2: return name##AVX2(__VA_ARGS__);                   \
+        case SimdLevel::SSE: return name##SSE(__VA_ARGS__);                     \
+        default: return name##Scalar(__VA_ARGS__); }
+#else
+#define softmaxDispatch(name, ...) return name##Scalar(__VA_ARGS__);
+#endif
+
+template <typename T> T softmaxExpSum (size_t n, const T* row, T* output, T max) {
+    softmaxDispatch(softmaxExpSum, n, row, output, max); }
+template <typename T> void softmaxColumns (size_t length, size_t columns, const T* input, ptrdiff_t step, T* max, T* sum) {
+    softmaxDispatch(softmaxColumns, length, columns, input, step, max, sum); }
+template <typename T> void softmaxApply (size_t length, size_t columns, const T* input, ptrdiff_t step,
+                                         T* output, ptrdiff_t outputStep, const T* shift, const T* scale, bool log) {
+    softmaxDispatch(softmaxApply, length, columns, input, step, output, outputStep, shift, scale, log); }
+
+
+// Driver
+
+// Computes `mode` along dimension `dim` of the tensor with the given data, shape
+// and stride, writing the result into `output`. For softmax and log-softmax the
+// output has the same shape as the input, and for logsumexp it has `dim` set to
+// 1, but either way we only need its stride, since we walk every dimension but
+// `dim` with the same iterator.
+template <typename T> void softmaxForward (const T* input, const Shape& shape, const Shape& stride, int dim,
+                                           T* output, const Shape& outputStride, SoftmaxMode mode) {
+    Shape outerShape = shape.flattenDimension(dim);
+    size_t length = shape[dim];
+    ptrdiff_t step = stride[dim], outputStep = outputStride[dim];
+    bool log = mode == SoftmaxMode::LogSoftmax;
+    let plan = StridedIterator(outerShape, { stride, outputStride });
+    size_t grain = std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, length));
+
+    parallelFor(0, outerShape.volume(), grain, [&] (size_t begin, size_t end) {
+        T max[SOFTMAX_COLUMNS], sum[SOFTMAX_COLUMNS], shift[SOFTMAX_COLUMNS], scale[SOFTMAX_COLUMNS];
+        let it = plan;
+        it.limit(begin, end);
+        for (; !it.done(); it.next()) {
+            // Contiguous rows get handled one at a time, and otherwise we take as
+            // many neighbouring rows at once as are adjacent in both the input and
+            // the output (or just one)
+            size_t columns = step == 1 ? 1 : it.stride[0] != 1 ? 1 :
+                mode != SoftmaxMode::LogSumExp && it.stride[1] != 1 ? 1 : SOFTMAX_COLUMNS;
+
+            for (size_t j = 0; j < it.size; j += columns) {
+                size_t n = std::min(columns, it.size - j);
+                const T* x = input + it.offset[0] + j * it.stride[0];
+                T* y = output + it.offset[1] + j * it.stride[1];
+
+                if (step == 1) {
+                    max[0] = std::min(std::max(simdMax(length, x), std::numeric_limits<T>::lowest()), std::numeric_limits<T>::max());
+                    if (mode == SoftmaxMode::Softmax && outputStep == 1) {
+                        T rowSum = softmaxExpSum(length, x, y, max[0]);
+                        T rowScale = rowSum == 0 ? 0 : 1 / rowSum;
+                        simdBinary<T, MulOp>(length, y, y, 1, &rowScale, 0);
+                        continue; }
+                    sum[0] = softmaxExpSum(length, x, (T*) NULL, max[0]); }
+                else softmaxColumns(length, n, x, step, max, sum);
+
+                if (mode == SoftmaxMode::LogSumExp) {
+                    for (size_t c = 0; c < n; c++)
+                        y[c * it.stride[1]] = max[c] + std::log(sum[c]);
+                    continue; }
+
+                for (size_t c = 0; c < n; c++) {
+                    shift[c] = log && sum[c] != 0 ? max[c] + std::log(sum[c]) : max[c];
+                    scale[c] = sum[c] == 0 ? 0 : 1 / sum[c]; }
+                if (log && step == 1 && outputStep == 1)
+                    simdBinary<T, SubOp>(length, y, x, 1, shift, 0);
+                else softmaxApply(length, n, x, step, y, outputStep, shift, scale, log); }}}); }
+
+
+#endif
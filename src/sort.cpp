@@ -0,0 +1,270 @@
+#ifndef __SORT__
+#define __SORT__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "simd.cpp"
+#include "half.cpp"
+#include "parallel.cpp"
+#include <algorithm>
+
+
+// Sorting and top-k along one dimension of a tensor, for Tensor::sort, argsort
+// and topk. Every row (the elements along the dimension, for one position in
+// the others) is sorted on its own, and the rows get spread across threads.
+// Rows are read through their stride, so a strided dimension doesn't get copied
+// into a contiguous tensor first.
+//
+// Elements are compared by their sort keys: integers that compare the same way
+// as the values do, which for floats are their bits with the rest of the bits
+// of the negative ones flipped. NaNs can have either sign bit (on x86, the ones
+// that arithmetic produces, like 0 / 0, have it set), so every NaN gets the
+// largest key before that, which puts them all after infinity, rather than
+// breaking the comparisons, and -0.0 gets the same key as 0.0, since they're
+// equal. Descending sorts flip the bits of the keys, and ties always keep the
+// order of their indices, so the results are the same as a stable sort's, and
+// don't depend on the algorithm or the number of threads. The sorted values get
+// read back from the input by index, so they keep their signs and payloads.
+//
+// Full sorts load a row's keys, along with their indices, and sort them with an
+// LSD radix sort, a byte at a time, skipping the bytes that are the same in
+// every key. Top-k with small k instead streams the row through a heap of the
+// best k elements so far, and only looks at the elements in a tile when the
+// best one in it beats the worst one in the heap, which a vectorized pass over
+// the tile checks. After the first few thousand elements that's almost never
+// true, so the heap is nearly free, and the pass runs at memory speed. Long
+// rows get split into chunks of SORT_TOPK_CHUNK elements, whose own top k get
+// merged at the end, so even a single row is spread across threads.
+
+#define SORT_RADIX_LENGTH 256       // Shortest row to get a radix sort, rather than a comparison sort
+#define SORT_HEAP_RATIO 16          // Top-k uses a heap when k is at most this fraction of the row
+#define SORT_TILE 256               // Elements that the top-k heap checks at once
+#define SORT_TOPK_CHUNK (1 << 16)   // Elements in each thread's share of a row for top-k
+
+// What `sort` and `topk` return (see tensor.cpp)
+template <typename T> struct SortResult;
+
+
+// Sort keys. `SortKey<T>::apply` maps the bits of a value to its key, and back,
+// for scalars and vector registers alike.
+
+template <typename T, bool Float = std::is_floating_point<T>::value> struct SortKey {
+    typedef T type;
+    template <typename V> static SIMD_INLINE V apply (const V& x) { return x; }};
+
+template <typename T> struct SortKey<T, true> {
+    typedef typename std::conditional<sizeof(T) == 4, int32_t, int64_t>::type type;
+    template <typename V> static SIMD_INLINE V apply (const V& bits) {
+        return bits ^ ((bits >> (8 * sizeof(T) - 1)) & std::numeric_limits<type>::max()); }};
+
+// Ranks are the keys as unsigned integers, flipped for descending orders, so
+// the best element always has the lowest rank
+template <typename T> struct SortRank {
+    typedef typename SortKey<T>::type Key;
+    typedef typename std::make_unsigned<Key>::type type;
+    static const type sign = std::is_signed<Key>::value ? (type) 1 << (8 * sizeof(Key) - 1) : 0;
+
+    static SIMD_INLINE type rank (T x, bool descending) {
+        Key key = x != x ? std::numeric_limits<Key>::max() : SortKey<T>::apply(bitCast<Key>(x == 0 ? (T) 0 : x));
+        return (type) ((type) (descending ? ~key : key) ^ sign); }};
+
+template <typename T> struct Ranked {
+    typename SortRank<T>::type rank;
+    uint32_t index;
+
+    bool operator< (const Ranked<T>& other) const {
+        return this->rank < other.rank || (this->rank == other.rank && this->index < other.index); }};
+
+
+// Vectorized check for whether any element in a tile has a rank below `limit`
+
+template <typename T, size_t Bytes> SIMD_INLINE bool anyBelowKernel (size_t n, const T* tile, typename SortRank<T>::type limit, bool descending) {
+    typedef typename SortKey<T>::type Key;
+    typedef SimdVector<Key, Bytes> V;
+    const size_t w = V::width;
+    const Key threshold = (Key) (limit ^ SortRank<T>::sign);
+    typename V::type flip = V::broadcast(descending ? (Key) -1 : 0), bound = V::broadcast(threshold), found = V::broadcast(0);
+    size_t i = 0;
+
+    // Floats whose magnitude is above infinity's are NaNs, which get the largest
+    // key, and -0.0 gets the same key as 0.0 (see SortRank)
+    const Key largest = std::numeric_limits<Key>::max();
+    const Key infinity = std::is_floating_point<T>::value ? bitCast<Key>(std::numeric_limits<T>::infinity()) : largest;
+    typename V::type magnitude = V::broadcast(std::is_floating_point<T>::value ? largest : (Key) -1), top = V::broadcast(infinity);
+    for (; i + w <= n; i += w) {
+        typename V::type bits = V::load((const Key*) (tile + i));
+        typename V::type nan = (typename V::type) ((bits & magnitude) > top);
+        bits &= ~(typename V::type) ((bits & magnitude) == V::broadcast(0));
+        typename V::type key = (SortKey<T>::apply(bits) & ~nan) | (nan & V::broadcast(largest));
+        found |= (typename V::type) ((key ^ flip) < bound); }
+
+    Key lanes[w];
+    V::store(lanes, found);
+    for (size_t k = 0; k < w; k++)
+        if (lanes[k]) return true;
+    for (; i < n; i++)
+        if (SortRank<T>::rank(tile[i], descending) < limit) return true;
+    return false; }
+
+#define sortEntryPoints(suffix, isa, bytes)                                     \
+template <typename T> __attribute__((target(isa)))                             \
+bool anyBelow##suffix (size_t n, const T* tile, typename SortRank<T>::type limit, bool descending) { \
+    return anyBelowKernel<T, bytes>(n, tile, limit, descending); }
+
+#ifdef SIMD_X86
+sortEntryPoints(SSE, "sse4.1", 16);
+sortEntryPoints(AVX2, "avx2", 32);
+sortEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+template <typename T> bool anyBelow (size_t n, const T* tile, typename SortRank<T>::type limit, bool descending) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return anyBelowAVX512(n, tile, limit, descending);
+        case SimdLevel::AVX2: return anyBelowAVX2(n, tile, limit, descending);
+        case SimdLevel::SSE: return anyBelowSSE(n, tile, limit, descending);
+        default: break; }
+    #endif
+    for (size_t i = 0; i < n; i++)
+        if (SortRank<T>::rank(tile[i], descending) < limit) return true;
+    return false; }
+
+
+// Sorting a row
+
+// Sorts `items` by rank with an LSD radix sort, using `scratch` (with room for
+// as many items) for the passes. Returns whichever of the two ends up sorted.
+template <typename T> Ranked<T>* radixSort (size_t n, Ranked<T>* items, Ranked<T>* scratch) {
+    typedef typename SortRank<T>::type Rank;
+    const int digits = sizeof(Rank);
+    size_t counts[digits][256] = {};
+    for (size_t i = 0; i < n; i++)
+        for (int d = 0; d < digits; d++)
+            counts[d][(items[i].rank >> (8 * d)) & 255]++;
+
+    for (int d = 0; d < digits; d++) {
+        size_t* count = counts[d];
+        if (count[(items[0].rank >> (8 * d)) & 255] == n)
+            continue;
+        size_t total = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = total;
+            total += c; }
+        for (size_t i = 0; i < n; i++)
+            scratch[count[(items[i].rank >> (8 * d)) & 255]++] = items[i];
+        std::swap(items, scratch); }
+    return items; }
+
+// Keeps the k best elements of a row in a max-heap, with the worst one on top
+template <typename T> struct TopK {
+    typedef typename SortRank<T>::type Rank;
+    List<Ranked<T>> heap;
+    size_t k;
+    bool descending;
+
+    TopK (size_t k, bool descending) : k(k), descending(descending) {
+        this->heap.reserve(k); }
+
+    // Adds the elements of a tile that starts at index `start`
+    void add (size_t n, const T* tile, size_t start) {
+        size_t i = 0;
+        for (; i < n && this->heap.size() < this->k; i++) {
+            this->heap.push_back({ SortRank<T>::rank(tile[i], this->descending), (uint32_t) (start + i) });
+            std::push_heap(this->heap.begin(), this->heap.end()); }
+        if (i == n || !anyBelow(n - i, tile + i, this->heap.front().rank, this->descending))
+            return;
+
+        for (; i < n; i++) {
+            Rank rank = SortRank<T>::rank(tile[i], this->descending);
+            if (rank >= this->heap.front().rank)
+                continue;
+            std::pop_heap(this->heap.begin(), this->heap.end());
+            this->heap.back() = { rank, (uint32_t) (start + i) };
+            std::push_heap(this->heap.begin(), this->heap.end()); }}};
+
+// Streams elements [begin, end) of a row, `step` apart, through a heap, a tile
+// at a time (copying the tile first if the row is strided)
+template <typename T> void addRange (TopK<T>& top, const T* row, ptrdiff_t step, size_t begin, size_t end) {
+    T tile[SORT_TILE];
+    for (size_t i = begin; i < end; i += SORT_TILE) {
+        size_t n = std::min((size_t) SORT_TILE, end - i);
+        if (step == 1)
+            top.add(n, row + i, i);
+        else {
+            for (size_t j = 0; j < n; j++)
+                tile[j] = row[(i + j) * step];
+            top.add(n, tile, i); }}}
+
+
+// Sorts every row of the tensor with the given shape and stride along `dim`, and
+// writes the first `k` of each into `values` and `indices` (either of which can
+// be NULL), whose rows are `k` long, with the given stride
+template <typename T> void sortRows (const T* input, const Shape& shape, const Shape& stride, int dim, size_t k, bool descending,
+                                     T* values, size_t* indices, const Shape& outputStride) {
+    size_t n = shape[dim], rows = shape.volume() / std::max((size_t) 1, n);
+    if (!rows || !k)
+        return;
+    ptrdiff_t step = stride[dim], outputStep = outputStride[dim];
+
+    // Offsets of row `r` in the input and the output
+    let rowOffsets = [&] (size_t r, ptrdiff_t& in, ptrdiff_t& out) {
+        in = out = 0;
+        for (int d = shape.length - 1; d >= 0; d--) {
+            if (d == dim) continue;
+            size_t position = r % shape[d];
+            r /= shape[d];
+            in += position * stride[d];
+            out += position * outputStride[d]; }};
+    let write = [&] (const Ranked<T>* sorted, ptrdiff_t in, ptrdiff_t out) {
+        for (size_t j = 0; j < k; j++) {
+            if (values) values[out + j * outputStep] = input[in + (ptrdiff_t) sorted[j].index * step];
+            if (indices) indices[out + j * outputStep] = sorted[j].index; }};
+
+    // Full sorts, and top-k with large k
+    if (k * SORT_HEAP_RATIO > n) {
+        parallelFor(0, rows, std::max((size_t) 1, PARALLEL_GRAIN / n), [&] (size_t begin, size_t end) {
+            List<Ranked<T>> items(n), scratch(n);
+            for (size_t r = begin; r < end; r++) {
+                ptrdiff_t in, out;
+                rowOffsets(r, in, out);
+                const T* row = input + in;
+                for (size_t i = 0; i < n; i++)
+                    items[i] = { SortRank<T>::rank(row[i * step], descending), (uint32_t) i };
+                Ranked<T>* sorted = items.data();
+                if (n >= SORT_RADIX_LENGTH)
+                    sorted = radixSort(n, items.data(), scratch.data());
+                else std::sort(items.begin(), items.end());
+                write(sorted, in, out); }});
+        return; }
+
+    // Top-k with small k. Each work item is a chunk of a row, and the chunks of
+    // a row get merged once they're all done.
+    size_t chunks = (n + SORT_TOPK_CHUNK - 1) / SORT_TOPK_CHUNK;
+    List<Ranked<T>> candidates(rows * chunks * k);
+    List<size_t> counts(rows * chunks);
+    parallelFor(0, rows * chunks, std::max((size_t) 1, PARALLEL_GRAIN / std::min(n, (size_t) SORT_TOPK_CHUNK)), [&] (size_t begin, size_t end) {
+        for (size_t item = begin; item < end; item++) {
+            ptrdiff_t in, out;
+            rowOffsets(item / chunks, in, out);
+            size_t first = item % chunks * SORT_TOPK_CHUNK;
+            TopK<T> top(k, descending);
+            addRange(top, input + in, step, first, std::min(n, first + SORT_TOPK_CHUNK));
+            std::sort(top.heap.begin(), top.heap.end());
+            std::copy(top.heap.begin(), top.heap.end(), candidates.begin() + item * k);
+            counts[item] = top.heap.size(); }});
+
+    parallelFor(0, rows, std::max((size_t) 1, PARALLEL_GRAIN / (chunks * k)), [&] (size_t begin, size_t end) {
+        List<Ranked<T>> merged;
+        for (size_t r = begin; r < end; r++) {
+            ptrdiff_t in, out;
+            rowOffsets(r, in, out);
+            merged.clear();
+            for (size_t c = 0; c < chunks; c++)
+                merged.insert(merged.end(), candidates.begin() + (r * chunks + c) * k,
+                              candidates.begin() + (r * chunks + c) * k + counts[r * chunks + c]);
+            std::partial_sort(merged.begin(), merged.begin() + k, merged.end());
+            write(merged.data(), in, out); }}); }
+
+
+#endif
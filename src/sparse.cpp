@@ -0,0 +1,433 @@
+#ifndef __SPARSE__
+#define __SPARSE__
+
+#include "core.cpp"
+#include "shape.cpp"
+#include "buffer.cpp"
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "parallel.cpp"
+#include "profiler.cpp"
+#include "reduction.cpp"
+
+
+// Sparse matrices. A SparseTensor is a 2-D tensor that only stores its nonzero
+// elements, in compressed sparse row (CSR) form: `values` holds the nonzeros
+// row by row, `columns` holds the column of each one, and row r's nonzeros are
+// the ones from `offsets[r]` up to `offsets[r + 1]`, sorted by column. All three
+// are regular tensors, and they're never written after the sparse tensor is
+// built, so ops that keep the same nonzeros (like multiplying by a dense
+// tensor) share `offsets` and `columns`, and only make new values.
+//
+// Sparse tensors get built from coordinates (COO form, a [2, nnz] tensor of
+// row and column indices, along with their values), where duplicates get added
+// up, or from a dense tensor, whose nonzeros get counted and then copied a
+// row at a time across threads. Everything else works on the CSR form:
+//
+//   - `matmul` multiplies by a dense vector (SpMV) or matrix (SpMM), spreading
+//     the rows across threads. SpMM adds up the dense rows that each nonzero
+//     picks, a tile of SPARSE_TILE columns at a time, with a SIMD kernel that
+//     takes four dense rows at once, so the output gets loaded and stored once
+//     for every four nonzeros. The products add up in the order of the
+//     nonzeros in each row, so the results don't depend on the number of
+//     threads.
+//   - `multiply` (or `*`) multiplies each nonzero by the element of a dense
+//     tensor at its position, with the dense tensor broadcast to the sparse
+//     tensor's shape like in any other elementwise op (so a tensor of shape
+//     [rows] scales each row, and one of shape [1, columns] scales each column).
+//   - `sum(dim)` returns a dense tensor, like the reductions on Tensor.
+//
+// The ops that return dense tensors, and `multiply`, get recorded while a graph
+// is being captured, like the ops on Tensor. The ones that build the sparse
+// structure (`fromCoo`, `fromDense` and `transpose`) depend on the values
+// themselves, so they can't be, and they're treated as constants. Like matmul,
+// none of these get recorded in the autograd graph.
+
+#define SPARSE_TILE 512    // Columns of the dense matrix that SpMM works on at a time
+#define SPARSE_BATCH 64    // Most nonzeros that SpMM gathers the dense rows of at a time
+
+
+// Kernels
+
+// out[i] += a[0] * rows[0][i] + a[1] * rows[1][i] + ... for the first `k` rows,
+// in that order
+template <typename T, size_t Bytes> SIMD_INLINE
+void accumulateKernel (size_t n, T* out, size_t k, const T* a, const T* const* rows) {
+    typedef SimdVector<T, Bytes> V;
+    const size_t w = V::width;
+    size_t j = 0;
+    for (; j + 4 <= k; j += 4) {
+        const T *r0 = rows[j], *r1 = rows[j + 1], *r2 = rows[j + 2], *r3 = rows[j + 3];
+        typename V::type a0 = V::broadcast(a[j]), a1 = V::broadcast(a[j + 1]),
+                         a2 = V::broadcast(a[j + 2]), a3 = V::broadcast(a[j + 3]);
+        size_t i = 0;
+        for (; i + w <= n; i += w)
+            V::store(out + i, V::load(out + i) + a0 * V::load(r0 + i) + a1 * V::load(r1 + i)
+                                               + a2 * V::load(r2 + i) + a3 * V::load(r3 + i));
+        for (; i < n; i++)
+            out[i] = out[i] + a[j] * r0[i] + a[j + 1] * r1[i] + a[j + 2] * r2[i] + a[j + 3] * r3[i]; }
+
+    for (; j < k; j++) {
+        const T* r = rows[j];
+        typename V::type s = V::broadcast(a[j]);
+        size_t i = 0;
+        for (; i + w <= n; i += w)
+            V::store(out + i, V::load(out + i) + s * V::load(r + i));
+        for (; i < n; i++)
+            out[i] = out[i] + a[j] * r[i]; }}
+
+#define sparseEntryPoints(suffix, isa, bytes)                                   \
+template <typename T> __attribute__((target(isa)))                             \
+void accumulate##suffix (size_t n, T* out, size_t k, const T* a, const T* const* rows) { \
+    accumulateKernel<T, bytes>(n, out, k, a, rows); }
+
+#ifdef SIMD_X86
+sparseEntryPoints(SSE, "sse4.1", 16);
+sparseEntryPoints(AVX2, "avx2", 32);
+sparseEntryPoints(AVX512, "avx512f", 64);
+#endif
+
+template <typename T> void simdAccumulate (size_t n, T* out, size_t k, const T* a, const T* const* rows) {
+    #ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512: return accumulateAVX512(n, out, k, a, rows);
+        case SimdLevel::AVX2: return accumulateAVX2(n, out, k, a, rows);
+        case SimdLevel::SSE: return accumulateSSE(n, out, k, a, rows);
+        default: break; }
+    #endif
+    accumulateKernel<T, sizeof(T)>(n, out, k, a, rows); }
+
+// Grain for running over the rows of a CSR matrix, given the work per nonzero
+inline size_t sparseGrain (size_t rows, size_t nonzeros, size_t work) {
+    return std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, nonzeros / std::max((size_t) 1, rows) * work)); }
+
+// out[r] = sum of values[p] * x[columns[p] * step] over row r's nonzeros
+template <typename T> void sparseMatvec (size_t rows, const size_t* offsets, const int* columns, const T* values,
+                                         const T* x, ptrdiff_t step, T* out, ptrdiff_t outputStep) {
+    parallelFor(0, rows, sparseGrain(rows, offsets[rows], 1), [&] (size_t begin, size_t end) {
+        for (size_t r = begin; r < end; r++) {
+            T sum = 0;
+            for (size_t p = offsets[r]; p < offsets[r + 1]; p++)
+                sum += values[p] * x[columns[p] * step];
+            out[r * outputStep] = sum; }}); }
+
+// out[r, :] = sum of values[p] * dense[columns[p], :] over row r's nonzeros,
+// where the dense matrix and the output are both contiguous along their rows
+template <typename T> void sparseMatmul (size_t rows, const size_t* offsets, const int* columns, const T* values,
+                                         const T* dense, ptrdiff_t denseStride, size_t n, T* out, ptrdiff_t outputStride) {
+    parallelFor(0, rows, sparseGrain(rows, offsets[rows], n), [&] (size_t begin, size_t end) {
+        const T* pointers[SPARSE_BATCH];
+        for (size_t r = begin; r < end; r++) {
+            T* row = out + r * outputStride;
+            std::fill(row, row + n, 0);
+            for (size_t t = 0; t < n; t += SPARSE_TILE) {
+                size_t length = std::min((size_t) SPARSE_TILE, n - t);
+                for (size_t p = offsets[r]; p < offsets[r + 1]; p += SPARSE_BATCH) {
+                    size_t k = std::min((size_t) SPARSE_BATCH, offsets[r + 1] - p);
+                    for (size_t j = 0; j < k; j++)
+                        pointers[j] = dense + columns[p + j] * denseStride + t;
+                    simdAccumulate(length, row + t, k, values + p, pointers); }}}}); }
+
+
+// Sparse tensors
+
+template <typename T> struct SparseTensor {
+    static_assert(std::is_arithmetic<T>::value, "SparseTensor - Only arithmetic types are supported");
+
+    Shape shape;                // [rows, columns]
+    Tensor<size_t> offsets;     // rows + 1 of them
+    Tensor<int> columns;        // One per nonzero
+    Tensor<T> values;
+
+    // CSR constructor. The tensors have to be contiguous, and the columns have
+    // to be sorted within each row.
+    SparseTensor (Shape shape, const Tensor<size_t>& offsets, const Tensor<int>& columns, const Tensor<T>& values) :
+        shape(shape), offsets(offsets), columns(columns), values(values) {
+        if (shape.length != 2)
+            throw "SparseTensor - Only 2-dimensional tensors are supported";
+        if (offsets.shape != Shape(shape[0] + 1) || columns.shape.length != 1 || values.shape != columns.shape)
+            throw "SparseTensor - There must be one offset per row, plus one, and one column per value";
+        if (!offsets.isContiguous() || !columns.isContiguous() || !values.isContiguous())
+            throw "SparseTensor - The offsets, columns and values must be contiguous";
+        if (offsets.at(0) != 0 || offsets.at(shape[0]) != (size_t) values.shape[0])
+            throw "SparseTensor - The offsets must run from 0 to the number of values"; }
+
+
+    // Conversions
+
+    // Builds a sparse tensor from the coordinates of its nonzeros, given as a
+    // [2, nnz] tensor of row and column indices, and a tensor of nnz values.
+    // The coordinates can come in any order, and any that repeat get added up.
+    template <typename I> static SparseTensor<T> fromCoo (Shape shape, const Tensor<I>& indices, const Tensor<T>& values) {
+        static_assert(std::is_integral<I>::value, "SparseTensor.fromCoo - The indices must be integers");
+        if (shape.length != 2)
+            throw "SparseTensor.fromCoo - Only 2-dimensional tensors are supported";
+        if (indices.shape.length != 2 || indices.shape[0] != 2 || values.shape != Shape(indices.shape[1]))
+            throw "SparseTensor.fromCoo - The indices must have a shape of [2, nnz], and the values a shape of [nnz]";
+        profileOp("fromCoo", profileSignature(shape, getStrideForShape(shape)),
+                  (double) values.shape.volume() * (2 * sizeof(I) + 2 * sizeof(T) + sizeof(int)), 0);
+
+        size_t rows = shape[0], n = values.shape[0];
+        Tensor<I> index = Tensor<I>(indices).contiguous();
+        Tensor<T> input = Tensor<T>(values).detach().contiguous();
+        const I *rowIndex = index.data(), *columnIndex = index.data() + n;
+        for (size_t i = 0; i < n; i++)
+            if (rowIndex[i] < 0 || (size_t) rowIndex[i] >= rows || columnIndex[i] < 0 || (size_t) columnIndex[i] >= (size_t) shape[1])
+                throw "SparseTensor.fromCoo - Index out of range";
+
+        // Bucket the entries by row, keeping their order, and then sort each
+        // row by column, adding up the duplicates
+        List<size_t> starts(rows + 1, 0), counts(rows);
+        for (size_t i = 0; i < n; i++)
+            starts[rowIndex[i] + 1]++;
+        for (size_t r = 0; r < rows; r++)
+            starts[r + 1] += starts[r];
+        List<std::pair<int, T>> entries(n);
+        List<size_t> next(starts.begin(), starts.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            entries[next[rowIndex[i]]++] = std::make_pair((int) columnIndex[i], input.data()[i]);
+
+        parallelFor(0, rows, sparseGrain(rows, n, 16), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                let first = entries.begin() + starts[r], last = entries.begin() + starts[r + 1];
+                std::stable_sort(first, last, [] (const std::pair<int, T>& a, const std::pair<int, T>& b) {
+                    return a.first < b.first; });
+                size_t count = 0;
+                for (let it = first; it != last; ++it) {
+                    if (count && (first + count - 1)->first == it->first)
+                        (first + count - 1)->second += it->second;
+                    else *(first + count++) = *it; }
+                counts[r] = count; }});
+
+        let offsets = Tensor<size_t>(Reference<Buffer<size_t>>(new Buffer<size_t>(rows + 1)), Shape((int) rows + 1));
+        size_t* offset = offsets.data();
+        offset[0] = 0;
+        for (size_t r = 0; r < rows; r++)
+            offset[r + 1] = offset[r] + counts[r];
+        let columns = Tensor<int>(Reference<Buffer<int>>(new Buffer<int>(offset[rows])), Shape((int) offset[rows]));
+        let result = Tensor<T>(Reference<Buffer<T>>(new Buffer<T>(offset[rows])), Shape((int) offset[rows]));
+        parallelFor(0, rows, sparseGrain(rows, n, 1), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++)
+                for (size_t j = 0; j < counts[r]; j++) {
+                    columns.data()[offset[r] + j] = entries[starts[r] + j].first;
+                    result.data()[offset[r] + j] = entries[starts[r] + j].second; }});
+        return SparseTensor<T>(shape, offsets, columns, result); }
+
+    // Builds a sparse tensor from the nonzero elements of a 2-D tensor, which can be strided
+    static SparseTensor<T> fromDense (const Tensor<T>& x) {
+        if (x.shape.length != 2)
+            throw "SparseTensor.fromDense - Only 2-dimensional tensors are supported";
+        profileOp("fromDense", profileSignature(x.shape, x.stride), 2.0 * x.shape.volume() * sizeof(T), 0);
+
+        size_t rows = x.shape[0], n = x.shape[1];
+        ptrdiff_t rowStride = x.stride[0], step = x.stride[1];
+        const T* input = x.data();
+        let offsets = Tensor<size_t>(Reference<Buffer<size_t>>(new Buffer<size_t>(rows + 1)), Shape((int) rows + 1));
+        size_t* offset = offsets.data();
+        offset[0] = 0;
+        parallelFor(0, rows, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                const T* row = input + r * rowStride;
+                size_t count = 0;
+                for (size_t c = 0; c < n; c++)
+                    count += row[c * step] != 0;
+                offset[r + 1] = count; }});
+        for (size_t r = 0; r < rows; r++)
+            offset[r + 1] += offset[r];
+
+        let columns = Tensor<int>(Reference<Buffer<int>>(new Buffer<int>(offset[rows])), Shape((int) offset[rows]));
+        let values = Tensor<T>(Reference<Buffer<T>>(new Buffer<T>(offset[rows])), Shape((int) offset[rows]));
+        int* column = columns.data();
+        T* value = values.data();
+        parallelFor(0, rows, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+            for (size_t r = begin; r < end; r++) {
+                const T* row = input + r * rowStride;
+                size_t p = offset[r];
+                for (size_t c = 0; c < n; c++) {
+                    if (row[c * step] != 0) {
+                        column[p] = (int) c;
+                        value[p++] = row[c * step]; }}}});
+        return SparseTensor<T>(x.shape, offsets, columns, values); }
+
+    // Returns the dense tensor that this one stands for
+    Tensor<T> toDense () const {
+        profileOp("toDense", profileSignature(this->shape, getStrideForShape(this->shape)),
+                  (double) this->shape.volume() * sizeof(T) + this->nnz() * (sizeof(T) + sizeof(int)), 0);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(this->shape.volume()));
+        SparseTensor<T> input = *this;
+        captureStep([=] () {
+            size_t rows = input.shape[0], n = input.shape[1];
+            const size_t* offset = input.offsets.data();
+            const int* column = input.columns.data();
+            const T* value = input.values.data();
+            T* out = buffer->data;
+            parallelFor(0, rows, std::max((size_t) 1, PARALLEL_GRAIN / std::max((size_t) 1, n)), [&] (size_t begin, size_t end) {
+                std::fill(out + begin * n, out + end * n, 0);
+                for (size_t r = begin; r < end; r++)
+                    for (size_t p = offset[r]; p < offset[r + 1]; p++)
+                        out[r * n + column[p]] = value[p]; }); },
+            { this->offsets.data(), this->columns.data(), this->values.data() }, buffer->data);
+        return Tensor<T>(buffer, this->shape); }
+
+    // The transpose, as another CSR matrix (so this one's columns become its
+    // rows), which keeps the nonzeros of each new row in order
+    SparseTensor<T> transpose () const {
+        profileOp("transpose", profileSignature(this->shape, getStrideForShape(this->shape)),
+                  2.0 * this->nnz() * (sizeof(T) + sizeof(int)), 0);
+        size_t rows = this->shape[0], n = this->shape[1], nonzeros = this->nnz();
+        const size_t* offset = this->offsets.data();
+        const int* column = this->columns.data();
+        const T* value = this->values.data();
+
+        let offsets = Tensor<size_t>(Reference<Buffer<size_t>>(new Buffer<size_t>(n + 1)), Shape((int) n + 1));
+        let columns = Tensor<int>(Reference<Buffer<int>>(new Buffer<int>(nonzeros)), Shape((int) nonzeros));
+        let values = Tensor<T>(Reference<Buffer<T>>(new Buffer<T>(nonzeros)), Shape((int) nonzeros));
+        size_t* start = offsets.data();
+        std::fill(start, start + n + 1, 0);
+        for (size_t p = 0; p < nonzeros; p++)
+            start[column[p] + 1]++;
+        for (size_t c = 0; c < n; c++)
+            start[c + 1] += start[c];
+        List<size_t> next(start, start + n);
+        for (size_t r = 0; r < rows; r++)
+            for (size_t p = offset[r]; p < offset[r + 1]; p++) {
+                size_t q = next[column[p]]++;
+                columns.data()[q] = (int) r;
+                values.data()[q] = value[p]; }
+        return SparseTensor<T>(Shape((int) n, (int) rows), offsets, columns, values); }
+
+
+    // Matrix multiplication
+
+    // Product with a dense vector of shape [columns] (SpMV), which returns a
+    // vector of shape [rows], or with a dense matrix of shape [columns, n]
+    // (SpMM), which returns a matrix of shape [rows, n]. The vector can be
+    // strided, and so can the matrix, but a matrix whose rows aren't contiguous
+    // gets copied first.
+    Tensor<T> matmul (const Tensor<T>& other) const {
+        if ((other.shape.length != 1 && other.shape.length != 2) || other.shape[0] != this->shape[1])
+            throw "SparseTensor.matmul - The dense tensor must be a vector or a matrix with as many rows as this one has columns";
+
+        size_t rows = this->shape[0];
+        size_t n = other.shape.length == 2 ? other.shape[1] : 1;
+        profileOp("sparseMatmul", profileSignature(this->shape, getStrideForShape(this->shape)) + " " +
+                  profileSignature(other.shape, other.stride),
+                  (double) this->nnz() * (sizeof(T) + sizeof(int) + n * sizeof(T)) + (double) rows * n * sizeof(T),
+                  2.0 * this->nnz() * n);
+        SparseTensor<T> input = *this;
+        Shape outputShape = other.shape.length == 2 ? Shape((int) rows, (int) n) : Shape((int) rows);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(rows * n));
+
+        if (other.shape.length == 1) {
+            Tensor<T> x = other;
+            ptrdiff_t step = other.stride[0];
+            captureStep([=] () {
+                sparseMatvec(rows, input.offsets.data(), input.columns.data(), input.values.data(), x.data(), step, buffer->data, 1); },
+                { this->offsets.data(), this->columns.data(), this->values.data(), x.data() }, buffer->data);
+            return Tensor<T>(buffer, outputShape); }
+
+        Tensor<T> dense = other.stride[1] == 1 || n == 1 ? other : Tensor<T>(other).contiguous();
+        ptrdiff_t denseStride = dense.stride[0];
+        captureStep([=] () {
+            sparseMatmul(rows, input.offsets.data(), input.columns.data(), input.values.data(),
+                         dense.data(), denseStride, n, buffer->data, n); },
+            { this->offsets.data(), this->columns.data(), this->values.data(), dense.data() }, buffer->data);
+        return Tensor<T>(buffer, outputShape); }
+
+
+    // Elementwise operations
+
+    // Multiplies each nonzero by the element of `other` at its position, with
+    // `other` broadcast to this tensor's shape. The result has the same
+    // nonzeros (even where the product is zero), and shares their offsets and
+    // columns with this tensor.
+    SparseTensor<T> multiply (const Tensor<T>& other) const {
+        if (getBroadcastedShape(this->shape, other.shape) != this->shape)
+            throw "SparseTensor.multiply - The dense tensor can't be broadcast to the shape of the sparse tensor";
+        profileOp("sparseMultiply", profileSignature(this->shape, getStrideForShape(this->shape)) + " " +
+                  profileSignature(other.shape, other.stride),
+                  (double) this->nnz() * (3 * sizeof(T) + sizeof(int)), this->nnz());
+
+        size_t rows = this->shape[0];
+        Shape stride = getBroadcastedStride(other.shape, other.stride, this->shape);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(this->nnz()));
+        SparseTensor<T> input = *this;
+        Tensor<T> dense = other;
+        captureStep([=] () {
+            const size_t* offset = input.offsets.data();
+            const int* column = input.columns.data();
+            const T *value = input.values.data(), *x = dense.data();
+            T* out = buffer->data;
+            parallelFor(0, rows, sparseGrain(rows, offset[rows], 1), [&] (size_t begin, size_t end) {
+                for (size_t r = begin; r < end; r++)
+                    for (size_t p = offset[r]; p < offset[r + 1]; p++)
+                        out[p] = value[p] * x[r * stride[0] + column[p] * stride[1]]; }); },
+            { this->offsets.data(), this->columns.data(), this->values.data(), dense.data() }, buffer->data);
+        return SparseTensor<T>(this->shape, this->offsets, this->columns, Tensor<T>(buffer, this->values.shape)); }
+
+    SparseTensor<T> operator* (const Tensor<T>& other) const {
+        return this->multiply(other); }
+
+
+    // Reductions
+
+    // The sum of every element
+    T sum () const {
+        return (T) Tensor<T>(this->values).sum(); }
+
+    // The sums along `dim`, as a dense tensor with `dim` set to 1, or dropped
+    // if `keepdim` is false. Summing the rows (dim 1) runs across threads, and
+    // summing the columns (dim 0) adds each row into the sums in turn.
+    Tensor<T> sum (int dim, bool keepdim = true) const {
+        if (dim < 0)
+            dim += 2;
+        if (dim < 0 || dim > 1)
+            throw "SparseTensor.sum - Dimension index out of range";
+        profileOp("sparseSum", profileSignature(this->shape, getStrideForShape(this->shape)),
+                  (double) this->nnz() * (sizeof(T) + sizeof(int)), this->nnz());
+
+        Shape dims = Shape(dim);
+        Shape keptShape = getReducedShape(this->shape, dims);
+        Shape outputShape = keepdim ? keptShape : squeezeReducedShape(keptShape, dims);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(keptShape.volume()));
+        SparseTensor<T> input = *this;
+        captureStep([=] () {
+            size_t rows = input.shape[0], n = input.shape[1];
+            const size_t* offset = input.offsets.data();
+            const int* column = input.columns.data();
+            const T* value = input.values.data();
+            T* out = buffer->data;
+            if (dim == 1) {
+                parallelFor(0, rows, sparseGrain(rows, offset[rows], 1), [&] (size_t begin, size_t end) {
+                    for (size_t r = begin; r < end; r++) {
+                        T sum = 0;
+                        for (size_t p = offset[r]; p < offset[r + 1]; p++)
+                            sum += value[p];
+                        out[r] = sum; }});
+                return; }
+            std::fill(out, out + n, 0);
+            for (size_t p = 0; p < offset[rows]; p++)
+                out[column[p]] += value[p]; },
+            { this->offsets.data(), this->columns.data(), this->values.data() }, buffer->data);
+        return Tensor<T>(buffer, outputShape); }
+
+
+    // Helper methods
+
+    // Number of stored elements
+    size_t nnz () const {
+        return this->values.shape[0]; }
+
+    // Fraction of the elements that are stored
+    double density () const {
+        return this->shape.volume() ? (double) this->nnz() / this->shape.volume() : 0; }
+
+    String toString () const {
+        return "SparseTensor { shape: " + this->shape.toString() + ", offsets: " + this->offsets.toString() +
+               ", columns: " + this->columns.toString() + ", values: " + this->values.toString() + " }"; }};
+
+template <typename T> std::ostream& operator<< (std::ostream& os, const SparseTensor<T>& tensor) {
+    return os << tensor.toString(); }
+
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef __SUMMATION__
+#define __SUMMATION__
+
+#include "core.cpp"
+#include "simd.cpp"
+#include "half.cpp"
+
+
+// Summation kernels for sum and mean. Adding n floats one after another has an
+// error bound that grows like n * eps, which starts to show past about 10^7
+// elements, so by default we sum pairwise instead: every block of PAIRWISE_BLOCK
+// elements is summed with several vector accumulators, and the block sums are
+// added up as a balanced binary tree, which we build on the fly with a stack of
+// partial sums (like a binary counter, where adding a block carries into the
+// levels above it). That brings the bound down to about
+// (PAIRWISE_BLOCK / lanes + log2(n / PAIRWISE_BLOCK)) * eps, and costs the same
+// as a plain vectorized sum. SumMode::Kahan keeps a running compensation for the
+// rounding error of each addition instead (Neumaier's variant of Kahan summation,
+// which also handles addends larger than the running sum), which makes the error
+// independent of n, for about twice the arithmetic.
+//
+// Both kernels take an accumulator type A that can differ from the element type
+// T, so floats can be summed in doubles (or ints in floats for their mean), and
+// the elements get converted a vector register at a time. (The half-precision
+// types always get summed in floats, see SumAccumulator.) Note that both need
+// the compiler to keep floating-point addition non-associative, so they would
+// silently lose their accuracy under -ffast-math.
+
+#define PAIRWISE_BLOCK 256
+
+enum class SumMode { Pairwise, Kahan };
+
+// The type that sums of T accumulate in by default, which is T itself except
+// for the types that are too narrow to hold a sum
+template <typename T> struct SumAccumulator { typedef T type; };
+template <> struct SumAccumulator<bf16> { typedef float type; };
+template <> struct SumAccumulator<f16> { typedef float type; };
+template <> struct SumAccumulator<int8_t> { typedef int type; };
+template <> struct SumAccumulator<uint8_t> { typedef int type; };
+
+// The type that means of T come out as, and the type they accumulate in by
+// default. Floating point types keep their own type (the half types still
+// accumulate in float), and integers get a float mean.
+template <typename T> struct MeanType {
+    typedef typename std::conditional<std::is_floating_point<T>::value, T, float>::type type;
+    typedef type accumulator; };
+template <> struct MeanType<bf16> { typedef bf16 type; typedef float accumulator; };
+template <> struct MeanType<f16> { typedef f16 type; typedef float accumulator; };
+
+
+// Kernels
+
+template <typename T> SIMD_INLINE T magnitude (const T& x) { return x < 0 ? -x : x; }
+
+// Adds `x` to `sum`, and the rounding error of the addition to `compensation`
+template <typename A> SIMD_INLINE void neumaierAdd (A& sum, A& compensation, const A& x) {
+    A t = sum + x, small = (sum - t) + x, large = (x - t) + sum;
+    compensation += magnitude(sum) >= magnitude(x) ? small : large;
+    sum = t; }
+
+// Loads a vector register's worth of accumulators from `row`, converting them
+// from T to A
+template <typename A, typename T, size_t Bytes> struct WideLoad {
+    static SIMD_INLINE typename SimdVector<A, Bytes>::type load (const T* row) {
+        typedef T Narrow __attribute__((vector_size(SimdVector<A, Bytes>::width * sizeof(T))));
+        Narrow x;
+        std::memcpy(&x, row, sizeof(x));
+        return __builtin_convertvector(x, typename SimdVector<A, Bytes>::type); }};
+
+template <size_t Bytes> struct WideLoad<float, bf16, Bytes> {
+    static SIMD_INLINE typename SimdVector<float, Bytes>::type load (const bf16* row) { return loadHalf<bf16, Bytes>(row); }};
+template <size_t Bytes> struct WideLoad<float, f16, Bytes> {
+    static SIMD_INLINE typename SimdVector<float, Bytes>::type load (const f16* row) { return loadHalf<f16, Bytes>(row); }};
+
+template <typename A, typename T, size_t Bytes> SIMD_INLINE
+typename SimdVector<A, Bytes>::type loadAs (const T* row) {
+    return WideLoad<A, T, Bytes>::load(row); }
+
+// Sums a block of up to PAIRWISE_BLOCK elements, with four vector accumulators
+template <typename A, typename T, size_t Bytes> SIMD_INLINE A blockSumKernel (size_t n, const T* row) {
+    typedef SimdVector<A, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+    A result = 0;
+
+    if (n >= 4 * w) {
+        typename V::type acc0 = loadAs<A, T, Bytes>(row), acc1 = loadAs<A, T, Bytes>(row + w),
+                         acc2 = loadAs<A, T, Bytes>(row + 2 * w), acc3 = loadAs<A, T, Bytes>(row + 3 * w);
+        for (i = 4 * w; i + 4 * w <= n; i += 4 * w) {
+            acc0 += loadAs<A, T, Bytes>(row + i);
+            acc1 += loadAs<A, T, Bytes>(row + i + w);
+            acc2 += loadAs<A, T, Bytes>(row + i + 2 * w);
+            acc3 += loadAs<A, T, Bytes>(row + i + 3 * w); }
+        for (; i + w <= n; i += w)
+            acc0 += loadAs<A, T, Bytes>(row + i);
+
+        acc0 = (acc0 + acc1) + (acc2 + acc3);
+        A lanes[w];
+        V::store(lanes, acc0);
+        for (size_t k = 0; k < w; k++)
+            result += lanes[k]; }
+
+    for (; i < n; i++)
+        result += (A) row[i];
+    return result; }
+
+// Adds up the blocks of `row` as a binary tree. `stack[k]` holds the sum of
+// 2^k blocks, and only exists if bit k of the number of blocks so far is set.
+template <typename A, typename T, size_t Bytes> SIMD_INLINE A pairwiseSumKernel (size_t n, const T* row) {
+    A stack[64];
+    size_t levels = 0, blocks = 0;
+    for (size_t i = 0; i < n; i += PAIRWISE_BLOCK) {
+        A sum = blockSumKernel<A, T, Bytes>(std::min((size_t) PAIRWISE_BLOCK, n - i), row + i);
+        for (size_t carry = blocks++; carry & 1; carry >>= 1)
+            sum = stack[--levels] + sum;
+        stack[levels++] = sum; }
+
+    A result = 0;
+    while (levels > 0)
+        result = stack[--levels] + result;
+    return result; }
+
+// Adds `row` to the running `sum` and `compensation`, with two independent
+// compensated accumulators per lane
+template <typename A, typename T, size_t Bytes> SIMD_INLINE
+void kahanSumKernel (size_t n, const T* row, A& sum, A& compensation) {
+    typedef SimdVector<A, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+
+    if (n >= 2 * w) {
+        typename V::type s0 = V::broadcast(0), s1 = V::broadcast(0), c0 = V::broadcast(0), c1 = V::broadcast(0);
+        for (; i + 2 * w <= n; i += 2 * w) {
+            neumaierAdd(s0, c0, loadAs<A, T, Bytes>(row + i));
+            neumaierAdd(s1, c1, loadAs<A, T, Bytes>(row + i + w)); }
+
+        A lanes[4 * w];
+        V::store(lanes, s0);
+        V::store(lanes + w, s1);
+        V::store(lanes + 2 * w, c0);
+        V::store(lanes + 3 * w, c1);
+        for (size_t k = 0; k < 2 * w; k++) {
+            neumaierAdd(sum, compensation, lanes[k]);
+            compensation += lanes[2 * w + k]; }}
+
+    for (; i < n; i++)
+        neumaierAdd(sum, compensation, (A) row[i]); }
+
+// acc[i] += row[i], converting the elements from T to A
+template <typename A, typename T, size_t Bytes> SIMD_INLINE void accumulateKernel (size_t n, A* acc, const T* row) {
+    typedef SimdVector<A, Bytes> V;
+    const size_t w = V::width;
+    size_t i = 0;
+    for (; i + w <= n; i += w)
+        V::store(acc + i, V::load(acc + i) + loadAs<A, T, Bytes>(row + i));
+    for (; i < n; i++)
+        acc[i] += (A) row[i]; }
+
+
+// Per-instruction-set entry points
+
+#define summationEntryPoints(suffix, attributes, bytes)                         \
+template <typename A, typename T> attributes                                   \
+A pairwiseSum##suffix (size_t n, const T* row) {                                \
+    return pairwiseSumKernel<A, T, bytes>(n, row); }                            \
+                                                                                \
+template <typename A, typename T> attributes                                   \
+void kahanSum##suffix (size_t n, const T* row, A& sum, A& compensation) {       \
+    kahanSumKernel<A, T, bytes>(n, row, sum, compensation); }                   \
+                                                                                \
+template <typename A, typename T> attributes                                   \
+void accumulate##suffix (size_t n, A* acc, const T* row) {                      \
+    accumulateKernel<A, T, bytes>(n, acc, row); }
+
+#ifdef SIMD_X86
+summationEntryPoints(SSE, __attribute__((target("sse4.1"))), 16);
+summationEntryPoints(AVX2, __attribute__((target("avx2"))), 32);
+summationEntryPoints(AVX512, __attribute__((target("avx512f"))), 64);
+#endif
+summationEntryPoints(Scalar, , sizeof(A));
+
+// Calls the entry point `name` for the current instruction set, for runs that
+// are long enough to make up for the dispatch
+#ifdef SIMD_X86
+#define summationDispatch(name, n, ...)                                         \
+    if (n >= SIMD_MIN_LENGTH) {                                                 \
+        switch (simdLevel()) {                                                  \
+            case SimdLevel::AVX512: return name##AVX512<A, T>(n, __VA_ARGS__);  \
+            case SimdLevel::AVX2: return name##AVX2<A, T>(n, __VA_ARGS__);      \
+            case SimdLevel::SSE: return name##SSE<A, T>(n, __VA_ARGS__);        \
+            default: break; }}                                                  \
+    return name##Scalar<A, T>(n, __VA_ARGS__);
+#else
+#define summationDispatch(name, n, ...) return name##Scalar<A, T>(n, __VA_ARGS__);
+#endif
+
+
+// Dispatchers
+
+// Returns the sum of the contiguous `row`, in A
+template <typename A, typename T> A simdPairwiseSum (size_t n, const T* row) {
+    summationDispatch(pairwiseSum, n, row); }
+
+// Adds the contiguous `row` to a compensated sum
+template <typename A, typename T> void simdKahanSum (size_t n, const T* row, A& sum, A& compensation) {
+    summationDispatch(kahanSum, n, row, sum, compensation); }
+
+// acc[i] += row[i] for contiguous `acc` and `row`
+template <typename A, typename T> void simdAccumulate (size_t n, A* acc, const T* row) {
+    summationDispatch(accumulate, n, acc, row); }
+
+// Pairwise sum of a strided row, which can't be vectorized
+template <typename A, typename T> A pairwiseSum (size_t n, const T* row, ptrdiff_t step) {
+    A stack[64];
+    size_t levels = 0, blocks = 0;
+    for (size_t i = 0; i < n; i += PAIRWISE_BLOCK) {
+        A sum = 0;
+        for (size_t j = i; j < std::min(n, i + PAIRWISE_BLOCK); j++)
+            sum += (A) row[j * step];
+        for (size_t carry = blocks++; carry & 1; carry >>= 1)
+            sum = stack[--levels] + sum;
+        stack[levels++] = sum; }
+
+    A result = 0;
+    while (levels > 0)
+        result = stack[--levels] + result;
+    return result; }
+
+
+#endif
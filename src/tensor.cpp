@@ -4,26 +4,48 @@
 #include "core.cpp"
 #include "shape.cpp"
 #include "buffer.cpp"
-
-// Seed the RNG
-std::random_device rd;
-std::mt19937 gen(rd());
+#include "iterator.cpp"
+#include "simd.cpp"
+#include "profiler.cpp"
+#include "half.cpp"
+#include "parallel.cpp"
+#include "copy.cpp"
+#include "cast.cpp"
+#include "reduction.cpp"
+#include "gemm.cpp"
+#include "conv.cpp"
+#include "indexing.cpp"
+#include "sort.cpp"
+#include "expression.cpp"
+#include "autograd.cpp"
+#include "graph.cpp"
+#include "serialization.cpp"
+#include "random.cpp"
+#include "softmax.cpp"
 
 
 // Tensor class
 
 template <typename T> class Tensor {
 public:
+    typedef T Type;
     Reference<Buffer<T>> buffer;
     Shape shape;
     Shape stride;
+    size_t offset;              // Index in the buffer of this tensor's first element, for views like `slice`
+    bool rowMajor;              // Whether the elements are contiguous and in row-major order
+    bool dense;                 // Whether the elements are contiguous, in any order
+    Reference<Node<T>> node;    // Node in the autograd graph, if this tensor requires a gradient
 
     // Constructors
 
     Tensor (T data) :
-        buffer(Reference<Buffer<T>>(new Buffer<T>(1, { data }))),
+        buffer(Reference<Buffer<T>>(new Buffer<T>(List<T>({ data })))),
         shape(Shape()),
-        stride(Shape()) { }
+        stride(Shape()),
+        offset(0),
+        rowMajor(true),
+        dense(true) { }
 
     // Vector constructors
     Tensor (List<T> data) :
@@ -31,9 +53,12 @@ public:
     Tensor (List<T> data, Shape shape) :
         Tensor (data, shape, getStrideForShape(shape)) { }
     Tensor (List<T> data, Shape shape, Shape stride) :
-        buffer (Reference<Buffer<T>>(new Buffer<T>(data))),
-        shape  (shape),
-        stride (stride) { }
+        buffer   (Reference<Buffer<T>>(new Buffer<T>(data))),
+        shape    (shape),
+        stride   (stride),
+        offset   (0),
+        rowMajor (isContiguousStride(shape, stride)),
+        dense    (isDenseStride(shape, stride)) { }
 
     // Array construtors
     Tensor (int length, T* data) :
@@ -41,17 +66,54 @@ public:
     Tensor (int length, T* data, Shape shape) :
         Tensor (length, data, shape, getStrideForShape(shape)) { }
     Tensor (int length, T* data, Shape shape, Shape stride) :
-        buffer (Reference<Buffer<T>>(new Buffer<T>(length, data))),
-        shape  (shape),
-        stride (stride) { }
+        buffer   (Reference<Buffer<T>>(new Buffer<T>(length, data))),
+        shape    (shape),
+        stride   (stride),
+        offset   (0),
+        rowMajor (isContiguousStride(shape, stride)),
+        dense    (isDenseStride(shape, stride)) { }
 
-    // Buffer constructor
+    // Buffer constructors
+    Tensor (Reference<Buffer<T>> buffer, Shape shape) :
+        Tensor (buffer, shape, getStrideForShape(shape)) { }
     Tensor (Reference<Buffer<T>> buffer, Shape shape, Shape stride) :
-        buffer(buffer), shape(shape), stride(stride) { }
+        Tensor (buffer, shape, stride, 0) { }
+    Tensor (Reference<Buffer<T>> buffer, Shape shape, Shape stride, size_t offset) :
+        buffer(buffer), shape(shape), stride(stride), offset(offset),
+        rowMajor(isContiguousStride(shape, stride)), dense(isDenseStride(shape, stride)) { }
 
-    // Copy constructor
+    // Copy and move constructors. Copies share the buffer, so they're cheap
+    // either way, but moving also skips the reference count updates.
     Tensor<T> (const Tensor<T>& other) :
-        Tensor (other.buffer, other.shape, other.stride) { }
+        buffer(other.buffer), shape(other.shape), stride(other.stride), offset(other.offset),
+        rowMajor(other.rowMajor), dense(other.dense), node(other.node) { }
+    Tensor<T> (Tensor<T>&& other) :
+        buffer(std::move(other.buffer)), shape(other.shape), stride(other.stride), offset(other.offset),
+        rowMajor(other.rowMajor), dense(other.dense), node(std::move(other.node)) { }
+
+    // Expression constructor, which evaluates a lazy expression like `a * b + c`
+    // into a new contiguous tensor (see expression.cpp)
+    template <typename E, typename = typename std::enable_if<
+        IsExpression<E>::value && !std::is_same<E, Tensor<T>>::value>::type>
+    Tensor (const E& expression) :
+        buffer   (Reference<Buffer<T>>(new Buffer<T>(expression.shape.volume()))),
+        shape    (expression.shape),
+        stride   (getStrideForShape(expression.shape)),
+        offset   (0),
+        rowMajor (true),
+        dense    (true)
+    {
+        captureExpression(expression, this->buffer, this->offset, this->shape, this->stride);
+        if (gradEnabled() && expression.requiresGrad()) {
+            List<Reference<Node<T>>> inputs;
+            List<typename Node<T>::Saved> saved;
+            expression.collectNodes(inputs);
+            expression.collectSaved(saved);
+            this->node = Reference<Node<T>>(new Node<T>(inputs, [expression] (const Tensor<T>& grad) {
+                List<Tensor<T>> grads;
+                expression.differentiate(grad, grads);
+                return grads; }, saved)); }
+    }
 
     // Destructor
 
@@ -61,110 +123,393 @@ public:
 
     // Static methods
 
-    // Tensor::random
+    // Tensor::random. Integers are drawn from [low, high], and floats from [low, high).
     static T random (T low, T high) {
-        return std::uniform_int_distribution<T>(low, high)(gen); }
+        return random(low, high, Shape()).at(0); }
     static T random () {
         return random(std::numeric_limits<T>::min(), std::numeric_limits<T>::max()); }
 
+    static Tensor<T> random (T low, T high, Shape shape, Generator& generator) {
+        return sample(Uniform<T>(low, high), shape, generator); }
     static Tensor<T> random (T low, T high, Shape shape) {
-        let dist = std::uniform_int_distribution<T>(low, high);
-        let outputSize = shape.volume();
-        T* data = new T[outputSize];
-        for (int i = 0; i < outputSize; i++) data[i] = dist(gen);
-        return Tensor(outputSize, data, shape); }
+        return random(low, high, shape, defaultGenerator()); }
     static Tensor<T> random (Shape shape) {
         return random(std::numeric_limits<T>::min(), std::numeric_limits<T>::max(), shape); }
 
     // Tensor::normal
     static T normal (T mean, T std) {
-        return std::normal_distribution<T>(mean, std)(gen); }
+        return normal(mean, std, Shape()).at(0); }
     static T normal () { return normal(0, 1); }
 
+    static Tensor<T> normal (T mean, T std, Shape shape, Generator& generator) {
+        return sample(Normal<T>(mean, std), shape, generator); }
     static Tensor<T> normal (T mean, T std, Shape shape) {
-        let dist = std::normal_distribution<T>(mean, std);
-        let outputSize = shape.volume();
-        T* data = new T[outputSize];
-        for (int i = 0; i < outputSize; i++) data[i] = dist(gen);
-        return Tensor(outputSize, data, shape); }
+        return normal(mean, std, shape, defaultGenerator()); }
     static Tensor<T> normal (Shape shape) { return normal(0, 1, shape); }
 
     // Tensor::constant
     static Tensor<T> constant (T value, Shape shape) {
+        profileOp("constant", profileSignature(shape, getStrideForShape(shape)), (double) shape.volume() * sizeof(T), 0);
         let outputSize = shape.volume();
-        T* data = new T[outputSize];
-        std::fill_n(data, outputSize, value);
-        return Tensor<T>(outputSize, data, shape); }
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(outputSize));
+        captureStep([buffer, outputSize, value] () {
+            T* data = buffer->data;
+            parallelFor(0, outputSize, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+                std::fill(data + begin, data + end, value); }); }, {}, buffer->data);
+        return Tensor<T>(buffer, shape); }
 
     static Tensor<T> zeros (Shape shape) { return constant(0, shape); }
     static Tensor<T> ones  (Shape shape) { return constant(1, shape); }
 
+    // Fills a new tensor with samples from `dist` (see random.cpp)
+    template <typename Distribution> static Tensor<T> sample (const Distribution& dist, Shape shape, Generator& generator) {
+        profileOp("random", profileSignature(shape, getStrideForShape(shape)), (double) shape.volume() * sizeof(T), 0);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(shape.volume()));
+        fillRandom(buffer->data, buffer->length, dist, generator);
+        return Tensor<T>(buffer, shape); }
+
+
+    // In-place operations. These write into this tensor's existing buffer rather
+    // than allocating a new one, so they also change any other tensors that share
+    // it, like the tensor this one is a view of. The other side gets broadcast to
+    // this tensor's shape, and it's allowed to read from this tensor too (see
+    // evaluateExpression). In-place ops can't be recorded in the autograd graph,
+    // so they're only allowed inside a `NoGrad` scope if either side needs a
+    // gradient, which is where things like optimizer steps happen anyway. They
+    // also bump the buffer's version, so a backward function that saved this
+    // tensor before it was changed throws rather than using the new values.
+
+    // Evaluates `expression` into this tensor
+    template <typename E> Tensor<T>& assign (const E& expression) {
+        if (getBroadcastedShape(this->shape, expression.shape) != this->shape)
+            throw "Tensor.assign - The expression can't be broadcast to the shape of this tensor";
+        if (gradEnabled() && (this->node || expression.requiresGrad()))
+            throw "Tensor.assign - In-place operations can't be recorded in the autograd graph";
+        captureExpression(expression, this->buffer, this->offset, this->shape, this->stride);
+        this->buffer->version++;
+        return *this; }
+
+    Tensor<T>& fill (T value) {
+        return this->assign(ScalarExpression<T>(value)); }
+
+    // Compound assignment operators, which take either an expression or a scalar
+    template <typename E> Tensor<T>& operator+= (const E& other) { return this->assign(*this + other); }
+    template <typename E> Tensor<T>& operator-= (const E& other) { return this->assign(*this - other); }
+    template <typename E> Tensor<T>& operator*= (const E& other) { return this->assign(*this * other); }
+    template <typename E> Tensor<T>& operator/= (const E& other) { return this->assign(*this / other); }
+
 
     // We have a bunch of tensor operations to define, and since they all share
     // a significant percentage of their structure, we'll define them as macros
     // and then expand them into the correct methods. These operations basically
-    // fall into two categories: ops that act only along a single dimension, and
+    // fall into two categories: ops that act along some of the dimensions, and
     // ops that act along all dimensions at once. We'll define macros for both
     // types of methods.
+    //
+    // Full reductions are given both as a statement that folds element `i` of the
+    // buffer into `result`, and as a statement that folds a whole contiguous
+    // `row` of `n` elements into `result` using the SIMD kernels, which we use
+    // whenever the elements being reduced are adjacent in memory. They also need
+    // a statement that folds the `partial` result of one block of the tensor into
+    // `result`, since they get split into blocks between threads.
 
-    // Macro for all-dimensional reduction operations
-    #define fullReduction(methodName, returnType, initialValue, reduction, resultValue) \
+    // Macro for all-dimensional reduction operations. Dense tensors skip the
+    // iterator, and reduce their blocks of the buffer directly, since the order
+    // of the elements doesn't matter.
+    #define fullReduction(methodName, returnType, initialValue, reduction, rowReduction, combination, resultValue) \
     returnType methodName () {                                                  \
+        checkNotCapturing("Tensor." #methodName " - Reductions to a single value can't be captured in a graph"); \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T), this->shape.volume()); \
+        const T* input = this->data();                                          \
         size_t startIndex = 0;                                                  \
-        returnType result = initialValue;                                       \
-        for (int i = 0; i < this->buffer->length; i++)                          \
-            reduction;                                                          \
+        let plan = StridedIterator(this->shape, { this->stride });              \
+                                                                                \
+        let reduceBlock = [&] (size_t begin, size_t end) {                      \
+            returnType result = initialValue;                                   \
+            if (this->dense) {                                                  \
+                const T* row = input + begin;                                   \
+                size_t n = end - begin;                                         \
+                rowReduction;                                                   \
+                return result; }                                                \
+                                                                                \
+            let it = plan;                                                      \
+            it.limit(begin, end);                                               \
+            for (; !it.done(); it.next()) {                                     \
+                if (it.stride[0] == 1) {                                        \
+                    const T* row = input + it.offset[0];                        \
+                    size_t n = it.size;                                         \
+                    rowReduction; }                                             \
+                else for (size_t j = 0; j < it.size; j++) {                     \
+                    size_t i = it.offset[0] + j * it.stride[0];                 \
+                    reduction; }}                                               \
+            return result; };                                                   \
+                                                                                \
+        let combine = [&] (returnType result, returnType partial) {             \
+            combination;                                                        \
+            return result; };                                                   \
+                                                                                \
+        returnType result = parallelReduce<returnType>(                         \
+            this->shape.volume(), PARALLEL_GRAIN, reduceBlock, combine);        \
         return resultValue; }
 
-    // Macro for single-dimensional reduction operations
-    #define partialReduction(methodName, returnType, initialValue, reduction, resultValue) \
-    Tensor<returnType> methodName (int dim) {                                   \
-        if (dim < 0)                                                            \
-            dim = this->shape.length + dim;                                     \
-        if (dim < 0 || dim >= this->shape.length)                               \
-            throw "Tensor.methodName - Dimension index out of range";           \
+    // Macro for reductions along one or more dimensions, which take the reducer
+    // that does the work (see reduction.cpp), and a statement that records the
+    // `output` in the autograd graph, if needed.
+    //
+    // Each one comes in two forms: `sum(dims, keepdim)` returns a new tensor, and
+    // `sumOut(output, dims)` writes into an existing `output` with the same shape
+    // as the new tensor would have (the input with `dims` set to 1, or dropped),
+    // which can be strided. Like the in-place ops, the second form doesn't record
+    // anything in the autograd graph, and it's only allowed inside a `NoGrad`
+    // scope if the input needs a gradient. The dimensions are given as a Shape,
+    // which also converts from a single int, or from a braced list of them.
+    #define partialReduction(methodName, returnType, reducer, gradient)         \
+    Tensor<returnType>& methodName##Out (Tensor<returnType>& output, Shape dims) { \
+        Shape outputShape = getReducedShape(this->shape, dims);                 \
+        if (output.shape != outputShape && output.shape != squeezeReducedShape(outputShape, dims)) \
+            throw "Tensor.methodName - The output doesn't have the right shape"; \
+        if (gradEnabled() && (this->node || output.node))                       \
+            throw "Tensor.methodName - Ops with an output tensor can't be recorded in the autograd graph"; \
+        if ((void*) output.buffer->data == (void*) this->buffer->data)          \
+            return output.assign(this->methodName(dims, output.shape == outputShape)); \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T) + (double) outputShape.volume() * sizeof(returnType), \
+                  this->shape.volume());                                        \
                                                                                 \
-        Shape outputShape = this->shape.flattenDimension(dim);                  \
-        Shape outputStride = getStrideForShape(outputShape);                    \
-        size_t outputSize = outputShape.volume();                               \
-        returnType* data = new returnType[outputSize];                          \
+        let input = *this;                                                      \
+        let result = output;                                                    \
+        let r = reducer;                                                        \
+        Shape shape = this->shape, stride = this->stride;                       \
+        Shape outputStride = unsqueezeReducedStride(output.stride, outputShape, dims); \
+        captureStep([=] () {                                                    \
+            reduceInto(r, input.data(), shape, stride, result.data(), outputShape, outputStride); }, \
+            { input.data() }, result.data());                                   \
+        output.buffer->version++;                                               \
+        return output; }                                                        \
                                                                                 \
-        for (int outputIndex = 0; outputIndex < outputSize; outputIndex++) {    \
-            size_t startIndex = 0;                                              \
-            for (int d = 0; d < outputShape.length; d++) {                      \
-                int position = outputIndex / outputStride[d] % outputShape[d];  \
-                startIndex += this->stride[d] * position; }                     \
+    Tensor<returnType> methodName (Shape dims, bool keepdim = true) {           \
+        Shape keptShape = getReducedShape(this->shape, dims);                   \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T) + (double) keptShape.volume() * sizeof(returnType), \
+                  this->shape.volume());                                        \
+        Shape outputShape = keepdim ? keptShape : squeezeReducedShape(keptShape, dims); \
+        let buffer = Reference<Buffer<returnType>>(new Buffer<returnType>(outputShape.volume())); \
+        Tensor<returnType> output(buffer, outputShape);                         \
+        {                                                                       \
+            NoGrad guard;                                                       \
+            this->methodName##Out(output, dims);                                \
+        }                                                                       \
+        gradient;                                                               \
+        return output; }                                                        \
+
+
+    // Macro for creating both types of methods at once
+    #define reduction(methodName, returnType, initialValue, reduction, rowReduction, combination, resultValue, reducer, gradient) \
+        fullReduction(methodName, returnType, initialValue, reduction, rowReduction, combination, resultValue); \
+        partialReduction(methodName, returnType, reducer, gradient);
+
+    // Macro for sums and means, which accumulate in the type A (given as the
+    // `accumulator`, unless the caller picks another one, like `x.sum<double>()`),
+    // and take a SumMode for how to add up the elements (see summation.cpp). The
+    // full reduction returns an A, and the ones along `dims` convert their results
+    // to `returnType`, so their gradients don't depend on A. Full reductions don't
+    // care about the order of the elements, so dense tensors get summed as a
+    // single run, whatever their layout.
+    #define summation(methodName, returnType, accumulator, mean, gradient)      \
+    template <typename A = accumulator> A methodName (SumMode mode = SumMode::Pairwise) { \
+        checkNotCapturing("Tensor." #methodName " - Reductions to a single value can't be captured in a graph"); \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T), this->shape.volume()); \
+        Shape shape = this->dense ? Shape((int) this->shape.volume()) : this->shape; \
+        Shape stride = this->dense ? Shape(1) : this->stride;                   \
+        Shape outputShape = Shape::filled(shape.length, 1), outputStride = Shape::filled(shape.length, 0); \
+        A result;                                                               \
+        if (mode == SumMode::Kahan)                                             \
+            reduceInto(KahanSumReducer<T, A, A, mean>(), this->data(), shape, stride, &result, outputShape, outputStride); \
+        else reduceInto(SumReducer<T, A, A, mean>(), this->data(), shape, stride, &result, outputShape, outputStride); \
+        return result; }                                                        \
                                                                                 \
-            returnType result = initialValue;                                   \
-            for (int d = 0; d < this->shape[dim]; d++) {                        \
-                int i = startIndex + d * this->stride[dim];                     \
-                reduction; }                                                    \
+    template <typename A = accumulator>                                         \
+    Tensor<returnType>& methodName##Out (Tensor<returnType>& output, Shape dims, SumMode mode = SumMode::Pairwise) { \
+        Shape outputShape = getReducedShape(this->shape, dims);                 \
+        if (output.shape != outputShape && output.shape != squeezeReducedShape(outputShape, dims)) \
+            throw "Tensor.methodName - The output doesn't have the right shape"; \
+        if (gradEnabled() && (this->node || output.node))                       \
+            throw "Tensor.methodName - Ops with an output tensor can't be recorded in the autograd graph"; \
+        if ((void*) output.buffer->data == (void*) this->buffer->data)          \
+            return output.assign(this->template methodName<A>(dims, output.shape == outputShape, mode)); \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T) + (double) outputShape.volume() * sizeof(returnType), \
+                  this->shape.volume());                                        \
                                                                                 \
-            data[outputIndex] = resultValue; }                                  \
+        let input = *this;                                                      \
+        let result = output;                                                    \
+        Shape shape = this->shape, stride = this->stride;                       \
+        Shape outputStride = unsqueezeReducedStride(output.stride, outputShape, dims); \
+        captureStep([=] () {                                                    \
+            if (mode == SumMode::Kahan)                                         \
+                reduceInto(KahanSumReducer<T, A, returnType, mean>(), input.data(), shape, stride, \
+                           result.data(), outputShape, outputStride);           \
+            else reduceInto(SumReducer<T, A, returnType, mean>(), input.data(), shape, stride, \
+                            result.data(), outputShape, outputStride); },       \
+            { input.data() }, result.data());                                   \
+        output.buffer->version++;                                               \
+        return output; }                                                        \
                                                                                 \
-        return Tensor<returnType>(outputSize, data, outputShape, outputStride); }
+    template <typename A = accumulator>                                         \
+    Tensor<returnType> methodName (Shape dims, bool keepdim = true, SumMode mode = SumMode::Pairwise) { \
+        Shape keptShape = getReducedShape(this->shape, dims);                   \
+        profileOp(#methodName, profileSignature(this->shape, this->stride),     \
+                  (double) this->shape.volume() * sizeof(T) + (double) keptShape.volume() * sizeof(returnType), \
+                  this->shape.volume());                                        \
+        Shape outputShape = keepdim ? keptShape : squeezeReducedShape(keptShape, dims); \
+        let buffer = Reference<Buffer<returnType>>(new Buffer<returnType>(outputShape.volume())); \
+        Tensor<returnType> output(buffer, outputShape);                         \
+        {                                                                       \
+            NoGrad guard;                                                       \
+            this->template methodName##Out<A>(output, dims, mode);              \
+        }                                                                       \
+        gradient;                                                               \
+        return output; }
 
-    // Macro for creating both types of methods at once
-    #define reduction(methodName, returnType, initialValue, reduction, resultValue) \
-        fullReduction(methodName, returnType, initialValue, reduction, resultValue); \
-        partialReduction(methodName, returnType, initialValue, reduction, resultValue);
+    // The gradient of a sum gets broadcast back over the reduced dimensions, and
+    // the gradient of a max or min gets routed to the element that was picked.
+    // The output's gradient has the reduced dimensions put back first, in case
+    // they were dropped.
+    #define sumGradient if (this->recordsGradient()) {                          \
+        Shape inputShape = this->shape;                                         \
+        this->recordGradient(output, [inputShape, keptShape] (const Tensor<T>& grad) { \
+            return List<Tensor<T>>({ expandGradient(Tensor<T>(grad).reshape(keptShape), inputShape) }); }); }
+    #define meanGradient if (this->recordsGradient()) {                         \
+        Shape inputShape = this->shape;                                         \
+        size_t length = inputShape.volume() / std::max((size_t) 1, keptShape.volume()); \
+        this->recordGradient(output, [inputShape, keptShape, length] (const Tensor<T>& grad) { \
+            return List<Tensor<T>>({ evaluateDetached(expandGradient(Tensor<T>(grad).reshape(keptShape), inputShape) / (T) length) }); }); }
+    #define extremeGradient(indexMethod) if (this->recordsGradient()) {         \
+        Tensor<size_t> indices = this->indexMethod(dims);                       \
+        Shape inputShape = this->shape;                                         \
+        this->recordGradient(output, [indices, inputShape, keptShape, dims] (const Tensor<T>& grad) { \
+            return List<Tensor<T>>({ scatterGradient(Tensor<T>(grad).reshape(keptShape), indices, inputShape, dims) }); }); }
 
     // Sum / Mean macro expansions
-    reduction(sum, T, 0, result += this->at(i), result);
-    fullReduction(mean, float, 0, result += this->at(i), result / this->buffer->length);
-    partialReduction(mean, float, 0, result += this->at(i), result / this->shape[dim]);
+    summation(sum, T, typename SumAccumulator<T>::type, false, sumGradient);
+    summation(mean, typename MeanType<T>::type, typename MeanType<T>::accumulator, true, meanGradient);
 
     // Min / Max macro expansions
-    #define maxReduction if (this->at(i) > result) { result = this->at(i); }
-    #define minReduction if (this->at(i) < result) { result = this->at(i); }
-    reduction(max, T, this->at(startIndex), maxReduction, result);
-    reduction(min, T, this->at(startIndex), minReduction, result);
+    #define maxReduction if (input[i] > result) { result = input[i]; }
+    #define minReduction if (input[i] < result) { result = input[i]; }
+    #define maxRowReduction { T x = simdMax(n, row); if (x > result) { result = x; }}
+    #define minRowReduction { T x = simdMin(n, row); if (x < result) { result = x; }}
+    #define maxCombination if (partial > result) { result = partial; }
+    #define minCombination if (partial < result) { result = partial; }
+    reduction(max, T, input[startIndex], maxReduction, maxRowReduction, maxCombination, result,
+              (ValueReducer<T, T, MaxOp>(lowestValue<T>())), extremeGradient(argmax));
+    reduction(min, T, input[startIndex], minReduction, minRowReduction, minCombination, result,
+              (ValueReducer<T, T, MinOp>(highestValue<T>())), extremeGradient(argmin));
+
+    // Argmin / Argmax macro expansions. These return the index of the first
+    // extreme element in row-major order over the reduced dimensions.
+    partialReduction(argmax, size_t, (IndexReducer<T, true>()), );
+    partialReduction(argmin, size_t, (IndexReducer<T, false>()), );
+
+
+    // Softmax operations. These are fused into one or two passes over the input
+    // (see softmax.cpp), and are only defined for floats and doubles. Softmax
+    // and log-softmax keep the input's shape, and logsumexp sets `dim` to 1 like
+    // the other reductions. Their gradients all come from the softmax itself,
+    // which gets recomputed from the input rather than saved.
+
+    Tensor<T> softmax (int dim) { return this->softmaxOp(dim, SoftmaxMode::Softmax); }
+    Tensor<T> logSoftmax (int dim) { return this->softmaxOp(dim, SoftmaxMode::LogSoftmax); }
+    Tensor<T> logsumexp (int dim) { return this->softmaxOp(dim, SoftmaxMode::LogSumExp); }
+
+    Tensor<T> softmaxOp (int dim, SoftmaxMode mode) {
+        static_assert(std::is_floating_point<T>::value, "Tensor.softmax - Only floats and doubles are supported");
+        if (dim < 0)
+            dim = this->shape.length + dim;
+        if (dim < 0 || (size_t) dim >= this->shape.length)
+            throw "Tensor.softmax - Dimension index out of range";
+
+        Shape outputShape = mode == SoftmaxMode::LogSumExp ? this->shape.flattenDimension(dim) : this->shape;
+        profileOp(mode == SoftmaxMode::Softmax ? "softmax" : mode == SoftmaxMode::LogSoftmax ? "logSoftmax" : "logsumexp",
+                  profileSignature(this->shape, this->stride),
+                  (double) (this->shape.volume() + outputShape.volume()) * sizeof(T), 4.0 * this->shape.volume());
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(outputShape.volume()));
+        Tensor<T> output(buffer, outputShape);
+        let input = *this;
+        Shape shape = this->shape, stride = this->stride, outputStride = output.stride;
+        captureStep([=] () {
+            softmaxForward(input.data(), shape, stride, dim, buffer->data, outputStride, mode); },
+            { input.data() }, buffer->data);
+
+        if (this->recordsGradient()) {
+            Tensor<T> input = this->detach();
+            this->recordGradient(output, [input, dim, mode] (const Tensor<T>& grad) {
+                Tensor<T> p = Tensor<T>(input).softmax(dim);
+                if (mode == SoftmaxMode::Softmax)
+                    return List<Tensor<T>>({ evaluateDetached(p * (grad - evaluateDetached(grad * p).sum(dim))) });
+                if (mode == SoftmaxMode::LogSoftmax)
+                    return List<Tensor<T>>({ evaluateDetached(grad - p * Tensor<T>(grad).sum(dim)) });
+                return List<Tensor<T>>({ evaluateDetached(p * grad) }); }, true); }
+        return output; }
+
+
+    // Sorting operations (see sort.cpp). These sort the elements along `dim`,
+    // and return their values along with their indices along it, as a
+    // Tensor<size_t> like `argmax` returns. Equal elements (including -0.0 and
+    // 0.0) keep their order, and NaNs count as larger than everything else.
+    // `topk` returns the `k` largest elements (or smallest), in order.
+
+    SortResult<T> sort (int dim = -1, bool descending = false) {
+        return this->sortAlong(dim, -1, descending, true, "Tensor.sort - Dimension index out of range"); }
+
+    Tensor<size_t> argsort (int dim = -1, bool descending = false) {
+        return this->sortAlong(dim, -1, descending, false, "Tensor.argsort - Dimension index out of range").indices; }
+
+    SortResult<T> topk (int k, int dim = -1, bool largest = true) {
+        if (k < 0)
+            throw "Tensor.topk - k can't be negative";
+        return this->sortAlong(dim, k, largest, true, "Tensor.topk - Dimension index out of range"); }
 
-    // Argmin / Argmax macro expansions
-    #define argmaxReduction if (this->at(i) > this->at(result)) { result = i; }
-    #define argminReduction if (this->at(i) < this->at(result)) { result = i; }
-    partialReduction(argmax, size_t, startIndex, argmaxReduction, (result - startIndex) / this->stride[dim]);
-    partialReduction(argmin, size_t, startIndex, argminReduction, (result - startIndex) / this->stride[dim]);
+    // Sorts along `dim` and keeps the first `k` elements of each row (or all of
+    // them, if `k` is -1). Both outputs get written by one step, which records
+    // the values as its output, so the indices stay out of a graph's arena.
+    SortResult<T> sortAlong (int dim, int k, bool descending, bool keepValues, const char* error) {
+        static_assert(std::is_arithmetic<T>::value, "Tensor.sort - Only arithmetic types are supported");
+        dim = this->dimension(dim, error);
+        if (k < 0)
+            k = this->shape[dim];
+        if (k > this->shape[dim])
+            throw "Tensor.topk - k is larger than the dimension";
+
+        Shape outputShape = this->shape;
+        outputShape[dim] = k;
+        Shape outputStride = getStrideForShape(outputShape);
+        profileOp(!keepValues ? "argsort" : k < this->shape[dim] ? "topk" : "sort", profileSignature(this->shape, this->stride),
+                  (double) this->shape.volume() * sizeof(T) + (double) outputShape.volume() * ((keepValues ? sizeof(T) : 0) + sizeof(size_t)), 0);
+        let values = Reference<Buffer<T>>(new Buffer<T>(keepValues ? outputShape.volume() : 0));
+        let indices = Reference<Buffer<size_t>>(new Buffer<size_t>(outputShape.volume()));
+        Tensor<T> input = *this;
+        Shape shape = this->shape, stride = this->stride;
+        captureStep([=] () {
+            sortRows(input.data(), shape, stride, dim, k, descending, keepValues ? values->data : NULL, indices->data, outputStride); },
+            { input.data() }, keepValues ? (const void*) values->data : (const void*) indices->data);
+
+        SortResult<T> result = { Tensor<T>(values, keepValues ? outputShape : Shape(0)), Tensor<size_t>(indices, outputShape) };
+        if (keepValues && this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            Tensor<size_t> positions = result.indices;
+            this->recordGradient(result.values, [inputShape, positions, dim] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ Tensor<T>::zeros(inputShape).scatterAdd(dim, positions, grad) }); }); }
+        return result; }
+
+
+    // Elementwise math operations. Like the arithmetic operators, these return
+    // lazy expressions (see expression.cpp), so `(x * w).gelu()` evaluates in a
+    // single pass, and their gradients get built the same way.
+
+    unaryMethods(Tensor<T>)
 
 
     // Reshaping operations
@@ -174,20 +519,496 @@ public:
     template <typename... Args> Tensor<T> permute (List<int> ordering, int n, Args... rest) {
         return permute(push(ordering, n), rest...); }
     Tensor<T> permute (List<int> ordering) {
-        return Tensor<T>(this->buffer, permuteShape(this->shape, ordering), permuteShape(this->stride, ordering)); }
+        profileOp("permute", profileSignature(this->shape, this->stride), 0, 0);
+        Tensor<T> output(this->buffer, permuteShape(this->shape, ordering), permuteShape(this->stride, ordering), this->offset);
+        if (this->recordsGradient()) {
+            List<int> inverse(ordering.size());
+            for (size_t i = 0; i < ordering.size(); i++)
+                inverse[ordering[i] < 0 ? ordering[i] + ordering.size() : ordering[i]] = i;
+            this->recordGradient(output, [inverse] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ Tensor<T>(grad).permute(inverse) }); }); }
+        return output; }
 
     Tensor<T> transpose () {
         return this->permute(range(this->shape.length - 1, -1, -1)); }
 
+    // Whether this tensor's elements are contiguous and in row-major order, which
+    // is worked out once when it's created
+    bool isContiguous () const {
+        return this->rowMajor; }
+
+    // Returns this tensor if it's contiguous, and otherwise a contiguous copy of
+    // it (see copy.cpp)
+    Tensor<T> contiguous () {
+        if (this->rowMajor)
+            return *this;
+        profileOp("contiguous", profileSignature(this->shape, this->stride), 2.0 * this->shape.volume() * sizeof(T), 0);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(this->shape.volume()));
+        let input = *this;
+        Shape shape = this->shape, stride = this->stride;
+        captureStep([=] () {
+            copyContiguous(input.data(), shape, stride, buffer->data); }, { input.data() }, buffer->data);
+        Tensor<T> output(buffer, this->shape);
+        if (this->recordsGradient())
+            this->recordGradient(output, [] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ grad }); });
+        return output; }
+
+    // Returns a tensor with the same elements in a new shape, which shares this
+    // tensor's buffer. One dimension can be -1, in which case it's inferred from
+    // the others. Contiguous tensors can take any shape with the same number of
+    // elements, but for strided ones the new shape has to be compatible with
+    // their strides (see getViewStride).
+    template <typename... Args> Tensor<T> view (int n, Args... rest) {
+        return view(Shape(n, rest...)); }
+    Tensor<T> view (Shape newShape) {
+        profileOp("view", profileSignature(this->shape, this->stride), 0, 0);
+        newShape = inferShape(newShape, this->shape.volume());
+        Shape newStride;
+        if (!getViewStride(this->shape, this->stride, newShape, newStride))
+            throw "Tensor.view - The tensor's strides aren't compatible with the new shape, try reshape instead";
+
+        Tensor<T> output(this->buffer, newShape, newStride, this->offset);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ Tensor<T>(grad).reshape(inputShape) }); }); }
+        return output; }
+
+    // Like `view`, but if the strides don't allow a view, the elements get copied
+    // into a contiguous tensor first
+    template <typename... Args> Tensor<T> reshape (int n, Args... rest) {
+        return reshape(Shape(n, rest...)); }
+    Tensor<T> reshape (Shape newShape) {
+        profileOp("reshape", profileSignature(this->shape, this->stride), 0, 0);
+        newShape = inferShape(newShape, this->shape.volume());
+        Shape newStride;
+        if (getViewStride(this->shape, this->stride, newShape, newStride))
+            return this->view(newShape);
+        return this->contiguous().view(newShape); }
+
+
+    // Views. These share this tensor's buffer, starting from another one of its
+    // elements and with other strides, so they don't copy anything. Writing into
+    // one (with `assign` or the in-place operators) writes into this tensor, and
+    // their gradients get scattered back into the elements that they cover.
+
+    // The elements from `start` up to `end` along `dim`, `step` apart. Negative
+    // indices count from the end, and ones out of range get clamped, like the
+    // slices in Python.
+    Tensor<T> slice (int dim, int start, int end, int step = 1) {
+        dim = this->dimension(dim, "Tensor.slice - Dimension index out of range");
+        if (step < 1)
+            throw "Tensor.slice - The step must be positive";
+
+        int size = this->shape[dim];
+        start = std::min(std::max(start < 0 ? start + size : start, 0), size);
+        end = std::min(std::max(end < 0 ? end + size : end, 0), size);
+        Shape newShape = this->shape, newStride = this->stride;
+        newShape[dim] = end > start ? (end - start + step - 1) / step : 0;
+        newStride[dim] *= step;
+
+        Tensor<T> output(this->buffer, newShape, newStride, this->offset + (ptrdiff_t) start * this->stride[dim]);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape, dim, start, end, step] (const Tensor<T>& grad) {
+                Tensor<T> result = Tensor<T>::zeros(inputShape);
+                result.slice(dim, start, end, step).assign(grad);
+                return List<Tensor<T>>({ result }); }); }
+        return output; }
+
+    // The `length` elements from `start` along `dim`, which all have to be in range
+    Tensor<T> narrow (int dim, int start, int length) {
+        dim = this->dimension(dim, "Tensor.narrow - Dimension index out of range");
+        if (start < 0)
+            start += this->shape[dim];
+        if (start < 0 || length < 0 || start + length > this->shape[dim])
+            throw "Tensor.narrow - The range is out of bounds";
+        return this->slice(dim, start, start + length); }
+
+    // The elements at `index` along `dim`, without that dimension
+    Tensor<T> select (int dim, int index) {
+        dim = this->dimension(dim, "Tensor.select - Dimension index out of range");
+        if (index < 0)
+            index += this->shape[dim];
+        if (index < 0 || index >= this->shape[dim])
+            throw "Tensor.select - Index out of range";
+
+        Tensor<T> output(this->buffer, this->shape.removeDimension(dim), this->stride.removeDimension(dim),
+                         this->offset + (ptrdiff_t) index * this->stride[dim]);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape, dim, index] (const Tensor<T>& grad) {
+                Tensor<T> result = Tensor<T>::zeros(inputShape);
+                result.select(dim, index).assign(grad);
+                return List<Tensor<T>>({ result }); }); }
+        return output; }
+
+    // Inserts a dimension of size 1 before `dim`, which can also be one past the
+    // last dimension (or -1, like in PyTorch)
+    Tensor<T> unsqueeze (int dim) {
+        if (dim < 0)
+            dim += this->shape.length + 1;
+        if (dim < 0 || dim > this->shape.length)
+            throw "Tensor.unsqueeze - Dimension index out of range";
+
+        int stride = dim < this->shape.length ? this->stride[dim] * this->shape[dim] : 1;
+        Tensor<T> output(this->buffer, this->shape.insertDimension(dim, 1), this->stride.insertDimension(dim, stride), this->offset);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ Tensor<T>(grad).reshape(inputShape) }); }); }
+        return output; }
+
+    // Broadcasts the dimensions of size 1 to `newShape`, with a stride of 0, so
+    // every element along them is the same one. Like broadcasting everywhere else
+    // in BTen, the shapes line up on the left, so new dimensions go on the end.
+    // A size of -1 keeps the size of that dimension.
+    template <typename... Args> Tensor<T> expand (int n, Args... rest) {
+        return expand(Shape(n, rest...)); }
+    Tensor<T> expand (Shape newShape) {
+        if (newShape.length < this->shape.length)
+            throw "Tensor.expand - The new shape can't have fewer dimensions";
+        for (size_t d = 0; d < newShape.length; d++) {
+            if (newShape[d] == -1 && d < this->shape.length)
+                newShape[d] = this->shape[d];
+            if (newShape[d] < 0 || (d < this->shape.length && this->shape[d] != 1 && this->shape[d] != newShape[d]))
+                throw "Tensor.expand - The tensor can't be broadcast to the new shape"; }
+
+        Tensor<T> output(this->buffer, newShape, getBroadcastedStride(this->shape, this->stride, newShape), this->offset);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ reduceGradient(grad, inputShape) }); }); }
+        return output; }
+
+
+    // Indexing operations (see indexing.cpp). The indices can be a tensor of any
+    // integer type, and have to be in range for the dimension they index, or
+    // these throw. The output is always a new row-major tensor.
+
+    // The elements at each of the 1-D `indices` along `dim`, so `dim` gets as
+    // long as the list of indices. `table.indexSelect(0, ids)` looks up the rows
+    // of an embedding table.
+    template <typename I> Tensor<T> indexSelect (int dim, const Tensor<I>& indices) {
+        static_assert(std::is_integral<I>::value, "Tensor.indexSelect - The indices must be integers");
+        dim = this->dimension(dim, "Tensor.indexSelect - Dimension index out of range");
+        if (indices.shape.length != 1)
+            throw "Tensor.indexSelect - The indices must be 1-dimensional";
+
+        Shape outputShape = this->shape;
+        outputShape[dim] = indices.shape[0];
+        profileOp("indexSelect", profileSignature(this->shape, this->stride) + " " + profileSignature(indices.shape, indices.stride),
+                  2.0 * outputShape.volume() * sizeof(T) + (double) indices.shape[0] * sizeof(I), 0);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(outputShape.volume()));
+        Tensor<T> input = this->indexedInput();
+        Tensor<I> index = Tensor<I>(indices).contiguous();
+        size_t outer = this->shape.volume(0, dim), size = this->shape[dim], n = indices.shape[0];
+        size_t inner = this->shape.volume(dim + 1, this->shape.length);
+        captureStep([=] () {
+            if (indexSelectForward(input.data(), index.data(), buffer->data, outer, size, n, inner))
+                throw "Tensor.indexSelect - Index out of range"; },
+            { input.data(), index.data() }, buffer->data);
+
+        Tensor<T> output(buffer, outputShape);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape, index, dim] (const Tensor<T>& grad) {
+                Shape shape = Shape::filled(inputShape.length, 1);
+                shape[dim] = index.shape[0];
+                Tensor<I> expanded = Tensor<I>(index).view(shape).expand(grad.shape).contiguous();
+                return List<Tensor<T>>({ Tensor<T>::zeros(inputShape).scatterAdd(dim, expanded, grad) }); }); }
+        return output; }
+
+    // out[i][j][k] = this[i][index[i][j][k]][k] (for `dim` = 1), where `index`
+    // has the same shape as this tensor, except along `dim`
+    template <typename I> Tensor<T> gather (int dim, const Tensor<I>& index) {
+        static_assert(std::is_integral<I>::value, "Tensor.gather - The indices must be integers");
+        dim = this->dimension(dim, "Tensor.gather - Dimension index out of range");
+        if (index.shape.length != this->shape.length || index.shape.flattenDimension(dim) != this->shape.flattenDimension(dim))
+            throw "Tensor.gather - The index must have the same shape as the tensor, except along the gathered dimension";
+
+        profileOp("gather", profileSignature(this->shape, this->stride) + " " + profileSignature(index.shape, index.stride),
+                  (double) index.shape.volume() * (2 * sizeof(T) + sizeof(I)), 0);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(index.shape.volume()));
+        Tensor<T> input = this->indexedInput();
+        Tensor<I> indices = Tensor<I>(index).contiguous();
+        size_t outer = this->shape.volume(0, dim), size = this->shape[dim], n = index.shape[dim];
+        size_t inner = this->shape.volume(dim + 1, this->shape.length);
+        captureStep([=] () {
+            if (gatherForward(input.data(), indices.data(), buffer->data, outer, size, n, inner))
+                throw "Tensor.gather - Index out of range"; },
+            { input.data(), indices.data() }, buffer->data);
+
+        Tensor<T> output(buffer, index.shape);
+        if (this->recordsGradient()) {
+            Shape inputShape = this->shape;
+            this->recordGradient(output, [inputShape, indices, dim] (const Tensor<T>& grad) {
+                return List<Tensor<T>>({ Tensor<T>::zeros(inputShape).scatterAdd(dim, indices, grad) }); }); }
+        return output; }
+
+    // A copy of this tensor with each element of `source` added to the element
+    // that `index` points at, the inverse of `gather`: out[i][index[i][j][k]][k]
+    // += source[i][j][k] (for `dim` = 1). Indices can repeat, in which case all
+    // of their elements get added. Like matmul, this isn't recorded in the
+    // autograd graph.
+    template <typename I> Tensor<T> scatterAdd (int dim, const Tensor<I>& index, const Tensor<T>& source) {
+        static_assert(std::is_integral<I>::value, "Tensor.scatterAdd - The indices must be integers");
+        static_assert(std::is_arithmetic<T>::value, "Tensor.scatterAdd - Only arithmetic types are supported");
+        dim = this->dimension(dim, "Tensor.scatterAdd - Dimension index out of range");
+        if (index.shape != source.shape)
+            throw "Tensor.scatterAdd - The index and the source must have the same shape";
+        if (index.shape.length != this->shape.length || index.shape.flattenDimension(dim) != this->shape.flattenDimension(dim))
+            throw "Tensor.scatterAdd - The index must have the same shape as the tensor, except along the scattered dimension";
+
+        profileOp("scatterAdd", profileSignature(this->shape, this->stride) + " " + profileSignature(index.shape, index.stride),
+                  2.0 * this->shape.volume() * sizeof(T) + (double) index.shape.volume() * (2 * sizeof(T) + sizeof(I)),
+                  index.shape.volume());
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(this->shape.volume()));
+        Tensor<T> input = *this, values = Tensor<T>(source).detach().contiguous();
+        Tensor<I> indices = Tensor<I>(index).contiguous();
+        Shape shape = this->shape, stride = this->stride;
+        size_t outer = shape.volume(0, dim), size = shape[dim], n = index.shape[dim], inner = shape.volume(dim + 1, shape.length);
+        captureStep([=] () {
+            copyContiguous(input.data(), shape, stride, buffer->data);
+            if (scatterAddForward(values.data(), indices.data(), buffer->data, outer, size, n, inner))
+                throw "Tensor.scatterAdd - Index out of range"; },
+            { input.data(), values.data(), indices.data() }, buffer->data);
+        return Tensor<T>(buffer, shape); }
+
+    // This tensor as a contiguous input to the indexing kernels, which doesn't
+    // get recorded in the autograd graph
+    Tensor<T> indexedInput () const {
+        return this->detach().contiguous(); }
+
+
+    // Type conversions
+
+    // Returns a tensor with this tensor's elements converted to U (see cast.cpp
+    // for the modes). Converting to the same type returns this tensor, sharing
+    // its buffer. Dense tensors keep their layout, so their buffers get converted
+    // straight through, and strided views are converted in place into a new
+    // row-major tensor, without being copied first. The result isn't part of the
+    // autograd graph, since the graph only connects tensors of one type.
+    template <typename U> Tensor<U> to (CastMode mode = CastMode::Truncate) {
+        return this->template castTo<U>(mode, std::is_same<T, U>()); }
+
+    template <typename U> Tensor<T> castTo (CastMode, std::true_type) {
+        return *this; }
+
+    template <typename U> Tensor<U> castTo (CastMode mode, std::false_type) {
+        size_t volume = this->shape.volume();
+        profileOp("to", profileSignature(this->shape, this->stride), (double) volume * (sizeof(T) + sizeof(U)), 0);
+        let buffer = Reference<Buffer<U>>(new Buffer<U>(volume));
+        let input = *this;
+        Shape shape = this->shape, stride = this->stride;
+        if (!this->dense) {
+            captureStep([=] () {
+                castStrided((const T*) input.data(), shape, stride, buffer->data, getStrideForShape(shape), mode); },
+                { input.data() }, buffer->data);
+            return Tensor<U>(buffer, this->shape); }
+
+        captureStep([=] () {
+            const T* in = input.data();
+            U* out = buffer->data;
+            parallelFor(0, volume, PARALLEL_GRAIN, [&] (size_t begin, size_t end) {
+                castRun(end - begin, in + begin, out + begin, mode); }); },
+            { input.data() }, buffer->data);
+        return Tensor<U>(buffer, this->shape, this->stride); }
+
+
+    // Matrix multiplication
+
+    // Matrix product of two 2-D tensors. Both operands are passed to the GEMM
+    // kernel with their own strides, so views like `transpose()` don't get copied.
+    Tensor<T> matmul (const Tensor<T>& other) {
+        if (this->shape.length != 2 || other.shape.length != 2)
+            throw "Tensor.matmul - Both tensors must be 2-dimensional";
+        if (this->shape[1] != other.shape[0])
+            throw "Tensor.matmul - The inner dimensions of the tensors don't match";
+
+        size_t m = this->shape[0], k = this->shape[1], n = other.shape[1];
+        profileOp("matmul", profileSignature(this->shape, this->stride) + " " + profileSignature(other.shape, other.stride),
+                  (double) (m * k + k * n + m * n) * sizeof(T), 2.0 * m * n * k);
+        Shape outputShape = Shape((int) m, (int) n);
+        Shape outputStride = getStrideForShape(outputShape);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(m * n));
+        Tensor<T> a = *this, b = other;
+        Shape strideA = this->stride, strideB = other.stride;
+
+        captureStep([=] () {
+            gemm(m, n, k,
+                (const T*) a.data(), strideA[0], strideA[1],
+                (const T*) b.data(), strideB[0], strideB[1],
+                buffer->data, outputStride[0], outputStride[1]); },
+            { a.data(), b.data() }, buffer->data);
+
+        return Tensor<T>(buffer, outputShape, outputStride); }
+
+    // Batched matrix product of two 3-D tensors, [b, m, k] x [b, k, n] -> [b, m, n].
+    // Either operand can have a batch size of 1, in which case it gets broadcast.
+    Tensor<T> bmm (const Tensor<T>& other) {
+        if (this->shape.length != 3 || other.shape.length != 3)
+            throw "Tensor.bmm - Both tensors must be 3-dimensional";
+        if (this->shape[0] != other.shape[0] && this->shape[0] != 1 && other.shape[0] != 1)
+            throw "Tensor.bmm - The batch dimensions of the tensors aren't compatible";
+        if (this->shape[2] != other.shape[1])
+            throw "Tensor.bmm - The inner dimensions of the tensors don't match";
+
+        size_t batches = std::max(this->shape[0], other.shape[0]);
+        size_t m = this->shape[1], k = this->shape[2], n = other.shape[2];
+        profileOp("bmm", profileSignature(this->shape, this->stride) + " " + profileSignature(other.shape, other.stride),
+                  (double) (this->shape[0] * m * k + other.shape[0] * k * n + batches * m * n) * sizeof(T), 2.0 * batches * m * n * k);
+        ptrdiff_t batchStrideA = this->shape[0] > 1 ? this->stride[0] : 0;
+        ptrdiff_t batchStrideB = other.shape[0] > 1 ? other.stride[0] : 0;
+        Shape outputShape = Shape((int) batches, (int) m, (int) n);
+        Shape outputStride = getStrideForShape(outputShape);
+        let buffer = Reference<Buffer<T>>(new Buffer<T>(batches * m * n));
+        Tensor<T> a = *this, b = other;
+        Shape strideA = this->stride, strideB = other.stride;
+
+        captureStep([=] () {
+            const T *dataA = a.data(), *dataB = b.data();
+            T* data = buffer->data;
+            let multiply = [&] (size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++)
+                    gemm(m, n, k,
+                        dataA + i * batchStrideA, strideA[1], strideA[2],
+                        dataB + i * batchStrideB, strideB[1], strideB[2],
+                        data + i * outputStride[0], outputStride[1], outputStride[2]); };
+
+            // With enough batches, give each thread whole products. Otherwise run
+            // the batches in order, and let each product split itself between threads.
+            if (batches >= getNumThreads())
+                parallelFor(0, batches, std::max((size_t) 1, GEMM_PARALLEL_THRESHOLD / (m * n * k + 1)), multiply);
+            else multiply(0, batches); },
+            { a.data(), b.data() }, buffer->data);
+
+        return Tensor<T>(buffer, outputShape, outputStride); }
+
+
+
+    // Convolution and pooling
+
+    // 2-D convolution of an [N, C, H, W] tensor with [filters, C / groups, kh, kw]
+    // weights, and an optional bias with one element per filter (see conv.cpp).
+    // For NHWC, pass the NCHW-shaped view `x.permute(0, 3, 1, 2)`; the output
+    // then has the channels innermost too. Like matmul, these aren't recorded in
+    // the autograd graph.
+    Tensor<T> conv2d (const Tensor<T>& weight, int stride = 1, int padding = 0, int dilation = 1, int groups = 1,
+                      ConvAlgorithm algorithm = ConvAlgorithm::Auto) {
+        return this->convolve(weight, NULL, stride, padding, dilation, groups, algorithm); }
+
+    Tensor<T> conv2d (const Tensor<T>& weight, const Tensor<T>& bias, int stride = 1, int padding = 0, int dilation = 1,
+                      int groups = 1, ConvAlgorithm algorithm = ConvAlgorithm::Auto) {
+        if (bias.shape.length != 1 || weight.shape.length != 4 || bias.shape[0] != weight.shape[0])
+            throw "Tensor.conv2d - The bias must have one element per filter";
+        return this->convolve(weight, &bias, stride, padding, dilation, groups, algorithm); }
+
+    Tensor<T> convolve (const Tensor<T>& weight, const Tensor<T>* bias, int stride, int padding, int dilation, int groups,
+                        ConvAlgorithm algorithm) {
+        static_assert(std::is_floating_point<T>::value, "Tensor.conv2d - Only floats and doubles are supported");
+        if (this->shape.length != 4 || weight.shape.length != 4)
+            throw "Tensor.conv2d - The input and the weight must both be 4-dimensional";
+        if (stride < 1 || padding < 0 || dilation < 1 || groups < 1)
+            throw "Tensor.conv2d - Invalid stride, padding, dilation or number of groups";
+        if (this->shape[1] % groups || weight.shape[0] % groups || weight.shape[1] * groups != this->shape[1])
+            throw "Tensor.conv2d - The weight's shape doesn't match the input's channels and groups";
+
+        ConvShape p = this->windowShape(weight.shape[2], weight.shape[3], stride, padding, dilation, "Tensor.conv2d - The kernel is larger than the padded input");
+        p.filters = weight.shape[0];
+        p.groups = groups;
+        for (int i = 0; i < 4; i++)
+            p.weight[i] = weight.stride[i];
+        algorithm = convAlgorithm(p, algorithm);
+        profileOp("conv2d", profileSignature(this->shape, this->stride) + " " + profileSignature(weight.shape, weight.stride),
+                  (double) (this->shape.volume() + weight.shape.volume() + p.batch * p.filters * p.outputHeight * p.outputWidth) * sizeof(T),
+                  2.0 * p.batch * p.filters * p.outputHeight * p.outputWidth * weight.shape[1] * p.kernelHeight * p.kernelWidth);
+
+        Tensor<T> output = this->windowOutput(p);
+        Tensor<T> input = *this, filters = weight, result = output;
+        let offsets = bias ? bias->buffer : Reference<Buffer<T>>();
+        size_t biasOffset = bias ? bias->offset : 0;
+        ptrdiff_t biasStride = bias ? bias->stride[0] : 0;
+        captureStep([=] () {
+            conv2dForward(p, (const T*) input.data(), (const T*) filters.data(), offsets ? (const T*) offsets->data + biasOffset : NULL,
+                          biasStride, result.data(), algorithm); },
+            { input.data(), filters.data(), offsets ? offsets->data + biasOffset : NULL }, result.data());
+        return output; }
+
+    // Max and average pooling over windows of kernel x kernel pixels, `stride`
+    // apart (the size of the kernel by default). The padding is left out of the
+    // windows, so the average only counts the pixels inside the input.
+    Tensor<T> maxPool2d (int kernel, int stride = 0, int padding = 0, int dilation = 1) {
+        return this->pool(kernel, stride, padding, dilation, PoolMode::Max); }
+    Tensor<T> avgPool2d (int kernel, int stride = 0, int padding = 0) {
+        return this->pool(kernel, stride, padding, 1, PoolMode::Average); }
+
+    Tensor<T> pool (int kernel, int stride, int padding, int dilation, PoolMode mode) {
+        static_assert(std::is_floating_point<T>::value, "Tensor.pool2d - Only floats and doubles are supported");
+        if (this->shape.length != 4)
+            throw "Tensor.pool2d - The input must be 4-dimensional";
+        if (kernel < 1 || stride < 0 || dilation < 1 || padding < 0 || 2 * padding > kernel)
+            throw "Tensor.pool2d - Invalid kernel size, stride, padding or dilation";
+
+        ConvShape p = this->windowShape(kernel, kernel, stride ? stride : kernel, padding, dilation, "Tensor.pool2d - The kernel is larger than the padded input");
+        p.filters = p.channels;
+        p.groups = p.channels;
+        profileOp(mode == PoolMode::Max ? "maxPool2d" : "avgPool2d", profileSignature(this->shape, this->stride),
+                  (double) (this->shape.volume() + p.batch * p.channels * p.outputHeight * p.outputWidth) * sizeof(T),
+                  (double) p.batch * p.channels * p.outputHeight * p.outputWidth * kernel * kernel);
+        Tensor<T> output = this->windowOutput(p);
+        Tensor<T> input = *this, result = output;
+        captureStep([=] () {
+            pool2dForward(p, (const T*) input.data(), result.data(), mode); }, { input.data() }, result.data());
+        return output; }
+
+    // The sizes of a window sliding over this [N, C, H, W] tensor
+    ConvShape windowShape (int kernelHeight, int kernelWidth, int stride, int padding, int dilation, const char* error) const {
+        int outputHeight = (this->shape[2] + 2 * padding - dilation * (kernelHeight - 1) - 1) / stride + 1;
+        int outputWidth = (this->shape[3] + 2 * padding - dilation * (kernelWidth - 1) - 1) / stride + 1;
+        if (this->shape[2] + 2 * padding < dilation * (kernelHeight - 1) + 1 || this->shape[3] + 2 * padding < dilation * (kernelWidth - 1) + 1)
+            throw error;
+
+        ConvShape p;
+        p.batch = this->shape[0], p.channels = this->shape[1], p.height = this->shape[2], p.width = this->shape[3];
+        p.kernelHeight = kernelHeight, p.kernelWidth = kernelWidth;
+        p.outputHeight = outputHeight, p.outputWidth = outputWidth;
+        p.stride = stride, p.padding = padding, p.dilation = dilation;
+        for (int i = 0; i < 4; i++)
+            p.input[i] = this->stride[i];
+        return p; }
+
+    // A new output for the window `p`, which is channels-last if this tensor is,
+    // and row-major otherwise. Sets the output strides of `p` to match.
+    Tensor<T> windowOutput (ConvShape& p) const {
+        Shape shape = Shape((int) p.batch, (int) p.filters, (int) p.outputHeight, (int) p.outputWidth);
+        Shape stride = getStrideForShape(shape);
+        if (this->stride[1] < this->stride[3])
+            stride = Shape((int) (p.outputHeight * p.outputWidth * p.filters), 1, (int) (p.outputWidth * p.filters), (int) p.filters);
+        for (int i = 0; i < 4; i++)
+            p.output[i] = stride[i];
+        return Tensor<T>(Reference<Buffer<T>>(new Buffer<T>(shape.volume())), shape, stride); }
+
 
     // Helper methods
 
+    // Resolves a negative dimension index, counting from the end, and checks it
+    int dimension (int dim, const char* error) const {
+        if (dim < 0)
+            dim += this->shape.length;
+        if (dim < 0 || (size_t) dim >= this->shape.length)
+            throw error;
+        return dim; }
+
     String toString () const {
         if (!this->shape.length)
             return "Tensor { " + std::to_string(this->at(0)) + " }";
+        if (this->shape.length == 1)
+            return "Tensor {\n  " + this->columnToString(0) + "\n}";
 
         size_t offset = 0, length = this->shape.length - 1;
-        Shape position = Shape(length, new int[length] { 0 });
+        Shape position = Shape::filled(length, 0);
         String result = "Tensor {";
 
         // This method is a bit of a doozy. We need to stringify one column at a time,
@@ -246,56 +1067,130 @@ public:
         delete[] values;
         return "[" + result + "]"; }
 
-    // Helper method to get element `i` from this tensor's buffer. Useful
-    // because `shared_ptr` doesn't support the [] operator.
+    // Helper method to get element `i` from this tensor's buffer, counting from
+    // its first element. Useful because `shared_ptr` doesn't support the []
+    // operator.
     T& at (size_t i) const {
-        return (*this->buffer)[i]; }
-
-
-    // Operator overloads
-
-    // Same as above, we'll define some methods inside a macro and then expand
-    // the macro for each of the operators we want to overload. This macro is a bit
-    // simpler than the last one, because the overloads are all exactly the same
-    // except for the operator itself.
-
-    #define tensorOp(op)                                                            \
-    Tensor<T> operator op (T other) {                                               \
-        size_t outputSize = this->buffer->length;                                   \
-        T* data = new T[outputSize];                                                \
-        for (int i = 0; i < outputSize; i++)                                        \
-            data[i] = this->at(i) + other;                                          \
-        return Tensor<T>(outputSize, data, this->shape, this->stride); }            \
-                                                                                    \
-    Tensor<T> operator op (const Tensor<T>& other) {                                \
-        Shape outputShape = getBroadcastedShape(this->shape, other.shape);          \
-        Shape outputStride = getStrideForShape(outputShape);                        \
-        size_t outputSize = outputShape.volume();                                   \
-        T* data = new T[outputSize];                                                \
-                                                                                    \
-        for (int i = 0; i < outputSize; i++) {                                      \
-            size_t indexA = 0, indexB = 0;                                          \
-                                                                                    \
-            for (int dim = 0; dim < outputShape.length; dim++) {                    \
-                size_t position = i / outputStride[dim] % outputShape[dim];         \
-                if (dim < this->shape.length && this->shape[dim] > 1)               \
-                    indexA += this->stride[dim] * position;                         \
-                if (dim < other.shape.length && other.shape[dim] > 1)               \
-                    indexB += other.stride[dim] * position; }                       \
-                                                                                    \
-            data[i] = this->at(indexA) op other.at(indexB); }                       \
-                                                                                    \
-        return Tensor<T>(outputSize, data, outputShape, outputStride); }
-
-    // Now we expand the macro with each the operators we want to overload
-    tensorOp(+);
-    tensorOp(-);
-    tensorOp(*);
-    tensorOp(/);
+        return (*this->buffer)[this->offset + i]; }
+
+    // Pointer to this tensor's first element, which its strides count from
+    T* data () const {
+        return this->buffer->data + this->offset; }
+
+
+    // Autograd methods
+
+    // Marks this tensor as a leaf of the autograd graph, so that ops on it get
+    // recorded and `backward` fills in its gradient
+    Tensor<T>& setRequiresGrad (bool value = true) {
+        if (!value) this->node.reset();
+        else if (!this->node) this->node = Reference<Node<T>>(new Node<T>());
+        return *this; }
+
+    bool requiresGrad () const {
+        return (bool) this->node; }
+
+    Tensor<T> grad () const {
+        if (!this->node || !this->node->grad)
+            throw "Tensor.grad - This tensor doesn't have a gradient";
+        return *this->node->grad; }
+
+    void zeroGrad () {
+        if (this->node)
+            this->node->grad.reset(); }
+
+    // Returns a tensor that shares this tensor's data, but isn't part of the graph
+    Tensor<T> detach () const {
+        return Tensor<T>(this->buffer, this->shape, this->stride, this->offset); }
+
+    // Backpropagates through the graph that produced this tensor, accumulating
+    // the gradients of the leaves. Without an explicit gradient, the tensor must
+    // hold a single value (like a loss), whose gradient is taken to be 1.
+    void backward () {
+        if (this->shape.volume() != 1)
+            throw "Tensor.backward - A gradient can only be implied for tensors with a single element";
+        this->backward(Tensor<T>::ones(this->shape)); }
+
+    void backward (const Tensor<T>& grad) {
+        if (!this->node)
+            throw "Tensor.backward - This tensor doesn't require a gradient";
+        if (grad.shape != this->shape)
+            throw "Tensor.backward - The gradient doesn't have the same shape as the tensor";
+        profileOp("backward", profileSignature(this->shape, this->stride), 0, 0);
+        runBackward(this->node, grad); }
+
+    // Whether ops on this tensor should record their output in the graph
+    bool recordsGradient () const {
+        return gradEnabled() && this->node; }
+
+    // Records `output` as the result of an op on this tensor, given a function
+    // that maps the gradient of `output` to the gradient of this tensor. If the
+    // function reads this tensor's values, it passes `savesInput`, so that
+    // `backward` can check that they haven't been modified since.
+    template <typename F> void recordGradient (Tensor<T>& output, const F& backward, bool savesInput = false) {
+        List<typename Node<T>::Saved> saved;
+        if (savesInput)
+            saved.push_back({ this->buffer, this->buffer->version });
+        output.node = Reference<Node<T>>(new Node<T>({ this->node }, backward, saved)); }
+    template <typename R, typename F> void recordGradient (Tensor<R>& output, const F& backward, bool savesInput = false) {
+        throw "Tensor.recordGradient - This op doesn't support gradients for this type"; }
+
+
+    // Expression methods. A tensor is the leaf of an expression tree, so it
+    // just hands back its own values for the current run of the iterator.
+
+    void collect (const Shape& outputShape, ExpressionOperands& operands) const {
+        operands.push(this->data(), getBroadcastedStride(this->shape, this->stride, outputShape)); }
+
+    const T* evaluate (const StridedIterator& it, size_t j, size_t n,
+                       size_t& operand, T* scratch, ptrdiff_t& step) const {
+        size_t k = operand++;
+        const T* values = this->data() + it.offset[k] + j * it.stride[k];
+        step = it.stride[k];
+        if (step == 0 || step == 1)
+            return values;
+
+        for (size_t i = 0; i < n; i++)
+            scratch[i] = values[i * step];
+        step = 1;
+        return scratch; }
+
+    void collectNodes (List<Reference<Node<T>>>& nodes) const {
+        if (this->node)
+            nodes.push_back(this->node); }
+
+    void collectSaved (List<typename Node<T>::Saved>& saved) const {
+        saved.push_back({ this->buffer, this->buffer->version }); }
+
+    void differentiate (const Tensor<T>& grad, List<Tensor<T>>& grads) const {
+        grads.push_back(reduceGradient(grad, this->shape)); }
+
+
+    // Assignment operators. Like the constructors, these make this tensor share
+    // the other tensor's buffer, rather than copying its values (see `assign`).
+    Tensor<T>& operator= (const Tensor<T>& other) {
+        this->buffer = other.buffer;
+        this->shape = other.shape;
+        this->stride = other.stride;
+        this->offset = other.offset;
+        this->rowMajor = other.rowMajor;
+        this->dense = other.dense;
+        this->node = other.node;
+        return *this; }
+
+    Tensor<T>& operator= (Tensor<T>&& other) {
+        this->buffer = std::move(other.buffer);
+        this->shape = other.shape;
+        this->stride = other.stride;
+        this->offset = other.offset;
+        this->rowMajor = other.rowMajor;
+        this->dense = other.dense;
+        this->node = std::move(other.node);
+        return *this; }
 
     // Accessor operator
     T& operator() (int a) const {
-        if (a < 0 || a >= this->buffer->length)
+        if (a < 0 || (size_t) a >= this->buffer->length - this->offset)
              throw "Tensor() - Invalid index";
         else return this->at(a); }};
 
@@ -306,32 +1201,45 @@ template <typename T> std::ostream& operator<< (std::ostream& os, const Tensor<T
     os << tensor.toString();
     return os; }
 
-// Template specializations for the Tensor::random method. Putting this in a
-// macro probably violates Fowler's rule of three, but I didn't really want
-// to write out all the definitions twice to handle both doubles and floats.
+// What `sort` and `topk` return: the sorted values, and their indices along the
+// sorted dimension
+template <typename T> struct SortResult {
+    Tensor<T> values;
+    Tensor<size_t> indices; };
+
+// Out-parameter versions of the elementwise operators, which evaluate `a op b`
+// into `output` with the same rules as the in-place operators. Either side can
+// be a tensor, an expression or a scalar.
+
+#define outOperator(methodName, op)                                             \
+template <typename T, typename L, typename R> Tensor<T>& methodName (Tensor<T>& output, const L& a, const R& b) { \
+    return output.assign(a op b); }
+
+outOperator(addOut, +);
+outOperator(subOut, -);
+outOperator(mulOut, *);
+outOperator(divOut, /);
+
+// Template specializations for the Tensor::random method. Floats default to
+// [0, 1) rather than the whole range of the type.
 
 #define randomSpecialization(T)                                                 \
-template<> T Tensor<T>::random (T low, T high) {                                \
-    return std::uniform_real_distribution<T>(low, high)(gen); }                 \
 template<> T Tensor<T>::random () {                                             \
     return Tensor<T>::random(0, 1); }                                           \
                                                                                 \
-template<> Tensor<T> Tensor<T>::random (T low, T high, Shape shape) {           \
-    let dist = std::uniform_real_distribution<T>(low, high);                    \
-    let outputSize = shape.volume();                                            \
-    T* data = new T[outputSize];                                                \
-                                                                                \
-    for (int i = 0; i < outputSize; i++)                                        \
-        data[i] = dist(gen);                                                    \
-                                                                                \
-    return Tensor<T>(outputSize, data, shape); }                                \
-                                                                                \
 template<> Tensor<T> Tensor<T>::random (Shape shape) {                          \
     return Tensor<T>::random(0, 1, shape); }
 
-// Expand the macro for both floats and doubles
+// Expand the macro for every floating point type
 randomSpecialization(float);
 randomSpecialization(double);
+randomSpecialization(bf16);
+randomSpecialization(f16);
+
+
+// Quantized and sparse tensors are made of regular tensors, so they come after them
+#include "quantize.cpp"
+#include "sparse.cpp"
 
 
 #endif
@@ -12,8 +12,57 @@ int main() {
         print("a * b.transpose() =", a * b.transpose());
         print("a.mean() =", a.mean());
         print("b.max(1) =", b.max(1));
+        print("a.sum({ 0, 2 }, false) =", a.sum({ 0, 2 }, false));
+        print("b.matmul(b.transpose()) =", b.matmul(b.transpose()));
+        print("a.transpose().reshape(2, 4) =", a.transpose().reshape(2, 4));
+        print("b += b.transpose() =", b += b.transpose());
+        print();
+
+        let x = Tensor<float>({ 1, 2, 3, 4 }, Shape(2, 2)).setRequiresGrad();
+        let y = (x * x + x).sum(1).sum(0);
+        y.backward();
+        print("y =", y);
+        print("x.grad() =", x.grad());
+        print("x.softmax(1) =", x.softmax(1));
+        let inf = std::numeric_limits<float>::infinity();
+        let masked = Tensor<float>({ -inf, 1, 2, -inf, -inf, -inf, -inf, -inf }, Shape(2, 4));
+        print("masked.logsumexp(1) =", masked.logsumexp(1));
+        print("masked.logSoftmax(1) =", masked.logSoftmax(1));
+        print("masked.transpose().logsumexp(0) =", masked.transpose().logsumexp(0));
+        print("masked.transpose().logSoftmax(0) =", masked.transpose().logSoftmax(0));
+        print("Tensor<float>({ 1, inf }).logsumexp(0) =", Tensor<float>({ 1, inf }).logsumexp(0));
+        print("(x - 2).gelu() =", (x - 2).gelu());
+        print();
+
+        manualSeed(0);
+        print("Tensor<float>::normal(Shape(2, 3)) =", Tensor<float>::normal(Shape(2, 3)));
+        print("Tensor<bf16>(x).matmul(x) =", Tensor<bf16>({ 1, 2, 3, 4 }, Shape(2, 2)).matmul(Tensor<bf16>({ 1, 2, 3, 4 }, Shape(2, 2))));
+        print("QuantizedTensor<>::quantize(x, 1).dequantize() =", QuantizedTensor<>::quantize(x, 1).dequantize());
+        print("(x * 1.25 - 3).to<int>(CastMode::Round) =", Tensor<float>(x * 1.25 - 3).to<int>(CastMode::Round));
+        print();
+
+        Graph graph;
+        let z = Tensor<float>({ 1, 2, 3, 4 }, Shape(2, 2));
+        let w = graph.capture([&] { return Tensor<float>(z.matmul(z) - 10).softmax(1); });
+        z += 1;
+        graph.replay();
+        print("graph.replay() after z += 1 =", w);
+        print();
+
+        let image = Tensor<float>({ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }, Shape(1, 1, 4, 4));
+        let filter = Tensor<float>({ 1, 0, 0, -1 }, Shape(1, 1, 2, 2));
+        print("image.conv2d(filter, 1, 1) =", image.conv2d(filter, 1, 1));
+        print("image.maxPool2d(2) =", image.maxPool2d(2));
+        print();
+
+        print("image.slice(2, 1, 4, 2).select(3, 0) =", image.slice(2, 1, 4, 2).select(3, 0));
+        print("image.view(4, 4).indexSelect(0, { 3, 0 }) =", image.view(4, 4).indexSelect(0, Tensor<int>(List<int>({ 3, 0 }))));
+        print("b.topk(1, 0).indices =", b.topk(1, 0).indices);
+        print("b.argsort(1, true) =", b.argsort(1, true));
+        print("SparseTensor<int>::fromDense(b - 1).matmul(b) =", SparseTensor<int>::fromDense(b - 1).matmul(b));
     }
     catch (const char* error) {
         print(error);
+        return 1;
     }
 }